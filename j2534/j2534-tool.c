@@ -0,0 +1,613 @@
+/*
+  Copyright (C) 2022
+  Authors: NikolaKozina
+            Dale Schultz
+
+  You are free to use this software for any purpose, but please keep
+  acknowledge where it came from!
+
+  j2534-tool checks a CAN bus and the cable to it from the command line.
+
+  monitor   prints every frame like candump, or with -a a table of the IDs
+            seen with their count, rate, period and latest data
+  send      sends one frame given as ID#data, -n times at -r frames per second
+  gen       generates frames with a running counter as payload at -r frames
+            per second, or as fast as possible in bursts of -B frames
+  stat      counts frames, IDs and bus load every second for -t seconds
+
+  Frames are read with J2534_SET_READ_BATCH in large batches and printed
+  through a large stdout buffer, so a fully loaded bus is followed while the
+  output is rendered.  Every command ends with the frames per second achieved.
+
+  Usage: j2534-tool [-d device name] [-b baud] <command> [options]
+ */
+
+#define _GNU_SOURCE
+#include "j2534.h"
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RX_MSGS	1024	// Messages read per PassThruReadMsgs call
+#define TX_BURST	64	// Default frames per PassThruWriteMsgs call of gen and send
+#define MAX_IDS	4096	// IDs aggregated by monitor -a and stat
+#define ID_HASH	8192	// Hash slots of the aggregated 29-bit IDs, power of two
+#define OUT_BUF	(1 << 20)	// stdout buffer
+
+#define RX_STATUS_TX_MSG	0x01	// loopback of a frame sent on this channel
+#define RX_STATUS_START	0x02	// start indication, the message follows
+#define RX_STATUS_TX_DONE	0x08
+#define CAN_29BIT_ID	0x100
+#define CAN_ID_BOTH	0x800
+
+typedef struct _id_stat
+{
+	uint32_t id;
+	unsigned long cnt;
+	unsigned long cnt_prev;		// cnt at the previous report
+	uint32_t last_ts;			// device timestamp of the latest frame
+	uint32_t period;			// usec between the latest two frames
+	uint8_t len;
+	uint8_t data[8];
+} id_stat_t;
+
+unsigned long device_id;
+unsigned long channel_id;
+unsigned long baud = 500000;
+id_stat_t ids[MAX_IDS];
+int num_ids = 0;
+uint16_t std_idx[0x800];		// index + 1 into ids of each 11-bit ID
+uint16_t ext_idx[ID_HASH];		// index + 1 into ids, open addressing
+unsigned long ids_dropped = 0;	// frames of IDs beyond MAX_IDS
+volatile sig_atomic_t quit = 0;
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+static uint64_t host_usec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleep_until(const uint64_t usec)
+{
+	struct timespec t = { (time_t)(usec / 1000000), (long)(usec % 1000000) * 1000 };
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL);
+}
+
+static void fail(const char *what)
+{
+	char error[80];
+	PassThruGetLastError(error);
+	fprintf(stderr, "j2534-tool: %s: %s\n", what, error);
+}
+
+static uint32_t msg_id(const PASSTHRU_MSG *msg)
+{
+	return ((uint32_t)msg->Data[0] << 24) | ((uint32_t)msg->Data[1] << 16)
+		| ((uint32_t)msg->Data[2] << 8) | msg->Data[3];
+}
+
+/*
+  A received CAN frame, not an indication or a frame too short for an ID.
+*/
+static int is_frame(const PASSTHRU_MSG *msg)
+{
+	return msg->DataSize >= 4 && !(msg->RxStatus & (RX_STATUS_START | RX_STATUS_TX_DONE));
+}
+
+/*
+  Bits a frame takes on the bus without stuffing, for the bus load.
+*/
+static unsigned long frame_bits(const PASSTHRU_MSG *msg)
+{
+	unsigned long len = msg->DataSize - 4;
+	return (msg_id(msg) > 0x7FF ? 67 : 47) + 8 * (len > 8 ? 8 : len);
+}
+
+static void set_id(PASSTHRU_MSG *msg, const uint32_t id)
+{
+	msg->Data[0] = (uint8_t)(id >> 24);
+	msg->Data[1] = (uint8_t)(id >> 16);
+	msg->Data[2] = (uint8_t)(id >> 8);
+	msg->Data[3] = (uint8_t)id;
+	msg->TxFlags = id > 0x7FF ? CAN_29BIT_ID : 0;
+}
+
+/*
+  Find the aggregate of an ID, direct for 11-bit IDs and hashed for larger
+  ones, adding it when it is new.  NULL once MAX_IDS are tracked.
+*/
+static id_stat_t *id_lookup(const uint32_t id)
+{
+	uint16_t *slot;
+	if (id < 0x800)
+		slot = &std_idx[id];
+	else
+	{
+		uint32_t h = (id * 2654435761u) & (ID_HASH - 1);
+		while (ext_idx[h] && ids[ext_idx[h] - 1].id != id)
+			h = (h + 1) & (ID_HASH - 1);
+		slot = &ext_idx[h];
+	}
+	if (*slot == 0)
+	{
+		if (num_ids == MAX_IDS)
+			return NULL;
+		memset(&ids[num_ids], 0, sizeof(id_stat_t));
+		ids[num_ids].id = id;
+		*slot = (uint16_t)++num_ids;
+	}
+	return &ids[*slot - 1];
+}
+
+static void id_update(const PASSTHRU_MSG *msg)
+{
+	id_stat_t *s = id_lookup(msg_id(msg));
+	if (s == NULL)
+	{
+		ids_dropped++;
+		return;
+	}
+	if (s->cnt)
+		s->period = (uint32_t)msg->Timestamp - s->last_ts;
+	s->last_ts = (uint32_t)msg->Timestamp;
+	s->cnt++;
+	s->len = (uint8_t)(msg->DataSize - 4 > 8 ? 8 : msg->DataSize - 4);
+	memcpy(s->data, msg->Data + 4, s->len);
+}
+
+static int cmp_id(const void *a, const void *b)
+{
+	uint32_t x = ((const id_stat_t*)a)->id;
+	uint32_t y = ((const id_stat_t*)b)->id;
+	return x < y ? -1 : x > y;
+}
+
+/*
+  Format a frame candump style into out, without stdio.
+*/
+static int format_frame(char *out, const PASSTHRU_MSG *msg)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	uint32_t id = msg_id(msg);
+	uint32_t ts = (uint32_t)msg->Timestamp;
+	char *p = out;
+	p += sprintf(p, "(%4u.%06u) %s ", ts / 1000000, ts % 1000000,
+		msg->RxStatus & RX_STATUS_TX_MSG ? "TX" : "RX");
+	int digits = id > 0x7FF ? 8 : 3;
+	int d = digits - 1;
+	for (; d >= 0; d--)
+		*p++ = hex[(id >> (4 * d)) & 0xF];
+	unsigned long len = msg->DataSize - 4;
+	*p++ = ' ';
+	*p++ = ' ';
+	*p++ = '[';
+	p += sprintf(p, "%lu", len);
+	*p++ = ']';
+	unsigned long i = 0;
+	for (; i < len && i < 64; i++)
+	{
+		*p++ = ' ';
+		*p++ = hex[msg->Data[4 + i] >> 4];
+		*p++ = hex[msg->Data[4 + i] & 0xF];
+	}
+	*p++ = '\n';
+	return (int)(p - out);
+}
+
+/*
+  Print the aggregated IDs over the previous screen.
+*/
+static void print_ids(const double seconds, const unsigned long frames, const unsigned long bits)
+{
+	qsort(ids, num_ids, sizeof(id_stat_t), cmp_id);
+	memset(std_idx, 0, sizeof(std_idx));
+	memset(ext_idx, 0, sizeof(ext_idx));
+	int i = 0;
+	for (; i < num_ids; i++)
+	{
+		id_stat_t *s = &ids[i];
+		if (s->id < 0x800)
+			std_idx[s->id] = (uint16_t)(i + 1);
+		else
+		{
+			uint32_t h = (s->id * 2654435761u) & (ID_HASH - 1);
+			while (ext_idx[h])
+				h = (h + 1) & (ID_HASH - 1);
+			ext_idx[h] = (uint16_t)(i + 1);
+		}
+	}
+
+	printf("\033[H\033[2J%.0f frames/s, bus load %.1f%%, %d IDs%s\n\n", frames / seconds,
+		100.0 * bits / seconds / baud, num_ids, ids_dropped ? " (more not tracked)" : "");
+	printf("      ID      count   frames/s  period ms  data\n");
+	for (i = 0; i < num_ids; i++)
+	{
+		id_stat_t *s = &ids[i];
+		printf(s->id > 0x7FF ? "%8X" : "     %03X", s->id);
+		printf(" %10lu %10.1f %10.1f ", s->cnt, (s->cnt - s->cnt_prev) / seconds, s->period / 1000.0);
+		int j = 0;
+		for (; j < s->len; j++)
+			printf(" %02X", s->data[j]);
+		printf("\n");
+		s->cnt_prev = s->cnt;
+	}
+	fflush(stdout);
+}
+
+enum read_mode {
+	READ_FRAMES,
+	READ_IDS,
+	READ_STATS
+};
+
+/*
+  Read frames until interrupted or for a number of seconds, printing every
+  frame, a table of IDs or one line of statistics per second.
+*/
+static int read_bus(const int mode, const unsigned long seconds)
+{
+	READ_BATCH batch = {RX_MSGS / 4, 20000};
+	if (PassThruIoctl(channel_id, J2534_SET_READ_BATCH, &batch, NULL) != J2534_NOERROR)
+	{
+		fail("cannot set read batching");
+		return 1;
+	}
+	PASSTHRU_MSG *msgs = malloc(RX_MSGS * sizeof(PASSTHRU_MSG));
+	char *line = malloc(RX_MSGS * 240);
+	if (msgs == NULL || line == NULL)
+	{
+		fprintf(stderr, "j2534-tool: out of memory\n");
+		return 1;
+	}
+
+	uint64_t start = host_usec();
+	uint64_t report = start;
+	unsigned long total = 0, frames = 0, bits = 0, overflows = 0;
+	while (!quit && (seconds == 0 || host_usec() < start + seconds * 1000000))
+	{
+		unsigned long n = RX_MSGS;
+		int r = PassThruReadMsgs(channel_id, msgs, &n, 100);
+		if (r == J2534_ERR_BUFFER_OVERFLOW)
+			overflows++;
+		else if (r != J2534_NOERROR && r != J2534_ERR_TIMEOUT && r != J2534_ERR_BUFFER_EMPTY)
+		{
+			fail("read error");
+			break;
+		}
+
+		int len = 0;
+		unsigned long i = 0;
+		for (; i < n; i++)
+		{
+			const PASSTHRU_MSG *msg = &msgs[i];
+			if (!is_frame(msg))
+				continue;
+			frames++;
+			bits += frame_bits(msg);
+			if (mode == READ_FRAMES)
+				len += format_frame(line + len, msg);
+			else
+				id_update(msg);
+		}
+		if (len)
+			fwrite(line, 1, len, stdout);
+
+		uint64_t now = host_usec();
+		if (mode != READ_FRAMES && now >= report + 1000000)
+		{
+			double elapsed = (now - report) / 1e6;
+			if (mode == READ_IDS)
+				print_ids(elapsed, frames, bits);
+			else
+			{
+				printf("%8.0f frames/s  bus load %5.1f%%  %d IDs\n", frames / elapsed,
+					100.0 * bits / elapsed / baud, num_ids);
+				fflush(stdout);
+			}
+			total += frames;
+			frames = 0;
+			bits = 0;
+			report = now;
+		}
+	}
+	total += frames;
+	fflush(stdout);
+
+	double elapsed = (host_usec() - start) / 1e6;
+	fprintf(stderr, "%lu frames in %.2f s, %.0f frames/s, %d IDs%s\n", total, elapsed,
+		elapsed > 0 ? total / elapsed : 0, num_ids, overflows ? ", receive buffer overflowed" : "");
+	free(msgs);
+	free(line);
+	return 0;
+}
+
+/*
+  Send count frames (0 for until interrupted) at rate frames per second in
+  calls of up to burst frames, or back to back bursts with a rate of 0.
+  With counter set the first 8 payload bytes carry the frame number.
+*/
+static int write_bus(const PASSTHRU_MSG *frame, const unsigned long count, const unsigned long rate,
+	const unsigned long burst, const int counter)
+{
+	PASSTHRU_MSG *msgs = malloc(burst * sizeof(PASSTHRU_MSG));
+	if (msgs == NULL)
+	{
+		fprintf(stderr, "j2534-tool: out of memory\n");
+		return 1;
+	}
+	unsigned long i = 0;
+	for (; i < burst; i++)
+		msgs[i] = *frame;
+
+	uint64_t start = host_usec();
+	uint64_t report = start;
+	unsigned long sent = 0, reported = 0;
+	int r = J2534_NOERROR;
+	while (!quit && (count == 0 || sent < count))
+	{
+		uint64_t now = host_usec();
+		unsigned long n = burst;
+		if (rate)
+		{
+			// frame k is due k / rate seconds after the start
+			uint64_t due = (now - start) * rate / 1000000 + 1;
+			if (due <= sent)
+			{
+				sleep_until(start + ((uint64_t)sent * 1000000 + rate - 1) / rate);
+				continue;
+			}
+			if (due - sent < n)
+				n = (unsigned long)(due - sent);
+		}
+		if (count && count - sent < n)
+			n = count - sent;
+		if (counter)
+		{
+			for (i = 0; i < n; i++)
+			{
+				uint64_t c = sent + i;
+				unsigned long j = 0;
+				for (; j < 8 && 4 + j < msgs[i].DataSize; j++)
+					msgs[i].Data[4 + j] = (uint8_t)(c >> (8 * (7 - j)));
+			}
+		}
+		unsigned long written = n;
+		r = PassThruWriteMsgs(channel_id, msgs, &written, 1000);
+		sent += written;
+		if (r != J2534_NOERROR)
+		{
+			fail("write error");
+			break;
+		}
+		if (now >= report + 1000000)
+		{
+			fprintf(stderr, "%8.0f frames/s\n", (sent - reported) / ((now - report) / 1e6));
+			reported = sent;
+			report = now;
+		}
+	}
+
+	double elapsed = (host_usec() - start) / 1e6;
+	fprintf(stderr, "%lu frames in %.2f s, %.0f frames/s\n", sent, elapsed, elapsed > 0 ? sent / elapsed : 0);
+	free(msgs);
+	return r != J2534_NOERROR;
+}
+
+/*
+  Parse ID#data, with an ID of more than three digits sent as 29-bit.
+*/
+static int parse_frame(PASSTHRU_MSG *msg, const char *text)
+{
+	char *end = NULL;
+	const char *hash = strchr(text, '#');
+	uint32_t id = (uint32_t)strtoul(text, &end, 16);
+	if (hash == NULL || end != hash || id > 0x1FFFFFFF)
+		return FALSE;
+	set_id(msg, id);
+	if (hash - text > 3)
+		msg->TxFlags = CAN_29BIT_ID;
+	msg->DataSize = 4;
+	const char *p = hash + 1;
+	while (*p)
+	{
+		if (*p == '.')
+		{
+			p++;
+			continue;
+		}
+		if (msg->DataSize == 12 || !isxdigit((unsigned char)p[0]) || !isxdigit((unsigned char)p[1]))
+			return FALSE;
+		char byte[3] = {p[0], p[1], '\0'};
+		msg->Data[msg->DataSize++] = (uint8_t)strtoul(byte, NULL, 16);
+		p += 2;
+	}
+	return TRUE;
+}
+
+static void usage()
+{
+	fprintf(stderr,
+		"Usage: j2534-tool [-d device name] [-b baud] <command> [options]\n"
+		"  monitor [-a]                         print frames, -a aggregates them per ID\n"
+		"  send [-n count] [-r rate] ID#data    send a frame, e.g. 7E0#0201 or 18DB33F1#02010C\n"
+		"  gen [-i ID] [-l length] [-n count] [-r rate] [-B burst]\n"
+		"                                       send frames with a counter as payload,\n"
+		"                                       without -r as fast as possible\n"
+		"  stat [-t seconds]                    frames/s, bus load and IDs every second\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "+d:b:h")) != -1)
+	{
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'b':
+			baud = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+	if (optind >= argc || baud == 0)
+	{
+		usage();
+		return 1;
+	}
+	const char *cmd = argv[optind];
+	argc -= optind;
+	argv += optind;
+	optind = 1;
+
+	int aggregate = FALSE;
+	unsigned long count = 0, rate = 0, burst = TX_BURST, seconds = 0;
+	uint32_t id = 0x123;
+	unsigned long len = 8;
+	PASSTHRU_MSG frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.ProtocolID = 5;
+	if (strcmp(cmd, "monitor") == 0)
+	{
+		while ((opt = getopt(argc, argv, "a")) != -1)
+		{
+			if (opt != 'a')
+			{
+				usage();
+				return 1;
+			}
+			aggregate = TRUE;
+		}
+	}
+	else if (strcmp(cmd, "send") == 0)
+	{
+		count = 1;
+		while ((opt = getopt(argc, argv, "n:r:")) != -1)
+		{
+			if (opt == 'n')
+				count = strtoul(optarg, NULL, 0);
+			else if (opt == 'r')
+				rate = strtoul(optarg, NULL, 0);
+			else
+			{
+				usage();
+				return 1;
+			}
+		}
+		if (optind >= argc || !parse_frame(&frame, argv[optind]))
+		{
+			fprintf(stderr, "j2534-tool: expected a frame as ID#data with up to 8 data bytes\n");
+			return 1;
+		}
+	}
+	else if (strcmp(cmd, "gen") == 0)
+	{
+		while ((opt = getopt(argc, argv, "i:l:n:r:B:")) != -1)
+		{
+			switch (opt) {
+			case 'i':
+				id = (uint32_t)strtoul(optarg, NULL, 16);
+				break;
+			case 'l':
+				len = strtoul(optarg, NULL, 0);
+				break;
+			case 'n':
+				count = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				rate = strtoul(optarg, NULL, 0);
+				break;
+			case 'B':
+				burst = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				usage();
+				return 1;
+			}
+		}
+		if (id > 0x1FFFFFFF || len > 8 || burst == 0)
+		{
+			fprintf(stderr, "j2534-tool: the ID must fit 29 bits, length 0 to 8, burst at least 1\n");
+			return 1;
+		}
+		set_id(&frame, id);
+		frame.DataSize = 4 + len;
+	}
+	else if (strcmp(cmd, "stat") == 0)
+	{
+		seconds = 5;
+		while ((opt = getopt(argc, argv, "t:")) != -1)
+		{
+			if (opt != 't')
+			{
+				usage();
+				return 1;
+			}
+			seconds = strtoul(optarg, NULL, 0);
+		}
+	}
+	else
+	{
+		usage();
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	setvbuf(stdout, NULL, _IOFBF, OUT_BUF);
+
+	if (PassThruOpen(device, &device_id) != J2534_NOERROR)
+	{
+		fail("cannot open the device");
+		return 1;
+	}
+	if (PassThruConnect(device_id, 5, CAN_ID_BOTH, baud, &channel_id) != J2534_NOERROR)	// CAN
+	{
+		fail("cannot connect a CAN channel");
+		PassThruClose(device_id);
+		return 1;
+	}
+
+	int r;
+	if (strcmp(cmd, "send") == 0 || strcmp(cmd, "gen") == 0)
+		r = write_bus(&frame, count, rate, burst, strcmp(cmd, "gen") == 0);
+	else
+	{
+		PASSTHRU_MSG mask, pattern;
+		unsigned long filter_id;
+		memset(&mask, 0, sizeof(mask));
+		memset(&pattern, 0, sizeof(pattern));
+		mask.ProtocolID = pattern.ProtocolID = 5;
+		mask.DataSize = pattern.DataSize = 4;
+		if (PassThruStartMsgFilter(channel_id, J2534_PASS_FILTER, &mask, &pattern, NULL, &filter_id)
+			!= J2534_NOERROR)
+		{
+			fail("cannot start a pass filter");
+			r = 1;
+		}
+		else
+			r = read_bus(strcmp(cmd, "stat") == 0 ? READ_STATS : aggregate ? READ_IDS : READ_FRAMES, seconds);
+	}
+
+	PassThruDisconnect(channel_id);
+	PassThruClose(device_id);
+	return r;
+}
@@ -22,17 +22,131 @@
   message verbosity:
 	NONE = 0, ERROR = 1, WARNING = 2, INFO = 3, DEBUG = 4
 
+  To profile an application, set J2534_TRACE to a file name.  Every PassThru call, USB bulk
+  transfer and decoded transfer is recorded as a span per thread and written at PassThruClose
+  as Chrome trace event JSON, which chrome://tracing and the Perfetto UI display.
+
   If linked with libusb version 1.0.10 thru 1.0.12, define a preprocessor symbol LIBUSB1010  before
   compilation to enable libusb library version reporting in this library's version info string.
+
+  Commands are sent through a queue of up to CMD_SLOTS outstanding commands, whoever reads the
+  bulk IN endpoint hands each reply to the oldest command expecting it and decodes data packets
+  arriving in between into the receive FIFO queue, so several configuration commands can be in
+  flight at once and no received message is lost while waiting for a reply.
+
+  The device holds DEVICE_FILTERS message filters per channel, PassThruStartMsgFilter accepts up
+  to MAX_FILTERS.  When they do not fit, pass filters are merged into ones that let a superset
+  through and the received messages are checked against the host copy of the filters.
+
+  The Timeout of PassThruReadMsgs bounds the whole call, it returns as soon as one message is read.
+  The J2534_SET_READ_BATCH Ioctl makes it wait for a minimum number of messages instead, but no
+  longer than a maximum latency after the first one arrived.
+
+  Applications driven by an event loop can request an RX readiness descriptor for the connected
+  channel with the J2534_GET_RX_EVENT_FD Ioctl.  This starts a USB event thread that decodes
+  incoming data into the receive FIFO queue, the descriptor becomes readable once the queue holds
+  the requested number of messages and PassThruReadMsgs then only drains the queue.
+
+  J2534_SET_RT_MODE or the J2534_RT environment variable run the USB event thread with a real-time
+  priority on chosen CPUs, with the process memory locked and libusb polled without sleeping if
+  asked for.  J2534_READ_RX_JITTER reports how late messages are decoded to compare the modes.
+
+  PassThruRegisterRxCallback hands each decoded message to a callback on the USB event thread
+  as soon as its packet is parsed, see j2534.h for what a callback may do.
+
+  PassThruSubscribe routes the messages of chosen CAN IDs into a ring per subscriber.  The USB
+  event thread finds the subscribers of a message with one lookup in a direct table for 11-bit
+  IDs or a small hash for larger ones, so each reader only touches the traffic it asked for.
+
+  J2534_START_SNAPSHOT keeps the latest frame of each CAN ID in a table guarded by sequence locks,
+  PassThruReadSnapshot samples it without ever making the USB event thread wait.
+
+  J2534_START_BUS_STATS makes the USB event thread count the bus load and the rate, mean period
+  and period jitter of every CAN ID as frames arrive, J2534_READ_BUS_STATS copies them out.
+
+  J2534_START_VBATT_SAMPLER asks for the battery voltage at a fixed rate from a thread of its own
+  while the USB event thread stores the replies, J2534_READ_VBATT then answers from memory.
+
+  PassThruLoadDbc compiles the signals of a DBC file into shift, mask, scale and offset plans that
+  PassThruDecodeDbc and PassThruDecodeDbcSeries apply to received messages.
+
+  PassThruReadMemory dumps ECU memory with ReadMemoryByAddress requests on an ISO15765 channel,
+  keeping as many requests in flight as the ECU answers and adapting the block size to it.
+
+  PassThruSendUds and PassThruReadUds run UDS requests to several ECUs at once on one ISO15765
+  channel, responses are matched to their requests by service and sender as they arrive.
+
+  J2534_START_CAPTURE records every CAN frame of the connected channel to a candump, Vector ASC
+  or pcapng file.  The USB event thread copies frames into a bounded ring, a writer thread formats
+  them and writes large blocks so a slow disk drops frames instead of stalling the receive path.
+
+  J2534_CAPTURE_INDEXED writes fixed size records in 64 KiB blocks, each headed by its time range
+  and a bitmap of its CAN IDs, followed by an index of the blocks.  PassThruOpenCapture maps such
+  a file, PassThruQueryCapture binary searches the index by time and skips blocks by bitmap.
+
+  J2534_START_REPLAY loads such a file and sends its frames from a thread of its own, each at a
+  fixed offset from the start on the monotonic clock.  Frames due together share one OUT transfer
+  and are sent ahead by the measured transfer time, the scheduling error of every frame is kept.
+
+  J2534_START_GATEWAY forwards the frames received on the CAN channel from the USB event thread,
+  rewritten or blocked by ID, back onto the channel with asynchronous OUT transfers or to a CAN
+  channel of another device through its j2534d, one batch per IN transfer.
+
+  J2534_START_ISOTP_SNIFFER reassembles the ISO-TP transfers of other testers and ECUs seen on a
+  CAN channel on the USB event thread, with a preallocated stream per sender found through a
+  hash, and hands complete PDUs to PassThruReadIsotp through a ring like the subscriptions.
+
+  Several processes can share one device through the j2534d daemon.  Open the device with the
+  name "j2534d" or "j2534d:<socket path>", or set the J2534_DAEMON environment variable to the
+  socket path (empty for the default) for applications that open the device without a name,
+  and the PassThru functions are served by the daemon.
+  Received messages are read from a shared memory ring without involving the daemon.
+
+  With one daemon per device ("openport:<n>" selects the device), PassThruOpenMerged reads the CAN
+  traffic of several daemons in one stream.  The device clocks are fitted against the arrival time
+  stamped by each daemon, so frames from different devices come out in corrected timestamp order.
+
+  On Linux the CAN and ISO15765 protocols can also run on a SocketCAN network interface instead of
+  an Openport, open the device with the name "socketcan:<interface>", e.g. "socketcan:vcan0".  CAN
+  frames are moved with recvmmsg/sendmmsg in batches, ISO15765 uses the kernel ISO-TP sockets.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		// recvmmsg and sendmmsg
+#endif
 #include "j2534.h"
+#include "j2534d.h"
+#include <ctype.h>
 #include <errno.h>
 #include <libusb.h>
+#include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _MSC_VER
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/can.h>
+#include <linux/can/isotp.h>
+#include <linux/can/raw.h>
+#include <linux/futex.h>
+#include <net/if.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 #ifdef _MSC_VER
 BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserved) { return TRUE; }
@@ -46,6 +160,83 @@ BOOL APIENTRY DllMain(HMODULE hModule, DWORD ul_reason_for_call, LPVOID lpReserv
 #define MAX_LEN	80	// Maximum length of small data message
 #define LE_LEN	80	// Maximum length of an error message string
 #define LM_LEN 256	// Maximum length of writelog() message
+#define RX_XFERS	4	// Bulk IN transfers kept in flight by the USB event thread
+#define REPLY_SLOTS	8	// Command replies buffered by the USB event thread
+#define REPLY_LEN	160	// Maximum length of a buffered command reply
+#define CMD_SLOTS	16	// Commands sent ahead of their replies
+#define MAX_FILTERS	256	// Message filters tracked on the host
+#define DEVICE_FILTERS	10	// Message filters the device holds per channel
+#define MAX_RX_CALLBACKS	16	// Registered RX callbacks
+#define MAX_SUBSCRIPTIONS	32	// Per-ID subscriptions, one bit each in the dispatch index
+#define SUB_STD_IDS	0x800	// Direct mapped dispatch entries, one per 11-bit CAN ID
+#define SUB_HASH_BITS	10	// log2 of the dispatch hash entries for larger CAN IDs
+#define SUB_HASH_SIZE	(1 << SUB_HASH_BITS)
+#define SUB_RING	(256 << 10)	// Ring bytes buffered per subscription, power of two
+#define SNAP_HASH_BITS	12	// log2 of the snapshot entries for CAN IDs above 0x7FF
+#define SNAP_HASH_SIZE	(1 << SNAP_HASH_BITS)
+#define STATS_HASH_BITS	12	// log2 of the bus statistics entries for CAN IDs above 0x7FF
+#define STATS_HASH_SIZE	(1 << STATS_HASH_BITS)
+#define CAPTURE_RING	(8 << 20)	// Ring bytes buffered ahead of the capture writer thread, power of two
+#define CAPTURE_BUF	(1 << 20)	// Capture file write size
+#define CAPTURE_LINE	256	// Room for one formatted capture record
+#define CAPTURE_PATH_LEN	256	// Maximum length of a capture file name
+#define VBATT_SAMPLES	4096	// Battery voltage samples kept by the sampler, power of two
+#define VBATT_MIN_PERIOD	5	// Shortest battery voltage sample period in msec
+#define CAPTURE_POLL	10	// Capture writer poll interval in msec
+#define CAPSTORE_HEADER	4096	// Header of an indexed capture file, the blocks start after it
+#define CAPSTORE_BLOCK	(64 << 10)	// Block size of an indexed capture file
+#define CAPSTORE_ID_BITS	2048	// ID bitmap of a block, one bit per 11-bit ID, 29-bit IDs hashed
+#define CAPSTORE_FRAMES	((CAPSTORE_BLOCK - sizeof(capstore_block_t)) / sizeof(CAPTURE_FRAME))
+#define MAX_CAPSTORES	8	// Indexed capture files open for queries at the same time
+#define ATT_FRAME_MAX	32	// Longest transmit command of a CAN frame
+#define REPLAY_OUT	512	// Largest OUT transfer of replayed frames
+#define REPLAY_SPIN	200	// usec before a replayed frame is due the replay thread stops sleeping
+#define REPLAY_LEAD_MAX	2000	// usec a replayed frame is sent ahead at most to cover the OUT transfer
+#define REPLAY_POLL	100	// msec the replay thread sleeps at most before looking at the stop flag
+#define REPLAY_GAP	1000	// usec between passes through a file of a single frame
+#define GW_OUT	1024	// Largest OUT transfer or j2534d request of the gateway
+#define GW_XFERS	16	// Gateway OUT transfers in flight at most
+#define GW_PENDING	64	// Gateway requests j2534d has not answered yet at most
+#define GW_RSP_WAIT	1000	// Gateway wait for a j2534d response when stopping, ms
+#define ISOTP_STREAMS	64	// ISO-TP sniffer streams unless configured
+#define ISOTP_MAX_STREAMS	1024	// ISO-TP sniffer streams at most
+#define ISOTP_RING	(1 << 20)	// ISO-TP sniffer PDU ring size in bytes, power of two
+#define ISOTP_PDU_MAX	sizeof(((ISOTP_PDU*)0)->Data)	// Longest PDU of the ISO-TP sniffer
+#define SC_BATCH	32	// CAN frames per recvmmsg/sendmmsg call on SocketCAN
+#define MAX_DBC	8	// DBC files loaded at the same time
+#define DBC_NAME_LEN	128	// Maximum length of a DBC message or signal name
+#define DBC_BLOCK	256	// Frames PassThruDecodeDbcSeries unpacks at a time
+#define MAX_MERGED	4	// Merged readers open at the same time
+#define MERGE_SOURCES	8	// Devices per merged reader
+#define CLOCK_POINTS	16	// Lower envelope points kept to fit a device clock
+#define CLOCK_SPAN	1000000	// Device time covered by one envelope point, usec
+#define CLOCK_MAX_DRIFT	0.0005	// Largest device clock drift believed, 500 ppm
+#define MEM_OUTSTANDING	16	// ReadMemoryByAddress requests in flight at most
+#define MEM_BLOCK_MAX	4094	// ISO15765 payload limit minus the response service ID
+#define MEM_RX_MSGS	4	// Messages fetched per PassThruReadMsgs call by the memory reader
+#define UDS_PENDING	5000	// msec to wait after a response pending reply, P2* of ISO 14229
+#define MAX_UDS	64	// UDS requests outstanding or queued
+#define UDS_RX_MSGS	8	// Messages fetched per PassThruReadMsgs call by PassThruReadUds
+#define UDS_PENDING_SRCS	8	// ECUs tracked per request while they reply response pending
+#define RX_PARTIAL_WAIT	50	// msec a read waits past its timeout for the rest of a started message
+#define JITTER_BUCKETS	2000	// RX jitter histogram buckets
+#define JITTER_STEP	5	// usec per RX jitter histogram bucket
+#define JITTER_WINDOW	250000	// usec the fastest message of a window stays the reference
+#define TRACE_EVENTS	(1 << 16)	// Trace spans buffered per thread between PassThruOpen and PassThruClose
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#define ATOMIC_LOAD(p)		(*(volatile uint32_t*)(p))
+#define ATOMIC_STORE(p, v)	(*(volatile uint32_t*)(p) = (v))
+#else
+#define THREAD_LOCAL __thread
+#define ATOMIC_LOAD(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ATOMIC_STORE(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define ATOMIC_ADD(p, v)	__atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#endif
+
+typedef int (*decode_fn)(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no);
 
 typedef struct _connection
 {
@@ -54,8 +245,24 @@ typedef struct _connection
 	unsigned long protocol_id;
 	struct libusb_context *ctx;
 	struct libusb_device_handle *dev_handle;
+	int backend;		// device reached through USB or the j2534d daemon
+	int sock;			// j2534d control socket
+	j2534d_ring_t *ring;	// j2534d RX ring of the connected channel
+	size_t ring_len;
+	decode_fn decode;	// data packet decoder of the connected protocol
+	unsigned long baud;	// bit rate of the connected channel
 } connection_t;
 
+/*
+  PassThruReadMsgs batching set with J2534_SET_READ_BATCH, min_msgs is 0
+  when it is off.
+*/
+typedef struct _read_batch
+{
+	unsigned long min_msgs;
+	uint64_t max_latency;	// usec
+} read_batch_t;
+
 typedef struct _endpoint
 {
 	uint8_t intf_num;
@@ -69,6 +276,601 @@ typedef struct _fifo_msg
 	struct _fifo_msg *next_in_q;
 } fifo_msg_t;
 
+typedef struct _msg_filter
+{
+	int used;
+	unsigned long id;		// filter ID returned to the application, or by the device for a device filter
+	unsigned long type;		// pass, block or flow control
+	unsigned long tx_flags;
+	unsigned long size;		// mask and pattern length
+	unsigned long flow_size;	// flow control message length
+	uint8_t mask[12];
+	uint8_t pattern[12];
+	uint8_t flow[12];
+} msg_filter_t;
+
+/*
+  The filters programmed on the device for the host filters of an Openport
+  channel and the rules applied on the host when the device lets more
+  through.  Rule i compares message bytes 0-7 and 8-11 masked with
+  mask_lo[i] and mask_hi[i] to pat_lo[i] and pat_hi[i], the pass and flow
+  control rules come first, then the block rules.
+*/
+typedef struct _filter_set
+{
+	unsigned long last_id;	// last filter ID handed out
+	msg_filter_t dev[DEVICE_FILTERS];
+	uint32_t exact;			// the device filters pass exactly the messages the host filters do
+	int pass_cnt;
+	int block_cnt;
+	uint64_t mask_lo[MAX_FILTERS];
+	uint64_t pat_lo[MAX_FILTERS];
+	uint32_t mask_hi[MAX_FILTERS];
+	uint32_t pat_hi[MAX_FILTERS];
+	uint32_t size[MAX_FILTERS];
+} filter_set_t;
+
+typedef struct _rx_callback
+{
+	PASSTHRU_RX_CALLBACK fn;	// NULL when the slot is unused
+	void *context;
+	unsigned long filter_id;	// J2534_ALL_FILTERS or a filter ID
+	unsigned long flags;
+} rx_callback_t;
+
+typedef struct _subscription
+{
+	j2534d_ring_t *ring;	// NULL when the slot is unused, same layout as the j2534d ring
+	unsigned long flags;
+	unsigned long num_ids;
+	uint32_t *ids;
+} subscription_t;
+
+/*
+  Last message of one CAN ID.  The USB event thread is the only writer, it
+  makes seq odd while it updates the entry so readers can detect a torn copy
+  and retry instead of locking.
+*/
+typedef struct _snap_entry
+{
+	uint32_t seq;			// 0 until the first message, odd during an update
+	uint32_t id;			// CAN ID of a hash entry
+	uint32_t protocol_id;
+	uint32_t rx_status;
+	uint32_t timestamp;
+	uint32_t data_size;
+	uint8_t data[12];		// CAN ID and up to 8 data bytes
+} snap_entry_t;
+
+typedef struct _snapshot
+{
+	snap_entry_t std[SUB_STD_IDS];	// one entry per 11-bit CAN ID
+	snap_entry_t ext[SNAP_HASH_SIZE];	// larger CAN IDs, linear probing, never removed
+	uint32_t ext_used;
+	uint32_t ext_full;		// messages not recorded because the hash was full
+} snapshot_t;
+
+/*
+  Running statistics of the frames of one CAN ID.  The mean and variance
+  of the period are updated with Welford's method, so every frame costs
+  the same however long the statistics run.
+*/
+typedef struct _id_stats
+{
+	uint32_t id;
+	unsigned long cnt;		// 0 for an unused entry
+	uint32_t first;			// device timestamps
+	uint32_t last;
+	uint32_t min_period;
+	uint32_t max_period;
+	double mean;			// of the cnt - 1 periods
+	double m2;				// sum of squared deviations from mean
+} id_stats_t;
+
+typedef struct _bus_stats
+{
+	id_stats_t std[SUB_STD_IDS];	// one entry per 11-bit CAN ID
+	id_stats_t ext[STATS_HASH_SIZE];	// larger CAN IDs, linear probing, never removed
+	uint32_t ext_used;
+	unsigned long frames;
+	unsigned long untracked;	// frames not recorded per ID because the hash was full
+	uint64_t bits;			// estimated bus bits of all frames
+	uint64_t start;			// host usec
+	uint64_t read_bits;		// bits and host usec at the previous J2534_READ_BUS_STATS
+	uint64_t read_time;
+} bus_stats_t;
+
+/*
+  A DBC signal compiled into a decode plan: the payload is loaded once as a
+  little and a big endian 64-bit word, a signal is then a shift and a mask
+  of one of them, sign extension and a linear conversion.
+*/
+typedef struct _dbc_signal
+{
+	uint64_t mask;
+	uint64_t sign;			// sign bit of a signed integer signal, 0 if unsigned
+	uint8_t shift;
+	uint8_t big_endian;		// Motorola byte order, taken from the big endian word
+	uint8_t is_float;		// 1 for IEEE float, 2 for IEEE double signals
+	int32_t mux;			// multiplexer value the signal is present for, -1 for always
+	double factor;
+	double offset;
+	uint32_t msg;			// index of the message carrying the signal
+	uint32_t msg_index;		// position among the signals of the message
+	char *name;
+	char *unit;
+} dbc_signal_t;
+
+typedef struct _dbc_msg
+{
+	uint32_t id;
+	uint32_t first;			// first signal, the signals of a message are contiguous
+	uint32_t count;
+	int32_t mux;			// multiplexer switch signal, -1 if none
+} dbc_msg_t;
+
+typedef struct _dbc
+{
+	dbc_signal_t *sig;
+	uint32_t sig_cnt;
+	dbc_msg_t *msg;
+	uint32_t msg_cnt;
+	uint16_t std[SUB_STD_IDS];	// message index + 1 of each 11-bit CAN ID, 0 if not in the file
+	uint32_t *ext;			// message index + 1 of larger CAN IDs, linear probing
+	uint32_t ext_bits;		// log2 of the ext entries
+} dbc_t;
+
+/*
+  Relation of a device clock to the host clock.  Every message gives a
+  sample of host arrival time minus device time, which is the clock offset
+  plus a non-negative delivery latency.  The smallest sample of each
+  CLOCK_SPAN of device time approximates the offset, a line through these
+  points gives offset and drift.
+*/
+typedef struct _clock_model
+{
+	int started;
+	uint32_t last;			// last 32-bit device timestamp
+	int64_t dev;			// unwrapped device time of the last message, usec
+	int64_t pt_dev[CLOCK_POINTS];	// device time of each envelope point
+	int64_t pt_diff[CLOCK_POINTS];	// smallest host minus device time in its span
+	int pt_cnt;
+	int pt_last;			// point of the current span
+	double ref;				// device time the fit is centered on
+	double offset;			// host minus device time at ref
+	double drift;
+} clock_model_t;
+
+typedef struct _merge_source
+{
+	int sock;				// j2534d control socket
+	j2534d_ring_t *ring;
+	size_t ring_len;
+	unsigned long channel_id;
+	clock_model_t clock;
+	int has_head;			// head holds the next message of this source
+	uint64_t head_time;		// corrected timestamp of head
+	uint64_t last_time;		// corrected timestamp of the previous message
+	PASSTHRU_MSG head;
+} merge_source_t;
+
+typedef struct _merge
+{
+	unsigned long num;
+	uint64_t window;		// reordering window, usec
+	merge_source_t src[MERGE_SOURCES];
+} merge_t;
+
+/*
+  A ReadMemoryByAddress request of PassThruReadMemory.  off is relative to
+  the start of the read, tries counts the times it went unanswered.
+*/
+typedef struct _mem_req
+{
+	uint32_t off;
+	uint32_t size;
+	uint32_t tries;
+} mem_req_t;
+
+enum uds_state {
+	UDS_QUEUED = 1,	// waiting for an earlier request to the same target
+	UDS_SENT,
+	UDS_FAILED		// sending failed after it was queued
+};
+
+typedef struct _uds_req
+{
+	unsigned long id;		// RequestID, 0 when the slot is unused
+	int state;
+	unsigned long flags;
+	uint32_t tx_id;
+	unsigned long tx_flags;
+	uint32_t rx_id;
+	uint32_t rx_mask;
+	uint8_t sid;			// service ID the responses answer
+	uint8_t *data;
+	uint32_t size;
+	uint32_t p2;			// msec to wait for a response
+	uint32_t p2_star;		// msec to wait after response pending
+	uint64_t deadline;		// host_usec() the request times out at
+	uint64_t pending;		// host_usec() the response pending replies extend the wait to
+	uint32_t pending_src[UDS_PENDING_SRCS];	// ECUs that replied response pending
+	uint32_t pending_cnt;
+	unsigned long answered;	// responses to a functional request
+} uds_req_t;
+
+typedef struct _sub_hash
+{
+	uint32_t id;
+	uint32_t subs;			// subscriber bit mask, 0 when the entry is unused
+} sub_hash_t;
+
+typedef struct _reply
+{
+	int len;
+	uint8_t data[REPLY_LEN];
+} reply_t;
+
+typedef struct _cmd_slot
+{
+	char expect[8];			// reply prefix, "aro" when the command is only acknowledged
+	int len;				// reply length, 0 while the reply is outstanding
+	uint8_t reply[REPLY_LEN];
+} cmd_slot_t;
+
+typedef struct _cmd_queue
+{
+	cmd_slot_t slot[CMD_SLOTS];
+	unsigned long head;		// oldest command whose reply was not taken yet
+	unsigned long tail;		// commands sent
+	PASSTHRU_MSG *msg;		// data message decoded while the bulk IN endpoint is read for replies
+} cmd_queue_t;
+
+typedef struct _usb_event
+{
+	int running;			// USB event thread owns the bulk IN endpoint, ATOMIC_LOAD across threads
+	int stop;				// ask the USB event thread to exit, ATOMIC_LOAD across threads
+	int joinable;			// USB event thread created and not joined yet
+	int inflight;			// bulk IN transfers submitted
+	int event_fd[2];		// RX readiness, [0] is polled by the application, [1] is signalled
+	int event_set;			// event_fd is readable
+	unsigned long watermark;	// queued messages needed to make event_fd readable
+	PASSTHRU_MSG *msg;		// message being assembled by the USB event thread
+	struct libusb_transfer *xfer[RX_XFERS];
+	int active[RX_XFERS];	// xfer is submitted and has not ended
+	uint8_t buf[RX_XFERS][PM_DATA_LEN];
+	reply_t reply[REPLY_SLOTS];	// command replies not yet read by usb_send_expect
+	int reply_head;
+	int reply_cnt;
+#ifndef _MSC_VER
+	pthread_t thread;
+	pthread_mutex_t lock;	// guards the FIFO queue, event_fd and replies
+	pthread_cond_t rx_cond;	// signalled when a message is queued
+	pthread_cond_t reply_cond;	// signalled when a command reply is buffered
+	pthread_mutex_t cb_lock;	// guards rx_cb, filters and subscriptions, held while callbacks run
+#endif
+	int cb_cnt;				// registered RX callbacks
+	int sub_cnt;			// active per-ID subscriptions
+} usb_event_t;
+
+/*
+  Indexed capture file: a CAPSTORE_HEADER byte header, CAPSTORE_BLOCK byte
+  blocks of a capstore_block_t and CAPTURE_FRAME records in time order, then
+  the block headers once more as index and a capstore_trailer_t.  All in
+  host byte order.
+*/
+typedef struct _capstore_head
+{
+	char magic[8];			// "J2534CS1"
+	uint32_t block_size;
+	uint32_t frame_size;
+	uint64_t start;			// usec since the epoch the file was opened
+} capstore_head_t;
+
+typedef struct _capstore_block
+{
+	char magic[4];			// "JCB1"
+	uint32_t count;			// frames in the block
+	uint64_t first;			// time of the first and last frame
+	uint64_t last;
+	uint64_t offset;		// of the block in the file
+	uint8_t ids[CAPSTORE_ID_BITS / 8];
+} capstore_block_t;
+
+typedef struct _capstore_trailer
+{
+	uint64_t index;			// offset of the index
+	uint64_t blocks;
+	char magic[8];			// "JCSINDEX"
+} capstore_trailer_t;
+
+typedef struct _capstore
+{
+	const uint8_t *map;
+	size_t len;
+	const capstore_block_t *index;
+	capstore_block_t *rebuilt;	// index read from the blocks of a file without one
+	unsigned long blocks;
+} capstore_t;
+
+typedef struct _capture
+{
+	int active;				// USB event thread hands messages to the writer
+	int stop;				// ask the writer thread to exit
+	unsigned long format;
+	unsigned long rotate_bytes;
+	unsigned long rotate_secs;
+	char path[CAPTURE_PATH_LEN];
+	j2534d_ring_t *ring;	// messages not yet written, same layout as the j2534d ring
+	uint8_t *buf;			// formatted records, written in CAPTURE_BUF blocks
+	size_t buf_len;
+	int fd;
+	int error;				// errno of a failed write, later records are discarded
+	unsigned long file_no;
+	uint64_t file_bytes;
+	uint64_t file_start;	// time of the first record in the file, usec since the epoch
+	uint64_t ts_base;		// host time of device timestamp 0, usec since the epoch
+	uint64_t ts_wraps;		// device timestamp wrap arounds, in usec
+	uint32_t ts_last;
+	uint8_t *block;			// indexed format: block being filled
+	capstore_block_t *index;	// and the headers of the blocks written to the file
+	unsigned long index_cnt;
+	unsigned long index_cap;
+	uint64_t block_last;	// time of the latest frame, later frames are not stored before it
+#ifndef _MSC_VER
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;	// signalled to stop the writer thread
+#endif
+} capture_t;
+
+typedef struct _vbatt
+{
+	int active;				// USB event thread stores pin 16 voltage replies
+	int stop;				// ask the sampler thread to exit
+	unsigned long period;	// msec between samples
+	unsigned long seq;		// samples stored so far
+	VBATT_SAMPLE sample[VBATT_SAMPLES];
+#ifndef _MSC_VER
+	pthread_t thread;
+	pthread_mutex_t lock;	// guards the samples
+	pthread_cond_t cond;	// signalled when a sample is stored or the sampler has to stop
+#endif
+} vbatt_t;
+
+typedef struct _replay_frame
+{
+	uint64_t offset;		// usec after the first frame of the file
+	uint32_t id;
+	uint8_t ext;
+	uint8_t len;
+	uint8_t data[8];
+} replay_frame_t;
+
+typedef struct _replay
+{
+	uint32_t running;		// replay thread still sends
+	uint32_t stop;			// ask the replay thread to exit
+	replay_frame_t *frame;
+	unsigned long cnt;
+	unsigned long loops;
+	double speed;
+	uint64_t period;		// file offset between the starts of two passes
+	unsigned long sent;		// guarded by lock from here on
+	unsigned long passes;
+	int64_t err_sum;
+	uint32_t err_max;
+	int32_t status;
+	uint32_t hist[JITTER_BUCKETS];	// absolute scheduling error
+#ifndef _MSC_VER
+	pthread_t thread;
+	pthread_mutex_t lock;
+#endif
+} replay_t;
+
+typedef struct _gw_xfer
+{
+	struct libusb_transfer *xfer;
+	struct _gateway *gw;
+	uint64_t rx_time;		// host usec the first frame of the transfer was decoded
+	int cnt;				// frames in the transfer, 0 when the slot is free
+	uint8_t buf[GW_OUT];
+} gw_xfer_t;
+
+/*
+  Gateway of the connected channel, frames are collected in out while an
+  IN transfer is decoded and sent together at its end.  Everything is
+  guarded by CB_LOCK.
+*/
+typedef struct _gateway
+{
+	int sock;				// j2534d connection of the target device, -1 to send on the connected channel
+	uint32_t channel_id;	// target channel at j2534d
+	GATEWAY_RULE *rule;		// sorted by CanID
+	unsigned long rules;
+	uint32_t *block;		// sorted
+	unsigned long blocks;
+	uint8_t out[GW_OUT];	// att commands or j2534d records
+	int out_len;
+	int out_cnt;
+	uint64_t rx_time;		// host usec the first frame in out was decoded
+	gw_xfer_t xfer[GW_XFERS];
+	int inflight;			// OUT transfers submitted and not completed
+	uint32_t pend_cnt[GW_PENDING];	// frames of each j2534d request not answered yet
+	int pend_head;
+	int pending;
+	uint8_t rsp[sizeof(j2534d_rsp_t)];	// j2534d response read so far
+	size_t rsp_len;
+	int lost;				// j2534d connection broken, frames are dropped
+	unsigned long frames;
+	unsigned long rewritten;
+	unsigned long blocked;
+	unsigned long dropped;
+	unsigned long lat_cnt;
+	uint32_t lat_max;
+	uint32_t hist[JITTER_BUCKETS];	// forwarding latency
+} gateway_t;
+
+typedef struct _isotp_stream
+{
+	uint32_t id;			// CAN ID of the sender
+	uint8_t ext;			// 29 bit ID
+	uint8_t addr;			// address byte with J2534_ISOTP_EXT_ADDR
+	uint8_t active;			// transfer in progress
+	uint8_t tx;				// first frame was sent by the device
+	uint8_t sn;				// sequence number of the next consecutive frame
+	uint8_t fc_wait;		// waiting for a flow control frame
+	uint8_t bs_left;		// consecutive frames until the next flow control, 0 for no limit
+	uint32_t target;		// CAN ID of the last flow control to the sender
+	uint32_t start;			// device timestamp of the first frame
+	uint32_t len;			// PDU length from the first frame
+	uint32_t got;
+	uint64_t used;			// frame count at the last frame of the sender
+	uint8_t *data;			// ISOTP_PDU_MAX bytes
+} isotp_stream_t;
+
+/*
+  ISO-TP sniffer of the connected channel, fed by the USB event thread
+  under CB_LOCK.  hash finds the stream of a sender with linear probing,
+  completed PDUs go to ring for PassThruReadIsotp.
+*/
+typedef struct _isotp
+{
+	uint32_t *mask;			// filters, pattern follows mask
+	uint32_t *pattern;
+	unsigned long filters;
+	int ext_addr;
+	isotp_stream_t *stream;
+	unsigned long streams;	// allocated
+	unsigned long used;		// assigned to a sender
+	uint16_t *hash;			// stream index + 1, 0 for a free slot
+	int hash_bits;
+	uint8_t *pool;			// stream buffers
+	uint64_t frames;
+	unsigned long fc_wait;	// streams waiting for a flow control frame
+	unsigned long pdus;
+	unsigned long aborted;
+	unsigned long evicted;
+	unsigned long oversize;
+	j2534d_ring_t *ring;
+} isotp_t;
+
+/*
+  A PDU in the ring of the ISO-TP sniffer, padded to a multiple of 8 bytes
+  like j2534d_msg_t.
+*/
+typedef struct _isotp_rec
+{
+	uint32_t size;			// record size including this header, J2534D_MSG_PAD for padding
+	uint32_t source;
+	uint32_t target;
+	uint32_t rx_status;
+	uint32_t address;
+	uint32_t start;
+	uint32_t end;
+	uint32_t data_size;
+	uint8_t data[];
+} isotp_rec_t;
+
+#define ISOTP_REC_SIZE(data_size) \
+	((uint32_t)((sizeof(isotp_rec_t) + (data_size) + 7) & ~(size_t)7))
+
+/*
+  Real-time mode of the USB event thread.  The RX jitter of a message is
+  how much more its host minus device time is than the smallest one seen
+  in the current and the previous JITTER_WINDOW, so the device clock may
+  drift without the reference going stale.
+*/
+typedef struct _rt
+{
+	RT_MODE mode;			// applied to the running USB event thread
+	int locked;				// mlockall was called
+	uint32_t busy_poll;		// USB event thread handles libusb events without waiting
+	uint32_t measure;		// USB event thread records RX jitter
+	uint64_t window;		// host usec the current window started, 0 before the first message
+	uint32_t base;			// smallest host minus device time of the current window
+	uint32_t base_prev;		// and of the previous one
+	unsigned long cnt;
+	uint32_t max;
+	uint32_t hist[JITTER_BUCKETS];	// guarded by CB_LOCK
+} rt_t;
+
+/*
+  A traced API call, USB transfer or decode batch.  The span is written
+  into the buffer of the thread it ran on when it ends, only that thread
+  appends to a buffer so recording takes no lock.
+*/
+typedef struct _trace_span
+{
+	const char *name;
+	uint64_t start;			// host usec, 0 when tracing was off as the span began
+	uint32_t size;			// bytes or messages moved
+	unsigned long *count;	// message count read back when the span ends, overrides size
+} trace_span_t;
+
+typedef struct _trace_event
+{
+	const char *name;
+	uint64_t ts;
+	uint32_t dur;
+	uint32_t size;
+} trace_event_t;
+
+typedef struct _trace_buf
+{
+	struct _trace_buf *next;	// all thread buffers, freed by trace_stop
+	uint32_t tid;
+	uint32_t cnt;
+	unsigned long dropped;		// spans not recorded because the buffer was full
+	trace_event_t ev[TRACE_EVENTS];
+} trace_buf_t;
+
+#ifdef __linux__
+typedef struct _socketcan_tp
+{
+	unsigned long filter_id;	// flow control filter, 0 when the slot is unused
+	int sock;				// CAN_ISOTP socket
+	uint32_t rx_id;
+	uint32_t tx_id;
+} socketcan_tp_t;
+
+typedef struct _socketcan
+{
+	char ifname[IFNAMSIZ];
+	unsigned int ifindex;
+	int sock;				// CAN_RAW socket of a connected CAN channel
+	int connected;
+	unsigned long baud;		// as given to PassThruConnect, the interface sets the bit rate
+	unsigned long loopback;
+	unsigned long bs;		// ISO15765 flow control block size and STmin we send
+	unsigned long stmin;
+	unsigned long filter_id;	// last filter ID handed out
+	struct can_frame frame[SC_BATCH];	// read by recvmmsg, returned from rx_pos on
+	struct iovec iov[SC_BATCH];
+	struct mmsghdr hdr[SC_BATCH];
+	union {
+		struct cmsghdr align;
+		uint8_t buf[CMSG_SPACE(sizeof(struct timeval))];
+	} cmsg[SC_BATCH];
+	int rx_pos;
+	int rx_cnt;
+	socketcan_tp_t tp[MAX_FILTERS];	// ISO-TP socket of each flow control filter
+	int tp_next;			// ISO-TP socket to read first
+} socketcan_t;
+#endif
+
+#ifndef _MSC_VER
+#define RX_LOCK()	pthread_mutex_lock(&usb_ev->lock)
+#define RX_UNLOCK()	pthread_mutex_unlock(&usb_ev->lock)
+#define CB_LOCK()	pthread_mutex_lock(&usb_ev->cb_lock)
+#define CB_UNLOCK()	pthread_mutex_unlock(&usb_ev->cb_lock)
+#else
+#define RX_LOCK()
+#define RX_UNLOCK()
+#define CB_LOCK()
+#define CB_UNLOCK()
+#endif
+
 const char *DELIMITERS = " \r\n";
 const uint16_t VENDOR_ID = 0x0403;
 const uint16_t PRODUCT_ID = 0xcc4d;
@@ -79,13 +881,56 @@ const uint8_t ISO15765 = 0x36;
 int8_t LAST_ERROR[LE_LEN];
 int littleEndian = TRUE;
 int write_log = FALSE;
-int8_t log_msg[LM_LEN];
+THREAD_LOCAL int8_t log_msg[LM_LEN];
 unsigned long rx_buf_idx = 0;
 char fw_version[MAX_LEN];
 FILE *logfile;
 connection_t con[1];
 endpoint_t endpoint[1];
 fifo_msg_t *fifo_head = NULL;
+fifo_msg_t *fifo_tail = NULL;
+unsigned long fifo_cnt = 0;
+usb_event_t usb_ev[1];
+cmd_queue_t cmdq[1];
+msg_filter_t filters[MAX_FILTERS];
+int filter_cnt = 0;		// filters used, guarded by the callback lock
+filter_set_t fset[1];
+rx_callback_t rx_cb[MAX_RX_CALLBACKS];
+subscription_t subs[MAX_SUBSCRIPTIONS];
+uint32_t sub_readers[MAX_SUBSCRIPTIONS];	// PassThruReadSubscription calls holding each ring
+uint32_t sub_std[SUB_STD_IDS];		// subscriber bit mask of each 11-bit CAN ID
+sub_hash_t sub_ext[SUB_HASH_SIZE];	// subscriber bit mask of larger CAN IDs
+capture_t capture[1];
+snapshot_t *snapshot = NULL;
+uint32_t snapshot_readers = 0;	// PassThruReadSnapshot calls holding snapshot
+bus_stats_t *bus_stats = NULL;
+replay_t *replay = NULL;
+gateway_t *gateway = NULL;
+isotp_t *isotp = NULL;
+uint32_t isotp_readers = 0;	// PassThruReadIsotp calls holding isotp
+dbc_t *dbc[MAX_DBC];
+capstore_t *capstores[MAX_CAPSTORES];
+merge_t *merged[MAX_MERGED];
+uds_req_t uds[MAX_UDS];
+read_batch_t read_batch[1];
+vbatt_t vbatt[1];
+rt_t rt[1];
+RT_MODE rt_env[1];		// from J2534_RT, applied at every PassThruConnect
+int rt_env_set = FALSE;
+char trace_path[FILENAME_MAX];	// from J2534_TRACE, written at PassThruClose
+uint32_t trace_on = FALSE;
+trace_buf_t *trace_bufs = NULL;
+uint32_t trace_gen = 0;		// bumped by trace_stop as it frees trace_bufs
+uint32_t trace_writers = 0;	// trace_end calls using a buffer
+THREAD_LOCAL trace_buf_t *trace_own = NULL;
+THREAD_LOCAL uint32_t trace_own_gen = 0;	// trace_gen trace_own was allocated in
+#ifndef _MSC_VER
+pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+unsigned long uds_next_id = 1;
+#ifdef __linux__
+socketcan_t sc[1];
+#endif
 
 enum rx_msg_type {
 	NORM_MSG,
@@ -98,6 +943,18 @@ enum rx_msg_type {
 	TX_LB_START_IND = 0xA0,
 };
 
+enum backend {
+	USB_BACKEND,
+	DAEMON_BACKEND,
+	SOCKETCAN_BACKEND
+};
+
+enum decode_result {
+	DECODE_SKIPPED,	// packet type not handled, nothing stored
+	DECODE_PARTIAL,	// data stored, the message completes with a following packet
+	DECODE_DONE		// message complete
+};
+
 static void writelog(const char *str)
 {
 	fprintf(logfile, "%s", str);
@@ -154,36 +1011,6 @@ static int isLittleEndian()
 	return r;
 }
 
-/*
-   Byte swap and return the provided 4-byte value
- */
-static uint32_t bswap(const uint32_t bytes)
-{
-	union {
-		uint8_t  B0[4];
-		uint32_t B4;
-	} tmp_bytes;
-	tmp_bytes.B0[0] = (uint8_t)(bytes >> 24);
-	tmp_bytes.B0[1] = (uint8_t)(bytes >> 16);
-	tmp_bytes.B0[2] = (uint8_t)(bytes >> 8);
-	tmp_bytes.B0[3] = (uint8_t)(bytes & 0xff);
-	return tmp_bytes.B4;
-}
-
-/*
-  Parse a timestamp. This parse_ts function parses four bytes from
-  the given data array and copies them to a long, then swaps them
-  based on the processor endian.
- */
-static uint32_t parse_ts(const void *data)
-{
-	uint32_t timestamp = 0;
-	memcpy(&timestamp, data, 4);
-	if (littleEndian)
-		timestamp = bswap(timestamp);
-	return timestamp;
-}
-
 /*
   This copy function copies bytes, 2 at a time between s_start to s_end
   from the object src into the object dest beginning at d_pos.
@@ -224,11 +1051,12 @@ static void datacopy(PASSTHRU_MSG *dest, const int8_t *src,
 
 /*
    This open_dev_endpoints function locates the device to open by Vendor and
-   Product.  Opens the device and sets the handle to use, then determines the
-   addresses for the endpoint transmit and receive queues.
+   Product, skipping the first index matching devices.  Opens the device and
+   sets the handle to use, then determines the addresses for the endpoint
+   transmit and receive queues.
  */
 static int open_dev_endpoints(libusb_device **devs, const ssize_t cnt,
-	const uint16_t vendor_id, const uint16_t product_id, endpoint_t *endpoint)
+	const uint16_t vendor_id, const uint16_t product_id, unsigned long index, endpoint_t *endpoint)
 {
 	ssize_t x = 0;
 	for (; x < cnt; x++)
@@ -238,7 +1066,7 @@ static int open_dev_endpoints(libusb_device **devs, const ssize_t cnt,
 		if (r != LIBUSB_SUCCESS)
 			return r;
 
-		if (desc.idVendor == vendor_id && desc.idProduct == product_id)
+		if (desc.idVendor == vendor_id && desc.idProduct == product_id && index-- == 0)
 		{
 			r = libusb_open(devs[x], &con->dev_handle);
 			if (r != LIBUSB_SUCCESS)
@@ -349,6 +1177,32 @@ static int is_valid(const unsigned long value)
 	return TRUE;
 }
 
+/*
+  Make the RX event descriptor readable once the receive FIFO queue holds
+  watermark messages and drain it again when the queue drops below that.
+  Called with the queue locked.
+*/
+static void rx_event_update()
+{
+#ifndef _MSC_VER
+	if (usb_ev->event_fd[0] < 0)
+		return;
+
+	uint64_t cnt = 1;
+	int ready = fifo_cnt >= usb_ev->watermark;
+	if (ready && !usb_ev->event_set)
+	{
+		if (write(usb_ev->event_fd[1], &cnt, sizeof(cnt)) == sizeof(cnt))
+			usb_ev->event_set = TRUE;
+	}
+	else if (!ready && usb_ev->event_set)
+	{
+		if (read(usb_ev->event_fd[0], &cnt, sizeof(cnt)) == sizeof(cnt))
+			usb_ev->event_set = FALSE;
+	}
+#endif
+}
+
 /*
   Add a PT message to the receive FIFO queue
 */
@@ -359,20 +1213,24 @@ static int queue_msg(PASSTHRU_MSG *mBuf)
 	{
 		new_msg->pt_msg = mBuf;
 		new_msg->next_in_q = NULL;
-		if (fifo_head)
+		RX_LOCK();
+		if (fifo_tail)
 		{
-			fifo_msg_t *temp = fifo_head;
-			// find last in queue
-			while (temp->next_in_q != NULL)
-				temp = temp->next_in_q;
 			// assign the new msg to last in queue
-			temp->next_in_q = new_msg;
+			fifo_tail->next_in_q = new_msg;
 		}
 		else
 		{
 			// new msg is now the first in the queue
 			fifo_head = new_msg;
 		}
+		fifo_tail = new_msg;
+		fifo_cnt++;
+		rx_event_update();
+#ifndef _MSC_VER
+		pthread_cond_signal(&usb_ev->rx_cond);
+#endif
+		RX_UNLOCK();
 		if (write_log)
 			writelog("\tNew message queued\n");
 		return TRUE;
@@ -385,10 +1243,19 @@ static int queue_msg(PASSTHRU_MSG *mBuf)
 */
 static int read_queue_msg(PASSTHRU_MSG *mBuf)
 {
+	RX_LOCK();
 	fifo_msg_t *temp = fifo_head;
 	if (temp)
 	{
 		fifo_head = fifo_head->next_in_q;
+		if (fifo_head == NULL)
+			fifo_tail = NULL;
+		fifo_cnt--;
+		rx_event_update();
+	}
+	RX_UNLOCK();
+	if (temp)
+	{
 		if (write_log)
 			writelog("\tMessage dequeued\n");
 
@@ -402,18 +1269,37 @@ static int read_queue_msg(PASSTHRU_MSG *mBuf)
 			return TRUE;
 		}
 		else
+		{
+			free(temp);
 			if (write_log)
 				writelog("\tPT msg is NULL\n");
+		}
 	}
 	return FALSE;
 }
 
+/*
+  Read up to msg_cnt PT messages from the receive FIFO queue into the
+  pMsg array, return the number of messages read.
+*/
+static unsigned long read_queue_msgs(PASSTHRU_MSG *pMsg, const unsigned long msg_cnt)
+{
+	unsigned long i = 0;
+	for (; i < msg_cnt; i++)
+	{
+		if (!read_queue_msg(pMsg + i))
+			break;
+	}
+	return i;
+}
+
 /*
   Flush the receive FIFO queue.
 */
 static void flush_queue()
 {
 	fifo_msg_t *current = NULL;
+	RX_LOCK();
 	while (fifo_head)
 	{
 		current = fifo_head;
@@ -422,1028 +1308,9293 @@ static void flush_queue()
 		fifo_head = current->next_in_q;
 		free(current);
 	}
+	fifo_tail = NULL;
+	fifo_cnt = 0;
+	rx_event_update();
+	RX_UNLOCK();
 	if (write_log)
 		writelog("\tReceive FIFO queue flushed\n");
 }
 
 /*
-  Serach through data to find a pattern match.
-  Return offset in data where first match is found or -1
-  if not found.
+  Time stamp of a data packet, big endian.
 */
-static int pattern_search(const uint8_t *data, const int data_len, const uint8_t *pattern)
+static uint32_t packet_ts(const uint8_t *p)
 {
-	if (data_len < (int)strlen(pattern))
-		return -1;
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
 
-	int search_len = data_len - (int)strlen(pattern) + 1;
-	int i = 0;
-	for (; i < search_len; ++i)
+/*
+  Append n bytes to the data of msg, as far as it has room.
+*/
+static void payload_copy(PASSTHRU_MSG *msg, const uint8_t *src, const uint32_t n)
+{
+	uint32_t room = PM_DATA_LEN - (uint32_t)msg->DataSize;
+	uint32_t cnt = n < room ? n : room;
+	memcpy(msg->Data + msg->DataSize, src, cnt);
+	msg->DataSize += cnt;
+}
+
+/*
+  Log a data packet decoded into msg, from data byte first of the message
+  on, with the result of the decode kernel.
+*/
+static void decode_log(const PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no, const uint32_t first, const int result)
+{
+	int next = bytes_processed + data[bytes_processed + 3] + 4;	// offset of the following packet
+	uint8_t packet_type = data[bytes_processed + 4];
+	const char *msg_type = "";
+	if (result == DECODE_SKIPPED)
 	{
-		if (data[i] != pattern[0])
-			continue;
+		snprintf(log_msg, LM_LEN,
+			"\t\t\t-- Unprocessed data length (data[len] = %02X)\n\t\t\t  ",
+			data[bytes_processed + 3]);
+		writelog(log_msg);
+		writelogmsg(data, bytes_processed + 5, bytes_read - bytes_processed);
+		writelog("\n");
+		snprintf(log_msg, LM_LEN,
+			"\t\t\t-- DEFAULT: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, msg_cnt:%lu\n",
+			next + 5, next + 3, next, bytes_read, msg_no);
+		writelog(log_msg);
+		return;
+	}
 
-		// first byte matched, test for the rest of the pattern
-		int j = (int)strlen(pattern) - 1;
-		for (; j >= 1; j--)
-		{
-			if (data[i + j] != pattern[j])
-				break;
-			if (j == 1)
-				return i;
-		}
+	if (first < msg->DataSize)
+	{
+		writelog("\t\t\t  ");
+		writelogmsg(msg->Data, first, msg->DataSize);
+		writelog("\n");
+	}
+	switch (packet_type)
+	{
+	case TX_DONE:
+		snprintf(log_msg, LM_LEN,
+			"\t\t\t-- PROCESSED TX Done: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, ts:%08lX, msg_cnt:%lu\n",
+			next + 5, next + 3, next, bytes_read, msg->Timestamp, msg_no + 1);
+		break;
+	case TX_LB_START_IND:
+	case NORM_MSG_START_IND:
+		snprintf(log_msg, LM_LEN,
+			"\t\t\t-- PROCESSED %s Msg INDICATION: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, ts:%08lX, msg_cnt:%lu\n",
+			packet_type == TX_LB_START_IND ? "TX LB" : "RX",
+			next + 5, next + 3, next, bytes_read, msg->Timestamp, msg_no + 1);
+		break;
+	case TX_LB_MSG:
+	case NORM_MSG:
+		snprintf(log_msg, LM_LEN,
+			"\t\t\t-- READ %s Msg: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, DataSize:%lu, msg_cnt:%lu\n",
+			packet_type == TX_LB_MSG ? "LB" : "RX",
+			next + 5, next + 3, next, bytes_read, msg->DataSize, msg_no + 1);
+		break;
+	default:
+		if (packet_type == RX_MSG_END_IND)
+			msg_type = "RX";
+		if (packet_type == EXT_ADDR_MSG_END_IND)
+			msg_type = "Ext Addr RX";
+		if (packet_type == LB_MSG_END_IND)
+			msg_type = "LB";
+		snprintf(log_msg, LM_LEN,
+			"\t\t\t-- PROCESSED %s END INDICATION: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, ts:%08lX, msg_cnt:%lu\n",
+			msg_type, next + 5, next + 3, next, bytes_read, msg->Timestamp, msg_no + 1);
+		break;
 	}
-	return -1;
+	writelog(log_msg);
 }
 
 /*
-  Send data and expect to receive a reply, using specified timeout.
-  If expect is NULL then command is acknowledged by aro response.
+  The decode kernels decode one ar<channel> data packet found at offset
+  bytes_processed of the data array into msg, msg_no is only used for
+  logging.  There is one per protocol family, each compiled with log
+  FALSE and TRUE, and PassThruConnect binds the one for the protocol and
+  logging setting to con->decode, so the receive loops do not test either
+  per packet.  Packet layout: 'a' 'r' channel length type, then for CAN
+  a 4 byte time stamp, a 4 byte CAN ID and the data.
+
+  CAN frames come in a single packet, the common normal and loopback
+  frames are handled first.
 */
-static int usb_send_expect(uint8_t *data, const size_t len,
-	const int capacity, const uint32_t timeout, const uint8_t *expect)
+static int decode_can_kernel(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no, const int log)
 {
-	int bytes_written = 0, r = LIBUSB_SUCCESS;
-
-	// send data only if there is more than 0 bytes to send
-	if (len > 0 && len <= (size_t)capacity)
+	const uint8_t *p = data + bytes_processed;
+	uint8_t packet_type = p[4];
+	uint32_t n = p[3] > 5 ? p[3] - 5u : 0;	// ID and data bytes
+	uint32_t first = (uint32_t)msg->DataSize;
+	int r = DECODE_DONE;
+
+	msg->Timestamp = packet_ts(p + 5);
+	if ((packet_type & ~TX_LB_MSG) == NORM_MSG)
 	{
-		r = libusb_bulk_transfer(con->dev_handle, endpoint->addr_out,
-			data, (int)len, &bytes_written, timeout);
-		if (write_log)
-		{
-			writelog("\tUSB stream Sent:\n\t\t");
-			if (bytes_written > 0)
-				writelogmsg(data, 0, bytes_written);
-			else
-				writelog("bytes_written: 0, no USB stream Sent");
-			writelog("\n");
-		}
+		payload_copy(msg, p + 9, n);
+		msg->ExtraDataIndex = msg->DataSize;
+		msg->RxStatus = packet_type >> 5;	// 1 for a TX loopback frame
 	}
-	if (r != LIBUSB_SUCCESS)
+	else if ((packet_type & ~TX_LB_MSG) == NORM_MSG_START_IND)
 	{
-		if (write_log)
-		{
-			snprintf(log_msg, LM_LEN, "\tSend Error: %s\n", libusb_error_name(r));
-			writelog(log_msg);
-		}
-		snprintf(LAST_ERROR, LE_LEN,
-			"USB data transfer error sending %d bytes: %s", (int)len, libusb_error_name(r));
+		payload_copy(msg, p + 9, n);
+		msg->ExtraDataIndex = 0;
+		msg->RxStatus = 2;	// Msg start indication
 	}
-	else
+	else if (packet_type == RX_MSG_END_IND || packet_type == EXT_ADDR_MSG_END_IND
+		|| packet_type == LB_MSG_END_IND)
 	{
-		if (timeout > 0) // expect a reply otherwise return without reading
-		{
-			int need_aro = TRUE;
-			int need_exp = FALSE;
-			// If expect value is passed then the check for ARO is not required
-			if (expect)
-			{
-				need_exp = TRUE;
-				need_aro = FALSE;
-			}
-
-			int bytes_read = 0;
-			int get_next = TRUE;
-			while (get_next)
-			{
-				r = libusb_bulk_transfer(con->dev_handle, endpoint->addr_in,
-					data, capacity, &bytes_read, timeout);
-				if (bytes_read < capacity)
-					data[bytes_read] = '\0';
+		payload_copy(msg, p + 9, n);
+		msg->ExtraDataIndex = msg->DataSize;
+		msg->RxStatus = 0;
+	}
+	else if (packet_type == TX_DONE)
+	{
+		payload_copy(msg, p + 9, n);
+		msg->ExtraDataIndex = 0;
+		msg->RxStatus = 8;	// TX Done
+	}
+	else
+		r = DECODE_SKIPPED;
+	msg->ProtocolID = con->protocol_id;
+	msg->TxFlags = 0;
 
-				if (r != LIBUSB_SUCCESS)
-				{
-					if (write_log)
-					{
-						snprintf(log_msg, LM_LEN, "\tReceive Error: %s\n", libusb_error_name(r));
-						writelog(log_msg);
-					}
-					snprintf(LAST_ERROR, LE_LEN, "USB data transfer error: %s", libusb_error_name(r));
-					return r;
-				}
+	if (log)
+		decode_log(msg, data, bytes_processed, bytes_read, msg_no, first, r);
+	return r;
+}
 
-				if (write_log)
-				{
-					writelog("\tUSB stream Rcvd:\n\t\t");
-					if (bytes_read > 0)
-						writelogmsg(data, 0, bytes_read);
-					else
-						writelog("bytes_read: 0, USB stream Rcvd");
-					writelog("\n");
-				}
+/*
+  ISO15765 messages arrive as a data packet completed by an end
+  indication, transmitted ones are confirmed with TX done.
+*/
+static int decode_iso15765_kernel(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no, const int log)
+{
+	const uint8_t *p = data + bytes_processed;
+	uint8_t packet_type = p[4];
+	uint32_t n = p[3] > 5 ? p[3] - 5u : 0;
+	uint32_t first = (uint32_t)msg->DataSize;
+	int r = DECODE_DONE;
 
-				if (data[2] == 0x65)	// e
-				{
-					unsigned long errnum = strtoul(data + 4, NULL, 10);
-					if (is_valid(errnum))
-					{
-						snprintf(LAST_ERROR, LE_LEN, "Error: J2534 device comms error: %lu", errnum);
-						return errnum;
-					}
-				}
-
-				if (need_aro)
-				{
-					int aro_pos = pattern_search(data, bytes_read, "aro\r\n");
-					if (aro_pos >= 0)
-					{
-						need_aro = FALSE;
-						get_next = FALSE;
-						if (write_log)
-							writelog("\t\tCommand acknowledged\n");
-					}
-				}
-
-				if (need_exp)
-				{
-					int exp_pos = pattern_search(data, bytes_read, expect);
-					if (exp_pos >= 0)
-					{
-						need_exp = FALSE;
-						get_next = FALSE;
-						if (write_log)
-							writelog("\t\tAcknowledged by expect\n");
-					}
-				}
-			}
-		}
+	switch (packet_type)
+	{
+	case NORM_MSG:
+	case TX_LB_MSG:
+		payload_copy(msg, p + 9, n);
+		msg->ExtraDataIndex = msg->DataSize;
+		msg->RxStatus = packet_type >> 5;	// 1 for TX loopback
+		r = DECODE_PARTIAL;	// Read next message to get End indication and timestamp
+		break;
+	case RX_MSG_END_IND:
+	case EXT_ADDR_MSG_END_IND:
+	case LB_MSG_END_IND:
+		payload_copy(msg, p + 9, n);
+		msg->ExtraDataIndex = msg->DataSize;
+		msg->RxStatus = 0;	// RX Indication
+		break;
+	case NORM_MSG_START_IND:
+	case TX_LB_START_IND:
+		payload_copy(msg, p + 9, n);
+		msg->ExtraDataIndex = 0;
+		msg->RxStatus = 2;	// Msg start indication
+		break;
+	case TX_DONE:
+		payload_copy(msg, p + 9, n);
+		msg->ExtraDataIndex = 0;
+		msg->RxStatus = 8;	// TX Done
+		break;
+	default:
+		r = DECODE_SKIPPED;
+		break;
+	}
+	if (r != DECODE_SKIPPED)
+	{
+		msg->Timestamp = packet_ts(p + 5);
+		msg->ProtocolID = con->protocol_id;
+		msg->TxFlags = 0;
 	}
+
+	if (log)
+		decode_log(msg, data, bytes_processed, bytes_read, msg_no, first, r);
 	return r;
 }
 
 /*
-  Establish a connection with a PassThru device.
- */
-int32_t PassThruOpen(const void *pName, unsigned long *pDeviceID)
+  ISO9141 and ISO14230 data packets carry no time stamp, the end
+  indication that follows them does.
+*/
+static int decode_kline_kernel(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no, const int log)
 {
-	if (pDeviceID == NULL)
+	const uint8_t *p = data + bytes_processed;
+	uint8_t packet_type = p[4];
+	uint32_t first = (uint32_t)msg->DataSize;
+	int r = DECODE_DONE;
+
+	switch (packet_type)
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error initializing J2534 library: pDeviceID must not be NULL");
-		return J2534_ERR_NULL_PARAMETER;
+	case NORM_MSG:
+	case TX_LB_MSG:
+		payload_copy(msg, p + 5, p[3] > 1 ? p[3] - 1u : 0);
+		msg->ExtraDataIndex = msg->DataSize;
+		msg->RxStatus = packet_type >> 5;	// 1 for TX loopback
+		msg->ProtocolID = con->protocol_id;
+		msg->TxFlags = 0;
+		r = DECODE_PARTIAL;	// Read next message to get End indication and timestamp
+		break;
+	case RX_MSG_END_IND:
+	case EXT_ADDR_MSG_END_IND:
+	case LB_MSG_END_IND:
+		msg->Timestamp = packet_ts(p + 5);
+		break;
+	case NORM_MSG_START_IND:
+	case TX_LB_START_IND:
+		msg->Timestamp = packet_ts(p + 5);
+		msg->DataSize = 0;
+		msg->ExtraDataIndex = 0;
+		msg->RxStatus = 2;	// Msg start indication
+		msg->ProtocolID = con->protocol_id;
+		msg->TxFlags = 0;
+		break;
+	case TX_DONE:
+		msg->Timestamp = packet_ts(p + 5);
+		msg->ProtocolID = con->protocol_id;
+		msg->TxFlags = 0;
+		break;
+	default:
+		r = DECODE_SKIPPED;
+		break;
 	}
 
-	const char *le = getenv("LOG_ENABLE");
-	if (le)
+	if (log)
+		decode_log(msg, data, bytes_processed, bytes_read, msg_no, first, r);
+	return r;
+}
+
+static int decode_can(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no)
+{
+	return decode_can_kernel(msg, data, bytes_processed, bytes_read, msg_no, FALSE);
+}
+
+static int decode_can_log(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no)
+{
+	return decode_can_kernel(msg, data, bytes_processed, bytes_read, msg_no, TRUE);
+}
+
+static int decode_iso15765(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no)
+{
+	return decode_iso15765_kernel(msg, data, bytes_processed, bytes_read, msg_no, FALSE);
+}
+
+static int decode_iso15765_log(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no)
+{
+	return decode_iso15765_kernel(msg, data, bytes_processed, bytes_read, msg_no, TRUE);
+}
+
+static int decode_kline(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no)
+{
+	return decode_kline_kernel(msg, data, bytes_processed, bytes_read, msg_no, FALSE);
+}
+
+static int decode_kline_log(PASSTHRU_MSG *msg, const uint8_t *data, const int bytes_processed,
+	const int bytes_read, const unsigned long msg_no)
+{
+	return decode_kline_kernel(msg, data, bytes_processed, bytes_read, msg_no, TRUE);
+}
+
+#ifndef _MSC_VER
+/*
+  Host CLOCK_MONOTONIC time in usec, the clock j2534d stamps messages with.
+*/
+static uint64_t host_usec()
+{
+#ifndef _MSC_VER
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+#else
+	return GetTickCount64() * 1000;
+#endif
+}
+
+/*
+  Return TRUE once a read holding got of want messages may return.  Without
+  batching (batch NULL or off) that is as soon as there is one message, else
+  when min_msgs are there or max_latency usec passed since the first one
+  arrived at host_usec() time first.
+*/
+static int read_complete(const read_batch_t *batch, const unsigned long got, const unsigned long want,
+	const uint64_t first, const uint64_t now)
+{
+	if (got >= want)
+		return TRUE;
+	if (got == 0)
+		return FALSE;
+	return batch == NULL || batch->min_msgs == 0 || got >= batch->min_msgs
+		|| now >= first + batch->max_latency;
+}
+
+/*
+  Time a read holding got messages waits for more until.
+*/
+static uint64_t read_wait_until(const read_batch_t *batch, const unsigned long got, const uint64_t first,
+	const uint64_t deadline)
+{
+	if (batch && got > 0 && first + batch->max_latency < deadline)
+		return first + batch->max_latency;
+	return deadline;
+}
+
+/*
+  Convert a timeout in msec to an absolute CLOCK_REALTIME deadline
+  for pthread_cond_timedwait.
+*/
+static void abs_deadline(struct timespec *deadline, const uint32_t timeout)
+{
+	clock_gettime(CLOCK_REALTIME, deadline);
+	deadline->tv_sec += timeout / 1000;
+	deadline->tv_nsec += (long)(timeout % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L)
 	{
-		if (le[0] == '0')
-			write_log = FALSE;
-		else
-			logfile = fopen(le, "a");
-		if (logfile)
-			write_log = TRUE;
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
 	}
+}
 
-	littleEndian = isLittleEndian();
-	if (write_log)
+/*
+  Kernel thread ID as shown by the trace viewer, so spans line up with
+  the threads seen by perf and top.
+*/
+static uint32_t trace_tid()
+{
+#ifdef __linux__
+	return (uint32_t)syscall(SYS_gettid);
+#else
+	return (uint32_t)(uintptr_t)pthread_self();
+#endif
+}
+
+static trace_span_t trace_begin(const char *name)
+{
+	trace_span_t span = {name, 0, 0, NULL};
+	if (ATOMIC_LOAD(&trace_on))
+		span.start = host_usec();
+	return span;
+}
+
+/*
+  Record a span in the buffer of the calling thread, run by TRACE_SPAN
+  as the span goes out of scope.
+*/
+static void trace_end(trace_span_t *span)
+{
+	if (span->start == 0)
+		return;
+	// trace_stop frees the buffers once no span is being recorded
+	ATOMIC_ADD(&trace_writers, 1);
+	if (!ATOMIC_LOAD(&trace_on))
 	{
-		writelog("Opening...\n\t|\n\tDevice Name: ");
-		if (pName == NULL)
-			writelog("NULL");
-		else
-			writelog((int8_t*)pName);
-		writelog("\n");
+		ATOMIC_ADD(&trace_writers, -1);
+		return;
 	}
-
-	con->ctx = NULL;	// use default context
-	int r = libusb_init(&con->ctx);
-	if (r != LIBUSB_SUCCESS)
+	uint64_t now = host_usec();
+	uint32_t gen = ATOMIC_LOAD(&trace_gen);
+	trace_buf_t *b = trace_own_gen == gen ? trace_own : NULL;
+	if (b == NULL)
 	{
-		// there was an error
-		if (write_log)
+		b = calloc(1, sizeof(trace_buf_t));
+		if (b == NULL)
 		{
-			snprintf(log_msg, LM_LEN, "\tInit Error: %s\n", libusb_error_name(r));
-			writelog(log_msg);
+			ATOMIC_ADD(&trace_writers, -1);
+			return;
 		}
-		snprintf(LAST_ERROR, LE_LEN, "Error initializing USB library: %s", libusb_error_name(r));
-		libusb_exit(con->ctx);
-		return error_map(r);
+		b->tid = trace_tid();
+		pthread_mutex_lock(&trace_lock);
+		b->next = trace_bufs;
+		trace_bufs = b;
+		pthread_mutex_unlock(&trace_lock);
+		trace_own = b;
+		trace_own_gen = gen;
 	}
-
-	libusb_device **devs;
-	ssize_t cnt = libusb_get_device_list(con->ctx, &devs);
-	if (cnt < 0)
+	uint32_t n = b->cnt;
+	if (n >= TRACE_EVENTS)
+		b->dropped++;
+	else
 	{
-		if (write_log)
-			writelog("\tError getting device list\n");
-		snprintf(LAST_ERROR, LE_LEN, "Error getting USB device list");
-		libusb_exit(con->ctx);
-		return J2534_ERR_DEVICE_NOT_CONNECTED;
+		trace_event_t *ev = &b->ev[n];
+		ev->name = span->name;
+		ev->ts = span->start;
+		ev->dur = (uint32_t)(now - span->start);
+		ev->size = span->count ? (uint32_t)*span->count : span->size;
+		ATOMIC_STORE(&b->cnt, n + 1);
 	}
+	ATOMIC_ADD(&trace_writers, -1);
+}
 
-	r = open_dev_endpoints(devs, cnt, VENDOR_ID, PRODUCT_ID, endpoint);
-	libusb_free_device_list(devs, 1);
-	if (r != LIBUSB_SUCCESS)
+/*
+  Free the buffers of all threads, each thread allocates a new one for its
+  next span.
+*/
+static void trace_free()
+{
+	pthread_mutex_lock(&trace_lock);
+	while (trace_bufs)
 	{
-		if (write_log)
-		{
-			snprintf(log_msg, LM_LEN, "\tCannot find device, error: %s\n", libusb_error_name(r));
-			writelog(log_msg);
-		}
-		snprintf(LAST_ERROR, LE_LEN, "Cannot find device: %s", libusb_error_name(r));
-		libusb_exit(con->ctx);
-		return J2534_ERR_DEVICE_NOT_CONNECTED;
+		trace_buf_t *b = trace_bufs;
+		trace_bufs = b->next;
+		free(b);
 	}
+	ATOMIC_ADD(&trace_gen, 1);
+	pthread_mutex_unlock(&trace_lock);
+}
 
-	if (con->dev_handle == NULL)
+/*
+  Start tracing into path, spans recorded by an earlier PassThruOpen are
+  discarded.
+*/
+static void trace_start(const char *path)
+{
+	pthread_mutex_lock(&trace_lock);
+	for (trace_buf_t *b = trace_bufs; b; b = b->next)
 	{
-		if (write_log)
-			writelog("\tCannot open device handle\n");
-		snprintf(LAST_ERROR, LE_LEN, "Cannot open device handle (disconnected?)");
-		libusb_exit(con->ctx);
-		return J2534_ERR_DEVICE_NOT_CONNECTED;
+		ATOMIC_STORE(&b->cnt, 0);
+		b->dropped = 0;
 	}
-	else
+	pthread_mutex_unlock(&trace_lock);
+	snprintf(trace_path, sizeof(trace_path), "%s", path);
+	ATOMIC_STORE(&trace_on, TRUE);
+}
+
+/*
+  Stop tracing and write the spans of all threads as Chrome trace event
+  JSON, which chrome://tracing and the Perfetto UI open.  Timestamps are
+  host CLOCK_MONOTONIC usec, args.size holds bytes for USB transfers and
+  decode batches and messages for PassThruReadMsgs and PassThruWriteMsgs.
+  The buffers are freed afterwards.
+*/
+static void trace_stop()
+{
+	if (!ATOMIC_LOAD(&trace_on))
+		return;
+	ATOMIC_STORE(&trace_on, FALSE);
+	while (ATOMIC_LOAD(&trace_writers))
+		usleep(100);
+
+	FILE *f = fopen(trace_path, "w");
+	if (f == NULL)
 	{
-		*pDeviceID = con->device_id;
 		if (write_log)
 		{
-			snprintf(log_msg, LM_LEN, "\tDeviceID %lu opened\n", *pDeviceID);
+			snprintf(log_msg, LM_LEN, "Could not write trace %s: %s\n", trace_path, strerror(errno));
 			writelog(log_msg);
 		}
+		trace_free();
+		return;
 	}
-
-	//find out if kernel driver is attached
-	if (libusb_kernel_driver_active(con->dev_handle, 0) == 1)
+	fprintf(f, "{\"traceEvents\":[\n");
+	const char *sep = "";
+	unsigned long events = 0;
+	unsigned long dropped = 0;
+	pthread_mutex_lock(&trace_lock);
+	for (trace_buf_t *b = trace_bufs; b; b = b->next)
 	{
-		if (write_log)
-			writelog("\tKernel Driver Active\n");
-		if (libusb_detach_kernel_driver(con->dev_handle, 0) == 0) //detach it
-			if (write_log)
-				writelog("\tKernel Driver Detached\n");
+		uint32_t n = ATOMIC_LOAD(&b->cnt);
+		for (uint32_t i = 0; i < n; i++)
+		{
+			const trace_event_t *ev = &b->ev[i];
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%llu,\"dur\":%u,"
+				"\"args\":{\"size\":%u}}", sep, ev->name, (int)getpid(), b->tid,
+				(unsigned long long)ev->ts, ev->dur, ev->size);
+			sep = ",\n";
+		}
+		events += n;
+		dropped += b->dropped;
 	}
+	pthread_mutex_unlock(&trace_lock);
+	fprintf(f, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%lu}}\n", dropped);
+	fclose(f);
+	trace_free();
 
-	//claim interface
-	r = libusb_claim_interface(con->dev_handle, endpoint->intf_num);
-	if (r != LIBUSB_SUCCESS)
-	{
-		if (write_log)
-			writelog("\tCannot Claim Interface\n");
-		snprintf(LAST_ERROR, LE_LEN, "Cannot claim interface from kernel driver");
-		libusb_close(con->dev_handle);
-		libusb_exit(con->ctx);
-		return error_map(r);
-	}
 	if (write_log)
 	{
-		snprintf(log_msg, LM_LEN, "\tClaimed Interface %u\n", endpoint->intf_num);
+		snprintf(log_msg, LM_LEN, "Trace %s: %lu spans, %lu dropped\n", trace_path, events, dropped);
 		writelog(log_msg);
 	}
+}
+#endif
 
-	uint8_t data[MAX_LEN];
-	// init device
-	strcpy(data, "\r\n\r\nati\r\n");
-
-	// expect ari with FW version
-	r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, "ari ");
-	if (r == LIBUSB_SUCCESS)
-		memcpy(fw_version, data, 80);
+/*
+  TRACE_SPAN(name) opens a span lasting until the end of the enclosing
+  block, TRACE_SIZE and TRACE_COUNT attach the bytes or messages it moved.
+  A span costs one atomic load while tracing is off.
+*/
+#ifndef _MSC_VER
+#define TRACE_SPAN(name)	trace_span_t trace_span __attribute__((cleanup(trace_end))) = trace_begin(name)
+#define TRACE_SIZE(n)		(trace_span.size = (uint32_t)(n))
+#define TRACE_COUNT(p)		(trace_span.count = (p))
+#else
+#define TRACE_SPAN(name)
+#define TRACE_SIZE(n)
+#define TRACE_COUNT(p)
+#endif
 
-	// open the device
-	strcpy(data, "ata\r\n");
-	r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
+/*
+  Buffer a command reply received by the USB event thread for usb_send_expect,
+  when all slots are in use the oldest reply is dropped.
+*/
+static void reply_put(const uint8_t *data, const int len)
+{
+#ifndef _MSC_VER
+	RX_LOCK();
+	if (usb_ev->reply_cnt == REPLY_SLOTS)
+	{
+		usb_ev->reply_head = (usb_ev->reply_head + 1) % REPLY_SLOTS;
+		usb_ev->reply_cnt--;
+	}
+	reply_t *reply = &usb_ev->reply[(usb_ev->reply_head + usb_ev->reply_cnt) % REPLY_SLOTS];
+	reply->len = len < REPLY_LEN ? len : REPLY_LEN;
+	memcpy(reply->data, data, reply->len);
+	usb_ev->reply_cnt++;
+	pthread_cond_signal(&usb_ev->reply_cond);
+	RX_UNLOCK();
+#endif
+}
 
-	if (write_log && r == LIBUSB_SUCCESS)
-		writelog("\tInit acknowledged\nInterface Opened\n");
-	LAST_ERROR[0] = '\0';
-	return J2534_NOERROR;
+/*
+  Store a pin 16 voltage reply asked for by the battery voltage sampler,
+  returns FALSE for any other command reply.
+*/
+static int vbatt_put(const uint8_t *data, const int len)
+{
+#ifndef _MSC_VER
+	char reply[MAX_LEN];
+	if (!vbatt->active || len <= 7 || len >= MAX_LEN || strncmp((const char*)data, "arr 16 ", 7) != 0)
+		return FALSE;
+	memcpy(reply, data, len);
+	reply[len] = '\0';
+
+	pthread_mutex_lock(&vbatt->lock);
+	VBATT_SAMPLE *sample = &vbatt->sample[vbatt->seq & (VBATT_SAMPLES - 1)];
+	sample->Timestamp = (unsigned long)host_usec();
+	sample->Voltage = strtoul(reply + 7, NULL, 10);
+	vbatt->seq++;
+	pthread_cond_broadcast(&vbatt->cond);
+	pthread_mutex_unlock(&vbatt->lock);
+	return TRUE;
+#else
+	return FALSE;
+#endif
 }
 
 /*
-  Terminate a connection with a Pass-Thru device.
- */
-int32_t PassThruClose(const unsigned long DeviceID)
+  Wait up to timeout msec for a command reply from the USB event thread and
+  copy it into data.  Takes the place of a bulk IN transfer while the thread
+  owns the endpoint.
+*/
+static int reply_wait(uint8_t *data, const int capacity, int *bytes_read, const uint32_t timeout)
 {
-	if (write_log)
-	{
-		snprintf(log_msg, LM_LEN, "Closing...\n\t|\n\tDeviceID:  %lu\n", DeviceID);
-		writelog(log_msg);
-	}
+	*bytes_read = 0;
+#ifndef _MSC_VER
+	struct timespec deadline;
+	abs_deadline(&deadline, timeout);
 
-	int r = J2534_NOERROR;
-	if ((uint8_t)DeviceID != con->device_id)
-	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid DeviceID");
-		r = J2534_ERR_INVALID_DEVICE_ID;
-	}
-	else
+	RX_LOCK();
+	while (usb_ev->reply_cnt == 0)
 	{
-		uint8_t data[MAX_LEN];
-		strcpy(data, "atz\r\n");
-		int r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
-		r = libusb_release_interface(con->dev_handle, endpoint->intf_num);
-		libusb_close(con->dev_handle);
-		libusb_exit(con->ctx);
-
-		if (write_log)
+		if (pthread_cond_timedwait(&usb_ev->reply_cond, &usb_ev->lock, &deadline) == ETIMEDOUT)
 		{
-			writelog("Closed\n");
-			fclose(logfile);
+			RX_UNLOCK();
+			return LIBUSB_ERROR_TIMEOUT;
 		}
 	}
-	return r;
+	reply_t *reply = &usb_ev->reply[usb_ev->reply_head];
+	*bytes_read = reply->len < capacity ? reply->len : capacity;
+	memcpy(data, reply->data, *bytes_read);
+	usb_ev->reply_head = (usb_ev->reply_head + 1) % REPLY_SLOTS;
+	usb_ev->reply_cnt--;
+	RX_UNLOCK();
+	return LIBUSB_SUCCESS;
+#else
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
 }
 
 /*
-  Establish a connection using a protocol channel.
- */
-int32_t PassThruConnect(const unsigned long DeviceID, const unsigned long protocolID,
-	const unsigned long flags, const unsigned long baud, unsigned long *pChannelID)
+  Drop command replies left over from earlier commands.
+*/
+static void reply_flush()
 {
-	if (write_log)
-	{
-		snprintf(log_msg, LM_LEN,
-			"Connecting...\n\t|\n"
-			"\tDeviceID:\t%lu\n"
-			"\tprotocolID:\t%lu\n"
-			"\tflags:\t\t%08lX\n"
-			"\tbaud:\t\t%lu\n"
-			, DeviceID, protocolID, flags, baud);
-		writelog(log_msg);
-	}
+	RX_LOCK();
+	usb_ev->reply_head = 0;
+	usb_ev->reply_cnt = 0;
+	RX_UNLOCK();
+}
 
-	if ((uint8_t)DeviceID != con->device_id)
-	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid DeviceID");
-		return J2534_ERR_INVALID_DEVICE_ID;
-	}
+/*
+  Synchronous bulk transfer on the device, traced as a USB IN or USB OUT
+  span of the bytes transferred.
+*/
+static int usb_bulk(const uint8_t ep, uint8_t *data, const int len, int *transferred,
+	const unsigned int timeout)
+{
+	TRACE_SPAN(ep & LIBUSB_ENDPOINT_IN ? "USB IN" : "USB OUT");
+	*transferred = 0;
+	int r = libusb_bulk_transfer(con->dev_handle, ep, data, len, transferred, timeout);
+	TRACE_SIZE(*transferred);
+	return r;
+}
 
-	switch ((int)protocolID) {
-	case 3:
-		con->channel = ISO9141;
-		break;
-	case 4:
-		con->channel = ISO14230;
-		break;
-	case 5:
-		con->channel = CAN;
-		break;
-	case 6:
-		con->channel = ISO15765;
-		break;
-	default:
-		return J2534_ERR_INVALID_PROTOCOL_ID;
-	}
+/*
+  Write the transmit command of a CAN frame on the connected channel to
+  out, room for ATT_FRAME_MAX bytes, and return its length.  Several
+  commands may go out in one transfer.
+*/
+static int att_frame(uint8_t *out, const uint32_t id, const int ext, const uint8_t *data,
+	const uint32_t len)
+{
+	int n = sprintf((char*)out, "att%c %u %u\r\n", con->channel, 4 + len, ext ? 0x100 : 0);	// CAN_29BIT_ID
+	out[n++] = (uint8_t)(id >> 24);
+	out[n++] = (uint8_t)(id >> 16);
+	out[n++] = (uint8_t)(id >> 8);
+	out[n++] = (uint8_t)id;
+	memcpy(out + n, data, len);
+	return n + (int)len;
+}
 
-	int r = J2534_NOERROR;
-	uint8_t data[MAX_LEN];
-	snprintf(data, MAX_LEN, "ato%lu %lu %lu 0\r\n", protocolID, flags, baud);
-	r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
-	*pChannelID = protocolID;
-	con->protocol_id = protocolID;
-	if (write_log && r == LIBUSB_SUCCESS)
-		writelog("Connected\n");
-	return error_map(r);
+/*
+  Read from the bulk IN endpoint, or from the replies buffered by the
+  USB event thread while it owns the endpoint.
+*/
+static int usb_recv(uint8_t *data, const int capacity, int *bytes_read, const uint32_t timeout)
+{
+	if (ATOMIC_LOAD(&usb_ev->running))
+		return reply_wait(data, capacity, bytes_read, timeout);
+	return usb_bulk(endpoint->addr_in, data, capacity, bytes_read, timeout);
 }
 
 /*
-  Terminate a connection with a protocol channel.
- */
-int32_t PassThruDisconnect(const unsigned long ChannelID)
+  Hand a command reply to the oldest outstanding command expecting it, an
+  error reply goes to the oldest outstanding command.  Returns FALSE when
+  no command waits for the reply.
+*/
+static int cmd_put(const uint8_t *data, const int len)
 {
-	if (write_log)
+	int matched = FALSE;
+	RX_LOCK();
+	unsigned long i = cmdq->head;
+	for (; i != cmdq->tail && !matched; i++)
 	{
-		snprintf(log_msg, LM_LEN, "Disconnecting\n\t|\n\tChannelID: %lu\n", ChannelID);
-		writelog(log_msg);
+		cmd_slot_t *slot = &cmdq->slot[i % CMD_SLOTS];
+		if (slot->len > 0)
+			continue;
+		if ((len >= 3 && data[2] == 0x65)	// e
+			|| (len >= (int)strlen(slot->expect) && memcmp(data, slot->expect, strlen(slot->expect)) == 0))
+		{
+			slot->len = len < REPLY_LEN - 1 ? len : REPLY_LEN - 1;
+			memcpy(slot->reply, data, slot->len);
+			slot->reply[slot->len] = '\0';
+			matched = TRUE;
+		}
 	}
+#ifndef _MSC_VER
+	if (matched)
+		pthread_cond_broadcast(&usb_ev->reply_cond);
+#endif
+	RX_UNLOCK();
+	return matched;
+}
 
-	if (ChannelID != strtoul(&con->channel, NULL, 10))
-	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
-		return J2534_ERR_INVALID_CHANNEL_ID;
-	}
+/*
+  Load up to 12 bytes as the two words compared by the host filter rules.
+*/
+static void filter_words(const uint8_t *data, const unsigned long size, uint64_t *lo, uint32_t *hi)
+{
+	uint8_t buf[12];
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, data, size < 12 ? size : 12);
+	memcpy(lo, buf, 8);
+	memcpy(hi, buf + 8, 4);
+}
 
-	// If any messages in the FIFO queue delete them
-	flush_queue();
+/*
+  Check a received message against the host filters when the device
+  filters let more messages through than asked for, called with CB_LOCK
+  held.  Indications and loopback messages are left to the device.
+*/
+static int filter_pass(const PASSTHRU_MSG *msg)
+{
+	if (ATOMIC_LOAD(&fset->exact) || (msg->RxStatus & 0x0B))
+		return TRUE;
 
-	uint8_t data[MAX_LEN];
-	snprintf(data, MAX_LEN, "atc%lu\r\n", ChannelID);
-	int r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
+	uint64_t lo;
+	uint32_t hi;
+	uint32_t len = (uint32_t)msg->DataSize;
+	filter_words(msg->Data, msg->DataSize, &lo, &hi);
+	int pass = 0, block = 0;
+	int i = 0;
+	int end = fset->pass_cnt + fset->block_cnt;
+	// no branches, the compiler turns these loops into vector compares
+	for (; i < fset->pass_cnt; i++)
+		pass |= ((lo & fset->mask_lo[i]) == fset->pat_lo[i])
+			& ((hi & fset->mask_hi[i]) == fset->pat_hi[i]) & (len >= fset->size[i]);
+	for (; i < end; i++)
+		block |= ((lo & fset->mask_lo[i]) == fset->pat_lo[i])
+			& ((hi & fset->mask_hi[i]) == fset->pat_hi[i]) & (len >= fset->size[i]);
+	return pass && !block;
+}
 
-	if (write_log && r == LIBUSB_SUCCESS)
-		writelog("Disconnected\n");
-	return error_map(r);
+/*
+  filter_pass for the threads decoding USB data outside the USB event
+  thread, takes CB_LOCK only when the host filters are needed.
+*/
+static int filter_accept(const PASSTHRU_MSG *msg)
+{
+	if (ATOMIC_LOAD(&fset->exact) || (msg->RxStatus & 0x0B))
+		return TRUE;
+	CB_LOCK();
+	int pass = filter_pass(msg);
+	CB_UNLOCK();
+	return pass;
 }
 
 /*
-  Read message(s) from a protocol channel.
- */
-int32_t PassThruReadMsgs(const unsigned long ChannelID, PASSTHRU_MSG *pMsg,
-	unsigned long *pNumMsgs, const unsigned long Timeout)
+  Split data read from the bulk IN endpoint while waiting for command
+  replies.  Messages of the connected channel are decoded into the receive
+  FIFO queue so PassThruReadMsgs still gets them, anything else is a reply.
+*/
+static void cmd_rx_data(const uint8_t *data, const int bytes_read)
 {
-	if (pMsg == NULL)
+	TRACE_SPAN("decode");
+	TRACE_SIZE(bytes_read);
+	int bytes_processed = 0;
+	while (bytes_processed < bytes_read)
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: *pMsg must not be NULL");
-		return J2534_ERR_NULL_PARAMETER;
+		const uint8_t *packet = data + bytes_processed;
+		int packet_len = bytes_read - bytes_processed;
+		if (packet_len >= 4
+			&& packet[0] == 0x61		// A
+			&& packet[1] == 0x72		// R
+			&& packet[2] >= ISO9141 && packet[2] <= ISO15765)
+		{
+			packet_len = packet[3] + 4;
+			if (bytes_processed + packet_len > bytes_read)
+				break;
+			if (packet[2] == con->channel)
+			{
+				if (cmdq->msg == NULL)
+				{
+					cmdq->msg = (PASSTHRU_MSG*)malloc(sizeof(PASSTHRU_MSG));
+					if (cmdq->msg)
+						cmdq->msg->DataSize = 0;
+				}
+				if (cmdq->msg
+					&& con->decode(cmdq->msg, data, bytes_processed, bytes_read, fifo_cnt) == DECODE_DONE)
+				{
+					if (filter_accept(cmdq->msg) && queue_msg(cmdq->msg))
+						cmdq->msg = NULL;
+					else
+						cmdq->msg->DataSize = 0;
+				}
+			}
+		}
+		else
+		{
+			// Command reply, up to and including CR LF
+			int i = 0;
+			for (; i + 1 < packet_len; i++)
+			{
+				if (packet[i] == '\r' && packet[i + 1] == '\n')
+				{
+					packet_len = i + 2;
+					break;
+				}
+			}
+			if (!cmd_put(packet, packet_len) && write_log)
+				writelog("\t\tUnexpected reply dropped\n");
+		}
+		bytes_processed += packet_len;
 	}
+}
 
-	if (ChannelID != strtoul(&con->channel, NULL, 10))
+/*
+  Send a command without waiting for its reply, which starts with expect
+  or with aro if expect is NULL.  Replies are collected in the order the
+  commands were sent with cmd_wait, up to CMD_SLOTS commands can be
+  outstanding.
+*/
+static int cmd_send(const uint8_t *data, const size_t len, const char *expect)
+{
+	if (cmdq->tail - cmdq->head >= CMD_SLOTS)
+		return LIBUSB_ERROR_BUSY;
+	if (ATOMIC_LOAD(&usb_ev->running) && cmdq->tail == cmdq->head)
+		reply_flush();
+
+	cmd_slot_t *slot = &cmdq->slot[cmdq->tail % CMD_SLOTS];
+	snprintf(slot->expect, sizeof(slot->expect), "%s", expect ? expect : "aro");
+	slot->len = 0;
+	RX_LOCK();
+	cmdq->tail++;
+	RX_UNLOCK();
+
+	int bytes_written = 0;
+	int r = usb_bulk(endpoint->addr_out,
+		(uint8_t*)data, (int)len, &bytes_written, 2000);
+	if (write_log)
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
-		return J2534_ERR_INVALID_CHANNEL_ID;
+		writelog("\tUSB stream Sent:\n\t\t");
+		if (bytes_written > 0)
+			writelogmsg(data, 0, bytes_written);
+		else
+			writelog("bytes_written: 0, no USB stream Sent");
+		writelog("\n");
+	}
+	if (r != LIBUSB_SUCCESS)
+	{
+		RX_LOCK();
+		cmdq->tail--;
+		RX_UNLOCK();
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tSend Error: %s\n", libusb_error_name(r));
+			writelog(log_msg);
+		}
+		snprintf(LAST_ERROR, LE_LEN,
+			"USB data transfer error sending %d bytes: %s", (int)len, libusb_error_name(r));
 	}
+	return r;
+}
 
-	int8_t channel = con->channel;
-	uint32_t timeout = Timeout;
-	unsigned long msg_cnt = *pNumMsgs;	// number of msgs to read into pMsg array
-	rx_buf_idx = 0;
+/*
+  Give up the replies of all outstanding commands.
+*/
+static void cmd_cancel()
+{
+	RX_LOCK();
+	cmdq->head = cmdq->tail;
+	RX_UNLOCK();
+}
 
-	if (write_log)
+/*
+  Wait up to timeout msec for the reply to the oldest outstanding command
+  and copy it, NUL terminated, into data.  When the reply does not come
+  every outstanding command is given up.  A device error reply returns
+  the device error number.
+*/
+static int cmd_wait(uint8_t *data, const int capacity, const uint32_t timeout)
+{
+	if (cmdq->head == cmdq->tail)
+		return LIBUSB_ERROR_NOT_FOUND;
+	cmd_slot_t *slot = &cmdq->slot[cmdq->head % CMD_SLOTS];
+	uint64_t deadline = host_usec() + (uint64_t)timeout * 1000;
+	int r = LIBUSB_SUCCESS;
+
+	if (ATOMIC_LOAD(&usb_ev->running))
 	{
-		snprintf(log_msg, LM_LEN,
-			"ReadMsgs\n\t|\n"
-			"\tChannelID:\t%lu\n"
-			"\tpNumMsgs:\t%lu\n"
-			"\tTimeout:\t%u msec\n"
-			"\trxBufIndex:\t%lu\n",
-			ChannelID, msg_cnt, timeout, rx_buf_idx);
-		writelog(log_msg);
+#ifndef _MSC_VER
+		// the USB event thread matches the replies
+		struct timespec abs;
+		abs_deadline(&abs, timeout);
+		RX_LOCK();
+		while (slot->len == 0 && r == LIBUSB_SUCCESS)
+		{
+			if (pthread_cond_timedwait(&usb_ev->reply_cond, &usb_ev->lock, &abs) == ETIMEDOUT)
+				r = LIBUSB_ERROR_TIMEOUT;
+		}
+		RX_UNLOCK();
+#endif
+	}
+	else
+	{
+		uint8_t buf[PM_DATA_LEN];
+		while (slot->len == 0 && r == LIBUSB_SUCCESS)
+		{
+			uint64_t now = host_usec();
+			if (now >= deadline)
+			{
+				r = LIBUSB_ERROR_TIMEOUT;
+				break;
+			}
+			int bytes_read = 0;
+			r = usb_bulk(endpoint->addr_in, buf, PM_DATA_LEN,
+				&bytes_read, (unsigned int)((deadline - now + 999) / 1000));
+			if (write_log && bytes_read > 0)
+			{
+				writelog("\tUSB stream Rcvd:\n\t\t");
+				writelogmsg(buf, 0, bytes_read);
+				writelog("\n");
+			}
+			if (r == LIBUSB_SUCCESS)
+				cmd_rx_data(buf, bytes_read);
+		}
 	}
 
-	*pNumMsgs = 0;
-	PASSTHRU_MSG *msgBuf = pMsg;	// local copy for pointer arithmetic
+	if (slot->len == 0)
+	{
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tReceive Error: %s\n", libusb_error_name(r));
+			writelog(log_msg);
+		}
+		snprintf(LAST_ERROR, LE_LEN, "USB data transfer error: %s", libusb_error_name(r));
+		cmd_cancel();
+		return r;
+	}
 
-	// Any messages in the FIFO queue to send?
-	for (; msg_cnt; msg_cnt--)
+	int len = slot->len < capacity - 1 ? slot->len : capacity - 1;
+	memcpy(data, slot->reply, len);
+	data[len] = '\0';
+	RX_LOCK();
+	cmdq->head++;
+	RX_UNLOCK();
+
+	if (data[2] == 0x65)	// e
 	{
-		if (read_queue_msg(msgBuf))
+		unsigned long errnum = strtoul(data + 4, NULL, 10);
+		if (is_valid(errnum))
 		{
-			(*pNumMsgs)++;	// count the dequeued message
-			msgBuf++;		// increment to next PT Msg
+			snprintf(LAST_ERROR, LE_LEN, "Error: J2534 device comms error: %lu", errnum);
+			return errnum;
 		}
-		else
-			break;
 	}
+	if (write_log)
+		writelog("\t\tCommand acknowledged\n");
+	return LIBUSB_SUCCESS;
+}
 
-	if (!msg_cnt)
+/*
+  Send data and expect to receive a reply, using specified timeout.
+  If expect is NULL then command is acknowledged by aro response.
+  The reply is returned in data.  With a timeout of 0 no reply is expected.
+*/
+static int usb_send_expect(uint8_t *data, const size_t len,
+	const int capacity, const uint32_t timeout, const uint8_t *expect)
+{
+	int bytes_written = 0, r = LIBUSB_SUCCESS;
+	if (len == 0 || len > (size_t)capacity)
+		return r;
+	if (timeout > 0)
+	{
+		r = cmd_send(data, len, expect);
+		if (r == LIBUSB_SUCCESS)
+			r = cmd_wait(data, capacity, timeout);
+		return r;
+	}
+
+	// send data only, e.g. messages, which are not acknowledged
+	r = usb_bulk(endpoint->addr_out,
+		data, (int)len, &bytes_written, 0);
+	if (write_log)
+	{
+		writelog("\tUSB stream Sent:\n\t\t");
+		if (bytes_written > 0)
+			writelogmsg(data, 0, bytes_written);
+		else
+			writelog("bytes_written: 0, no USB stream Sent");
+		writelog("\n");
+	}
+	if (r != LIBUSB_SUCCESS)
 	{
 		if (write_log)
 		{
-			snprintf(log_msg, LM_LEN, "\tRX Buffers remaining:\t%lu\nEndReadMsg\n", msg_cnt);
+			snprintf(log_msg, LM_LEN, "\tSend Error: %s\n", libusb_error_name(r));
 			writelog(log_msg);
 		}
-		return J2534_NOERROR;
+		snprintf(LAST_ERROR, LE_LEN,
+			"USB data transfer error sending %d bytes: %s", (int)len, libusb_error_name(r));
 	}
+	return r;
+}
 
-	int bytes_read = 0, r = LIBUSB_SUCCESS;
-	if (rx_buf_idx < msg_cnt)	// if pMsg array is not full, read from USB
+/*
+  Check a message against the mask and pattern of a message filter.
+*/
+static int filter_match(const msg_filter_t *filter, const PASSTHRU_MSG *msg)
+{
+	unsigned long i = 0;
+	if (msg->DataSize < filter->size)
+		return FALSE;
+	for (; i < filter->size; i++)
 	{
-		uint8_t data[PM_DATA_LEN];
-		int dontexit = TRUE;
-		msgBuf->DataSize = 0;	// Initialize msg datasize
+		if ((msg->Data[i] & filter->mask[i]) != (filter->pattern[i] & filter->mask[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
 
-		while (dontexit)
-		{
-			//dontexit--;
-			// Try to read USB
-			r = libusb_bulk_transfer(con->dev_handle, endpoint->addr_in,
-				data, PM_DATA_LEN, &bytes_read, timeout);
+/*
+  Return the host copy of a message filter or NULL if the ID is unknown.
+  Called with the callback lock held.
+*/
+static msg_filter_t *filter_find(const unsigned long filter_id)
+{
+	int i = 0;
+	for (; i < MAX_FILTERS; i++)
+	{
+		if (filters[i].used && filters[i].id == filter_id)
+			return &filters[i];
+	}
+	return NULL;
+}
 
-			if (r != LIBUSB_SUCCESS)
+/*
+  Keep a host copy of a message filter, returns FALSE when all MAX_FILTERS
+  are in use.
+*/
+static int filter_add(const unsigned long filter_id, const unsigned long type,
+	const PASSTHRU_MSG *mask, const PASSTHRU_MSG *pattern, const PASSTHRU_MSG *flow)
+{
+	int added = FALSE;
+	int i = 0;
+	CB_LOCK();
+	for (; i < MAX_FILTERS && !added; i++)
+	{
+		if (!filters[i].used)
+		{
+			memset(&filters[i], 0, sizeof(msg_filter_t));
+			filters[i].id = filter_id;
+			filters[i].type = type;
+			filters[i].tx_flags = mask->TxFlags;
+			memcpy(filters[i].mask, mask->Data, mask->DataSize);
+			memcpy(filters[i].pattern, pattern->Data, pattern->DataSize);
+			filters[i].size = mask->DataSize;
+			if (flow)
 			{
-				if (write_log)
-				{
-					snprintf(log_msg, LM_LEN, "\tRead Error: %s\n", libusb_error_name(r));
-					writelog(log_msg);
-				}
-				snprintf(LAST_ERROR, LE_LEN, "USB data transfer error: %s", libusb_error_name(r));
-				return error_map(r);
+				filters[i].flow_size = flow->DataSize < 12 ? flow->DataSize : 12;
+				memcpy(filters[i].flow, flow->Data, filters[i].flow_size);
 			}
+			filters[i].used = TRUE;
+			filter_cnt++;
+			added = TRUE;
+		}
+	}
+	CB_UNLOCK();
+	return added;
+}
 
-			uint32_t pos = 5;	// index within "data" array to start a copy from
-			uint32_t len = 3;	// index of the packet length for the current message in the "data" array
-			int bytes_processed = 0;	// the number of bytes processed in the "data" array
-			if (write_log)
-			{
-				snprintf(log_msg, LM_LEN,
-					"\t\t*** USB READ: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, USB:%s\n\t\t",
-					pos, len, bytes_processed, bytes_read, libusb_error_name(r));
-				writelog(log_msg);
-				writelogmsg(data, 0, bytes_read);
-				writelog("\n");
+/*
+  Forget the host copy of a stopped message filter.
+*/
+static void filter_remove(const unsigned long filter_id)
+{
+	CB_LOCK();
+	msg_filter_t *filter = filter_find(filter_id);
+	if (filter)
+	{
+		filter->used = FALSE;
+		filter_cnt--;
+	}
+	CB_UNLOCK();
+}
+
+/*
+  Build the host rules from the host filters and stop trusting the device
+  filters until filter_update has programmed them.
+*/
+static void filter_rules()
+{
+	int n = 0;
+	int i = 0;
+	CB_LOCK();
+	ATOMIC_STORE(&fset->exact, FALSE);
+	fset->pass_cnt = 0;
+	for (; i < MAX_FILTERS * 2; i++)
+	{
+		// pass and flow control filters on the first round, block filters on the second
+		const msg_filter_t *f = &filters[i % MAX_FILTERS];
+		if (!f->used || (f->type == J2534_BLOCK_FILTER) != (i >= MAX_FILTERS))
+			continue;
+		uint8_t pattern[12];
+		unsigned long j = 0;
+		for (; j < f->size; j++)
+			pattern[j] = f->pattern[j] & f->mask[j];
+		filter_words(f->mask, f->size, &fset->mask_lo[n], &fset->mask_hi[n]);
+		filter_words(pattern, f->size, &fset->pat_lo[n], &fset->pat_hi[n]);
+		fset->size[n] = (uint32_t)f->size;
+		n++;
+		if (i < MAX_FILTERS)
+			fset->pass_cnt = n;
+	}
+	fset->block_cnt = n - fset->pass_cnt;
+	CB_UNLOCK();
+}
+
+/*
+  TRUE if every message matching filter b also matches filter a.
+*/
+static int filter_covers(const msg_filter_t *a, const msg_filter_t *b)
+{
+	unsigned long i = 0;
+	if (a->tx_flags != b->tx_flags || a->size > b->size)
+		return FALSE;
+	for (; i < a->size; i++)
+	{
+		if ((a->mask[i] & ~b->mask[i]) || ((a->pattern[i] ^ b->pattern[i]) & a->mask[i]))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+  Drop the filters of f that another one covers.
+*/
+static void filter_reduce(msg_filter_t *f, int *cnt)
+{
+	int i = 0, j = 0;
+	for (; i < *cnt; i++)
+	{
+		for (j = 0; j < *cnt; j++)
+		{
+			if (j != i && filter_covers(&f[j], &f[i]))
+			{
+				f[i--] = f[--*cnt];
+				break;
 			}
+		}
+	}
+}
 
-			if (bytes_read > 0 && bytes_read <= PM_DATA_LEN)
+/*
+  Make the filter covering both a and b, return the number of mask bits
+  it keeps.
+*/
+static int filter_merge(const msg_filter_t *a, const msg_filter_t *b, msg_filter_t *m)
+{
+	int bits = 0;
+	unsigned long i = 0;
+	*m = *a;
+	m->size = a->size < b->size ? a->size : b->size;
+	for (; i < 12; i++)
+	{
+		uint8_t mask = i < m->size ? a->mask[i] & b->mask[i] & ~(a->pattern[i] ^ b->pattern[i]) : 0;
+		m->mask[i] = mask;
+		m->pattern[i] = a->pattern[i] & mask;
+		for (; mask; mask &= mask - 1)
+			bits++;
+	}
+	return bits;
+}
+
+/*
+  Work out the device filters for the host filters.  Flow control filters
+  are programmed as they are.  While there are more pass filters than
+  free device slots, the two whose combined filter keeps the most mask bits
+  are replaced by that filter.  Block filters get the slots left over.
+  Returns the number of device filters in want or -1 when the filters do
+  not fit, *exact tells if the device passes just what the host filters do.
+*/
+static int filter_compile(msg_filter_t *want, int *exact)
+{
+	static msg_filter_t pass[MAX_FILTERS];
+	int cnt = 0, n = 0;
+	int i = 0, j = 0;
+	*exact = TRUE;
+	for (; i < MAX_FILTERS; i++)
+	{
+		if (!filters[i].used)
+			continue;
+		if (filters[i].type == J2534_FLOW_CONTROL_FILTER)
+		{
+			if (cnt == DEVICE_FILTERS)
+				return -1;
+			want[cnt++] = filters[i];
+		}
+		else if (filters[i].type == J2534_PASS_FILTER)
+			pass[n++] = filters[i];
+	}
+
+	filter_reduce(pass, &n);
+	while (n > DEVICE_FILTERS - cnt)
+	{
+		msg_filter_t m, best;
+		int best_i = -1, best_j = -1, best_bits = -1;
+		for (i = 0; i < n; i++)
+		{
+			for (j = i + 1; j < n; j++)
 			{
-				if (write_log)
+				if (pass[i].tx_flags != pass[j].tx_flags)
+					continue;
+				int bits = filter_merge(&pass[i], &pass[j], &m);
+				if (bits > best_bits)
 				{
-					snprintf(log_msg, LM_LEN,
-						"\t\t=== %02X | %02X | %02X <> %02X | %02X ===\n",
-						(uint8_t)data[0], (uint8_t)data[1],
-						(uint8_t)data[2], (uint8_t)data[3],
-						(uint8_t)data[4]);
-					writelog(log_msg);
+					best = m;
+					best_bits = bits;
+					best_i = i;
+					best_j = j;
 				}
+			}
+		}
+		if (best_i < 0)
+			return -1;	// only filters with different TxFlags left
+		pass[best_i] = best;
+		pass[best_j] = pass[--n];
+		filter_reduce(pass, &n);
+		*exact = FALSE;
+	}
+	for (i = 0; i < n; i++)
+		want[cnt++] = pass[i];
 
-				// Process an expected data packet
-				while (bytes_processed < bytes_read
-					&& data[bytes_processed + 0] == 0x61		// A
-					&& data[bytes_processed + 1] == 0x72		// R
-					&& (data[bytes_processed + 2] == channel
-						|| data[bytes_processed + 2] == 0x6F))	// O
-				{
-					// If third byte equals the channel #, then this is Message data
-					if (data[bytes_processed + 2] == channel)
-					{
-						uint8_t channel_id = data[bytes_processed + 2];
-						uint8_t packet_type = data[bytes_processed + 4];
-						int8_t *msg_type = "";
-						unsigned long dataSize = 0;
-
-						// Message Type check
-						// TxDone Msg 0x10
-						if (packet_type == TX_DONE)
-						{
-							msgBuf->Timestamp = parse_ts(data + pos);
-							if (channel_id == ISO15765)	// CAN message
-							{
-								datacopy(msgBuf, data, 4, pos, (data[len] - 1));
-								dataSize = msgBuf->DataSize + (data[len] - 5);
-								msgBuf->DataSize = dataSize;
-								msgBuf->ExtraDataIndex = 0;
-								msgBuf->RxStatus = 8;	// TX Done
-							}
-							msgBuf->ProtocolID = con->protocol_id;
-							msgBuf->TxFlags = 0;
+	for (i = 0; i < MAX_FILTERS; i++)
+	{
+		if (!filters[i].used || filters[i].type != J2534_BLOCK_FILTER)
+			continue;
+		if (cnt < DEVICE_FILTERS)
+			want[cnt++] = filters[i];
+		else
+			*exact = FALSE;
+	}
+	return cnt;
+}
 
-							bytes_processed = bytes_processed + data[len] + 4;
-							pos = bytes_processed + 5;
-							len = bytes_processed + 3;
-							if (write_log)
-							{
-								snprintf(log_msg, LM_LEN,
-									"\t\t\t-- PROCESSED TX Done: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, ts:%08lX, msg_cnt:%lu\n",
-									pos, len, bytes_processed, bytes_read, msgBuf->Timestamp, rx_buf_idx + 1);
-								writelog(log_msg);
-							}
-							rx_buf_idx++;
-							if (rx_buf_idx < msg_cnt)
-							{
-								msgBuf++;
-								msgBuf->DataSize = 0;	// Initialize new msg datasize
-							}
-							dontexit = FALSE;
-						}
+/*
+  Format the device command starting filter f on channel.
+*/
+static size_t filter_cmd(uint8_t *data, const unsigned long channel, const msg_filter_t *f)
+{
+	snprintf(data, MAX_LEN, "atf%lu %lu %lu %lu\r\n", channel, f->type, f->tx_flags, f->size);
+	size_t i = strlen(data);
+	memcpy(data + i, f->mask, f->size);
+	i += f->size;
+	memcpy(data + i, f->pattern, f->size);
+	i += f->size;
+	if (f->type == J2534_FLOW_CONTROL_FILTER)
+	{
+		memcpy(data + i, f->flow, f->flow_size);
+		i += f->flow_size;
+	}
+	return i;
+}
 
-						// Start of a TX LB Msg 0xA0 or Normal Msg 0x80 Indication
-						else if (packet_type == TX_LB_START_IND || packet_type == NORM_MSG_START_IND)
-						{
-							msgBuf->Timestamp = parse_ts(data + pos);
-							if (channel_id == CAN || channel_id == ISO15765)	// CAN message
-							{
-								datacopy(msgBuf, data, 4, pos, (data[len] - 1));
-								dataSize = msgBuf->DataSize + (data[len] - 5);
-								msgBuf->DataSize = dataSize;
-								msgBuf->ExtraDataIndex = 0;
-								msgBuf->RxStatus = 2;	// Msg start indication
-							}
-							if (channel_id == ISO9141 || channel_id == ISO14230)	// K-line message
-							{
-								msgBuf->DataSize = 0;
-								msgBuf->ExtraDataIndex = 0;
-								msgBuf->RxStatus = 2;	// Msg start indication
-							}
-							msgBuf->ProtocolID = con->protocol_id;
-							msgBuf->TxFlags = 0;
+/*
+  TRUE if the device filter d is the same as filter f.
+*/
+static int filter_same(const msg_filter_t *d, const msg_filter_t *f)
+{
+	return d->type == f->type && d->tx_flags == f->tx_flags && d->size == f->size
+		&& d->flow_size == f->flow_size && memcmp(d->mask, f->mask, f->size) == 0
+		&& memcmp(d->pattern, f->pattern, f->size) == 0 && memcmp(d->flow, f->flow, f->flow_size) == 0;
+}
 
-							bytes_processed = bytes_processed + data[len] + 4;
-							pos = bytes_processed + 5;
-							len = bytes_processed + 3;
-							if (write_log)
-							{
-								if (packet_type == TX_LB_START_IND)
-									msg_type = "TX LB";
-								if (packet_type == NORM_MSG_START_IND)
-									msg_type = "RX";
-
-								snprintf(log_msg, LM_LEN,
-									"\t\t\t-- PROCESSED %s Msg INDICATION: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, ts:%08lX, msg_cnt:%lu\n",
-									msg_type, pos, len, bytes_processed, bytes_read, msgBuf->Timestamp, rx_buf_idx+1);
-								writelog(log_msg);
-							}
-							rx_buf_idx++;
-							if (rx_buf_idx < msg_cnt)
-							{
-								msgBuf++;
-								msgBuf->DataSize = 0;	// Initialize new msg datasize
-							}
-							dontexit = FALSE;
-						}
+/*
+  Start the filters of want not on the device yet and mark them to keep,
+  the commands are sent together and the replies collected after.
+*/
+static int filter_start_new(const unsigned long channel, const msg_filter_t *want, const int *on_dev,
+	const int want_cnt, int *keep)
+{
+	uint8_t data[MAX_LEN];
+	int sent[DEVICE_FILTERS];
+	int n = 0, i = 0, j = 0;
+	int r = LIBUSB_SUCCESS;
+	for (; i < want_cnt && r == LIBUSB_SUCCESS; i++)
+	{
+		if (on_dev[i])
+			continue;
+		size_t len = filter_cmd(data, channel, &want[i]);
+		r = cmd_send(data, len, "arf");
+		if (r == LIBUSB_SUCCESS)
+			sent[n++] = i;
+	}
+	for (i = 0; i < n; i++)
+	{
+		int rw = cmd_wait(data, MAX_LEN, 2000);
+		const char *id = strchr((const char*)data, ' ');
+		if (rw == LIBUSB_SUCCESS && id == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: failed to parse reply");
+			rw = J2534_ERR_FAILED;
+		}
+		if (rw != LIBUSB_SUCCESS)
+		{
+			if (r == LIBUSB_SUCCESS)
+				r = rw;
+			continue;
+		}
+		for (j = 0; j < DEVICE_FILTERS && fset->dev[j].used; j++)
+			;
+		if (j == DEVICE_FILTERS)
+			continue;
+		fset->dev[j] = want[sent[i]];
+		fset->dev[j].id = strtoul(id + 1, NULL, 10);
+		fset->dev[j].used = TRUE;
+		keep[j] = TRUE;
+	}
+	return r;
+}
 
-						// TX LB 0x20 or Normal 0x00 Message
-						else if (packet_type == TX_LB_MSG || packet_type == NORM_MSG)
-						{
-							msgBuf->RxStatus = 0;		// normal msg status
-							if (packet_type == TX_LB_MSG)
-								msgBuf->RxStatus = 1;	// TX Loopback msg status
+/*
+  Stop the device filters not in want.
+*/
+static int filter_stop_old(const unsigned long channel, const int *keep)
+{
+	uint8_t data[MAX_LEN];
+	int sent[DEVICE_FILTERS];
+	int n = 0, i = 0;
+	int r = LIBUSB_SUCCESS;
+	for (; i < DEVICE_FILTERS && r == LIBUSB_SUCCESS; i++)
+	{
+		if (!fset->dev[i].used || keep[i])
+			continue;
+		snprintf(data, MAX_LEN, "atk%lu %lu\r\n", channel, fset->dev[i].id);
+		r = cmd_send(data, strlen(data), NULL);
+		if (r == LIBUSB_SUCCESS)
+			sent[n++] = i;
+	}
+	for (i = 0; i < n; i++)
+	{
+		int rw = cmd_wait(data, MAX_LEN, 2000);
+		if (rw == LIBUSB_SUCCESS)
+			fset->dev[sent[i]].used = FALSE;
+		else if (r == LIBUSB_SUCCESS)
+			r = rw;
+	}
+	return r;
+}
 
-							if (channel_id == CAN || channel_id == ISO15765)	// CAN message
-							{
-								msgBuf->Timestamp = parse_ts(data + pos);
-								datacopy(msgBuf, data, 4, pos, (data[len] - 1));
-								dataSize = msgBuf->DataSize + (data[len] - 5);
-								msgBuf->DataSize = dataSize;
-								msgBuf->ExtraDataIndex = dataSize;
-							}
-							if (channel_id == ISO9141 || channel_id == ISO14230)	// K-line message
-							{
-								datacopy(msgBuf, data, 0, pos, (data[len] - 1));
-								dataSize = msgBuf->DataSize + (data[len] - 1);
-								msgBuf->DataSize = dataSize;
-								msgBuf->ExtraDataIndex = dataSize;
-							}
-							msgBuf->ProtocolID = con->protocol_id;
-							msgBuf->TxFlags = 0;
-							bytes_processed = bytes_processed + data[len] + 4;
-							pos = bytes_processed + 5;
-							len = bytes_processed + 3;
-							if (write_log)
-							{
-								if (packet_type == TX_LB_MSG)
-									msg_type = "LB";
-								if (packet_type == NORM_MSG)
-									msg_type = "RX";
-
-								snprintf(log_msg, LM_LEN,
-									"\t\t\t-- READ %s Msg: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, DataSize:%lu, msg_cnt:%lu\n",
-									msg_type, pos, len, bytes_processed, bytes_read, dataSize, rx_buf_idx+1);
-								writelog(log_msg);
-							}
-							if (channel_id == CAN)	// CAN message
-							{
-								rx_buf_idx++;
-								if (rx_buf_idx < msg_cnt)
-								{
-									msgBuf++;
-									msgBuf->DataSize = 0;	// Initialize new msg datasize
-								}
-								dontexit = FALSE;
-							}
-							else
-								dontexit = TRUE;	// Read next message to get End indication and timestamp
-						}
+/*
+  Program the device filters for the current host filters.  Unchanged
+  device filters stay, new ones are started before the old ones are
+  stopped when the device has room for both.  Until the device filters
+  are known to be exact the host rules are applied to received messages.
+*/
+static int32_t filter_update(const unsigned long channel)
+{
+	msg_filter_t want[DEVICE_FILTERS];
+	int on_dev[DEVICE_FILTERS];
+	int keep[DEVICE_FILTERS];
+	int exact = FALSE;
+	int cnt = filter_compile(want, &exact);
+	if (cnt < 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: filters do not fit into the %d device filters", DEVICE_FILTERS);
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	filter_rules();
 
-						// End of RX 0x40, ExtAddr RX 0x44 or LB 0x60 Msg End Indication
-						else if (packet_type == RX_MSG_END_IND || packet_type == EXT_ADDR_MSG_END_IND || packet_type == LB_MSG_END_IND)
-						{
-							if (write_log)
-							{
-								if (packet_type == RX_MSG_END_IND)
-									msg_type = "RX";
-								if (packet_type == EXT_ADDR_MSG_END_IND)
-									msg_type = "Ext Addr RX";
-								if (packet_type == LB_MSG_END_IND)
-									msg_type = "LB";
-
-								snprintf(log_msg, LM_LEN,
-									"\t\t\t-- %s Msg END INDICATION: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d\n",
-									msg_type, pos, len, bytes_processed, bytes_read);
-								writelog(log_msg);
-							}
-							msgBuf->Timestamp = parse_ts(data + pos);
-							if (channel_id == CAN || channel_id == ISO15765)	// CAN message
-							{
-								datacopy(msgBuf, data, 4, pos, (data[len] - 1));
-								dataSize = msgBuf->DataSize + (data[len] - 5);
-								msgBuf->DataSize = dataSize;
-								msgBuf->ExtraDataIndex = dataSize;
-								msgBuf->RxStatus = 0;	// RX Indication
-							}
-							bytes_processed = bytes_processed + data[len] + 4;
-							pos = bytes_processed + 5;
-							len = bytes_processed + 3;
-							if (write_log)
-							{
-								snprintf(log_msg, LM_LEN,
-									"\t\t\t-- PROCESSED %s END INDICATION: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, ts:%08lX, msg_cnt:%lu\n",
-									msg_type, pos, len, bytes_processed, bytes_read, msgBuf->Timestamp, rx_buf_idx+1);
-								writelog(log_msg);
-							}
-							rx_buf_idx++;
-							if (rx_buf_idx < msg_cnt)
-							{
-								msgBuf++;
-								msgBuf->DataSize = 0;	// Initialize new msg datasize
-							}
-							dontexit = FALSE;
-						}
-						else
-						{
-							if (write_log)
-							{
-								snprintf(log_msg, LM_LEN,
-									"\t\t\t-- Unprocessed data length (data[len] = %02X)\n\t\t\t  ",
-									data[len]);
-								writelog(log_msg);
-								writelogmsg(data, bytes_processed + 5, bytes_read - bytes_processed);
-								writelog("\n");
-							}
-							bytes_processed = bytes_processed + data[len] + 4;
-							pos = bytes_processed + 5;
-							len = bytes_processed + 3;
-							if (write_log)
-							{
-								snprintf(log_msg, LM_LEN,
-									"\t\t\t-- DEFAULT: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, msg_cnt:%lu\n",
-									pos, len, bytes_processed, bytes_read, rx_buf_idx);
-								writelog(log_msg);
-							}
-						} // End of message type check
-					}	// End of the AR channel# packet
+	int used = 0, added = cnt;
+	int i = 0, j = 0;
+	for (; i < DEVICE_FILTERS; i++)
+	{
+		on_dev[i] = FALSE;
+		keep[i] = FALSE;
+	}
+	for (i = 0; i < DEVICE_FILTERS; i++)
+	{
+		if (!fset->dev[i].used)
+			continue;
+		used++;
+		for (j = 0; j < cnt && !keep[i]; j++)
+		{
+			if (!on_dev[j] && filter_same(&fset->dev[i], &want[j]))
+			{
+				on_dev[j] = TRUE;
+				keep[i] = TRUE;
+				added--;
+			}
+		}
+	}
 
-					// If third byte equals 'O', then this is Acknowledgement data
-					if (data[bytes_processed + 2] == 0x6F)	// O
-					{
-						bytes_processed = bytes_processed + 5;
-						pos = bytes_processed + 5;
-						len = bytes_processed + 3;
-						if (write_log)
-						{
-							snprintf(log_msg, LM_LEN,
-								"\t\t\t-- ARO Msg: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, msg_cnt:%lu\n",
-								pos, len, bytes_processed, bytes_read, rx_buf_idx);
-							writelog(log_msg);
-						}
-					}
+	int r;
+	if (used + added <= DEVICE_FILTERS)
+	{
+		r = filter_start_new(channel, want, on_dev, cnt, keep);
+		if (r == LIBUSB_SUCCESS)
+			r = filter_stop_old(channel, keep);
+	}
+	else
+	{
+		r = filter_stop_old(channel, keep);
+		if (r == LIBUSB_SUCCESS)
+			r = filter_start_new(channel, want, on_dev, cnt, keep);
+	}
+	if (r == LIBUSB_SUCCESS && exact)
+		ATOMIC_STORE(&fset->exact, TRUE);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tDevice filters: %d, %s\n", cnt,
+			exact ? "exact" : "host filtering");
+		writelog(log_msg);
+	}
+	return error_map(r);
+}
 
-					// Check if we have read msg_cnt messages,
-					// if so, pMsg array is full, try to queue the message
-					if (bytes_processed < bytes_read && rx_buf_idx >= msg_cnt)
-					{
-						if (write_log)
-						{
-							snprintf(log_msg, LM_LEN, "\tRead message array full, %d bytes remaining\n",
-								bytes_read - bytes_processed);
-							writelog(log_msg);
-						}
+/*
+  Hand a decoded message to the registered RX callbacks, runs on the USB
+  event thread with CB_LOCK held.  Return TRUE if a callback consumed the
+  message so it is not queued for PassThruReadMsgs.
+*/
+static int rx_callbacks(const PASSTHRU_MSG *msg)
+{
+	if (usb_ev->cb_cnt == 0)
+		return FALSE;
 
-						// Try to queue the remaining bytes into new PT messages
-						msgBuf = (PASSTHRU_MSG*)malloc(sizeof(PASSTHRU_MSG));
-						if (msgBuf)
-						{
-							msgBuf->DataSize = 0;	// Initialize new msg datasize
-							if (write_log)
-								writelog("\tMore data, let's queue it\n");
-							if (queue_msg(msgBuf))
-								rx_buf_idx--;	// message queued so don't count it
-							else
-							{
-								// couldn't allocate memory in queue, skip remaining bytes and free msgBuf
-								bytes_processed = bytes_read;
-								dontexit = FALSE;
-								free(msgBuf);
-							}
-						}
-						else
-						{
+	int consumed = FALSE;
+	int i = 0;
+	for (; i < MAX_RX_CALLBACKS; i++)
+	{
+		rx_callback_t *cb = &rx_cb[i];
+		if (cb->fn == NULL)
+			continue;
+		if (cb->filter_id != J2534_ALL_FILTERS)
+		{
+			msg_filter_t *filter = filter_find(cb->filter_id);
+			if (filter == NULL || !filter_match(filter, msg))
+				continue;
+		}
+		cb->fn(msg, cb->context);
+		if (!(cb->flags & J2534_RX_CB_QUEUE))
+			consumed = TRUE;
+	}
+	return consumed;
+}
+
+/*
+  Hash slot of a CAN ID in sub_ext, linear probing from the home slot.
+*/
+static sub_hash_t *sub_hash_slot(const uint32_t id)
+{
+	uint32_t i = (id * 2654435761u) >> (32 - SUB_HASH_BITS);
+	while (sub_ext[i].subs && sub_ext[i].id != id)
+		i = (i + 1) & (SUB_HASH_SIZE - 1);
+	return &sub_ext[i];
+}
+
+/*
+  Rebuild the dispatch index from the ID lists of the subscriptions, called
+  with CB_LOCK held.  Return FALSE if the hash has no room for every CAN ID
+  above 0x7FF.
+*/
+static int sub_rebuild()
+{
+	int used = 0;
+	int i = 0;
+	memset(sub_std, 0, sizeof(sub_std));
+	memset(sub_ext, 0, sizeof(sub_ext));
+	usb_ev->sub_cnt = 0;
+	for (; i < MAX_SUBSCRIPTIONS; i++)
+	{
+		if (subs[i].ring == NULL)
+			continue;
+		unsigned long n = 0;
+		for (; n < subs[i].num_ids; n++)
+		{
+			uint32_t id = subs[i].ids[n];
+			if (id < SUB_STD_IDS)
+			{
+				sub_std[id] |= 1u << i;
+				continue;
+			}
+			sub_hash_t *slot = sub_hash_slot(id);
+			if (slot->subs == 0)
+			{
+				// keep the hash at most half full so probe sequences stay short
+				if (++used > SUB_HASH_SIZE / 2)
+					return FALSE;
+				slot->id = id;
+			}
+			slot->subs |= 1u << i;
+		}
+		usb_ev->sub_cnt++;
+	}
+	return TRUE;
+}
+
+/*
+  Wait for the reads still holding a buffer that was taken out of use under
+  CB_LOCK, a read holds it at most for its timeout.
+*/
+static void readers_wait(const uint32_t *readers)
+{
+#ifndef _MSC_VER
+	while (ATOMIC_LOAD(readers))
+		usleep(100);
+#endif
+}
+
+/*
+  Free a subscription taken out of subs.
+*/
+static void sub_free(subscription_t *sub)
+{
+	free(sub->ring);
+	free(sub->ids);
+	memset(sub, 0, sizeof(subscription_t));
+}
+
+/*
+  Drop all subscriptions when the channel is disconnected or the device is
+  closed, the USB event thread has been stopped.
+*/
+static void sub_clear()
+{
+	subscription_t old[MAX_SUBSCRIPTIONS];
+	int i = 0;
+	CB_LOCK();
+	memcpy(old, subs, sizeof(subs));
+	memset(subs, 0, sizeof(subs));
+	sub_rebuild();
+	CB_UNLOCK();
+	for (; i < MAX_SUBSCRIPTIONS; i++)
+	{
+		if (old[i].ring)
+		{
+			readers_wait(&sub_readers[i]);
+			sub_free(&old[i]);
+		}
+	}
+}
+
+/*
+  Free all UDS requests.
+*/
+static void uds_clear()
+{
+	int i = 0;
+	for (; i < MAX_UDS; i++)
+		free(uds[i].data);
+	memset(uds, 0, sizeof(uds));
+}
+
+/*
+  Copy a PASSTHRU_MSG into a j2534d message record, return the record size.
+*/
+static uint32_t daemon_msg_put(j2534d_msg_t *rec, const PASSTHRU_MSG *msg)
+{
+	rec->size = J2534D_MSG_SIZE(msg->DataSize);
+	rec->protocol_id = msg->ProtocolID;
+	rec->rx_status = msg->RxStatus;
+	rec->tx_flags = msg->TxFlags;
+	rec->timestamp = msg->Timestamp;
+	rec->data_size = msg->DataSize;
+	rec->extra_data_index = msg->ExtraDataIndex;
+	rec->reserved = 0;
+	rec->host_time = 0;
+	memcpy(rec->data, msg->Data, msg->DataSize);
+	return rec->size;
+}
+
+/*
+  Copy a j2534d message record into a PASSTHRU_MSG.
+*/
+static void daemon_msg_get(PASSTHRU_MSG *msg, const j2534d_msg_t *rec)
+{
+	msg->ProtocolID = rec->protocol_id;
+	msg->RxStatus = rec->rx_status;
+	msg->TxFlags = rec->tx_flags;
+	msg->Timestamp = rec->timestamp;
+	msg->DataSize = rec->data_size < PM_DATA_LEN ? rec->data_size : PM_DATA_LEN;
+	msg->ExtraDataIndex = rec->extra_data_index;
+	memcpy(msg->Data, rec->data, msg->DataSize);
+}
+
+/*
+  Make room for a record of need bytes, a multiple of 8 starting with its
+  size, at the head of a ring.  Runs on the single producer of the ring.
+  Return NULL if the ring is full, else the record to fill and in *head
+  the head to publish with ring_commit.
+*/
+static void *ring_reserve(j2534d_ring_t *ring, const uint32_t need, uint32_t *head)
+{
+	uint32_t h = ring->head;
+	uint32_t tail = ATOMIC_LOAD(&ring->tail);
+	uint32_t off = h & (ring->size - 1);
+	uint32_t pad = ring->size - off < need ? ring->size - off : 0;
+	if (ring->size - (h - tail) < pad + need)
+	{
+		ring->overflows++;
+		return NULL;
+	}
+	if (pad)
+	{
+		*(uint32_t*)(ring->data + off) = pad | J2534D_MSG_PAD;
+		h += pad;
+		off = 0;
+	}
+	*head = h + need;
+	return ring->data + off;
+}
+
+/*
+  Publish the record filled after ring_reserve and wake the consumer.
+*/
+static void ring_commit(j2534d_ring_t *ring, const uint32_t head)
+{
+	ATOMIC_STORE(&ring->head, head);
+#ifdef __linux__
+	if (ATOMIC_LOAD(&ring->waiting))
+		syscall(SYS_futex, &ring->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+/*
+  Append a message to a ring, runs on the single producer of the ring.
+  Return FALSE if the ring is full and the message was dropped.
+*/
+static int ring_put(j2534d_ring_t *ring, const PASSTHRU_MSG *msg)
+{
+	uint32_t head;
+	j2534d_msg_t *rec = (j2534d_msg_t*)ring_reserve(ring, J2534D_MSG_SIZE(msg->DataSize), &head);
+	if (rec == NULL)
+		return FALSE;
+	daemon_msg_put(rec, msg);
+	ring_commit(ring, head);
+	return TRUE;
+}
+
+/*
+  Sleep until the producer publishes past head or timeout usec passed.
+*/
+static void ring_wait(j2534d_ring_t *ring, const uint32_t head, const uint64_t timeout)
+{
+#ifndef _MSC_VER
+	struct timespec ts;
+	ts.tv_sec = timeout / 1000000;
+	ts.tv_nsec = (long)(timeout % 1000000) * 1000;
+	ATOMIC_STORE(&ring->waiting, 1);
+	if (ATOMIC_LOAD(&ring->head) == head)
+	{
+#ifdef __linux__
+		syscall(SYS_futex, &ring->head, FUTEX_WAIT, head, &ts, NULL, 0);
+#else
+		if (ts.tv_sec > 0 || ts.tv_nsec > 1000000)
+		{
+			ts.tv_sec = 0;
+			ts.tv_nsec = 1000000;
+		}
+		nanosleep(&ts, NULL);
+#endif
+	}
+	ATOMIC_STORE(&ring->waiting, 0);
+#endif
+}
+
+/*
+  Take the next record off a ring, only the single consumer of the ring may
+  call this.  Return FALSE if the ring is empty or the record was padding.
+*/
+static int ring_get(j2534d_ring_t *ring, PASSTHRU_MSG *msg, uint64_t *host_time)
+{
+	uint32_t tail = ring->tail;
+	if (ATOMIC_LOAD(&ring->head) == tail)
+		return FALSE;
+	const j2534d_msg_t *rec = (const j2534d_msg_t*)(ring->data + (tail & (ring->size - 1)));
+	int got = !(rec->size & J2534D_MSG_PAD);
+	if (got)
+	{
+		daemon_msg_get(msg, rec);
+		if (host_time)
+			*host_time = rec->host_time;
+	}
+	ATOMIC_STORE(&ring->tail, tail + (rec->size & ~J2534D_MSG_PAD));
+	return got;
+}
+
+/*
+  Read up to *pNumMsgs messages from a ring, waiting up to timeout msec
+  for the first one.  Only the single consumer of the ring may call this,
+  a system call is only made to sleep while the ring is empty.
+*/
+static int32_t ring_read_msgs(j2534d_ring_t *ring, PASSTHRU_MSG *pMsg,
+	unsigned long *pNumMsgs, const uint32_t timeout, const read_batch_t *batch)
+{
+	unsigned long msg_cnt = *pNumMsgs;
+	*pNumMsgs = 0;
+
+	uint64_t deadline = host_usec() + (uint64_t)timeout * 1000;
+	uint64_t first = 0;		// host_usec() the first message was read
+	while (*pNumMsgs < msg_cnt)
+	{
+		uint32_t head = ATOMIC_LOAD(&ring->head);
+		if (head == ring->tail)
+		{
+			if (timeout == 0)
+				break;
+			uint64_t t = host_usec();
+			if (read_complete(batch, *pNumMsgs, msg_cnt, first, t) || t >= deadline)
+				break;
+#ifndef _MSC_VER
+			ring_wait(ring, head, read_wait_until(batch, *pNumMsgs, first, deadline) - t);
+#endif
+			continue;
+		}
+
+		if (ring_get(ring, &pMsg[*pNumMsgs], NULL) && (*pNumMsgs)++ == 0)
+			first = host_usec();
+	}
+
+	if (write_log)
+	{
+		unsigned long i = 0;
+		for (; i < *pNumMsgs; i++)
+			writelogpassthrumsg(pMsg + i);
+		snprintf(log_msg, LM_LEN, "\tRing overflows:\t%u\nEndReadMsg\n", ring->overflows);
+		writelog(log_msg);
+	}
+	if (*pNumMsgs == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "No messages received");
+		return timeout > 0 ? J2534_ERR_TIMEOUT : J2534_ERR_BUFFER_EMPTY;
+	}
+	return J2534_NOERROR;
+}
+
+/*
+  Copy a decoded message into the ring of every subscription to its CAN ID,
+  runs on the USB event thread with CB_LOCK held.  Return TRUE if a
+  subscription consumed the message so it is not queued for PassThruReadMsgs.
+*/
+static int sub_dispatch(const PASSTHRU_MSG *msg)
+{
+	if (usb_ev->sub_cnt == 0 || msg->DataSize < 4)
+		return FALSE;
+
+	uint32_t id = ((uint32_t)msg->Data[0] << 24 | (uint32_t)msg->Data[1] << 16
+		| (uint32_t)msg->Data[2] << 8 | msg->Data[3]) & 0x1FFFFFFF;
+	int consumed = FALSE;
+	int i = 0;
+	uint32_t mask = id < SUB_STD_IDS ? sub_std[id] : sub_hash_slot(id)->subs;
+	for (; mask; i++, mask >>= 1)
+	{
+		if (!(mask & 1))
+			continue;
+		if (!ring_put(subs[i].ring, msg) && write_log)
+			writelog("	Subscription ring full, message dropped\n");
+		if (!(subs[i].flags & J2534_SUB_QUEUE))
+			consumed = TRUE;
+	}
+	return consumed;
+}
+
+#ifndef _MSC_VER
+/*
+  Snapshot entry of a CAN ID above 0x7FF, the first unused entry if the ID
+  has not been seen yet.
+*/
+static snap_entry_t *snapshot_slot(snapshot_t *snap, const uint32_t id)
+{
+	uint32_t i = (id * 2654435761u) >> (32 - SNAP_HASH_BITS);
+	snap_entry_t *e = &snap->ext[i];
+	while (__atomic_load_n(&e->seq, __ATOMIC_ACQUIRE) != 0 && e->id != id)
+	{
+		i = (i + 1) & (SNAP_HASH_SIZE - 1);
+		e = &snap->ext[i];
+	}
+	return e;
+}
+
+/*
+  Record a decoded message as the latest of its CAN ID, runs on the USB
+  event thread with CB_LOCK held.  Indications and multi frame ISO15765
+  payloads are skipped.
+*/
+static void snapshot_put(const PASSTHRU_MSG *msg)
+{
+	if (msg->DataSize < 4 || msg->DataSize > 12 || (msg->RxStatus & (2 | 8)))	// START_OF_MESSAGE, TX_DONE
+		return;
+
+	uint32_t id = ((uint32_t)msg->Data[0] << 24 | (uint32_t)msg->Data[1] << 16
+		| (uint32_t)msg->Data[2] << 8 | msg->Data[3]) & 0x1FFFFFFF;
+	if (snapshot)
+	{
+		snap_entry_t *e = id < SUB_STD_IDS ? &snapshot->std[id] : snapshot_slot(snapshot, id);
+		uint32_t seq = e->seq;
+		if (seq == 0 && id >= SUB_STD_IDS)
+		{
+			// keep the hash at most 3/4 full so probe sequences stay short
+			if (snapshot->ext_used >= SNAP_HASH_SIZE / 4 * 3)
+			{
+				snapshot->ext_full++;
+				return;
+			}
+			snapshot->ext_used++;
+			e->id = id;
+		}
+		__atomic_store_n(&e->seq, seq + 1, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		e->protocol_id = msg->ProtocolID;
+		e->rx_status = msg->RxStatus;
+		e->timestamp = msg->Timestamp;
+		e->data_size = msg->DataSize;
+		memcpy(e->data, msg->Data, msg->DataSize);
+		__atomic_store_n(&e->seq, seq + 2, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+  Copy a snapshot entry without locking, retry while the USB event thread
+  updates it.  Return FALSE if no message was recorded yet.
+*/
+static int snapshot_get(const snap_entry_t *e, PASSTHRU_MSG *msg)
+{
+	for (;;)
+	{
+		uint32_t seq = __atomic_load_n(&e->seq, __ATOMIC_ACQUIRE);
+		if (seq == 0)
+			return FALSE;
+		if (seq & 1)
+			continue;
+		msg->ProtocolID = e->protocol_id;
+		msg->RxStatus = e->rx_status;
+		msg->TxFlags = 0;
+		msg->Timestamp = e->timestamp;
+		msg->DataSize = e->data_size < sizeof(e->data) ? e->data_size : sizeof(e->data);
+		msg->ExtraDataIndex = msg->DataSize;
+		memcpy(msg->Data, e->data, msg->DataSize);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&e->seq, __ATOMIC_RELAXED) == seq)
+			return TRUE;
+	}
+}
+
+/*
+  Statistics entry of a CAN ID above 0x7FF, a new entry if the ID has not
+  been seen yet, NULL when the hash is full.
+*/
+static id_stats_t *bus_stats_slot(bus_stats_t *st, const uint32_t id)
+{
+	uint32_t i = (id * 2654435761u) >> (32 - STATS_HASH_BITS);
+	while (st->ext[i].cnt != 0 && st->ext[i].id != id)
+		i = (i + 1) & (STATS_HASH_SIZE - 1);
+	if (st->ext[i].cnt == 0)
+	{
+		// keep the hash at most 3/4 full so probe sequences stay short
+		if (st->ext_used >= STATS_HASH_SIZE / 4 * 3)
+			return NULL;
+		st->ext_used++;
+	}
+	return &st->ext[i];
+}
+
+/*
+  Count a decoded frame in the bus statistics, runs on the USB event
+  thread with CB_LOCK held.  A frame takes its bits, 3 bits of interframe space and at most
+  one stuff bit per 4 bits from the start of frame to the CRC.
+*/
+static void bus_stats_put(const PASSTHRU_MSG *msg)
+{
+	if (msg->DataSize < 4 || msg->DataSize > 12 || (msg->RxStatus & (2 | 8)))	// START_OF_MESSAGE, TX_DONE
+		return;
+
+	uint32_t id = ((uint32_t)msg->Data[0] << 24 | (uint32_t)msg->Data[1] << 16
+		| (uint32_t)msg->Data[2] << 8 | msg->Data[3]) & 0x1FFFFFFF;
+	uint32_t data_bits = 8 * (uint32_t)(msg->DataSize - 4);
+	uint32_t bits = id > 0x7FF ? 67 + data_bits + (53 + data_bits) / 4
+		: 47 + data_bits + (33 + data_bits) / 4;
+	uint32_t ts = (uint32_t)msg->Timestamp;
+	bus_stats_t *st = bus_stats;
+	if (st)
+	{
+		st->frames++;
+		st->bits += bits;
+		id_stats_t *e = id < SUB_STD_IDS ? &st->std[id] : bus_stats_slot(st, id);
+		if (e == NULL)
+			st->untracked++;
+		else if (e->cnt == 0)
+		{
+			e->id = id;
+			e->cnt = 1;
+			e->first = ts;
+			e->last = ts;
+			e->min_period = UINT32_MAX;
+		}
+		else
+		{
+			uint32_t period = ts - e->last;
+			double delta = period - e->mean;
+			e->cnt++;
+			e->last = ts;
+			e->mean += delta / (e->cnt - 1);
+			e->m2 += delta * (period - e->mean);
+			if (period < e->min_period)
+				e->min_period = period;
+			if (period > e->max_period)
+				e->max_period = period;
+		}
+	}
+}
+
+/*
+  Slot of a sender in the stream hash of the ISO-TP sniffer.
+*/
+static uint32_t isotp_home(const isotp_t *it, const isotp_stream_t *s)
+{
+	uint32_t key = (s->id | (uint32_t)s->ext << 31) ^ (uint32_t)s->addr << 11;
+	return (key * 2654435761u) >> (32 - it->hash_bits);
+}
+
+/*
+  Take a stream out of the hash, the entries after it move back so that
+  probing still finds them.
+*/
+static void isotp_unhash(isotp_t *it, const isotp_stream_t *s)
+{
+	uint32_t mask = (1u << it->hash_bits) - 1;
+	uint16_t idx = (uint16_t)(s - it->stream + 1);
+	uint32_t i = isotp_home(it, s);
+	while (it->hash[i] != idx)
+		i = (i + 1) & mask;
+	uint32_t j = i;
+	for (;;)
+	{
+		j = (j + 1) & mask;
+		if (it->hash[j] == 0)
+			break;
+		// the entry at j fills the hole unless its home lies after the hole
+		uint32_t k = isotp_home(it, &it->stream[it->hash[j] - 1]);
+		if (((j - k) & mask) >= ((j - i) & mask))
+		{
+			it->hash[i] = it->hash[j];
+			i = j;
+		}
+	}
+	it->hash[i] = 0;
+}
+
+/*
+  Drop the transfer of a stream.
+*/
+static void isotp_abort(isotp_t *it, isotp_stream_t *s)
+{
+	s->active = 0;
+	if (s->fc_wait)
+	{
+		s->fc_wait = 0;
+		it->fc_wait--;
+	}
+}
+
+/*
+  Stream of a sender, with add a new one if the sender has none.  With
+  every stream taken, the one idle longest is reused, else the one with
+  the oldest transfer.
+*/
+static isotp_stream_t *isotp_find(isotp_t *it, const uint32_t id, const uint8_t ext, const uint8_t addr,
+	const int add)
+{
+	isotp_stream_t key;
+	key.id = id;
+	key.ext = ext;
+	key.addr = addr;
+	uint32_t mask = (1u << it->hash_bits) - 1;
+	uint32_t i = isotp_home(it, &key);
+	for (; it->hash[i]; i = (i + 1) & mask)
+	{
+		isotp_stream_t *s = &it->stream[it->hash[i] - 1];
+		if (s->id == id && s->ext == ext && s->addr == addr)
+			return s;
+	}
+	if (!add)
+		return NULL;
+
+	isotp_stream_t *s = NULL;
+	if (it->used < it->streams)
+		s = &it->stream[it->used++];
+	else
+	{
+		unsigned long n = 0;
+		for (; n < it->streams; n++)
+		{
+			isotp_stream_t *e = &it->stream[n];
+			if (s == NULL || e->active < s->active || (e->active == s->active && e->used < s->used))
+				s = e;
+		}
+		if (s->active)
+		{
+			isotp_abort(it, s);
+			it->evicted++;
+		}
+		isotp_unhash(it, s);
+		// the hash moved entries back, probe again for the free slot
+		for (i = isotp_home(it, &key); it->hash[i]; i = (i + 1) & mask)
+			;
+	}
+	uint8_t *data = s->data;
+	memset(s, 0, sizeof(isotp_stream_t));
+	s->id = id;
+	s->ext = ext;
+	s->addr = addr;
+	s->data = data;
+	it->hash[i] = (uint16_t)(s - it->stream + 1);
+	return s;
+}
+
+/*
+  Hand a complete PDU to PassThruReadIsotp.  The PDU is counted even when
+  the ring is full, the ring counts it as overflow.
+*/
+static void isotp_emit(isotp_t *it, const isotp_stream_t *s, const uint8_t *data, const uint32_t len,
+	const uint32_t end)
+{
+	it->pdus++;
+	uint32_t head;
+	isotp_rec_t *rec = (isotp_rec_t*)ring_reserve(it->ring, ISOTP_REC_SIZE(len), &head);
+	if (rec == NULL)
+		return;
+	rec->size = ISOTP_REC_SIZE(len);
+	rec->source = s->id;
+	rec->target = s->target;
+	rec->rx_status = (s->ext ? 0x100 : 0) | s->tx;	// CAN_29BIT_ID, TX_MSG_TYPE
+	rec->address = s->addr;
+	rec->start = s->start;
+	rec->end = end;
+	rec->data_size = len;
+	memcpy(rec->data, data, len);
+	ring_commit(it->ring, head);
+}
+
+/*
+  How well the sender of a flow control frame fits a transfer waiting for
+  one: 3 if it sent the flow control of the transfer before, 2 if the two
+  are a normal fixed addressing pair (0x18DA/0x18DB with source and target
+  swapped), 1 if both IDs have the same length.
+*/
+static int isotp_fc_match(const isotp_stream_t *s, const uint32_t id, const uint8_t ext)
+{
+	if (s->target == id)
+		return 3;
+	if (ext && s->ext && (id >> 16) == (s->id >> 16) && ((id >> 16) & 0xFE) == 0xDA
+		&& (id & 0xFF) == ((s->id >> 8) & 0xFF) && ((id >> 8) & 0xFF) == (s->id & 0xFF))
+		return 2;
+	return ext == s->ext;
+}
+
+/*
+  Follow the ISO-TP transfers in a CAN frame, runs on the USB event thread.
+  Frames are told apart by the protocol control information in the upper
+  nibble of their first byte after the address.
+*/
+static void isotp_frame(isotp_t *it, const uint32_t id, const uint8_t ext, const uint8_t tx,
+	const uint8_t *p, int n, const uint32_t ts)
+{
+	uint8_t addr = 0;
+	if (it->ext_addr)
+	{
+		if (n < 2)
+			return;
+		addr = *p++;
+		n--;
+	}
+	it->frames++;
+	isotp_stream_t *s, *w, sf;
+	uint32_t len, k;
+	int off = 2, m, best = 0;
+	unsigned long i = 0;
+	switch (p[0] >> 4)
+	{
+	case 0:		// single frame
+		len = p[0] & 0x0F;
+		if (len == 0 || len >= (uint32_t)n)
+			break;
+		s = isotp_find(it, id, ext, addr, FALSE);
+		if (s && s->active)
+		{
+			isotp_abort(it, s);
+			it->aborted++;
+		}
+		sf.id = id;
+		sf.ext = ext;
+		sf.addr = addr;
+		sf.tx = tx;
+		sf.target = s ? s->target : 0;
+		sf.start = ts;
+		isotp_emit(it, &sf, p + 1, len, ts);
+		if (s)
+			s->used = it->frames;
+		break;
+	case 1:		// first frame
+		if (n < 2)
+			break;
+		len = (uint32_t)(p[0] & 0x0F) << 8 | p[1];
+		if (len == 0)
+		{
+			// escape sequence, a 32 bit length follows
+			if (n < 6)
+				break;
+			len = (uint32_t)p[2] << 24 | (uint32_t)p[3] << 16 | (uint32_t)p[4] << 8 | p[5];
+			off = 6;
+		}
+		if (len < (uint32_t)n)	// would have fit a single frame
+			break;
+		s = isotp_find(it, id, ext, addr, len <= ISOTP_PDU_MAX);
+		if (s && s->active)
+		{
+			isotp_abort(it, s);
+			it->aborted++;
+		}
+		if (len > ISOTP_PDU_MAX)
+		{
+			it->oversize++;
+			break;
+		}
+		s->active = 1;
+		s->tx = tx;
+		s->sn = 1;
+		s->bs_left = 0;
+		s->fc_wait = 1;
+		it->fc_wait++;
+		s->start = ts;
+		s->len = len;
+		s->got = (uint32_t)(n - off);
+		memcpy(s->data, p + off, s->got);
+		s->used = it->frames;
+		break;
+	case 2:		// consecutive frame
+		s = isotp_find(it, id, ext, addr, FALSE);
+		if (s == NULL || !s->active)
+			break;
+		s->used = it->frames;
+		if ((p[0] & 0x0F) != s->sn)
+		{
+			isotp_abort(it, s);
+			it->aborted++;
+			break;
+		}
+		// the sender goes on, so the receiver let it even if its flow control was missed
+		if (s->fc_wait)
+		{
+			s->fc_wait = 0;
+			it->fc_wait--;
+		}
+		k = s->len - s->got < (uint32_t)(n - 1) ? s->len - s->got : (uint32_t)(n - 1);
+		memcpy(s->data + s->got, p + 1, k);
+		s->got += k;
+		s->sn = (s->sn + 1) & 0x0F;
+		if (s->got == s->len)
+		{
+			isotp_emit(it, s, s->data, s->len, ts);
+			s->active = 0;
+		}
+		else if (s->bs_left && --s->bs_left == 0)
+		{
+			s->fc_wait = 1;
+			it->fc_wait++;
+		}
+		break;
+	case 3:		// flow control
+		if (n < 3 || it->fc_wait == 0)
+			break;
+		// the waiting transfer that fits the sender best, the latest of equals
+		w = NULL;
+		for (; i < it->used; i++)
+		{
+			s = &it->stream[i];
+			if (!s->fc_wait)
+				continue;
+			m = isotp_fc_match(s, id, ext);
+			if (w == NULL || m > best || (m == best && s->used > w->used))
+			{
+				w = s;
+				best = m;
+			}
+		}
+		if (w == NULL)
+			break;
+		w->target = id;
+		if ((p[0] & 0x0F) == 0)	// continue to send
+		{
+			w->fc_wait = 0;
+			it->fc_wait--;
+			w->bs_left = p[1];
+		}
+		else if ((p[0] & 0x0F) == 2)	// overflow
+		{
+			isotp_abort(it, w);
+			it->aborted++;
+		}
+		break;
+	}
+}
+
+/*
+  Feed a decoded message to the ISO-TP sniffer, runs on the USB event
+  thread with CB_LOCK held.
+*/
+static void isotp_put(const PASSTHRU_MSG *msg)
+{
+	// complete CAN frames only, no indications
+	if (msg->DataSize < 5 || msg->DataSize > 12 || (msg->RxStatus & (2 | 8)))
+		return;
+
+	uint32_t id = ((uint32_t)msg->Data[0] << 24 | (uint32_t)msg->Data[1] << 16
+		| (uint32_t)msg->Data[2] << 8 | msg->Data[3]) & 0x1FFFFFFF;
+	uint8_t ext = (msg->RxStatus & 0x100) || id > 0x7FF;	// CAN_29BIT_ID
+	isotp_t *it = isotp;
+	if (it)
+	{
+		unsigned long i = 0;
+		while (i < it->filters && (id & it->mask[i]) != it->pattern[i])
+			i++;
+		if (it->filters == 0 || i < it->filters)
+			isotp_frame(it, id, ext, msg->RxStatus & 1, msg->Data + 4, (int)msg->DataSize - 4,
+				(uint32_t)msg->Timestamp);
+	}
+}
+
+/*
+  Hand a decoded message to the capture writer, runs on the USB event
+  thread with CB_LOCK held.  Never waits for the writer, the message is dropped and counted
+  when the capture ring is full.
+*/
+static void capture_put(const PASSTHRU_MSG *msg)
+{
+	// complete CAN frames only, no indications
+	if (msg->DataSize < 4 || msg->DataSize > 12 || (msg->RxStatus & (2 | 8)))
+		return;
+
+	if (capture->active)
+		ring_put(capture->ring, msg);
+}
+
+/*
+  Write len bytes to the capture file.
+*/
+static void capture_out(const uint8_t *data, const size_t len)
+{
+	size_t done = 0;
+	while (done < len && capture->error == 0)
+	{
+		ssize_t n = write(capture->fd, data + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			capture->error = n < 0 ? errno : EIO;
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\tCapture write failed: %s\n", strerror(capture->error));
+				writelog(log_msg);
+			}
+			break;
+		}
+		done += n;
+	}
+	capture->file_bytes += len;
+}
+
+/*
+  Write len bytes of the capture buffer to the capture file and keep the rest.
+*/
+static void capture_write(const size_t len)
+{
+	capture_out(capture->buf, len);
+	memmove(capture->buf, capture->buf + len, capture->buf_len - len);
+	capture->buf_len -= len;
+}
+
+/*
+  Start the next capture file and write its header.  start is the time of
+  the first record, usec since the epoch.
+*/
+static int capture_open(const uint64_t start)
+{
+	char name[CAPTURE_PATH_LEN + 8];
+	if (capture->rotate_bytes == 0 && capture->rotate_secs == 0)
+		snprintf(name, sizeof(name), "%s", capture->path);
+	else
+	{
+		// number the files before the extension, capture.log -> capture-0000.log
+		const char *ext = strrchr(capture->path, '.');
+		const char *dir = strrchr(capture->path, '/');
+		if (ext == NULL || (dir && ext < dir))
+			ext = capture->path + strlen(capture->path);
+		snprintf(name, sizeof(name), "%.*s-%04lu%s",
+			(int)(ext - capture->path), capture->path, capture->file_no, ext);
+	}
+
+	capture->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (capture->fd < 0)
+		return errno;
+	capture->file_no++;
+	capture->file_bytes = 0;
+	capture->file_start = start;
+
+	char *out = (char*)capture->buf + capture->buf_len;
+	if (capture->format == J2534_CAPTURE_ASC)
+	{
+		time_t sec = (time_t)(start / 1000000);
+		struct tm tm;
+		char date[64];
+		localtime_r(&sec, &tm);
+		int n = strftime(date, sizeof(date), "%a %b %d %I:%M:%S", &tm);
+		snprintf(date + n, sizeof(date) - n, ".%03u %s %d",
+			(unsigned)(start / 1000 % 1000), tm.tm_hour < 12 ? "am" : "pm", tm.tm_year + 1900);
+		capture->buf_len += sprintf(out,
+			"date %s\n"
+			"base hex  timestamps absolute\n"
+			"internal events logged\n"
+			"// version 7.0.0\n"
+			"Begin Triggerblock %s\n"
+			"   0.000000 Start of measurement\n",
+			date, date);
+	}
+	if (capture->format == J2534_CAPTURE_PCAPNG)
+	{
+		// Section header and one SocketCAN interface, timestamps in usec
+		uint32_t shb[7] = { 0x0A0D0D0A, 28, 0x1A2B3C4D, 0, 0xFFFFFFFF, 0xFFFFFFFF, 28 };
+		uint32_t idb[5] = { 1, 20, 0, 16, 20 };
+		const uint16_t version[2] = { 1, 0 };
+		const uint16_t link_type[2] = { 227, 0 };
+		memcpy(&shb[3], version, 4);
+		memcpy(&idb[2], link_type, 4);
+		memcpy(out, shb, sizeof(shb));
+		memcpy(out + sizeof(shb), idb, sizeof(idb));
+		capture->buf_len += sizeof(shb) + sizeof(idb);
+	}
+	if (capture->format == J2534_CAPTURE_INDEXED)
+	{
+		capstore_head_t head;
+		memset(out, 0, CAPSTORE_HEADER);
+		memcpy(head.magic, "J2534CS1", 8);
+		head.block_size = CAPSTORE_BLOCK;
+		head.frame_size = sizeof(CAPTURE_FRAME);
+		head.start = start;
+		memcpy(out, &head, sizeof(head));
+		capture->buf_len += CAPSTORE_HEADER;
+		capture->index_cnt = 0;
+		capture->block_last = 0;
+	}
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tCapture file %s opened\n", name);
+		writelog(log_msg);
+	}
+	return 0;
+}
+
+/*
+  Bit of a CAN ID in the ID bitmap of an indexed capture block.
+*/
+static uint32_t capstore_id_bit(const uint32_t id, const int ext)
+{
+	return ext ? (id * 2654435761u) >> 21 : id & 0x7FF;
+}
+
+/*
+  Finish the block being filled in the indexed format, move it to the
+  capture buffer and add it to the index.
+*/
+static void capstore_flush()
+{
+	capstore_block_t *b = (capstore_block_t*)capture->block;
+	if (b->count == 0)
+		return;
+	if (capture->index_cnt == capture->index_cap)
+	{
+		unsigned long n = capture->index_cap ? capture->index_cap * 2 : 256;
+		capstore_block_t *index = (capstore_block_t*)realloc(capture->index, n * sizeof(capstore_block_t));
+		if (index == NULL)
+		{
+			capture->error = ENOMEM;
+			return;
+		}
+		capture->index = index;
+		capture->index_cap = n;
+	}
+	if (capture->buf_len + CAPSTORE_BLOCK > CAPTURE_BUF)
+		capture_write(capture->buf_len);
+	memcpy(b->magic, "JCB1", 4);
+	b->offset = capture->file_bytes + capture->buf_len;
+	capture->index[capture->index_cnt++] = *b;
+	memcpy(capture->buf + capture->buf_len, capture->block, CAPSTORE_BLOCK);
+	capture->buf_len += CAPSTORE_BLOCK;
+	memset(capture->block, 0, CAPSTORE_BLOCK);
+}
+
+/*
+  Write out the buffered records and close the capture file.
+*/
+static void capture_close()
+{
+	if (capture->format == J2534_CAPTURE_ASC)
+		capture->buf_len += sprintf((char*)capture->buf + capture->buf_len, "End TriggerBlock\n");
+	if (capture->format == J2534_CAPTURE_INDEXED)
+	{
+		capstore_flush();
+		capture_write(capture->buf_len);
+		capstore_trailer_t trailer;
+		trailer.index = capture->file_bytes;
+		trailer.blocks = capture->index_cnt;
+		memcpy(trailer.magic, "JCSINDEX", 8);
+		capture_out((const uint8_t*)capture->index, capture->index_cnt * sizeof(capstore_block_t));
+		capture_out((const uint8_t*)&trailer, sizeof(trailer));
+	}
+	capture_write(capture->buf_len);
+	close(capture->fd);
+	capture->fd = -1;
+}
+
+/*
+  Format one message record into the capture buffer, rotating the capture
+  file first when it is due.
+*/
+static void capture_record(const j2534d_msg_t *rec)
+{
+	// extend the 32 bit device timestamp and convert it to host time
+	if (capture->ts_base == 0)
+	{
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		capture->ts_base = (uint64_t)now.tv_sec * 1000000 + now.tv_usec - rec->timestamp;
+	}
+	else if (rec->timestamp < capture->ts_last && capture->ts_last - rec->timestamp > 0x80000000u)
+		capture->ts_wraps += 0x100000000ULL;
+	capture->ts_last = rec->timestamp;
+	uint64_t t = capture->ts_base + capture->ts_wraps + rec->timestamp;
+
+	if ((capture->rotate_bytes && capture->file_bytes + capture->buf_len >= capture->rotate_bytes)
+		|| (capture->rotate_secs && t > capture->file_start
+			&& t - capture->file_start >= (uint64_t)capture->rotate_secs * 1000000))
+	{
+		capture_close();
+		int r = capture_open(t);
+		if (r != 0)
+		{
+			capture->error = r;
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\tCapture file rotation failed: %s\n", strerror(r));
+				writelog(log_msg);
+			}
+		}
+	}
+	if (capture->error)
+		return;
+
+	uint32_t id = (rec->data[0] << 24) | (rec->data[1] << 16) | (rec->data[2] << 8) | rec->data[3];
+	int ext = (rec->rx_status & 0x100) || id > 0x7FF;	// CAN_29BIT_ID
+	uint32_t dlc = rec->data_size - 4;
+	const uint8_t *payload = rec->data + 4;
+	char *out = (char*)capture->buf + capture->buf_len;
+	int n = 0;
+	uint32_t i = 0;
+	if (capture->format == J2534_CAPTURE_INDEXED && dlc <= 8)
+	{
+		// frames are stored in time order so blocks can be found by time
+		capstore_block_t *b = (capstore_block_t*)capture->block;
+		if (t < capture->block_last)
+			t = capture->block_last;
+		capture->block_last = t;
+		CAPTURE_FRAME *f = (CAPTURE_FRAME*)(capture->block + sizeof(capstore_block_t)) + b->count;
+		f->Timestamp = t;
+		f->CanID = ext ? id | 0x80000000u : id;
+		f->DataSize = (uint8_t)dlc;
+		f->Flags = rec->rx_status & 1;	// TX_MSG_TYPE
+		memcpy(f->Data, payload, dlc);
+		if (b->count == 0)
+			b->first = t;
+		b->last = t;
+		uint32_t bit = capstore_id_bit(id, ext);
+		b->ids[bit >> 3] |= 1 << (bit & 7);
+		if (++b->count == CAPSTORE_FRAMES)
+			capstore_flush();
+	}
+	if (capture->format == J2534_CAPTURE_CANDUMP)
+	{
+		n = sprintf(out, ext ? "(%llu.%06llu) can0 %08X#" : "(%llu.%06llu) can0 %03X#",
+			(unsigned long long)(t / 1000000), (unsigned long long)(t % 1000000), id);
+		for (; i < dlc; i++)
+			n += sprintf(out + n, "%02X", payload[i]);
+		out[n++] = '\n';
+	}
+	if (capture->format == J2534_CAPTURE_ASC)
+	{
+		uint64_t rel = t > capture->file_start ? t - capture->file_start : 0;
+		char can_id[16];
+		snprintf(can_id, sizeof(can_id), ext ? "%Xx" : "%X", id);
+		n = sprintf(out, "%4llu.%06llu 1  %-15s %s   d %u",
+			(unsigned long long)(rel / 1000000), (unsigned long long)(rel % 1000000),
+			can_id, (rec->rx_status & 1) ? "Tx" : "Rx", dlc);
+		for (; i < dlc; i++)
+			n += sprintf(out + n, " %02X", payload[i]);
+		out[n++] = '\n';
+	}
+	if (capture->format == J2534_CAPTURE_PCAPNG)
+	{
+		// Enhanced packet block holding a struct can_frame, can_id in network order
+		uint32_t epb[12] = { 6, 48, 0, (uint32_t)(t >> 32), (uint32_t)t, 16, 16, 0, 0, 0, 0, 48 };
+		uint8_t *frame = (uint8_t*)&epb[7];
+		uint32_t can_id = ext ? id | 0x80000000u : id;
+		frame[0] = can_id >> 24;
+		frame[1] = can_id >> 16;
+		frame[2] = can_id >> 8;
+		frame[3] = can_id;
+		frame[4] = dlc;
+		memcpy(frame + 8, payload, dlc);
+		memcpy(out, epb, sizeof(epb));
+		n = sizeof(epb);
+	}
+	capture->buf_len += n;
+
+	// whole blocks only, the remainder waits for the next records
+	if (capture->buf_len >= CAPTURE_BUF)
+		capture_write(CAPTURE_BUF);
+}
+
+/*
+  Capture writer thread, formats the records queued by the USB event thread
+  and writes them out in CAPTURE_BUF blocks.  A partial block is written
+  once the bus goes quiet so the file can be followed while recording.
+*/
+static void *capture_thread(void *arg)
+{
+	j2534d_ring_t *ring = capture->ring;
+	uint32_t mask = ring->size - 1;
+	uint32_t tail = ring->tail;
+	int idle = 0;
+	while (TRUE)
+	{
+		uint32_t head = ATOMIC_LOAD(&ring->head);
+		if (head != tail)
+		{
+			while (tail != head)
+			{
+				const j2534d_msg_t *rec = (const j2534d_msg_t*)(ring->data + (tail & mask));
+				if (!(rec->size & J2534D_MSG_PAD))
+					capture_record(rec);
+				tail += rec->size & ~J2534D_MSG_PAD;
+			}
+			ATOMIC_STORE(&ring->tail, tail);
+			idle = 0;
+			continue;
+		}
+		if (ATOMIC_LOAD(&capture->stop))
+			break;
+		if (++idle == 1000 / CAPTURE_POLL && capture->buf_len > 0)
+			capture_write(capture->buf_len);
+
+		struct timespec deadline;
+		abs_deadline(&deadline, CAPTURE_POLL);
+		pthread_mutex_lock(&capture->lock);
+		if (!capture->stop)
+			pthread_cond_timedwait(&capture->cond, &capture->lock, &deadline);
+		pthread_mutex_unlock(&capture->lock);
+	}
+	capture_close();
+	return NULL;
+}
+#endif
+
+#ifndef _MSC_VER
+/*
+  Record the RX jitter of a message decoded by the USB event thread, called
+  with CB_LOCK held.
+*/
+static void rt_jitter_put(const PASSTHRU_MSG *msg)
+{
+	uint64_t now = host_usec();
+	uint32_t offset = (uint32_t)now - (uint32_t)msg->Timestamp;	// wraps with the device clock
+	if (rt->window == 0 || now - rt->window >= 2 * JITTER_WINDOW)
+	{
+		rt->base = offset;
+		rt->base_prev = offset;
+		rt->window = now;
+	}
+	else if (now - rt->window >= JITTER_WINDOW)
+	{
+		rt->base_prev = rt->base;
+		rt->base = offset;
+		rt->window = now;
+	}
+	else if ((int32_t)(offset - rt->base) < 0)
+		rt->base = offset;
+	uint32_t base = (int32_t)(rt->base_prev - rt->base) < 0 ? rt->base_prev : rt->base;
+	uint32_t late = offset - base;
+	if ((int32_t)late < 0)
+		late = 0;
+	rt->hist[late / JITTER_STEP < JITTER_BUCKETS ? late / JITTER_STEP : JITTER_BUCKETS - 1]++;
+	if (late > rt->max)
+		rt->max = late;
+	rt->cnt++;
+}
+
+/*
+  Count the forwarding latency of cnt frames decoded at rx_time.
+*/
+static void gateway_latency(gateway_t *gw, const uint64_t now, const uint64_t rx_time, const int cnt)
+{
+	uint32_t lat = now > rx_time ? (uint32_t)(now - rx_time) : 0;
+	gw->hist[lat / JITTER_STEP < JITTER_BUCKETS ? lat / JITTER_STEP : JITTER_BUCKETS - 1] += cnt;
+	gw->lat_cnt += cnt;
+	if (lat > gw->lat_max)
+		gw->lat_max = lat;
+}
+
+/*
+  Completion of a gateway OUT transfer, runs on the USB event thread.
+*/
+static void LIBUSB_CALL gateway_sent(struct libusb_transfer *xfer)
+{
+	gw_xfer_t *slot = (gw_xfer_t*)xfer->user_data;
+	gateway_t *gw = slot->gw;
+	uint64_t now = host_usec();
+	CB_LOCK();
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED)
+	{
+		gw->frames += slot->cnt;
+		gateway_latency(gw, now, slot->rx_time, slot->cnt);
+	}
+	else
+		gw->dropped += slot->cnt;
+	slot->cnt = 0;
+	gw->inflight--;
+	CB_UNLOCK();
+}
+
+/*
+  Read the responses of j2534d to gateway requests, waiting up to
+  GW_RSP_WAIT for one when wait is TRUE.  A daemon not answering in time
+  counts as lost.  Returns FALSE when the connection is lost.
+*/
+static int gateway_responses(gateway_t *gw, const int wait)
+{
+	while (gw->pending > 0 && !gw->lost)
+	{
+		ssize_t n = recv(gw->sock, gw->rsp + gw->rsp_len, sizeof(j2534d_rsp_t) - gw->rsp_len, MSG_DONTWAIT);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			if (!wait)
+				return TRUE;
+			struct pollfd pfd = { gw->sock, POLLIN, 0 };
+			int p = poll(&pfd, 1, GW_RSP_WAIT);
+			if (p > 0 || (p < 0 && errno == EINTR))
+				continue;
+		}
+		if (n <= 0)
+		{
+			if (write_log)
+				writelog("\tGateway lost the j2534d connection\n");
+			gw->lost = TRUE;
+			break;
+		}
+		gw->rsp_len += n;
+		if (gw->rsp_len < sizeof(j2534d_rsp_t))
+			continue;
+
+		// write requests carry no response payload
+		const j2534d_rsp_t *rsp = (const j2534d_rsp_t*)gw->rsp;
+		uint32_t cnt = gw->pend_cnt[gw->pend_head];
+		uint32_t written = rsp->arg[0] < cnt ? rsp->arg[0] : cnt;
+		gw->frames += written;
+		gw->dropped += cnt - written;
+		gw->pend_head = (gw->pend_head + 1) % GW_PENDING;
+		gw->pending--;
+		gw->rsp_len = 0;
+		if (wait)
+			return TRUE;
+	}
+	// requests without a response any more
+	for (; gw->pending > 0; gw->pending--)
+	{
+		gw->dropped += gw->pend_cnt[gw->pend_head];
+		gw->pend_head = (gw->pend_head + 1) % GW_PENDING;
+	}
+	return FALSE;
+}
+
+/*
+  Send the frames collected in out, called with CB_LOCK held.  On the
+  connected device the OUT transfer is asynchronous, for a device behind
+  j2534d the request is written and its response picked up later.
+*/
+static void gateway_flush(gateway_t *gw)
+{
+	if (gw->out_cnt == 0)
+		return;
+	if (gw->sock < 0)
+	{
+		gw_xfer_t *slot = NULL;
+		int i = 0;
+		for (; i < GW_XFERS && slot == NULL; i++)
+			if (gw->xfer[i].cnt == 0)
+				slot = &gw->xfer[i];
+		if (slot)
+		{
+			memcpy(slot->buf, gw->out, gw->out_len);
+			libusb_fill_bulk_transfer(slot->xfer, con->dev_handle, endpoint->addr_out,
+				slot->buf, gw->out_len, gateway_sent, slot, 1000);
+			if (libusb_submit_transfer(slot->xfer) == LIBUSB_SUCCESS)
+			{
+				slot->cnt = gw->out_cnt;
+				slot->rx_time = gw->rx_time;
+				gw->inflight++;
+			}
+			else
+				slot = NULL;
+		}
+		if (slot == NULL)
+			gw->dropped += gw->out_cnt;
+	}
+	else
+	{
+		// never wait for the daemon here, with its pipeline full the frames are dropped
+		if (!gw->lost)
+			gateway_responses(gw, FALSE);
+		if (gw->lost || gw->pending == GW_PENDING)
+		{
+			gw->dropped += gw->out_cnt;
+			gw->out_len = 0;
+			gw->out_cnt = 0;
+			return;
+		}
+		j2534d_req_t req;
+		memset(&req, 0, sizeof(req));
+		req.op = J2534D_WRITE_MSGS;
+		req.arg[0] = gw->channel_id;
+		req.arg[1] = (uint32_t)gw->out_cnt;
+		req.len = (uint32_t)gw->out_len;
+		struct iovec iov[2] = { { &req, sizeof(req) }, { gw->out, (size_t)gw->out_len } };
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = iov;
+		mh.msg_iovlen = 2;
+		ssize_t n = sendmsg(gw->sock, &mh, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n == (ssize_t)(sizeof(req) + req.len))
+		{
+			gateway_latency(gw, host_usec(), gw->rx_time, gw->out_cnt);
+			gw->pend_cnt[(gw->pend_head + gw->pending) % GW_PENDING] = (uint32_t)gw->out_cnt;
+			gw->pending++;
+		}
+		else
+		{
+			gw->dropped += gw->out_cnt;
+			// nothing sent on a full socket leaves the stream intact, a partial request does not
+			if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			{
+				if (write_log)
+					writelog("\tGateway lost the j2534d connection\n");
+				gw->lost = TRUE;
+				gateway_responses(gw, FALSE);
+			}
+		}
+	}
+	gw->out_len = 0;
+	gw->out_cnt = 0;
+}
+
+static int gateway_rule_cmp(const void *a, const void *b)
+{
+	unsigned long x = ((const GATEWAY_RULE*)a)->CanID;
+	unsigned long y = ((const GATEWAY_RULE*)b)->CanID;
+	return x < y ? -1 : x > y;
+}
+
+static int gateway_id_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/*
+  Forward a message decoded by the USB event thread at rx_time through the
+  gateway, unless its ID is blocked, called with CB_LOCK held.  Only frames received from the bus
+  are forwarded, so a gateway on the same channel does not see its own.
+*/
+static void gateway_put(const PASSTHRU_MSG *msg, const uint64_t rx_time)
+{
+	if (msg->DataSize < 4 || msg->DataSize > 12 || (msg->RxStatus & (1 | 2 | 8)))	// TX_MSG_TYPE, START_OF_MESSAGE, TX_DONE
+		return;
+
+	uint32_t id = ((uint32_t)msg->Data[0] << 24 | (uint32_t)msg->Data[1] << 16
+		| (uint32_t)msg->Data[2] << 8 | msg->Data[3]) & 0x1FFFFFFF;
+	int ext = (msg->RxStatus & 0x100) || id > 0x7FF;	// CAN_29BIT_ID
+	uint32_t len = (uint32_t)msg->DataSize - 4;
+	uint8_t data[8];
+	memcpy(data, msg->Data + 4, len);
+	gateway_t *gw = gateway;
+	if (gw == NULL)
+		return;
+	if (gw->blocks && bsearch(&id, gw->block, gw->blocks, sizeof(uint32_t), gateway_id_cmp))
+	{
+		gw->blocked++;
+		return;
+	}
+	GATEWAY_RULE key;
+	key.CanID = id;
+	const GATEWAY_RULE *rule = gw->rules
+		? (const GATEWAY_RULE*)bsearch(&key, gw->rule, gw->rules, sizeof(GATEWAY_RULE), gateway_rule_cmp) : NULL;
+	if (rule)
+	{
+		id = rule->NewID & 0x1FFFFFFF;
+		ext = ext || id > 0x7FF;
+		uint32_t i = 0;
+		for (; i < len; i++)
+			data[i] = (data[i] & ~rule->Mask[i]) | (rule->Value[i] & rule->Mask[i]);
+		gw->rewritten++;
+	}
+
+	uint32_t need = gw->sock < 0 ? ATT_FRAME_MAX : J2534D_MSG_SIZE(4 + len);
+	if (gw->out_len + need > GW_OUT)
+		gateway_flush(gw);
+	if (gw->out_cnt == 0)
+		gw->rx_time = rx_time;
+	if (gw->sock < 0)
+		gw->out_len += att_frame(gw->out + gw->out_len, id, ext, data, len);
+	else
+	{
+		j2534d_msg_t *rec = (j2534d_msg_t*)(gw->out + gw->out_len);
+		memset(rec, 0, sizeof(j2534d_msg_t));
+		rec->size = J2534D_MSG_SIZE(4 + len);
+		rec->protocol_id = 5;	// CAN
+		rec->tx_flags = ext ? 0x100 : 0;
+		rec->data_size = 4 + len;
+		rec->data[0] = (uint8_t)(id >> 24);
+		rec->data[1] = (uint8_t)(id >> 16);
+		rec->data[2] = (uint8_t)(id >> 8);
+		rec->data[3] = (uint8_t)id;
+		memcpy(rec->data + 4, data, len);
+		gw->out_len += rec->size;
+	}
+	gw->out_cnt++;
+}
+
+/*
+  Send what the gateway collected from the IN transfer just decoded.
+*/
+static void gateway_end()
+{
+	CB_LOCK();
+	if (gateway)
+		gateway_flush(gateway);
+	CB_UNLOCK();
+}
+
+/*
+  Hand a decoded message to the host filters and the features fed by the
+  USB event thread, taking CB_LOCK once for all of them and not at all
+  when none is in use.  rx_time is taken at the first frame for the
+  gateway.  Return TRUE if the message is to be queued for PassThruReadMsgs.
+*/
+static int usb_event_msg(const PASSTHRU_MSG *msg, uint64_t *rx_time)
+{
+	int measure = ATOMIC_LOAD(&rt->measure);
+	if (ATOMIC_LOAD(&fset->exact) && !measure && !capture->active && snapshot == NULL
+		&& bus_stats == NULL && isotp == NULL && gateway == NULL
+		&& usb_ev->sub_cnt == 0 && usb_ev->cb_cnt == 0)
+		return TRUE;
+
+	CB_LOCK();
+	if (!filter_pass(msg))
+	{
+		CB_UNLOCK();
+		return FALSE;	// let through by a merged device filter
+	}
+	if (measure)
+		rt_jitter_put(msg);
+	if (capture->active)
+		capture_put(msg);
+	if (snapshot)
+		snapshot_put(msg);
+	if (bus_stats)
+		bus_stats_put(msg);
+	if (isotp)
+		isotp_put(msg);
+	if (gateway)
+	{
+		if (*rx_time == 0)
+			*rx_time = host_usec();
+		gateway_put(msg, *rx_time);
+	}
+	int consumed = sub_dispatch(msg);
+	if (rx_callbacks(msg))
+		consumed = TRUE;
+	CB_UNLOCK();
+	return !consumed;
+}
+
+/*
+  Split a bulk IN transfer received by the USB event thread into packets.
+  Data packets for the connected channel are decoded into the receive FIFO
+  queue, anything else is a command reply for usb_send_expect.
+*/
+static void usb_event_data(const uint8_t *data, const int bytes_read)
+{
+	TRACE_SPAN("decode");
+	TRACE_SIZE(bytes_read);
+	int bytes_processed = 0;
+	uint64_t rx_time = 0;	// taken at the first frame for the gateway
+	while (bytes_processed < bytes_read)
+	{
+		const uint8_t *packet = data + bytes_processed;
+		int packet_len = bytes_read - bytes_processed;
+		if (packet_len >= 4
+			&& packet[0] == 0x61		// A
+			&& packet[1] == 0x72		// R
+			&& packet[2] >= ISO9141 && packet[2] <= ISO15765)
+		{
+			packet_len = packet[3] + 4;
+			if (bytes_processed + packet_len > bytes_read)
+			{
+				if (write_log)
+					writelog("\t\t\t-- Truncated data packet dropped\n");
+				break;
+			}
+			if (packet[2] == con->channel
+				&& con->decode(usb_ev->msg, data, bytes_processed, bytes_read, fifo_cnt) == DECODE_DONE)
+			{
+				if (usb_event_msg(usb_ev->msg, &rx_time))
+				{
+					PASSTHRU_MSG *next = (PASSTHRU_MSG*)malloc(sizeof(PASSTHRU_MSG));
+					if (next && queue_msg(usb_ev->msg))
+						usb_ev->msg = next;
+					else
+					{
+						// couldn't allocate memory, drop the message
+						free(next);
+						if (write_log)
+							writelog("\tReceive FIFO queue full, message dropped\n");
+					}
+				}
+				usb_ev->msg->DataSize = 0;	// Initialize new msg datasize
+			}
+		}
+		else
+		{
+			// Command reply, up to and including CR LF
+			int i = 0;
+			for (; i + 1 < packet_len; i++)
+			{
+				if (packet[i] == '\r' && packet[i + 1] == '\n')
+				{
+					packet_len = i + 2;
+					break;
+				}
+			}
+			if (!vbatt_put(packet, packet_len) && !cmd_put(packet, packet_len))
+				reply_put(packet, packet_len);
+		}
+		bytes_processed += packet_len;
+	}
+	if (rx_time)
+		gateway_end();
+}
+
+/*
+  Completion of a bulk IN transfer, runs on the USB event thread.
+*/
+static void LIBUSB_CALL usb_event_rx(struct libusb_transfer *xfer)
+{
+	TRACE_SPAN("USB IN completion");
+	TRACE_SIZE(xfer->actual_length);
+	if (xfer->status == LIBUSB_TRANSFER_COMPLETED)
+	{
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\t\t*** USB EVENT READ: bytes_read:%d\n\t\t", xfer->actual_length);
+			writelog(log_msg);
+			writelogmsg(xfer->buffer, 0, xfer->actual_length);
+			writelog("\n");
+		}
+		usb_event_data(xfer->buffer, xfer->actual_length);
+	}
+
+	if (!ATOMIC_LOAD(&usb_ev->stop)
+		&& (xfer->status == LIBUSB_TRANSFER_COMPLETED || xfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+		&& libusb_submit_transfer(xfer) == LIBUSB_SUCCESS)
+		return;
+
+	if (write_log && xfer->status != LIBUSB_TRANSFER_CANCELLED)
+	{
+		snprintf(log_msg, LM_LEN, "\tUSB event transfer ended, status: %d\n", xfer->status);
+		writelog(log_msg);
+	}
+	*(int*)xfer->user_data = FALSE;
+	usb_ev->inflight--;
+}
+
+/*
+  USB event thread, handles libusb events until all bulk IN transfers
+  have been cancelled or ended with an error.
+*/
+static void *usb_event_thread(void *arg)
+{
+	while (usb_ev->inflight > 0)
+	{
+		// in real-time busy poll mode only look for completed transfers
+		struct timeval tv = { 0, ATOMIC_LOAD(&rt->busy_poll) ? 0 : 100000 };
+		if (ATOMIC_LOAD(&usb_ev->stop))
+		{
+			int i = 0;
+			for (; i < RX_XFERS; i++)
+				if (usb_ev->active[i])
+					libusb_cancel_transfer(usb_ev->xfer[i]);
+		}
+		libusb_handle_events_timeout_completed(con->ctx, &tv, NULL);
+	}
+	if (!ATOMIC_LOAD(&usb_ev->stop))
+	{
+		// every transfer failed, the endpoint is read directly again until usb_event_start
+		ATOMIC_STORE(&usb_ev->running, FALSE);
+		if (write_log)
+			writelog("\tUSB event thread exited, all transfers failed\n");
+	}
+	return NULL;
+}
+#endif
+
+/*
+  Initialize the USB event state when the device is opened.
+*/
+static void usb_event_init()
+{
+	memset(usb_ev, 0, sizeof(usb_event_t));
+	usb_ev->event_fd[0] = -1;
+	usb_ev->event_fd[1] = -1;
+	usb_ev->watermark = 1;
+#ifndef _MSC_VER
+	pthread_mutex_init(&usb_ev->lock, NULL);
+	pthread_cond_init(&usb_ev->rx_cond, NULL);
+	pthread_cond_init(&usb_ev->reply_cond, NULL);
+	pthread_mutex_init(&usb_ev->cb_lock, NULL);
+#endif
+	memset(filters, 0, sizeof(filters));
+	filter_cnt = 0;
+	memset(fset, 0, sizeof(fset));
+	fset->exact = TRUE;
+	memset(rx_cb, 0, sizeof(rx_cb));
+	memset(subs, 0, sizeof(subs));
+	sub_rebuild();
+	free(cmdq->msg);
+	memset(cmdq, 0, sizeof(cmd_queue_t));
+	memset(vbatt, 0, sizeof(vbatt_t));
+	memset(rt, 0, sizeof(rt_t));
+#ifndef _MSC_VER
+	pthread_mutex_init(&vbatt->lock, NULL);
+	pthread_cond_init(&vbatt->cond, NULL);
+#endif
+}
+
+#ifndef _MSC_VER
+/*
+  Close the RX event descriptor.
+*/
+static void rx_event_close()
+{
+	if (usb_ev->event_fd[0] >= 0)
+		close(usb_ev->event_fd[0]);
+	if (usb_ev->event_fd[1] >= 0 && usb_ev->event_fd[1] != usb_ev->event_fd[0])
+		close(usb_ev->event_fd[1]);
+	usb_ev->event_fd[0] = -1;
+	usb_ev->event_fd[1] = -1;
+}
+#endif
+
+/*
+  Stop the USB event thread and close the RX event descriptor, the bulk IN
+  endpoint is read directly by PassThruReadMsgs again.
+*/
+static void usb_event_stop()
+{
+#ifndef _MSC_VER
+	if (!usb_ev->joinable)
+		return;
+	ATOMIC_STORE(&usb_ev->stop, TRUE);
+	pthread_join(usb_ev->thread, NULL);
+	usb_ev->joinable = FALSE;
+	ATOMIC_STORE(&usb_ev->running, FALSE);
+
+	int i = 0;
+	for (; i < RX_XFERS; i++)
+	{
+		libusb_free_transfer(usb_ev->xfer[i]);
+		usb_ev->xfer[i] = NULL;
+	}
+	free(usb_ev->msg);
+	usb_ev->msg = NULL;
+	reply_flush();
+
+	RX_LOCK();
+	rx_event_close();
+	usb_ev->event_set = FALSE;
+	RX_UNLOCK();
+	if (write_log)
+		writelog("\tUSB event thread stopped\n");
+#endif
+}
+
+/*
+  Start the USB event thread and create the RX event descriptor.  From now
+  on the thread owns the bulk IN endpoint.
+*/
+static int usb_event_start()
+{
+	if (ATOMIC_LOAD(&usb_ev->running))
+		return LIBUSB_SUCCESS;
+#ifndef _MSC_VER
+	// join a thread that exited because its transfers failed
+	usb_event_stop();
+#ifdef __linux__
+	usb_ev->event_fd[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	usb_ev->event_fd[1] = usb_ev->event_fd[0];
+	if (usb_ev->event_fd[0] < 0)
+		return LIBUSB_ERROR_NO_MEM;
+#else
+	if (pipe(usb_ev->event_fd) != 0)
+		return LIBUSB_ERROR_NO_MEM;
+	fcntl(usb_ev->event_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl(usb_ev->event_fd[1], F_SETFL, O_NONBLOCK);
+#endif
+	usb_ev->event_set = FALSE;
+	ATOMIC_STORE(&usb_ev->stop, FALSE);
+	usb_ev->inflight = 0;
+	usb_ev->msg = (PASSTHRU_MSG*)malloc(sizeof(PASSTHRU_MSG));
+	if (usb_ev->msg == NULL)
+	{
+		rx_event_close();
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	usb_ev->msg->DataSize = 0;
+
+	int r = LIBUSB_SUCCESS;
+	int i = 0;
+	for (; i < RX_XFERS && r == LIBUSB_SUCCESS; i++)
+	{
+		usb_ev->xfer[i] = libusb_alloc_transfer(0);
+		if (usb_ev->xfer[i] == NULL)
+		{
+			r = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+		libusb_fill_bulk_transfer(usb_ev->xfer[i], con->dev_handle, endpoint->addr_in,
+			usb_ev->buf[i], PM_DATA_LEN, usb_event_rx, &usb_ev->active[i], 0);
+		r = libusb_submit_transfer(usb_ev->xfer[i]);
+		if (r == LIBUSB_SUCCESS)
+		{
+			usb_ev->active[i] = TRUE;
+			usb_ev->inflight++;
+		}
+	}
+
+	ATOMIC_STORE(&usb_ev->running, TRUE);
+	if (r == LIBUSB_SUCCESS)
+	{
+		if (pthread_create(&usb_ev->thread, NULL, usb_event_thread, NULL) == 0)
+			usb_ev->joinable = TRUE;
+		else
+			r = LIBUSB_ERROR_OTHER;
+	}
+	if (r != LIBUSB_SUCCESS)
+	{
+		// nothing is handling events yet, cancel in this thread
+		ATOMIC_STORE(&usb_ev->stop, TRUE);
+		usb_event_thread(NULL);
+	}
+	RX_LOCK();
+	rx_event_update();
+	RX_UNLOCK();
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tUSB event thread %s\n",
+			r == LIBUSB_SUCCESS ? "started" : libusb_error_name(r));
+		writelog(log_msg);
+	}
+	if (r != LIBUSB_SUCCESS)
+	{
+		ATOMIC_STORE(&usb_ev->running, FALSE);
+		for (i = 0; i < RX_XFERS; i++)
+		{
+			libusb_free_transfer(usb_ev->xfer[i]);
+			usb_ev->xfer[i] = NULL;
+		}
+		free(usb_ev->msg);
+		usb_ev->msg = NULL;
+		rx_event_close();
+	}
+	return r;
+#else
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Apply the priority, CPU affinity and flags of a real-time mode to the
+  running USB event thread.
+*/
+static int32_t rt_apply(const RT_MODE *mode)
+{
+#ifndef _MSC_VER
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = (int)mode->Priority;
+	int e = pthread_setschedparam(usb_ev->thread, mode->Priority ? SCHED_FIFO : SCHED_OTHER, &param);
+	if (e != 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: cannot set priority %lu: %s", mode->Priority, strerror(e));
+		return J2534_ERR_FAILED;
+	}
+#ifdef __linux__
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	int i = 0;
+	for (; i < CPU_SETSIZE; i++)
+	{
+		if (mode->CpuMask == 0 || (i < (int)sizeof(unsigned long) * 8 && ((mode->CpuMask >> i) & 1)))
+			CPU_SET(i, &cpus);
+	}
+	e = pthread_setaffinity_np(usb_ev->thread, sizeof(cpus), &cpus);
+	if (e != 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: cannot set CPU mask %lX: %s", mode->CpuMask, strerror(e));
+		return J2534_ERR_FAILED;
+	}
+#else
+	if (mode->CpuMask)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: CPU mask not supported");
+		return J2534_ERR_NOT_SUPPORTED;
+	}
+#endif
+	if ((mode->Flags & J2534_RT_LOCK_MEMORY) && !rt->locked)
+	{
+		if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: cannot lock memory: %s", strerror(errno));
+			return J2534_ERR_FAILED;
+		}
+		rt->locked = TRUE;
+	}
+	else if (!(mode->Flags & J2534_RT_LOCK_MEMORY) && rt->locked)
+	{
+		munlockall();
+		rt->locked = FALSE;
+	}
+	if ((mode->Flags & J2534_RT_MEASURE) && !ATOMIC_LOAD(&rt->measure))
+	{
+		CB_LOCK();
+		memset(rt->hist, 0, sizeof(rt->hist));
+		rt->cnt = 0;
+		rt->max = 0;
+		rt->window = 0;
+		CB_UNLOCK();
+	}
+	ATOMIC_STORE(&rt->measure, (mode->Flags & J2534_RT_MEASURE) != 0);
+	ATOMIC_STORE(&rt->busy_poll, (mode->Flags & J2534_RT_BUSY_POLL) != 0);
+	rt->mode = *mode;
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tUSB event thread priority %lu, CPU mask %lX, flags %lX\n",
+			mode->Priority, mode->CpuMask, mode->Flags);
+		writelog(log_msg);
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: real-time mode not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Start the USB event thread in a real-time mode, or return it to normal
+  scheduling when mode is NULL.
+*/
+static int32_t rt_set(const RT_MODE *mode)
+{
+#ifndef _MSC_VER
+	RT_MODE normal;
+	memset(&normal, 0, sizeof(normal));
+	if (mode == NULL)
+		return ATOMIC_LOAD(&usb_ev->running) ? rt_apply(&normal) : J2534_NOERROR;
+	if (mode->Flags & ~(unsigned long)(J2534_RT_LOCK_MEMORY | J2534_RT_BUSY_POLL | J2534_RT_MEASURE))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: unknown real-time mode flags %lX", mode->Flags);
+		return J2534_ERR_INVALID_FLAGS;
+	}
+	if (mode->Priority > (unsigned long)sched_get_priority_max(SCHED_FIFO))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: priority must be %d at most", sched_get_priority_max(SCHED_FIFO));
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+	int u = usb_event_start();
+	if (u != LIBUSB_SUCCESS)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+			libusb_error_name(u));
+		return error_map(u);
+	}
+	int32_t r = rt_apply(mode);
+	if (r != J2534_NOERROR)
+	{
+		char error[LE_LEN];
+		memcpy(error, LAST_ERROR, LE_LEN);
+		rt_apply(&normal);
+		memcpy(LAST_ERROR, error, LE_LEN);
+	}
+	return r;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: real-time mode not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Leave real-time mode before the USB event thread stops.
+*/
+static void rt_stop()
+{
+#ifndef _MSC_VER
+	if (rt->locked)
+		munlockall();
+	ATOMIC_STORE(&rt->busy_poll, FALSE);
+	ATOMIC_STORE(&rt->measure, FALSE);
+	memset(&rt->mode, 0, sizeof(RT_MODE));
+	rt->locked = FALSE;
+#endif
+}
+
+/*
+  Fill out[n] with the per_mille[n] percentile of the cnt values counted
+  in a JITTER_BUCKETS histogram, per_mille ascending.
+*/
+static void hist_percentiles(const uint32_t *hist, const unsigned long cnt, const uint32_t max,
+	const unsigned long *per_mille, unsigned long **out, const int n)
+{
+	unsigned long seen = 0;
+	int i = 0, p = 0;
+	for (; i < JITTER_BUCKETS && p < n; i++)
+	{
+		seen += hist[i];
+		// the upper end of the bucket, but not more than the largest value
+		while (p < n && cnt > 0 && seen * 1000 >= cnt * per_mille[p])
+		{
+			unsigned long usec = (unsigned long)(i + 1) * JITTER_STEP;
+			*out[p++] = usec < max ? usec : max;
+		}
+	}
+}
+
+/*
+  Return the RX jitter recorded since the last call and start over.
+*/
+static int32_t rt_jitter(RX_JITTER *jitter)
+{
+	if (!ATOMIC_LOAD(&rt->measure))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: RX jitter is not measured, set J2534_RT_MEASURE");
+		return J2534_ERR_FAILED;
+	}
+	unsigned long *out[3] = { &jitter->Median, &jitter->P99, &jitter->P999 };
+	const unsigned long per_mille[3] = { 500, 990, 999 };
+	memset(jitter, 0, sizeof(RX_JITTER));
+	CB_LOCK();
+	hist_percentiles(rt->hist, rt->cnt, rt->max, per_mille, out, 3);
+	jitter->NumMsgs = rt->cnt;
+	jitter->Max = rt->max;
+	memset(rt->hist, 0, sizeof(rt->hist));
+	rt->cnt = 0;
+	rt->max = 0;
+	CB_UNLOCK();
+	return J2534_NOERROR;
+}
+
+/*
+  Wait up to timeout usec for the USB event thread to queue count messages.
+*/
+static void rx_wait(const unsigned long count, const uint64_t timeout)
+{
+#ifndef _MSC_VER
+	struct timespec deadline;
+	abs_deadline(&deadline, (uint32_t)(timeout / 1000));
+	deadline.tv_nsec += (long)(timeout % 1000) * 1000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	RX_LOCK();
+	while (fifo_cnt < count)
+	{
+		if (pthread_cond_timedwait(&usb_ev->rx_cond, &usb_ev->lock, &deadline) == ETIMEDOUT)
+			break;
+	}
+	RX_UNLOCK();
+#endif
+}
+
+/*
+  Stop recording, write out everything queued so far and close the capture
+  file.  dropped, if not NULL, receives the number of messages lost because
+  the writer fell behind.
+*/
+static int32_t capture_stop(unsigned long *dropped)
+{
+#ifndef _MSC_VER
+	if (capture->ring == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: capture not running");
+		return J2534_ERR_FAILED;
+	}
+	CB_LOCK();
+	capture->active = FALSE;
+	CB_UNLOCK();
+	pthread_mutex_lock(&capture->lock);
+	capture->stop = TRUE;
+	pthread_cond_signal(&capture->cond);
+	pthread_mutex_unlock(&capture->lock);
+	pthread_join(capture->thread, NULL);
+	pthread_mutex_destroy(&capture->lock);
+	pthread_cond_destroy(&capture->cond);
+
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tCapture stopped, files: %lu, dropped: %u\n",
+			capture->file_no, capture->ring->overflows);
+		writelog(log_msg);
+	}
+	if (dropped)
+		*dropped = capture->ring->overflows;
+	free(capture->buf);
+	free(capture->ring);
+	free(capture->block);
+	free(capture->index);
+	capture->buf = NULL;
+	capture->ring = NULL;
+	capture->block = NULL;
+	capture->index = NULL;
+	capture->index_cap = 0;
+	if (capture->error)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: capture write failed: %s", strerror(capture->error));
+		return J2534_ERR_FAILED;
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: capture not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Start recording the connected channel to a capture file.
+*/
+static int32_t capture_start(const CAPTURE_CONFIG *cfg)
+{
+#ifndef _MSC_VER
+	if (capture->ring)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: capture already running");
+		return J2534_ERR_NOT_UNIQUE;
+	}
+	if (cfg->pPath == NULL || cfg->pPath[0] == 0 || strlen(cfg->pPath) >= CAPTURE_PATH_LEN)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: invalid capture path");
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+	if (cfg->Format < J2534_CAPTURE_CANDUMP || cfg->Format > J2534_CAPTURE_INDEXED)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: invalid capture format");
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+	if (con->channel != CAN && con->channel != ISO15765)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: capture needs a CAN channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+
+	memset(capture, 0, sizeof(capture_t));
+	capture->format = cfg->Format;
+	capture->rotate_bytes = cfg->RotateBytes;
+	capture->rotate_secs = cfg->RotateSeconds;
+	strcpy(capture->path, cfg->pPath);
+	capture->fd = -1;
+	if (posix_memalign((void**)&capture->buf, 4096, CAPTURE_BUF + CAPTURE_LINE) != 0
+		|| posix_memalign((void**)&capture->ring, 64, sizeof(j2534d_ring_t) + CAPTURE_RING) != 0
+		|| (cfg->Format == J2534_CAPTURE_INDEXED
+			&& (capture->block = (uint8_t*)calloc(1, CAPSTORE_BLOCK)) == NULL))
+	{
+		free(capture->buf);
+		free(capture->ring);
+		free(capture->block);
+		capture->buf = NULL;
+		capture->ring = NULL;
+		capture->block = NULL;
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	memset(capture->ring, 0, sizeof(j2534d_ring_t));
+	capture->ring->size = CAPTURE_RING;
+
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	int r = capture_open((uint64_t)now.tv_sec * 1000000 + now.tv_usec);
+	if (r != 0)
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to open capture file: %s", strerror(r));
+	else
+	{
+		pthread_mutex_init(&capture->lock, NULL);
+		pthread_cond_init(&capture->cond, NULL);
+		if (pthread_create(&capture->thread, NULL, capture_thread, NULL) != 0)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: failed to start capture thread");
+			close(capture->fd);
+			r = -1;
+		}
+	}
+	if (r != 0)
+	{
+		free(capture->buf);
+		free(capture->ring);
+		free(capture->block);
+		capture->buf = NULL;
+		capture->ring = NULL;
+		capture->block = NULL;
+		return J2534_ERR_FAILED;
+	}
+
+	// messages are decoded by the USB event thread from now on
+	int u = usb_event_start();
+	CB_LOCK();
+	capture->active = (u == LIBUSB_SUCCESS);
+	CB_UNLOCK();
+	if (u != LIBUSB_SUCCESS)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+			libusb_error_name(u));
+		capture_stop(NULL);
+		return error_map(u);
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: capture not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Stop keeping the latest message of each CAN ID and free the table.
+*/
+static void snapshot_stop()
+{
+	CB_LOCK();
+	snapshot_t *old = snapshot;
+	snapshot = NULL;
+	CB_UNLOCK();
+	readers_wait(&snapshot_readers);
+	if (old && write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tSnapshot stopped, IDs above 0x7FF: %u, not recorded: %u\n",
+			old->ext_used, old->ext_full);
+		writelog(log_msg);
+	}
+	free(old);
+}
+
+/*
+  Start keeping the latest message of each CAN ID of the connected channel.
+*/
+static int32_t snapshot_start()
+{
+#ifndef _MSC_VER
+	if (snapshot)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: snapshot already running");
+		return J2534_ERR_NOT_UNIQUE;
+	}
+	if (con->channel != CAN && con->channel != ISO15765)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: snapshot needs a CAN channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+	snapshot_t *snap = (snapshot_t*)calloc(1, sizeof(snapshot_t));
+	if (snap == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+
+	// messages are decoded by the USB event thread from now on
+	int u = usb_event_start();
+	if (u != LIBUSB_SUCCESS)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+			libusb_error_name(u));
+		free(snap);
+		return error_map(u);
+	}
+	CB_LOCK();
+	snapshot = snap;
+	CB_UNLOCK();
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: snapshot not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Stop the bus statistics and free them.
+*/
+static void bus_stats_stop()
+{
+	CB_LOCK();
+	bus_stats_t *old = bus_stats;
+	bus_stats = NULL;
+	CB_UNLOCK();
+	if (old && write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tBus statistics stopped, frames: %lu, not recorded per ID: %lu\n",
+			old->frames, old->untracked);
+		writelog(log_msg);
+	}
+	free(old);
+}
+
+/*
+  Start keeping bus statistics of the connected CAN channel.
+*/
+static int32_t bus_stats_start()
+{
+#ifndef _MSC_VER
+	if (bus_stats)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: bus statistics already running");
+		return J2534_ERR_NOT_UNIQUE;
+	}
+	if (con->channel != CAN)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: bus statistics need a CAN channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+	bus_stats_t *st = (bus_stats_t*)calloc(1, sizeof(bus_stats_t));
+	if (st == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	st->start = host_usec();
+	st->read_time = st->start;
+
+	// frames are decoded by the USB event thread from now on
+	int u = usb_event_start();
+	if (u != LIBUSB_SUCCESS)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+			libusb_error_name(u));
+		free(st);
+		return error_map(u);
+	}
+	CB_LOCK();
+	bus_stats = st;
+	CB_UNLOCK();
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: bus statistics not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#ifndef _MSC_VER
+static int id_stats_cmp(const void *a, const void *b)
+{
+	uint32_t x = ((const id_stats_t*)a)->id;
+	uint32_t y = ((const id_stats_t*)b)->id;
+	return x < y ? -1 : x > y;
+}
+#endif
+
+/*
+  Copy the bus statistics for J2534_READ_BUS_STATS.  The entries in use are
+  copied while the USB event thread is held off, sorted and converted after.
+*/
+static int32_t bus_stats_read(BUS_STATS *out)
+{
+#ifndef _MSC_VER
+	if (out->NumIDs > 0 && out->pIDs == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pIDs must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	id_stats_t *ids = NULL;
+	if (out->NumIDs > 0)
+	{
+		ids = (id_stats_t*)malloc((SUB_STD_IDS + STATS_HASH_SIZE) * sizeof(id_stats_t));
+		if (ids == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+			return J2534_ERR_EXCEEDED_LIMIT;
+		}
+	}
+
+	unsigned long n = 0;
+	uint64_t now = host_usec();
+	CB_LOCK();
+	bus_stats_t *st = bus_stats;
+	if (st == NULL)
+	{
+		CB_UNLOCK();
+		free(ids);
+		snprintf(LAST_ERROR, LE_LEN, "Error: bus statistics not started");
+		return J2534_ERR_FAILED;
+	}
+	int i = 0;
+	for (; i < SUB_STD_IDS + STATS_HASH_SIZE; i++)
+	{
+		const id_stats_t *e = i < SUB_STD_IDS ? &st->std[i] : &st->ext[i - SUB_STD_IDS];
+		if (e->cnt == 0)
+			continue;
+		if (ids)
+			ids[n] = *e;
+		n++;
+	}
+	double rate = (double)con->baud / 1e6;	// bits per usec
+	out->TotalIDs = n;
+	out->NumFrames = st->frames;
+	out->Untracked = st->untracked;
+	out->Elapsed = (unsigned long)(now - st->start);
+	out->BusLoad = rate > 0 && now > st->start ? st->bits / rate / (now - st->start) : 0;
+	out->RecentLoad = rate > 0 && now > st->read_time
+		? (st->bits - st->read_bits) / rate / (now - st->read_time) : 0;
+	st->read_bits = st->bits;
+	st->read_time = now;
+	CB_UNLOCK();
+
+	if (ids)
+	{
+		qsort(ids, n, sizeof(id_stats_t), id_stats_cmp);
+		if (n > out->NumIDs)
+			n = out->NumIDs;
+		unsigned long j = 0;
+		for (; j < n; j++)
+		{
+			const id_stats_t *e = &ids[j];
+			BUS_ID_STATS *o = &out->pIDs[j];
+			uint32_t span = e->last - e->first;
+			o->CanID = e->id;
+			o->NumFrames = e->cnt;
+			o->FirstSeen = e->first;
+			o->LastSeen = e->last;
+			o->FrameRate = span > 0 ? (e->cnt - 1) * 1e6 / span : 0;
+			o->MeanPeriod = e->mean;
+			o->PeriodJitter = e->cnt > 2 ? sqrt(e->m2 / (e->cnt - 2)) : 0;
+			o->MinPeriod = e->cnt > 1 ? e->min_period : 0;
+			o->MaxPeriod = e->max_period;
+		}
+		free(ids);
+	}
+	out->NumIDs = n;
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: bus statistics not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Free an ISO-TP sniffer.
+*/
+static void isotp_free(isotp_t *it)
+{
+	if (it == NULL)
+		return;
+	free(it->mask);
+	free(it->stream);
+	free(it->hash);
+	free(it->pool);
+	free(it->ring);
+	free(it);
+}
+
+static void isotp_fill(const isotp_t *it, ISOTP_STATS *out)
+{
+	out->NumPdus = it->pdus;
+	out->Aborted = it->aborted;
+	out->Evicted = it->evicted;
+	out->Oversize = it->oversize;
+	out->Overflows = it->ring->overflows;
+	out->NumStreams = it->used;
+}
+
+/*
+  Stop the ISO-TP sniffer, PDUs not read yet are discarded.
+*/
+static void isotp_stop(ISOTP_STATS *out)
+{
+	if (out)
+		memset(out, 0, sizeof(ISOTP_STATS));
+	CB_LOCK();
+	isotp_t *it = isotp;
+	isotp = NULL;
+	CB_UNLOCK();
+	if (it == NULL)
+		return;
+	readers_wait(&isotp_readers);
+	if (out)
+		isotp_fill(it, out);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tISO-TP sniffer stopped, PDUs: %lu, aborted: %lu, evicted: %lu, lost: %u\n",
+			it->pdus, it->aborted, it->evicted, it->ring->overflows);
+		writelog(log_msg);
+	}
+	isotp_free(it);
+}
+
+/*
+  Start reassembling the ISO-TP transfers on the connected CAN channel.
+  Every buffer is allocated here, the USB event thread never allocates.
+*/
+static int32_t isotp_start(const ISOTP_SNIFF_CONFIG *cfg)
+{
+#ifndef _MSC_VER
+	if (isotp)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: ISO-TP sniffer already running");
+		return J2534_ERR_NOT_UNIQUE;
+	}
+	if (con->channel != CAN)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: ISO-TP sniffer needs a CAN channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+	if (cfg->NumFilters > 0 && (cfg->pMasks == NULL || cfg->pPatterns == NULL))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pMasks and pPatterns must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	unsigned long streams = cfg->MaxStreams ? cfg->MaxStreams : ISOTP_STREAMS;
+	if (streams > ISOTP_MAX_STREAMS)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: MaxStreams must be at most %d", ISOTP_MAX_STREAMS);
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+
+	isotp_t *it = (isotp_t*)calloc(1, sizeof(isotp_t));
+	if (it)
+	{
+		it->filters = cfg->NumFilters;
+		it->ext_addr = (cfg->Flags & J2534_ISOTP_EXT_ADDR) != 0;
+		it->streams = streams;
+		// at most half full, so probes stay short
+		it->hash_bits = 1;
+		while ((1ul << it->hash_bits) < 2 * streams)
+			it->hash_bits++;
+		it->mask = (uint32_t*)malloc((2 * it->filters + 1) * sizeof(uint32_t));
+		it->stream = (isotp_stream_t*)calloc(streams, sizeof(isotp_stream_t));
+		it->hash = (uint16_t*)calloc((size_t)1 << it->hash_bits, sizeof(uint16_t));
+		it->pool = (uint8_t*)malloc(streams * ISOTP_PDU_MAX);
+		if (posix_memalign((void**)&it->ring, 64, sizeof(j2534d_ring_t) + ISOTP_RING) != 0)
+			it->ring = NULL;
+	}
+	if (it == NULL || it->mask == NULL || it->stream == NULL || it->hash == NULL || it->pool == NULL
+		|| it->ring == NULL)
+	{
+		isotp_free(it);
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	it->pattern = it->mask + it->filters;
+	unsigned long i = 0;
+	for (; i < it->filters; i++)
+	{
+		it->mask[i] = cfg->pMasks[i] & 0x1FFFFFFF;
+		it->pattern[i] = cfg->pPatterns[i] & it->mask[i];
+	}
+	for (i = 0; i < streams; i++)
+		it->stream[i].data = it->pool + i * ISOTP_PDU_MAX;
+	memset(it->ring, 0, sizeof(j2534d_ring_t));
+	it->ring->size = ISOTP_RING;
+
+	// frames are decoded by the USB event thread from now on
+	int u = usb_event_start();
+	if (u != LIBUSB_SUCCESS)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+			libusb_error_name(u));
+		isotp_free(it);
+		return error_map(u);
+	}
+	CB_LOCK();
+	isotp = it;
+	CB_UNLOCK();
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: ISO-TP sniffer not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Copy the counters of the ISO-TP sniffer for J2534_READ_ISOTP_STATS.
+*/
+static int32_t isotp_read(ISOTP_STATS *out)
+{
+	CB_LOCK();
+	if (isotp == NULL)
+	{
+		CB_UNLOCK();
+		snprintf(LAST_ERROR, LE_LEN, "Error: ISO-TP sniffer not started");
+		return J2534_ERR_FAILED;
+	}
+	isotp_fill(isotp, out);
+	CB_UNLOCK();
+	return J2534_NOERROR;
+}
+
+#ifndef _MSC_VER
+/*
+  Free an indexed capture file opened by capstore_open.
+*/
+static void capstore_free(capstore_t *cs)
+{
+	if (cs->map)
+		munmap((void*)cs->map, cs->len);
+	free(cs->rebuilt);
+	free(cs);
+}
+
+/*
+  Map an indexed capture file and find its index.  A file without a valid
+  index gets one rebuilt from its blocks up to the first incomplete one.
+*/
+static capstore_t *capstore_open(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: cannot open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	struct stat st;
+	capstore_t *cs = (capstore_t*)calloc(1, sizeof(capstore_t));
+	if (cs == NULL || fstat(fd, &st) != 0 || st.st_size < CAPSTORE_HEADER)
+	{
+		close(fd);
+		free(cs);
+		snprintf(LAST_ERROR, LE_LEN, "Error: %s is not an indexed capture file", path);
+		return NULL;
+	}
+	cs->len = (size_t)st.st_size;
+	void *map = mmap(NULL, cs->len, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		free(cs);
+		snprintf(LAST_ERROR, LE_LEN, "Error: cannot map %s: %s", path, strerror(errno));
+		return NULL;
+	}
+	cs->map = (const uint8_t*)map;
+	// queries jump between blocks, read ahead would only fetch pages nobody wants
+	madvise(map, cs->len, MADV_RANDOM);
+
+	const capstore_head_t *head = (const capstore_head_t*)cs->map;
+	if (memcmp(head->magic, "J2534CS1", 8) != 0 || head->block_size != CAPSTORE_BLOCK
+		|| head->frame_size != sizeof(CAPTURE_FRAME))
+	{
+		capstore_free(cs);
+		snprintf(LAST_ERROR, LE_LEN, "Error: %s is not an indexed capture file", path);
+		return NULL;
+	}
+
+	const capstore_trailer_t *trailer = (const capstore_trailer_t*)(cs->map + cs->len - sizeof(capstore_trailer_t));
+	if (cs->len >= CAPSTORE_HEADER + sizeof(capstore_trailer_t)
+		&& memcmp(trailer->magic, "JCSINDEX", 8) == 0
+		&& trailer->index >= CAPSTORE_HEADER && trailer->index % 8 == 0
+		&& trailer->blocks <= (cs->len - CAPSTORE_HEADER) / CAPSTORE_BLOCK
+		&& trailer->index + trailer->blocks * sizeof(capstore_block_t) + sizeof(capstore_trailer_t) == cs->len)
+	{
+		cs->index = (const capstore_block_t*)(cs->map + trailer->index);
+		cs->blocks = (unsigned long)trailer->blocks;
+	}
+	else
+	{
+		unsigned long max = (unsigned long)((cs->len - CAPSTORE_HEADER) / CAPSTORE_BLOCK);
+		cs->rebuilt = (capstore_block_t*)malloc((max ? max : 1) * sizeof(capstore_block_t));
+		if (cs->rebuilt == NULL)
+		{
+			capstore_free(cs);
+			snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+			return NULL;
+		}
+		for (; cs->blocks < max; cs->blocks++)
+		{
+			uint64_t offset = CAPSTORE_HEADER + (uint64_t)cs->blocks * CAPSTORE_BLOCK;
+			const capstore_block_t *b = (const capstore_block_t*)(cs->map + offset);
+			if (memcmp(b->magic, "JCB1", 4) != 0 || b->offset != offset)
+				break;
+			cs->rebuilt[cs->blocks] = *b;
+		}
+		cs->index = cs->rebuilt;
+	}
+
+	// a damaged index entry must not send a query outside the mapping
+	unsigned long i = 0;
+	for (; i < cs->blocks; i++)
+	{
+		const capstore_block_t *b = &cs->index[i];
+		if (b->count > CAPSTORE_FRAMES || b->offset < CAPSTORE_HEADER || b->offset > cs->len - CAPSTORE_BLOCK)
+		{
+			capstore_free(cs);
+			snprintf(LAST_ERROR, LE_LEN, "Error: %s has a damaged index", path);
+			return NULL;
+		}
+	}
+	return cs;
+}
+
+/*
+  First frame of a block at or after time t.
+*/
+static uint32_t capstore_seek(const CAPTURE_FRAME *f, const uint32_t count, const uint64_t t)
+{
+	uint32_t lo = 0, hi = count;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (f[mid].Timestamp < t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static const CAPTURE_FRAME *capstore_frames(const capstore_t *cs, const capstore_block_t *b)
+{
+	return (const CAPTURE_FRAME*)(cs->map + b->offset + sizeof(capstore_block_t));
+}
+#endif
+
+#ifndef _MSC_VER
+/*
+  Append a frame at time t of the file, in usec, to the replay.
+*/
+static int replay_add(replay_t *rp, unsigned long *cap, const uint64_t t, const uint32_t id,
+	const int ext, const uint8_t *data, const unsigned long len)
+{
+	if (rp->cnt == *cap)
+	{
+		unsigned long n = *cap ? *cap * 2 : 4096;
+		replay_frame_t *f = (replay_frame_t*)realloc(rp->frame, n * sizeof(replay_frame_t));
+		if (f == NULL)
+			return FALSE;
+		rp->frame = f;
+		*cap = n;
+	}
+	replay_frame_t *f = &rp->frame[rp->cnt++];
+	f->offset = t;
+	f->id = id;
+	f->ext = ext || id > 0x7FF;
+	f->len = (uint8_t)len;
+	memcpy(f->data, data, len);
+	return TRUE;
+}
+
+/*
+  Parse a candump -l or Vector ASC line, returns FALSE for lines that hold
+  no data frame: headers, comments, remote, error and CAN FD frames.
+*/
+static int replay_parse_line(const unsigned long format, char *line, uint64_t *t, uint32_t *id,
+	int *ext, uint8_t *data, unsigned long *len)
+{
+	char *end = NULL;
+	if (format == J2534_CAPTURE_CANDUMP)
+	{
+		unsigned long long sec = 0, usec = 0;
+		char frame[64];
+		if (sscanf(line, " (%llu.%6llu) %*s %63s", &sec, &usec, frame) != 3)
+			return FALSE;
+		char *hash = strchr(frame, '#');
+		if (hash == NULL || hash == frame || hash[1] == '#' || hash[1] == 'R')
+			return FALSE;
+		*hash++ = 0;
+		*id = strtoul(frame, &end, 16);
+		if (*end != 0 || *id > 0x1FFFFFFF)
+			return FALSE;
+		*ext = strlen(frame) > 3;
+		*t = (uint64_t)sec * 1000000 + usec;
+		for (*len = 0; isxdigit((unsigned char)hash[0]) && isxdigit((unsigned char)hash[1]); hash += 2)
+		{
+			char byte[3] = { hash[0], hash[1], 0 };
+			if (*len == 8)
+				return FALSE;
+			data[(*len)++] = (uint8_t)strtoul(byte, NULL, 16);
+		}
+		return *hash == 0;
+	}
+
+	double sec = 0;
+	char can_id[16], dir[8];
+	unsigned int dlc = 0;
+	int pos = 0;
+	if (sscanf(line, "%lf %*d %15s %7s d %u%n", &sec, can_id, dir, &dlc, &pos) != 4
+		|| dlc > 8 || sec < 0 || (strcmp(dir, "Rx") != 0 && strcmp(dir, "Tx") != 0))
+		return FALSE;
+	*id = strtoul(can_id, &end, 16);
+	*ext = (*end == 'x');
+	if (end == can_id || (*end != 0 && strcmp(end, "x") != 0) || *id > 0x1FFFFFFF)
+		return FALSE;
+	*t = (uint64_t)(sec * 1e6 + 0.5);
+	char *p = line + pos;
+	for (*len = 0; *len < dlc; (*len)++)
+	{
+		unsigned long b = strtoul(p, &end, 16);
+		if (end == p || b > 0xFF)
+			return FALSE;
+		data[*len] = (uint8_t)b;
+		p = end;
+	}
+	return TRUE;
+}
+
+/*
+  Convert a pcapng timestamp of resolution res (if_tsresol) to usec.
+*/
+static uint64_t replay_pcapng_usec(const uint64_t ts, const uint8_t res)
+{
+	if (res & 0x80)
+		return (uint64_t)ldexp((double)ts * 1e6, -(int)(res & 0x7F));
+	uint64_t t = ts;
+	int e = res;
+	for (; e > 6; e--)
+		t /= 10;
+	for (; e < 6; e++)
+		t *= 10;
+	return t;
+}
+
+/*
+  Read the CAN frames of the LINKTYPE_CAN_SOCKETCAN interfaces of a pcapng
+  file in host byte order.
+*/
+static int32_t replay_load_pcapng(replay_t *rp, FILE *f)
+{
+	uint8_t link_ok[8] = { 0 };		// interface has LINKTYPE_CAN_SOCKETCAN frames
+	uint8_t res[8] = { 0 };
+	unsigned long if_cnt = 0, cap = 0;
+	uint32_t *block = NULL;
+	uint32_t block_cap = 0;
+	uint32_t hdr[2];
+	while (fread(hdr, sizeof(hdr), 1, f) == 1)
+	{
+		if (hdr[1] < 12 || hdr[1] % 4 != 0 || hdr[1] > (16 << 20))
+		{
+			free(block);
+			snprintf(LAST_ERROR, LE_LEN, "Error: corrupt pcapng block");
+			return J2534_ERR_INVALID_IOCTL_VALUE;
+		}
+		if (hdr[1] > block_cap)
+		{
+			uint32_t *b = (uint32_t*)realloc(block, hdr[1]);
+			if (b == NULL)
+			{
+				free(block);
+				snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+				return J2534_ERR_EXCEEDED_LIMIT;
+			}
+			block = b;
+			block_cap = hdr[1];
+		}
+		// body and trailing length, starting at block[2]
+		if (fread(block + 2, hdr[1] - 8, 1, f) != 1)
+			break;
+		const uint8_t *body = (const uint8_t*)(block + 2);
+		uint32_t body_len = hdr[1] - 12;
+		if (hdr[0] == 0x0A0D0D0A)
+		{
+			if (body_len < 4 || block[2] != 0x1A2B3C4D)
+			{
+				free(block);
+				snprintf(LAST_ERROR, LE_LEN, "Error: pcapng file of the other byte order");
+				return J2534_ERR_INVALID_IOCTL_VALUE;
+			}
+			if_cnt = 0;
+		}
+		else if (hdr[0] == 1 && body_len >= 8 && if_cnt < sizeof(link_ok))
+		{
+			// linktype, then options from byte 8
+			link_ok[if_cnt] = (*(const uint16_t*)body == 227);
+			res[if_cnt] = 6;
+			uint32_t o = 8;
+			while (o + 4 <= body_len)
+			{
+				uint16_t code = *(const uint16_t*)(body + o);
+				uint16_t opt_len = *(const uint16_t*)(body + o + 2);
+				if (code == 0 || o + 4 + opt_len > body_len)
+					break;
+				if (code == 9 && opt_len >= 1)
+					res[if_cnt] = body[o + 4];
+				o += 4 + ((opt_len + 3) & ~3u);
+			}
+			if_cnt++;
+		}
+		else if (hdr[0] == 6 && body_len >= 20 + 8)
+		{
+			uint32_t iface = block[2];
+			uint32_t caplen = block[5];
+			const uint8_t *frame = body + 20;
+			if (iface >= if_cnt || !link_ok[iface] || caplen < 8 || caplen > body_len - 20)
+				continue;
+			uint32_t can_id = ((uint32_t)frame[0] << 24) | (frame[1] << 16) | (frame[2] << 8) | frame[3];
+			unsigned long len = frame[4];
+			// remote and error frames are not replayed
+			if (can_id & 0x60000000u || len > 8 || 8 + len > caplen)
+				continue;
+			uint64_t ts = ((uint64_t)block[3] << 32) | block[4];
+			if (!replay_add(rp, &cap, replay_pcapng_usec(ts, res[iface]), can_id & 0x1FFFFFFF,
+				(can_id & 0x80000000u) != 0, frame + 8, len))
+			{
+				free(block);
+				snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+				return J2534_ERR_EXCEEDED_LIMIT;
+			}
+		}
+	}
+	free(block);
+	return J2534_NOERROR;
+}
+
+/*
+  Read the frames of an indexed capture file.
+*/
+static int32_t replay_load_indexed(replay_t *rp, const char *path)
+{
+	capstore_t *cs = capstore_open(path);
+	if (cs == NULL)
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	madvise((void*)cs->map, cs->len, MADV_SEQUENTIAL);
+	unsigned long cap = 0, i = 0;
+	for (; i < cs->blocks; i++)
+	{
+		const CAPTURE_FRAME *f = capstore_frames(cs, &cs->index[i]);
+		uint32_t j = 0;
+		for (; j < cs->index[i].count; j++)
+		{
+			if (f[j].DataSize <= 8 && !replay_add(rp, &cap, f[j].Timestamp, f[j].CanID & 0x1FFFFFFF,
+				(f[j].CanID & 0x80000000u) != 0, f[j].Data, f[j].DataSize))
+			{
+				capstore_free(cs);
+				snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+				return J2534_ERR_EXCEEDED_LIMIT;
+			}
+		}
+	}
+	capstore_free(cs);
+	return J2534_NOERROR;
+}
+
+/*
+  Load the frames of a capture file into the replay and turn their times
+  into offsets from the first frame.  A frame stamped before the one ahead
+  of it is sent right after that one.
+*/
+static int32_t replay_load(replay_t *rp, const REPLAY_CONFIG *cfg)
+{
+	FILE *f = fopen(cfg->pPath, cfg->Format == J2534_CAPTURE_PCAPNG ? "rb" : "r");
+	if (f == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: cannot open %s: %s", cfg->pPath, strerror(errno));
+		return J2534_ERR_FAILED;
+	}
+	int32_t r = J2534_NOERROR;
+	if (cfg->Format == J2534_CAPTURE_PCAPNG)
+		r = replay_load_pcapng(rp, f);
+	else if (cfg->Format == J2534_CAPTURE_INDEXED)
+		r = replay_load_indexed(rp, cfg->pPath);
+	else
+	{
+		char line[CAPTURE_LINE];
+		unsigned long cap = 0;
+		while (r == J2534_NOERROR && fgets(line, sizeof(line), f))
+		{
+			uint64_t t = 0;
+			uint32_t id = 0;
+			int ext = FALSE;
+			uint8_t data[8];
+			unsigned long len = 0;
+			if (replay_parse_line(cfg->Format, line, &t, &id, &ext, data, &len)
+				&& !replay_add(rp, &cap, t, id, ext, data, len))
+			{
+				snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+				r = J2534_ERR_EXCEEDED_LIMIT;
+			}
+		}
+	}
+	fclose(f);
+	if (r == J2534_NOERROR && rp->cnt == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: no CAN frames in %s", cfg->pPath);
+		r = J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+	if (r != J2534_NOERROR)
+		return r;
+
+	uint64_t first = rp->frame[0].offset, last = 0;
+	unsigned long i = 0;
+	for (; i < rp->cnt; i++)
+	{
+		uint64_t t = rp->frame[i].offset;
+		last = t > first && t - first > last ? t - first : last;
+		rp->frame[i].offset = last;
+	}
+	// the next pass starts one mean frame gap after the last frame
+	rp->period = last + (rp->cnt > 1 && last > 0 ? last / (rp->cnt - 1) : REPLAY_GAP);
+	return J2534_NOERROR;
+}
+
+/*
+  Sleep until host_usec() time t, the last REPLAY_SPIN usec spinning, or
+  until the replay is asked to stop.
+*/
+static void replay_wait(replay_t *rp, const uint64_t t)
+{
+	uint64_t now = host_usec();
+	while (now + REPLAY_SPIN < t && !ATOMIC_LOAD(&rp->stop))
+	{
+		uint64_t until = t - REPLAY_SPIN;
+		if (until > now + REPLAY_POLL * 1000)
+			until = now + REPLAY_POLL * 1000;
+		struct timespec ts = { (time_t)(until / 1000000), (long)(until % 1000000) * 1000 };
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		now = host_usec();
+	}
+	while (now < t && !ATOMIC_LOAD(&rp->stop))
+		now = host_usec();
+}
+
+/*
+  Replay thread.  Each frame is due at the start plus its offset in the
+  file over the speed, never relative to the frame before, so late frames
+  do not push back the rest.  Frames are sent ahead by the time an OUT
+  transfer takes, and all frames due by then go out in one transfer.
+*/
+static void *replay_thread(void *arg)
+{
+	replay_t *rp = (replay_t*)arg;
+	uint8_t out[REPLAY_OUT];
+	uint64_t due[REPLAY_OUT / 14];	// of the frames in out, each takes at least 14 bytes
+	uint64_t lead = 0;
+	uint64_t start = host_usec();
+	unsigned long pass = 0, i = 0;
+	int32_t status = J2534_NOERROR;
+
+	if (rt->mode.Priority)
+	{
+		// as urgent as the USB event thread in real-time mode
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = (int)rt->mode.Priority;
+		int e = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (e != 0 && write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tReplay thread keeps normal priority: %s\n", strerror(e));
+			writelog(log_msg);
+		}
+	}
+
+	while (!ATOMIC_LOAD(&rp->stop) && (rp->loops == 0 || pass < rp->loops))
+	{
+		uint64_t next = start + (uint64_t)((pass * rp->period + rp->frame[i].offset) / rp->speed);
+		replay_wait(rp, next > lead ? next - lead : 0);
+		if (ATOMIC_LOAD(&rp->stop))
+			break;
+
+		uint64_t now = host_usec();
+		int len = 0, n = 0;
+		while (n < (int)(sizeof(due) / sizeof(due[0])) && (rp->loops == 0 || pass < rp->loops))
+		{
+			const replay_frame_t *f = &rp->frame[i];
+			uint64_t t = start + (uint64_t)((pass * rp->period + f->offset) / rp->speed);
+			if (n > 0 && t > now + lead)
+				break;
+			if (len + ATT_FRAME_MAX > REPLAY_OUT)
+				break;
+			len += att_frame(out + len, f->id, f->ext, f->data, f->len);
+			due[n++] = t;
+			if (++i == rp->cnt)
+			{
+				i = 0;
+				pass++;
+			}
+		}
+
+		int bytes_written = 0;
+		int r = usb_bulk(endpoint->addr_out, out, len, &bytes_written, 1000);
+		uint64_t done = host_usec();
+		if (r != LIBUSB_SUCCESS)
+		{
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\tReplay stopped, send failed: %s\n", libusb_error_name(r));
+				writelog(log_msg);
+			}
+			status = error_map(r);
+			break;
+		}
+		// follow the transfer time slowly, one slow transfer should not move all frames ahead
+		lead += ((int64_t)(done - now) - (int64_t)lead) / 8;
+		if (lead > REPLAY_LEAD_MAX)
+			lead = REPLAY_LEAD_MAX;
+
+		pthread_mutex_lock(&rp->lock);
+		int k = 0;
+		for (; k < n; k++)
+		{
+			int64_t err = (int64_t)(done - due[k]);
+			uint32_t abs_err = (uint32_t)(err < 0 ? -err : err);
+			rp->hist[abs_err / JITTER_STEP < JITTER_BUCKETS ? abs_err / JITTER_STEP : JITTER_BUCKETS - 1]++;
+			rp->err_sum += err;
+			if (abs_err > rp->err_max)
+				rp->err_max = abs_err;
+		}
+		rp->sent += n;
+		rp->passes = pass;
+		pthread_mutex_unlock(&rp->lock);
+	}
+
+	pthread_mutex_lock(&rp->lock);
+	rp->status = status;
+	pthread_mutex_unlock(&rp->lock);
+	ATOMIC_STORE(&rp->running, FALSE);
+	return NULL;
+}
+
+/*
+  Fill a REPLAY_STATUS from the replay.
+*/
+static void replay_fill(replay_t *rp, REPLAY_STATUS *st)
+{
+	unsigned long *out[2] = { &st->Median, &st->P99 };
+	const unsigned long per_mille[2] = { 500, 990 };
+	memset(st, 0, sizeof(REPLAY_STATUS));
+	pthread_mutex_lock(&rp->lock);
+	hist_percentiles(rp->hist, rp->sent, rp->err_max, per_mille, out, 2);
+	st->Running = ATOMIC_LOAD(&rp->running);
+	st->NumFrames = rp->sent;
+	st->FileFrames = rp->cnt;
+	st->Loops = rp->passes;
+	st->MeanError = rp->sent ? (long)(rp->err_sum / (int64_t)rp->sent) : 0;
+	st->Max = rp->err_max;
+	st->Status = rp->status;
+	pthread_mutex_unlock(&rp->lock);
+}
+#endif
+
+/*
+  Stop the replay and free it, the final status goes to st unless NULL.
+*/
+static void replay_stop(REPLAY_STATUS *st)
+{
+#ifndef _MSC_VER
+	replay_t *rp = replay;
+	if (st)
+		memset(st, 0, sizeof(REPLAY_STATUS));
+	if (rp == NULL)
+		return;
+	ATOMIC_STORE(&rp->stop, TRUE);
+	pthread_join(rp->thread, NULL);
+	replay = NULL;
+	if (st)
+		replay_fill(rp, st);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tReplay stopped, frames sent: %lu, largest scheduling error: %lu usec\n",
+			rp->sent, (unsigned long)rp->err_max);
+		writelog(log_msg);
+	}
+	pthread_mutex_destroy(&rp->lock);
+	free(rp->frame);
+	free(rp);
+#endif
+}
+
+/*
+  Load a capture file and start replaying it on the connected CAN channel.
+  A replay that has run to its end is replaced.
+*/
+static int32_t replay_start(const REPLAY_CONFIG *cfg)
+{
+#ifndef _MSC_VER
+	if (replay && ATOMIC_LOAD(&replay->running))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: replay already running");
+		return J2534_ERR_NOT_UNIQUE;
+	}
+	if (cfg->pPath == NULL || cfg->pPath[0] == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: invalid replay path");
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+	if (cfg->Format < J2534_CAPTURE_CANDUMP || cfg->Format > J2534_CAPTURE_INDEXED)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: invalid replay format");
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+	if (!(cfg->Speed >= 0))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: invalid replay speed");
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+	if (con->channel != CAN)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: replay needs a CAN channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+	replay_stop(NULL);
+
+	replay_t *rp = (replay_t*)calloc(1, sizeof(replay_t));
+	if (rp == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	int32_t r = replay_load(rp, cfg);
+	if (r != J2534_NOERROR)
+	{
+		free(rp->frame);
+		free(rp);
+		return r;
+	}
+	rp->loops = cfg->Loops;
+	rp->speed = cfg->Speed > 0 ? cfg->Speed : 1.0;
+	rp->running = TRUE;
+	pthread_mutex_init(&rp->lock, NULL);
+	if (pthread_create(&rp->thread, NULL, replay_thread, rp) != 0)
+	{
+		pthread_mutex_destroy(&rp->lock);
+		free(rp->frame);
+		free(rp);
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start replay thread");
+		return J2534_ERR_FAILED;
+	}
+	replay = rp;
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tReplaying %lu frames over %.3f s\n",
+			rp->cnt, rp->frame[rp->cnt - 1].offset / 1e6 / rp->speed);
+		writelog(log_msg);
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: replay not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Status of the running or finished replay for J2534_READ_REPLAY_STATUS.
+*/
+static int32_t replay_status(REPLAY_STATUS *st)
+{
+#ifndef _MSC_VER
+	if (replay == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: replay not started");
+		return J2534_ERR_FAILED;
+	}
+	replay_fill(replay, st);
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: replay not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#ifndef _MSC_VER
+/*
+  Battery voltage sampler thread, asks for the pin 16 voltage every period
+  msec.  The replies are stored by the USB event thread, so the sampler
+  never waits for the device and application commands are not held up.
+*/
+static void *vbatt_thread(void *arg)
+{
+	uint8_t cmd[] = "atr 16\r\n";
+	pthread_mutex_lock(&vbatt->lock);
+	while (!vbatt->stop)
+	{
+		pthread_mutex_unlock(&vbatt->lock);
+		struct timespec deadline;
+		abs_deadline(&deadline, vbatt->period);
+		int bytes_written = 0;
+		int r = usb_bulk(endpoint->addr_out,
+			cmd, (int)strlen((const char*)cmd), &bytes_written, 1000);
+		if (r != LIBUSB_SUCCESS && write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tBattery voltage request failed: %s\n", libusb_error_name(r));
+			writelog(log_msg);
+		}
+
+		pthread_mutex_lock(&vbatt->lock);
+		while (!vbatt->stop
+			&& pthread_cond_timedwait(&vbatt->cond, &vbatt->lock, &deadline) != ETIMEDOUT)
+			;
+	}
+	pthread_mutex_unlock(&vbatt->lock);
+	return NULL;
+}
+#endif
+
+/*
+  Stop the battery voltage sampler, J2534_READ_VBATT asks the device again.
+*/
+static void vbatt_stop()
+{
+#ifndef _MSC_VER
+	if (!vbatt->active)
+		return;
+	pthread_mutex_lock(&vbatt->lock);
+	vbatt->stop = TRUE;
+	pthread_cond_broadcast(&vbatt->cond);
+	pthread_mutex_unlock(&vbatt->lock);
+	pthread_join(vbatt->thread, NULL);
+	vbatt->active = FALSE;
+#endif
+}
+
+/*
+  Start sampling the battery voltage every period msec.
+*/
+static int32_t vbatt_start(const unsigned long period)
+{
+#ifndef _MSC_VER
+	if (vbatt->active)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: battery voltage sampler already running");
+		return J2534_ERR_NOT_UNIQUE;
+	}
+	if (period < VBATT_MIN_PERIOD)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: sample period must be at least %d msec", VBATT_MIN_PERIOD);
+		return J2534_ERR_INVALID_IOCTL_VALUE;
+	}
+
+	// the replies are picked up by the USB event thread
+	int u = usb_event_start();
+	if (u != LIBUSB_SUCCESS)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+			libusb_error_name(u));
+		return error_map(u);
+	}
+	pthread_mutex_lock(&vbatt->lock);
+	vbatt->seq = 0;
+	vbatt->period = period;
+	vbatt->stop = FALSE;
+	vbatt->active = TRUE;
+	pthread_mutex_unlock(&vbatt->lock);
+	if (pthread_create(&vbatt->thread, NULL, vbatt_thread, NULL) != 0)
+	{
+		vbatt->active = FALSE;
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start battery voltage sampler");
+		return J2534_ERR_FAILED;
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: battery voltage sampler not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Return the latest sample of the battery voltage sampler, waiting up to
+  2 seconds for the first one.
+*/
+static int32_t vbatt_latest(uint32_t *mv)
+{
+#ifndef _MSC_VER
+	struct timespec deadline;
+	abs_deadline(&deadline, 2000);
+	pthread_mutex_lock(&vbatt->lock);
+	while (vbatt->seq == 0
+		&& pthread_cond_timedwait(&vbatt->cond, &vbatt->lock, &deadline) != ETIMEDOUT)
+		;
+	int32_t r = J2534_ERR_TIMEOUT;
+	if (vbatt->seq > 0)
+	{
+		*mv = (uint32_t)vbatt->sample[(vbatt->seq - 1) & (VBATT_SAMPLES - 1)].Voltage;
+		r = J2534_NOERROR;
+	}
+	pthread_mutex_unlock(&vbatt->lock);
+	if (r != J2534_NOERROR)
+		snprintf(LAST_ERROR, LE_LEN, "Error: no battery voltage sample received");
+	return r;
+#else
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Copy the battery voltage samples from sequence number h->Next on.
+*/
+static int32_t vbatt_history(VBATT_HISTORY *h)
+{
+#ifndef _MSC_VER
+	if (h->pSamples == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pSamples must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	pthread_mutex_lock(&vbatt->lock);
+	unsigned long oldest = vbatt->seq > VBATT_SAMPLES ? vbatt->seq - VBATT_SAMPLES : 0;
+	unsigned long next = h->Next;
+	if (next > vbatt->seq)
+		next = oldest;	// the sampler was restarted since
+	h->Lost = next < oldest ? oldest - next : 0;
+	if (next < oldest)
+		next = oldest;
+	unsigned long n = 0;
+	for (; next < vbatt->seq && n < h->NumSamples; next++)
+		h->pSamples[n++] = vbatt->sample[next & (VBATT_SAMPLES - 1)];
+	pthread_mutex_unlock(&vbatt->lock);
+	h->NumSamples = n;
+	h->Next = next;
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: battery voltage sampler not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Send a request to the j2534d daemon connected on sock and wait for its
+  response.  Up to rsp_cap bytes of response payload are copied to rsp_data,
+  a file descriptor passed along with the response is returned in fd.
+*/
+static int32_t daemon_io(const int sock, j2534d_req_t *req, const void *req_data,
+	j2534d_rsp_t *rsp, void *rsp_data, const uint32_t rsp_cap, int *fd)
+{
+#ifndef _MSC_VER
+	struct iovec iov[2];
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	iov[0].iov_base = req;
+	iov[0].iov_len = sizeof(j2534d_req_t);
+	iov[1].iov_base = (void*)req_data;
+	iov[1].iov_len = req->len;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = req->len ? 2 : 1;
+	if (sendmsg(sock, &mh, MSG_NOSIGNAL) != (ssize_t)(sizeof(j2534d_req_t) + req->len))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: j2534d request failed: %s", strerror(errno));
+		return J2534_ERR_DEVICE_NOT_CONNECTED;
+	}
+
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	memset(&mh, 0, sizeof(mh));
+	iov[0].iov_base = rsp;
+	iov[0].iov_len = sizeof(j2534d_rsp_t);
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	if (recvmsg(sock, &mh, MSG_WAITALL) != sizeof(j2534d_rsp_t))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: j2534d connection lost");
+		return J2534_ERR_DEVICE_NOT_CONNECTED;
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	{
+		int passed_fd;
+		memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+		if (fd)
+			*fd = passed_fd;
+		else
+			close(passed_fd);
+	}
+
+	// read the payload, anything beyond rsp_cap is discarded
+	uint32_t done = 0;
+	while (done < rsp->len)
+	{
+		uint8_t scratch[256];
+		uint8_t *dst = done < rsp_cap ? (uint8_t*)rsp_data + done : scratch;
+		size_t want = done < rsp_cap ? rsp_cap - done : sizeof(scratch);
+		if (want > rsp->len - done)
+			want = rsp->len - done;
+		ssize_t n = recv(sock, dst, want, MSG_WAITALL);
+		if (n <= 0)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: j2534d connection lost");
+			return J2534_ERR_DEVICE_NOT_CONNECTED;
+		}
+		done += (uint32_t)n;
+	}
+	if (rsp->status != J2534_NOERROR)
+	{
+		rsp->error[J2534D_ERR_LEN - 1] = '\0';
+		snprintf(LAST_ERROR, LE_LEN, "%s", rsp->error);
+	}
+	return rsp->status;
+#else
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Send a request without payload and return the daemon's status.
+*/
+static int32_t daemon_simple(const int sock, const uint32_t op, const uint32_t arg0, const uint32_t arg1)
+{
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	memset(&req, 0, sizeof(req));
+	req.op = op;
+	req.arg[0] = arg0;
+	req.arg[1] = arg1;
+	return daemon_io(sock, &req, NULL, &rsp, NULL, 0, NULL);
+}
+
+/*
+  Connect to the j2534d daemon listening on path, the default socket if
+  path is empty, and open its device.
+*/
+static int32_t daemon_dial(const char *path, int *sock, uint32_t *device_id)
+{
+#ifndef _MSC_VER
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path[0] ? path : J2534D_SOCKET);
+
+	*sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (*sock < 0 || connect(*sock, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tCannot connect to j2534d at %s: %s\n",
+				addr.sun_path, strerror(errno));
+			writelog(log_msg);
+		}
+		snprintf(LAST_ERROR, LE_LEN, "Cannot connect to j2534d: %s", strerror(errno));
+		if (*sock >= 0)
+			close(*sock);
+		*sock = -1;
+		return J2534_ERR_DEVICE_NOT_CONNECTED;
+	}
+
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	memset(&req, 0, sizeof(req));
+	req.op = J2534D_OPEN;
+	int32_t r = daemon_io(*sock, &req, NULL, &rsp, NULL, 0, NULL);
+	if (r != J2534_NOERROR)
+	{
+		close(*sock);
+		*sock = -1;
+		return r;
+	}
+	*device_id = rsp.arg[0];
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: j2534d is not supported on this platform");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Connect to the j2534d daemon listening on path instead of opening the
+  USB device.
+*/
+static int32_t daemon_open(const char *path, unsigned long *pDeviceID)
+{
+#ifndef _MSC_VER
+	uint32_t device_id;
+	int32_t r = daemon_dial(path, &con->sock, &device_id);
+	if (r != J2534_NOERROR)
+		return r;
+	con->backend = DAEMON_BACKEND;
+	con->device_id = (uint8_t)device_id;
+	*pDeviceID = con->device_id;
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tDeviceID %lu opened through j2534d at %s\n",
+			*pDeviceID, path[0] ? path : J2534D_SOCKET);
+		writelog(log_msg);
+	}
+	LAST_ERROR[0] = '\0';
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: j2534d is not supported on this platform");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Map the RX ring the daemon passed along with a connect response and close
+  the descriptor.  Return NULL with LAST_ERROR set on failure.
+*/
+static j2534d_ring_t *daemon_map(const int fd, const size_t len)
+{
+#ifndef _MSC_VER
+	j2534d_ring_t *ring = (j2534d_ring_t*)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring != MAP_FAILED)
+		return ring;
+	snprintf(LAST_ERROR, LE_LEN, "Error: cannot map j2534d RX ring: %s", strerror(errno));
+#endif
+	return NULL;
+}
+
+/*
+  Unmap the RX ring of the connected channel.
+*/
+static void daemon_unmap()
+{
+#ifndef _MSC_VER
+	if (con->ring)
+		munmap(con->ring, con->ring_len);
+#endif
+	con->ring = NULL;
+	con->ring_len = 0;
+}
+
+/*
+  Close the connection to the j2534d daemon.
+*/
+static int32_t daemon_close()
+{
+	int32_t r = daemon_simple(con->sock, J2534D_CLOSE, 0, 0);
+	daemon_unmap();
+#ifndef _MSC_VER
+	close(con->sock);
+#endif
+	con->sock = -1;
+	con->backend = USB_BACKEND;
+	return r;
+}
+
+/*
+  Connect a protocol channel through the j2534d daemon and map the shared
+  RX ring it publishes received messages to.
+*/
+static int32_t daemon_connect(const unsigned long protocolID, const unsigned long flags,
+	const unsigned long baud, unsigned long *pChannelID)
+{
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	int fd = -1;
+	memset(&req, 0, sizeof(req));
+	req.op = J2534D_CONNECT;
+	req.arg[0] = protocolID;
+	req.arg[1] = flags;
+	req.arg[2] = baud;
+	int32_t r = daemon_io(con->sock, &req, NULL, &rsp, NULL, 0, &fd);
+	if (r != J2534_NOERROR)
+		return r;
+	daemon_unmap();
+	con->ring_len = sizeof(j2534d_ring_t) + rsp.arg[1];
+	con->ring = daemon_map(fd, con->ring_len);
+	if (con->ring == NULL)
+	{
+		daemon_simple(con->sock, J2534D_DISCONNECT, protocolID, 0);
+		return J2534_ERR_FAILED;
+	}
+	*pChannelID = rsp.arg[0];
+	con->protocol_id = protocolID;
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tj2534d RX ring mapped, %u bytes\nConnected\n", rsp.arg[1]);
+		writelog(log_msg);
+	}
+	return J2534_NOERROR;
+}
+
+/*
+  Disconnect the protocol channel in the j2534d daemon.
+*/
+static int32_t daemon_disconnect(const unsigned long ChannelID)
+{
+	int32_t r = daemon_simple(con->sock, J2534D_DISCONNECT, ChannelID, 0);
+	daemon_unmap();
+	return r;
+}
+
+/*
+  Read messages the j2534d daemon published to the RX ring.  Reading does
+  not involve the daemon.
+*/
+static int32_t daemon_read_msgs(PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs, const uint32_t timeout)
+{
+	if (con->ring == NULL)
+	{
+		*pNumMsgs = 0;
+		snprintf(LAST_ERROR, LE_LEN, "Error: channel not connected");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+	return ring_read_msgs(con->ring, pMsg, pNumMsgs, timeout, read_batch);
+}
+
+/*
+  Send messages through the j2534d daemon.
+*/
+static int32_t daemon_write_msgs(const unsigned long ChannelID, const PASSTHRU_MSG *pMsg,
+	unsigned long *pNumMsgs, const unsigned long timeout)
+{
+	unsigned long i = 0;
+	uint32_t len = 0;
+	for (; i < *pNumMsgs; i++)
+	{
+		if (pMsg[i].DataSize == 0 || pMsg[i].DataSize > PM_DATA_LEN)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Invalid message size: %lu", pMsg[i].DataSize);
+			*pNumMsgs = 0;
+			return J2534_ERR_INVALID_MSG;
+		}
+		len += J2534D_MSG_SIZE(pMsg[i].DataSize);
+	}
+
+	uint8_t *payload = (uint8_t*)malloc(len ? len : 1);
+	if (payload == NULL)
+	{
+		*pNumMsgs = 0;
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	uint32_t off = 0;
+	for (i = 0; i < *pNumMsgs; i++)
+		off += daemon_msg_put((j2534d_msg_t*)(payload + off), &pMsg[i]);
+
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	memset(&req, 0, sizeof(req));
+	req.op = J2534D_WRITE_MSGS;
+	req.arg[0] = ChannelID;
+	req.arg[1] = (uint32_t)*pNumMsgs;
+	req.arg[2] = timeout;
+	req.len = len;
+	int32_t r = daemon_io(con->sock, &req, payload, &rsp, NULL, 0, NULL);
+	free(payload);
+	*pNumMsgs = r == J2534_ERR_DEVICE_NOT_CONNECTED ? 0 : rsp.arg[0];
+	return r;
+}
+
+/*
+  Start a message filter through the j2534d daemon.  The daemon also
+  applies the filter to what it publishes to this client.
+*/
+static int32_t daemon_start_filter(const unsigned long ChannelID, const unsigned long FilterType,
+	const PASSTHRU_MSG *pMaskMsg, const PASSTHRU_MSG *pPatternMsg,
+	const PASSTHRU_MSG *pFlowControlMsg, unsigned long *pMsgID)
+{
+	uint8_t payload[3 * J2534D_MSG_SIZE(12)];
+	uint32_t off = daemon_msg_put((j2534d_msg_t*)payload, pMaskMsg);
+	off += daemon_msg_put((j2534d_msg_t*)(payload + off), pPatternMsg);
+	if (pFlowControlMsg)
+		off += daemon_msg_put((j2534d_msg_t*)(payload + off), pFlowControlMsg);
+
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	memset(&req, 0, sizeof(req));
+	req.op = J2534D_START_FILTER;
+	req.arg[0] = ChannelID;
+	req.arg[1] = FilterType;
+	req.arg[2] = pFlowControlMsg != NULL;
+	req.len = off;
+	int32_t r = daemon_io(con->sock, &req, payload, &rsp, NULL, 0, NULL);
+	if (r == J2534_NOERROR)
+		*pMsgID = rsp.arg[0];
+	return r;
+}
+
+/*
+  Read the version strings through the j2534d daemon.
+*/
+static int32_t daemon_read_version(char *pFirmwareVersion, char *pDllVersion, char *pApiVersion)
+{
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	char ver[3][MAX_LEN];
+	memset(&req, 0, sizeof(req));
+	memset(ver, 0, sizeof(ver));
+	req.op = J2534D_READ_VERSION;
+	int32_t r = daemon_io(con->sock, &req, NULL, &rsp, ver, sizeof(ver), NULL);
+	if (r == J2534_NOERROR)
+	{
+		ver[0][MAX_LEN - 1] = ver[1][MAX_LEN - 1] = ver[2][MAX_LEN - 1] = '\0';
+		strcpy(pFirmwareVersion, ver[0]);
+		strcpy(pDllVersion, ver[1]);
+		strcpy(pApiVersion, ver[2]);
+	}
+	return r;
+}
+
+/*
+  Forward an Ioctl to the j2534d daemon.  The receive buffer lives in this
+  process so CLEAR_RX_BUFFER is handled here.
+*/
+static int32_t daemon_ioctl(const unsigned long ChannelID, const unsigned long ioctlID,
+	const void *pInput, void *pOutput)
+{
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	memset(&req, 0, sizeof(req));
+	req.op = J2534D_IOCTL;
+	req.arg[0] = ChannelID;
+	req.arg[1] = ioctlID;
+
+	if (ioctlID == J2534_CLEAR_RX_BUFFER)
+	{
+		if (con->ring)
+			ATOMIC_STORE(&con->ring->tail, ATOMIC_LOAD(&con->ring->head));
+		return J2534_NOERROR;
+	}
+	if (ioctlID == J2534_GET_CONFIG || ioctlID == J2534_SET_CONFIG)
+	{
+		const SCONFIG_LIST *inputlist = pInput;
+		if (inputlist == NULL)
+			return J2534_ERR_NULL_PARAMETER;
+		uint32_t *pairs = (uint32_t*)malloc(inputlist->NumOfParams * 2 * sizeof(uint32_t) + 1);
+		if (pairs == NULL)
+			return J2534_ERR_EXCEEDED_LIMIT;
+		unsigned long i = 0;
+		for (; i < inputlist->NumOfParams; i++)
+		{
+			pairs[2 * i] = inputlist->ConfigPtr[i].Parameter;
+			pairs[2 * i + 1] = inputlist->ConfigPtr[i].Value;
+		}
+		req.len = inputlist->NumOfParams * 2 * sizeof(uint32_t);
+		int32_t r = daemon_io(con->sock, &req, pairs, &rsp, pairs, req.len, NULL);
+		if (r == J2534_NOERROR && ioctlID == J2534_GET_CONFIG)
+		{
+			for (i = 0; i < inputlist->NumOfParams; i++)
+				inputlist->ConfigPtr[i].Value = pairs[2 * i + 1];
+		}
+		free(pairs);
+		return r;
+	}
+	if (ioctlID == J2534_READ_VBATT)
+	{
+		if (pOutput == NULL)
+			return J2534_ERR_NULL_PARAMETER;
+		int32_t r = daemon_io(con->sock, &req, NULL, &rsp, NULL, 0, NULL);
+		if (r == J2534_NOERROR)
+			*(uint32_t*)pOutput = rsp.arg[0];
+		return r;
+	}
+	if (ioctlID == J2534_FAST_INIT)
+	{
+		uint8_t payload[J2534D_MSG_SIZE(PM_DATA_LEN)];
+		if (pInput == NULL || pOutput == NULL)
+			return J2534_ERR_NULL_PARAMETER;
+		req.len = daemon_msg_put((j2534d_msg_t*)payload, pInput);
+		int32_t r = daemon_io(con->sock, &req, payload, &rsp, payload, sizeof(payload), NULL);
+		if (r == J2534_NOERROR)
+			daemon_msg_get(pOutput, (j2534d_msg_t*)payload);
+		return r;
+	}
+	if (ioctlID >= J2534_GET_RX_EVENT_FD)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Ioctl not supported through j2534d");
+		return J2534_ERR_NOT_SUPPORTED;
+	}
+	return daemon_io(con->sock, &req, NULL, &rsp, NULL, 0, NULL);
+}
+
+/*
+  Free a gateway that the USB event thread no longer sees.
+*/
+static void gateway_free(gateway_t *gw)
+{
+#ifndef _MSC_VER
+	int i = 0;
+	for (; i < GW_XFERS; i++)
+		libusb_free_transfer(gw->xfer[i].xfer);
+	if (gw->sock >= 0)
+		close(gw->sock);
+	free(gw->rule);
+	free(gw->block);
+	free(gw);
+#endif
+}
+
+/*
+  Copy the gateway statistics, called with CB_LOCK held.
+*/
+static void gateway_fill(const gateway_t *gw, GATEWAY_STATS *st)
+{
+#ifndef _MSC_VER
+	unsigned long *out[2] = { &st->Median, &st->P99 };
+	const unsigned long per_mille[2] = { 500, 990 };
+	memset(st, 0, sizeof(GATEWAY_STATS));
+	hist_percentiles(gw->hist, gw->lat_cnt, gw->lat_max, per_mille, out, 2);
+	st->NumFrames = gw->frames;
+	st->Rewritten = gw->rewritten;
+	st->Blocked = gw->blocked;
+	st->Dropped = gw->dropped;
+	st->Max = gw->lat_max;
+#endif
+}
+
+/*
+  Stop forwarding and free the gateway once its transfers have completed,
+  the final statistics go to st unless NULL.
+*/
+static void gateway_stop(GATEWAY_STATS *st)
+{
+#ifndef _MSC_VER
+	if (st)
+		memset(st, 0, sizeof(GATEWAY_STATS));
+	CB_LOCK();
+	gateway_t *gw = gateway;
+	gateway = NULL;
+	CB_UNLOCK();
+	if (gw == NULL)
+		return;
+
+	// OUT transfers complete on the USB event thread within their timeout
+	while (ATOMIC_LOAD(&usb_ev->running))
+	{
+		CB_LOCK();
+		int inflight = gw->inflight;
+		CB_UNLOCK();
+		if (inflight == 0)
+			break;
+		usleep(1000);
+	}
+	if (gw->sock >= 0)
+	{
+		while (gw->pending > 0 && gateway_responses(gw, TRUE))
+			;
+		if (!gw->lost)
+		{
+			fcntl(gw->sock, F_SETFL, 0);
+			daemon_simple(gw->sock, J2534D_DISCONNECT, gw->channel_id, 0);
+		}
+	}
+	if (st)
+		gateway_fill(gw, st);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tGateway stopped, frames forwarded: %lu, blocked: %lu, dropped: %lu\n",
+			gw->frames, gw->blocked, gw->dropped);
+		writelog(log_msg);
+	}
+	gateway_free(gw);
+#endif
+}
+
+/*
+  Start forwarding the frames received on the connected CAN channel.
+*/
+static int32_t gateway_start(const GATEWAY_CONFIG *cfg)
+{
+#ifndef _MSC_VER
+	if (gateway)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: gateway already running");
+		return J2534_ERR_NOT_UNIQUE;
+	}
+	if (con->channel != CAN)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: gateway needs a CAN channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+	if ((cfg->NumRewrite && cfg->pRewrite == NULL) || (cfg->NumBlock && cfg->pBlock == NULL))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: %s must not be NULL", cfg->NumBlock && cfg->pBlock == NULL
+			? "pBlock" : "pRewrite");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	gateway_t *gw = (gateway_t*)calloc(1, sizeof(gateway_t));
+	if (gw == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	gw->sock = -1;
+	gw->rule = (GATEWAY_RULE*)malloc((cfg->NumRewrite ? cfg->NumRewrite : 1) * sizeof(GATEWAY_RULE));
+	gw->block = (uint32_t*)malloc((cfg->NumBlock ? cfg->NumBlock : 1) * sizeof(uint32_t));
+	if (gw->rule == NULL || gw->block == NULL)
+	{
+		gateway_free(gw);
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	unsigned long i = 0;
+	for (; i < cfg->NumRewrite; i++)
+	{
+		gw->rule[i] = cfg->pRewrite[i];
+		gw->rule[i].CanID &= 0x1FFFFFFF;
+	}
+	gw->rules = cfg->NumRewrite;
+	qsort(gw->rule, gw->rules, sizeof(GATEWAY_RULE), gateway_rule_cmp);
+	for (i = 0; i < cfg->NumBlock; i++)
+		gw->block[i] = (uint32_t)cfg->pBlock[i] & 0x1FFFFFFF;
+	gw->blocks = cfg->NumBlock;
+	qsort(gw->block, gw->blocks, sizeof(uint32_t), gateway_id_cmp);
+
+	int32_t r = J2534_NOERROR;
+	if (cfg->pTarget)
+	{
+		// a CAN channel on the device of another daemon, its received frames are not wanted
+		uint32_t device_id;
+		r = daemon_dial(cfg->pTarget, &gw->sock, &device_id);
+		if (r == J2534_NOERROR)
+		{
+			j2534d_req_t req;
+			j2534d_rsp_t rsp;
+			memset(&req, 0, sizeof(req));
+			req.op = J2534D_CONNECT;
+			req.arg[0] = 5;	// CAN
+			req.arg[1] = cfg->Flags;
+			req.arg[2] = cfg->Baudrate;
+			r = daemon_io(gw->sock, &req, NULL, &rsp, NULL, 0, NULL);
+			if (r == J2534_NOERROR)
+				gw->channel_id = rsp.arg[0];
+		}
+	}
+	else
+	{
+		for (i = 0; i < GW_XFERS && r == J2534_NOERROR; i++)
+		{
+			gw->xfer[i].gw = gw;
+			gw->xfer[i].xfer = libusb_alloc_transfer(0);
+			if (gw->xfer[i].xfer == NULL)
+			{
+				snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+				r = J2534_ERR_EXCEEDED_LIMIT;
+			}
+		}
+	}
+	if (r != J2534_NOERROR)
+	{
+		gateway_free(gw);
+		return r;
+	}
+
+	// frames are forwarded by the USB event thread from now on
+	int u = usb_event_start();
+	if (u != LIBUSB_SUCCESS)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+			libusb_error_name(u));
+		if (gw->sock >= 0)
+			daemon_simple(gw->sock, J2534D_DISCONNECT, gw->channel_id, 0);
+		gateway_free(gw);
+		return error_map(u);
+	}
+	// requests are written from the USB event thread, which must never block on the daemon
+	if (gw->sock >= 0)
+		fcntl(gw->sock, F_SETFL, O_NONBLOCK);
+	CB_LOCK();
+	gateway = gw;
+	CB_UNLOCK();
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: gateway not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Statistics of the running gateway for J2534_READ_GATEWAY_STATS.
+*/
+static int32_t gateway_read(GATEWAY_STATS *st)
+{
+#ifndef _MSC_VER
+	CB_LOCK();
+	if (gateway == NULL)
+	{
+		CB_UNLOCK();
+		snprintf(LAST_ERROR, LE_LEN, "Error: gateway not started");
+		return J2534_ERR_FAILED;
+	}
+	gateway_fill(gateway, st);
+	CB_UNLOCK();
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: gateway not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+#ifdef __linux__
+/*
+  Set the kernel CAN_RAW filter list to the CAN ID part of the pass
+  filters so frames nobody asked for are dropped before they are copied
+  to user space.  The frame format is part of the kernel filter, so an
+  11-bit filter does not let 29-bit frames with the same low bits through.
+  The full mask and pattern and the block filters are applied by
+  socketcan_pass.
+*/
+static void socketcan_set_kernel_filter()
+{
+	struct can_filter kf[MAX_FILTERS];
+	int cnt = 0;
+	int i = 0;
+	if (sc->sock < 0)
+		return;
+	CB_LOCK();
+	for (; i < MAX_FILTERS; i++)
+	{
+		const msg_filter_t *f = &filters[i];
+		if (!f->used || f->type != J2534_PASS_FILTER)
+			continue;
+		if (f->size < 4)
+		{
+			// mask shorter than the CAN ID, every frame may pass
+			kf[0].can_id = 0;
+			kf[0].can_mask = 0;
+			cnt = 1;
+			break;
+		}
+		uint32_t id = (f->pattern[0] << 24) | (f->pattern[1] << 16) | (f->pattern[2] << 8) | f->pattern[3];
+		uint32_t mask = (f->mask[0] << 24) | (f->mask[1] << 16) | (f->mask[2] << 8) | f->mask[3];
+		uint32_t eff = (f->tx_flags & 0x100) || (id & mask & CAN_EFF_MASK) > CAN_SFF_MASK
+			? CAN_EFF_FLAG : 0;	// CAN_29BIT_ID
+		kf[cnt].can_id = (id & mask & CAN_EFF_MASK) | eff;
+		kf[cnt].can_mask = (mask & CAN_EFF_MASK) | CAN_EFF_FLAG;
+		cnt++;
+	}
+	CB_UNLOCK();
+	setsockopt(sc->sock, SOL_CAN_RAW, CAN_RAW_FILTER, cnt ? kf : NULL, cnt * sizeof(struct can_filter));
+}
+
+/*
+  Apply the pass and block filters to a received CAN frame.
+*/
+static int socketcan_pass(const PASSTHRU_MSG *msg)
+{
+	int pass = FALSE;
+	int seen = 0;
+	int i = 0;
+	CB_LOCK();
+	for (; i < MAX_FILTERS && seen < filter_cnt; i++)
+	{
+		const msg_filter_t *f = &filters[i];
+		if (!f->used)
+			continue;
+		seen++;
+		if (!filter_match(f, msg))
+			continue;
+		if (f->type == J2534_BLOCK_FILTER)
+		{
+			pass = FALSE;
+			break;
+		}
+		if (f->type == J2534_PASS_FILTER)
+			pass = TRUE;
+	}
+	CB_UNLOCK();
+	return pass;
+}
+
+/*
+  Return the next received CAN frame passing the message filters in msg,
+  reading up to SC_BATCH frames per recvmmsg call.  FALSE if none is waiting.
+*/
+static int socketcan_raw_recv(PASSTHRU_MSG *msg)
+{
+	while (TRUE)
+	{
+		if (sc->rx_pos == sc->rx_cnt)
+		{
+			int i = 0;
+			for (; i < SC_BATCH; i++)
+				sc->hdr[i].msg_hdr.msg_controllen = sizeof(sc->cmsg[i]);
+			int n = recvmmsg(sc->sock, sc->hdr, SC_BATCH, MSG_DONTWAIT, NULL);
+			if (n <= 0)
+				return FALSE;
+			sc->rx_pos = 0;
+			sc->rx_cnt = n;
+		}
+
+		int k = sc->rx_pos++;
+		const struct can_frame *frame = &sc->frame[k];
+		const struct msghdr *hdr = &sc->hdr[k].msg_hdr;
+		if (frame->can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG))
+			continue;
+
+		uint32_t id = frame->can_id & ((frame->can_id & CAN_EFF_FLAG) ? CAN_EFF_MASK : CAN_SFF_MASK);
+		uint8_t len = frame->can_dlc > 8 ? 8 : frame->can_dlc;
+		msg->ProtocolID = con->protocol_id;
+		msg->RxStatus = (frame->can_id & CAN_EFF_FLAG) ? 0x100 : 0;	// CAN_29BIT_ID
+		if (hdr->msg_flags & MSG_CONFIRM)
+			msg->RxStatus |= 1;	// TX Loopback msg status
+		msg->TxFlags = 0;
+		msg->Timestamp = 0;
+		struct cmsghdr *cm = CMSG_FIRSTHDR((struct msghdr*)hdr);
+		for (; cm; cm = CMSG_NXTHDR((struct msghdr*)hdr, cm))
+		{
+			if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SO_TIMESTAMP)
+			{
+				struct timeval tv;
+				memcpy(&tv, CMSG_DATA(cm), sizeof(tv));
+				msg->Timestamp = (uint32_t)((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+			}
+		}
+		msg->Data[0] = id >> 24;
+		msg->Data[1] = id >> 16;
+		msg->Data[2] = id >> 8;
+		msg->Data[3] = id;
+		memcpy(msg->Data + 4, frame->data, len);
+		msg->DataSize = 4 + len;
+		msg->ExtraDataIndex = msg->DataSize;
+		if (socketcan_pass(msg))
+			return TRUE;
+	}
+}
+
+/*
+  Return the next ISO15765 message received by one of the ISO-TP sockets
+  in msg.  FALSE if none is waiting.
+*/
+static int socketcan_tp_recv(PASSTHRU_MSG *msg)
+{
+	int i = 0;
+	for (; i < MAX_FILTERS; i++)
+	{
+		// continue after the socket read last so one busy peer can't starve the others
+		socketcan_tp_t *tp = &sc->tp[(sc->tp_next + i) % MAX_FILTERS];
+		if (tp->filter_id == 0)
+			continue;
+		ssize_t n = recv(tp->sock, msg->Data + 4, PM_DATA_LEN - 4, MSG_DONTWAIT);
+		if (n < 0)
+			continue;
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		uint32_t id = tp->rx_id & CAN_EFF_MASK;
+		msg->ProtocolID = con->protocol_id;
+		msg->RxStatus = (tp->rx_id & CAN_EFF_FLAG) ? 0x100 : 0;	// CAN_29BIT_ID
+		msg->TxFlags = 0;
+		msg->Timestamp = (uint32_t)((uint64_t)now.tv_sec * 1000000 + now.tv_usec);
+		msg->Data[0] = id >> 24;
+		msg->Data[1] = id >> 16;
+		msg->Data[2] = id >> 8;
+		msg->Data[3] = id;
+		msg->DataSize = 4 + n;
+		msg->ExtraDataIndex = msg->DataSize;
+		sc->tp_next = (sc->tp_next + i + 1) % MAX_FILTERS;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+  Wait up to timeout msec for any socket of the channel to become readable
+  (events POLLIN) or writable (POLLOUT).
+*/
+static void socketcan_poll(const short events, const int timeout)
+{
+	struct pollfd pfd[MAX_FILTERS + 1];
+	int cnt = 0;
+	int i = 0;
+	if (sc->sock >= 0)
+	{
+		pfd[cnt].fd = sc->sock;
+		pfd[cnt++].events = events;
+	}
+	for (; i < MAX_FILTERS; i++)
+	{
+		if (sc->tp[i].filter_id == 0)
+			continue;
+		pfd[cnt].fd = sc->tp[i].sock;
+		pfd[cnt++].events = events;
+	}
+	poll(pfd, cnt, timeout);
+}
+
+/*
+  Milliseconds left until a CLOCK_MONOTONIC deadline in usec, 0 once passed.
+*/
+static int socketcan_remaining(const uint64_t deadline)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t t = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	return t >= deadline ? 0 : (int)((deadline - t + 999) / 1000);
+}
+
+static uint64_t socketcan_deadline(const unsigned long timeout)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 + (uint64_t)timeout * 1000;
+}
+
+/*
+  Close the ISO-TP socket of a flow control filter.
+*/
+static void socketcan_tp_close(socketcan_tp_t *tp)
+{
+	if (tp->filter_id == 0)
+		return;
+	close(tp->sock);
+	tp->sock = -1;
+	tp->filter_id = 0;
+}
+
+/*
+  Close every socket of the connected channel.
+*/
+static void socketcan_close_channel()
+{
+	int i = 0;
+	for (; i < MAX_FILTERS; i++)
+		socketcan_tp_close(&sc->tp[i]);
+	if (sc->sock >= 0)
+		close(sc->sock);
+	sc->sock = -1;
+	sc->connected = FALSE;
+	sc->rx_pos = 0;
+	sc->rx_cnt = 0;
+	CB_LOCK();
+	memset(filters, 0, sizeof(filters));
+	filter_cnt = 0;
+	CB_UNLOCK();
+}
+#endif
+
+/*
+  Open a SocketCAN network interface as the PassThru device.
+*/
+static int32_t socketcan_open(const char *ifname, unsigned long *pDeviceID)
+{
+#ifdef __linux__
+	memset(sc, 0, sizeof(socketcan_t));
+	sc->sock = -1;
+	snprintf(sc->ifname, sizeof(sc->ifname), "%s", ifname);
+	sc->ifindex = if_nametoindex(sc->ifname);
+	if (sc->ifindex == 0)
+	{
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tCannot find CAN interface %s: %s\n", sc->ifname, strerror(errno));
+			writelog(log_msg);
+		}
+		snprintf(LAST_ERROR, LE_LEN, "Cannot find CAN interface %s", sc->ifname);
+		return J2534_ERR_DEVICE_NOT_CONNECTED;
+	}
+
+	int i = 0;
+	for (; i < SC_BATCH; i++)
+	{
+		sc->iov[i].iov_base = &sc->frame[i];
+		sc->iov[i].iov_len = sizeof(struct can_frame);
+		sc->hdr[i].msg_hdr.msg_iov = &sc->iov[i];
+		sc->hdr[i].msg_hdr.msg_iovlen = 1;
+		sc->hdr[i].msg_hdr.msg_control = &sc->cmsg[i];
+		sc->hdr[i].msg_hdr.msg_controllen = sizeof(sc->cmsg[i]);
+	}
+	for (i = 0; i < MAX_FILTERS; i++)
+		sc->tp[i].sock = -1;
+
+	con->backend = SOCKETCAN_BACKEND;
+	con->device_id = 1;
+	snprintf(fw_version, MAX_LEN, "SocketCAN:%s", sc->ifname);	// reported by ReadVersion
+	*pDeviceID = con->device_id;
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tDeviceID %lu opened on CAN interface %s\n", *pDeviceID, sc->ifname);
+		writelog(log_msg);
+	}
+	LAST_ERROR[0] = '\0';
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: SocketCAN is not supported on this platform");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static int32_t socketcan_connect(const unsigned long protocolID, const unsigned long flags,
+	const unsigned long baud, unsigned long *pChannelID)
+{
+#ifdef __linux__
+	if (protocolID != 5 && protocolID != 6)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: SocketCAN supports CAN and ISO15765 only");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+	if (sc->connected)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: channel already connected");
+		return J2534_ERR_CHANNEL_IN_USE;
+	}
+	sc->loopback = FALSE;
+	sc->baud = baud;
+	sc->filter_id = 0;
+	sc->bs = 0;
+	sc->stmin = 0;
+	con->protocol_id = protocolID;
+	*pChannelID = protocolID;
+
+	// ISO15765 messages are sent and received by the ISO-TP socket of each
+	// flow control filter, CAN frames by a raw socket
+	if (protocolID == 6)
+	{
+		sc->connected = TRUE;
+		if (write_log)
+			writelog("Connected\n");
+		return J2534_NOERROR;
+	}
+	sc->sock = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+	struct sockaddr_can addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = sc->ifindex;
+	int on = 1;
+	if (sc->sock < 0
+		|| bind(sc->sock, (struct sockaddr*)&addr, sizeof(addr)) != 0
+		|| setsockopt(sc->sock, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on)) != 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: cannot open CAN socket on %s: %s", sc->ifname, strerror(errno));
+		if (sc->sock >= 0)
+			close(sc->sock);
+		sc->sock = -1;
+		return J2534_ERR_FAILED;
+	}
+	// nothing is received until a pass filter is started
+	setsockopt(sc->sock, SOL_CAN_RAW, CAN_RAW_FILTER, NULL, 0);
+	sc->connected = TRUE;
+	if (write_log)
+		writelog("Connected\n");
+	return J2534_NOERROR;
+#else
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static int32_t socketcan_read_msgs(PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs, const unsigned long timeout)
+{
+#ifdef __linux__
+	unsigned long msg_cnt = *pNumMsgs;
+	uint64_t deadline = socketcan_deadline(timeout);
+	uint64_t first = 0;		// host_usec() the first message was read
+	*pNumMsgs = 0;
+	while (*pNumMsgs < msg_cnt)
+	{
+		PASSTHRU_MSG *msg = &pMsg[*pNumMsgs];
+		if (con->protocol_id == 6 ? socketcan_tp_recv(msg) : socketcan_raw_recv(msg))
+		{
+			if (write_log)
+				writelogpassthrumsg(msg);
+			if ((*pNumMsgs)++ == 0)
+				first = host_usec();
+			continue;
+		}
+		uint64_t now = host_usec();
+		if (timeout == 0 || read_complete(read_batch, *pNumMsgs, msg_cnt, first, now) || now >= deadline)
+			break;
+		socketcan_poll(POLLIN, (int)((read_wait_until(read_batch, *pNumMsgs, first, deadline) - now + 999) / 1000));
+	}
+	if (write_log)
+		writelog("EndReadMsg\n");
+	if (*pNumMsgs == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "No messages received");
+		return timeout > 0 ? J2534_ERR_TIMEOUT : J2534_ERR_BUFFER_EMPTY;
+	}
+	return J2534_NOERROR;
+#else
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Send CAN frames with up to SC_BATCH frames per sendmmsg call, or ISO15765
+  messages on the ISO-TP socket whose flow control filter matches the ID.
+*/
+static int32_t socketcan_write_msgs(const PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs,
+	const unsigned long timeout)
+{
+#ifdef __linux__
+	unsigned long msg_cnt = *pNumMsgs;
+	uint64_t deadline = socketcan_deadline(timeout);
+	struct can_frame frame[SC_BATCH];
+	struct iovec iov[SC_BATCH];
+	struct mmsghdr hdr[SC_BATCH];
+	*pNumMsgs = 0;
+	while (*pNumMsgs < msg_cnt)
+	{
+		int n = 0;
+		int r = 0;
+		if (con->protocol_id == 6)
+		{
+			const PASSTHRU_MSG *msg = &pMsg[*pNumMsgs];
+			if (msg->DataSize < 4)
+			{
+				snprintf(LAST_ERROR, LE_LEN, "Invalid message size: %lu", msg->DataSize);
+				return J2534_ERR_INVALID_MSG;
+			}
+			uint32_t id = (msg->Data[0] << 24) | (msg->Data[1] << 16) | (msg->Data[2] << 8) | msg->Data[3];
+			socketcan_tp_t *tp = NULL;
+			int i = 0;
+			for (; i < MAX_FILTERS; i++)
+			{
+				if (sc->tp[i].filter_id && (sc->tp[i].tx_id & CAN_EFF_MASK) == id)
+					tp = &sc->tp[i];
+			}
+			if (tp == NULL)
+			{
+				snprintf(LAST_ERROR, LE_LEN, "Error: no flow control filter for ID %X", id);
+				return J2534_ERR_NO_FLOW_CONTROL;
+			}
+			r = send(tp->sock, msg->Data + 4, msg->DataSize - 4, MSG_DONTWAIT);
+			n = r < 0 ? r : 1;
+		}
+		else
+		{
+			for (; n < SC_BATCH && *pNumMsgs + n < msg_cnt; n++)
+			{
+				const PASSTHRU_MSG *msg = &pMsg[*pNumMsgs + n];
+				if (msg->DataSize < 4 || msg->DataSize > 12)
+				{
+					snprintf(LAST_ERROR, LE_LEN, "Invalid message size: %lu", msg->DataSize);
+					if (n == 0)
+						return J2534_ERR_INVALID_MSG;
+					break;	// send the valid ones first
+				}
+				uint32_t id = (msg->Data[0] << 24) | (msg->Data[1] << 16) | (msg->Data[2] << 8) | msg->Data[3];
+				memset(&frame[n], 0, sizeof(struct can_frame));
+				frame[n].can_id = id & CAN_EFF_MASK;
+				if ((msg->TxFlags & 0x100) || id > CAN_SFF_MASK)	// CAN_29BIT_ID
+					frame[n].can_id |= CAN_EFF_FLAG;
+				frame[n].can_dlc = msg->DataSize - 4;
+				memcpy(frame[n].data, msg->Data + 4, frame[n].can_dlc);
+				iov[n].iov_base = &frame[n];
+				iov[n].iov_len = sizeof(struct can_frame);
+				memset(&hdr[n], 0, sizeof(struct mmsghdr));
+				hdr[n].msg_hdr.msg_iov = &iov[n];
+				hdr[n].msg_hdr.msg_iovlen = 1;
+			}
+			r = sendmmsg(sc->sock, hdr, n, MSG_DONTWAIT);
+			n = r;
+		}
+
+		if (n > 0)
+		{
+			*pNumMsgs += n;
+			continue;
+		}
+		if (errno != EAGAIN && errno != ENOBUFS)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: CAN send failed: %s", strerror(errno));
+			return J2534_ERR_FAILED;
+		}
+		int remaining = socketcan_remaining(deadline);
+		if (remaining == 0)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: transmit queue full");
+			return timeout > 0 ? J2534_ERR_TIMEOUT : J2534_ERR_BUFFER_FULL;
+		}
+		// ENOBUFS does not wake poll, retry at least every msec
+		socketcan_poll(POLLOUT, 1);
+	}
+	if (write_log)
+		writelog("EndWriteMsgs\n");
+	return J2534_NOERROR;
+#else
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Pass and block filters are applied to CAN frames, a flow control filter
+  opens a kernel ISO-TP socket receiving the pattern ID and sending to the
+  flow control ID.
+*/
+static int32_t socketcan_start_filter(const unsigned long FilterType,
+	const PASSTHRU_MSG *pMaskMsg, const PASSTHRU_MSG *pPatternMsg,
+	const PASSTHRU_MSG *pFlowControlMsg, unsigned long *pMsgID)
+{
+#ifdef __linux__
+	unsigned long filter_id = sc->filter_id + 1;
+	socketcan_tp_t *tp = NULL;
+	if (FilterType == J2534_FLOW_CONTROL_FILTER)
+	{
+		if (pFlowControlMsg == NULL || pPatternMsg->DataSize < 4 || pFlowControlMsg->DataSize < 4)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: flow control filter needs 4 byte CAN IDs");
+			return J2534_ERR_INVALID_MSG;
+		}
+		int i = 0;
+		for (; i < MAX_FILTERS && tp == NULL; i++)
+		{
+			if (sc->tp[i].filter_id == 0)
+				tp = &sc->tp[i];
+		}
+		if (tp == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: too many flow control filters");
+			return J2534_ERR_EXCEEDED_LIMIT;
+		}
+
+		const uint8_t *rx = pPatternMsg->Data;
+		const uint8_t *tx = pFlowControlMsg->Data;
+		uint32_t eff = (pPatternMsg->TxFlags & 0x100) ? CAN_EFF_FLAG : 0;	// CAN_29BIT_ID
+		struct sockaddr_can addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.can_family = AF_CAN;
+		addr.can_ifindex = sc->ifindex;
+		addr.can_addr.tp.rx_id = ((rx[0] << 24) | (rx[1] << 16) | (rx[2] << 8) | rx[3]) | eff;
+		addr.can_addr.tp.tx_id = ((tx[0] << 24) | (tx[1] << 16) | (tx[2] << 8) | tx[3]) | eff;
+
+		struct can_isotp_options opts;
+		memset(&opts, 0, sizeof(opts));
+		if (pFlowControlMsg->TxFlags & 0x40)	// ISO15765_FRAME_PAD
+			opts.flags |= CAN_ISOTP_TX_PADDING;
+		struct can_isotp_fc_options fc;
+		memset(&fc, 0, sizeof(fc));
+		fc.bs = sc->bs;
+		fc.stmin = sc->stmin;
+
+		int s = socket(PF_CAN, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_ISOTP);
+		if (s < 0
+			|| setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_OPTS, &opts, sizeof(opts)) != 0
+			|| setsockopt(s, SOL_CAN_ISOTP, CAN_ISOTP_RECV_FC, &fc, sizeof(fc)) != 0
+			|| bind(s, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: cannot open ISO-TP socket: %s", strerror(errno));
+			if (s >= 0)
+				close(s);
+			return J2534_ERR_FAILED;
+		}
+		tp->sock = s;
+		tp->rx_id = addr.can_addr.tp.rx_id;
+		tp->tx_id = addr.can_addr.tp.tx_id;
+		tp->filter_id = filter_id;
+	}
+
+	if (!filter_add(filter_id, FilterType, pMaskMsg, pPatternMsg, pFlowControlMsg))
+	{
+		if (tp)
+			socketcan_tp_close(tp);
+		snprintf(LAST_ERROR, LE_LEN, "Error: too many filters");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	sc->filter_id = filter_id;
+	*pMsgID = filter_id;
+	if (FilterType == J2534_PASS_FILTER)
+		socketcan_set_kernel_filter();
+	if (write_log)
+		writelog("EndStartMsgFilter\n");
+	return J2534_NOERROR;
+#else
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static int32_t socketcan_stop_filter(const unsigned long msgID)
+{
+#ifdef __linux__
+	int found = FALSE;
+	int i = 0;
+	for (; i < MAX_FILTERS; i++)
+	{
+		if (sc->tp[i].filter_id && sc->tp[i].filter_id == msgID)
+		{
+			socketcan_tp_close(&sc->tp[i]);
+			found = TRUE;
+		}
+	}
+	CB_LOCK();
+	if (filter_find(msgID))
+		found = TRUE;
+	CB_UNLOCK();
+	if (!found)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid FilterID");
+		return J2534_ERR_INVALID_MSG_ID;
+	}
+	filter_remove(msgID);
+	socketcan_set_kernel_filter();
+	return J2534_NOERROR;
+#else
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static int32_t socketcan_disconnect()
+{
+#ifdef __linux__
+	socketcan_close_channel();
+	if (write_log)
+		writelog("Disconnected\n");
+#endif
+	return J2534_NOERROR;
+}
+
+static int32_t socketcan_close()
+{
+#ifdef __linux__
+	socketcan_close_channel();
+#endif
+	con->backend = USB_BACKEND;
+	return J2534_NOERROR;
+}
+
+/*
+  Configuration parameters that have a SocketCAN equivalent, the bit rate
+  is set on the interface with "ip link" and only reported here.
+*/
+static int32_t socketcan_ioctl(const unsigned long ioctlID, const void *pInput, void *pOutput)
+{
+#ifdef __linux__
+	unsigned long i = 0;
+	if (ioctlID == J2534_GET_CONFIG || ioctlID == J2534_SET_CONFIG)
+	{
+		const SCONFIG_LIST *list = pInput;
+		if (list == NULL)
+			return J2534_ERR_NULL_PARAMETER;
+		for (; i < list->NumOfParams; i++)
+		{
+			SCONFIG *item = &list->ConfigPtr[i];
+			unsigned long *value = NULL;
+			switch (item->Parameter) {
+			case 0x01:	// DATA_RATE
+				if (ioctlID == J2534_SET_CONFIG && item->Value != sc->baud)
+				{
+					snprintf(LAST_ERROR, LE_LEN, "Error: set the bit rate of %s with ip link", sc->ifname);
+					return J2534_ERR_NOT_SUPPORTED;
+				}
+				value = &sc->baud;
+				break;
+			case 0x03:	// LOOPBACK
+				value = &sc->loopback;
+				break;
+			case 0x1E:	// ISO15765_BS, used by flow control filters started later
+				value = &sc->bs;
+				break;
+			case 0x1F:	// ISO15765_STMIN
+				value = &sc->stmin;
+				break;
+			default:
+				snprintf(LAST_ERROR, LE_LEN, "Error: parameter %lX not supported on SocketCAN", item->Parameter);
+				return J2534_ERR_NOT_SUPPORTED;
+			}
+			if (ioctlID == J2534_GET_CONFIG)
+				item->Value = *value;
+			else
+			{
+				*value = item->Value;
+				if (item->Parameter == 0x03 && sc->sock >= 0)
+				{
+					int on = item->Value != 0;
+					setsockopt(sc->sock, SOL_CAN_RAW, CAN_RAW_RECV_OWN_MSGS, &on, sizeof(on));
+				}
+			}
+		}
+		return J2534_NOERROR;
+	}
+	if (ioctlID == J2534_CLEAR_TX_BUFFER)
+		return J2534_NOERROR;
+	if (ioctlID == J2534_CLEAR_RX_BUFFER)
+	{
+		PASSTHRU_MSG *msg = (PASSTHRU_MSG*)malloc(sizeof(PASSTHRU_MSG));
+		if (msg == NULL)
+			return J2534_ERR_EXCEEDED_LIMIT;
+		while (con->protocol_id == 6 ? socketcan_tp_recv(msg) : socketcan_raw_recv(msg))
+			;
+		free(msg);
+		return J2534_NOERROR;
+	}
+	if (ioctlID == J2534_CLEAR_MSG_FILTERS)
+	{
+		for (; i < MAX_FILTERS; i++)
+			socketcan_tp_close(&sc->tp[i]);
+		CB_LOCK();
+		memset(filters, 0, sizeof(filters));
+		filter_cnt = 0;
+		CB_UNLOCK();
+		socketcan_set_kernel_filter();
+		return J2534_NOERROR;
+	}
+#endif
+	snprintf(LAST_ERROR, LE_LEN, "Error: Ioctl not supported on SocketCAN");
+	return J2534_ERR_NOT_SUPPORTED;
+}
+
+/*
+  Establish a connection with a PassThru device.
+ */
+int32_t PassThruOpen(const void *pName, unsigned long *pDeviceID)
+{
+	if (pDeviceID == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error initializing J2534 library: pDeviceID must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+
+#ifndef _MSC_VER
+	// "<path>" records API calls, USB transfers and decoding, written at PassThruClose
+	const char *trace = getenv("J2534_TRACE");
+	if (trace && trace[0] != '\0')
+		trace_start(trace);
+#endif
+	TRACE_SPAN(__func__);
+
+	const char *le = getenv("LOG_ENABLE");
+	if (le)
+	{
+		if (le[0] == '0')
+			write_log = FALSE;
+		else
+			logfile = fopen(le, "a");
+		if (logfile)
+			write_log = TRUE;
+	}
+
+	// "Priority[,CpuMask[,Flags]]" runs the USB event thread in real-time mode
+	const char *rt_mode = getenv("J2534_RT");
+	rt_env_set = rt_mode != NULL && rt_mode[0] != '\0';
+	if (rt_env_set)
+	{
+		char *end = NULL;
+		memset(rt_env, 0, sizeof(rt_env));
+		rt_env->Priority = strtoul(rt_mode, &end, 0);
+		if (*end == ',')
+			rt_env->CpuMask = strtoul(end + 1, &end, 0);
+		if (*end == ',')
+			rt_env->Flags = strtoul(end + 1, &end, 0);
+	}
+
+	littleEndian = isLittleEndian();
+	if (write_log)
+	{
+		writelog("Opening...\n\t|\n\tDevice Name: ");
+		if (pName == NULL)
+			writelog("NULL");
+		else
+			writelog((int8_t*)pName);
+		writelog("\n");
+	}
+
+	usb_event_init();
+	con->backend = USB_BACKEND;
+
+	// "j2534d" or "j2534d:<socket path>" shares a device owned by the j2534d daemon,
+	// J2534_DAEMON only redirects applications that did not name a device
+	const char *daemon_path = NULL;
+	if (pName && strncmp((const char*)pName, "j2534d", 6) == 0)
+		daemon_path = ((const char*)pName)[6] == ':' ? (const char*)pName + 7 : "";
+	else if (pName == NULL || *(const char*)pName == '\0')
+		daemon_path = getenv("J2534_DAEMON");
+	if (daemon_path)
+		return daemon_open(daemon_path, pDeviceID);
+
+	// "socketcan:<interface>" runs the CAN protocols on a Linux CAN network interface
+	if (pName && strncmp((const char*)pName, "socketcan:", 10) == 0)
+		return socketcan_open((const char*)pName + 10, pDeviceID);
+
+	con->ctx = NULL;	// use default context
+	int r = libusb_init(&con->ctx);
+	if (r != LIBUSB_SUCCESS)
+	{
+		// there was an error
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tInit Error: %s\n", libusb_error_name(r));
+			writelog(log_msg);
+		}
+		snprintf(LAST_ERROR, LE_LEN, "Error initializing USB library: %s", libusb_error_name(r));
+		libusb_exit(con->ctx);
+		return error_map(r);
+	}
+
+	libusb_device **devs;
+	ssize_t cnt = libusb_get_device_list(con->ctx, &devs);
+	if (cnt < 0)
+	{
+		if (write_log)
+			writelog("\tError getting device list\n");
+		snprintf(LAST_ERROR, LE_LEN, "Error getting USB device list");
+		libusb_exit(con->ctx);
+		return J2534_ERR_DEVICE_NOT_CONNECTED;
+	}
+
+	// "openport:<n>" opens the n-th Openport found, counting from 0
+	unsigned long index = 0;
+	if (pName && strncmp((const char*)pName, "openport:", 9) == 0)
+		index = strtoul((const char*)pName + 9, NULL, 10);
+	r = open_dev_endpoints(devs, cnt, VENDOR_ID, PRODUCT_ID, index, endpoint);
+	libusb_free_device_list(devs, 1);
+	if (r != LIBUSB_SUCCESS)
+	{
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tCannot find device, error: %s\n", libusb_error_name(r));
+			writelog(log_msg);
+		}
+		snprintf(LAST_ERROR, LE_LEN, "Cannot find device: %s", libusb_error_name(r));
+		libusb_exit(con->ctx);
+		return J2534_ERR_DEVICE_NOT_CONNECTED;
+	}
+
+	if (con->dev_handle == NULL)
+	{
+		if (write_log)
+			writelog("\tCannot open device handle\n");
+		snprintf(LAST_ERROR, LE_LEN, "Cannot open device handle (disconnected?)");
+		libusb_exit(con->ctx);
+		return J2534_ERR_DEVICE_NOT_CONNECTED;
+	}
+	else
+	{
+		*pDeviceID = con->device_id;
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tDeviceID %lu opened\n", *pDeviceID);
+			writelog(log_msg);
+		}
+	}
+
+	//find out if kernel driver is attached
+	if (libusb_kernel_driver_active(con->dev_handle, 0) == 1)
+	{
+		if (write_log)
+			writelog("\tKernel Driver Active\n");
+		if (libusb_detach_kernel_driver(con->dev_handle, 0) == 0) //detach it
+			if (write_log)
+				writelog("\tKernel Driver Detached\n");
+	}
+
+	//claim interface
+	r = libusb_claim_interface(con->dev_handle, endpoint->intf_num);
+	if (r != LIBUSB_SUCCESS)
+	{
+		if (write_log)
+			writelog("\tCannot Claim Interface\n");
+		snprintf(LAST_ERROR, LE_LEN, "Cannot claim interface from kernel driver");
+		libusb_close(con->dev_handle);
+		libusb_exit(con->ctx);
+		return error_map(r);
+	}
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tClaimed Interface %u\n", endpoint->intf_num);
+		writelog(log_msg);
+	}
+
+	uint8_t data[MAX_LEN];
+	// init device, expect ari with FW version
+	strcpy(data, "\r\n\r\nati\r\n");
+	r = cmd_send(data, strlen(data), "ari ");
+
+	// open the device without waiting for the version first
+	strcpy(data, "ata\r\n");
+	int ra = cmd_send(data, strlen(data), NULL);
+
+	if (r == LIBUSB_SUCCESS)
+		r = cmd_wait(data, MAX_LEN, 2000);
+	if (r == LIBUSB_SUCCESS)
+	{
+		memcpy(fw_version, data, 80);
+		r = ra == LIBUSB_SUCCESS ? cmd_wait(data, MAX_LEN, 2000) : ra;
+	}
+	else
+		cmd_cancel();	// report why ati failed, not the ata behind it
+	if (r != LIBUSB_SUCCESS)
+	{
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tInit Error: %s\n", LAST_ERROR);
+			writelog(log_msg);
+		}
+		libusb_release_interface(con->dev_handle, endpoint->intf_num);
+		libusb_close(con->dev_handle);
+		libusb_exit(con->ctx);
+		return error_map(r);
+	}
+
+	if (write_log)
+		writelog("\tInit acknowledged\nInterface Opened\n");
+	LAST_ERROR[0] = '\0';
+	return J2534_NOERROR;
+}
+
+/*
+  Terminate a connection with a Pass-Thru device.
+ */
+int32_t PassThruClose(const unsigned long DeviceID)
+{
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "Closing...\n\t|\n\tDeviceID:  %lu\n", DeviceID);
+		writelog(log_msg);
+	}
+#ifndef _MSC_VER
+	trace_span_t span = trace_begin(__func__);
+#endif
+
+	int r = J2534_NOERROR;
+	if ((uint8_t)DeviceID != con->device_id)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid DeviceID");
+		r = J2534_ERR_INVALID_DEVICE_ID;
+	}
+	else if (con->backend == DAEMON_BACKEND || con->backend == SOCKETCAN_BACKEND)
+	{
+		uds_clear();
+		r = con->backend == DAEMON_BACKEND ? daemon_close() : socketcan_close();
+		if (write_log)
+		{
+			writelog("Closed\n");
+			fclose(logfile);
+		}
+	}
+	else
+	{
+		if (capture->ring)
+			capture_stop(NULL);
+		replay_stop(NULL);
+		gateway_stop(NULL);
+		vbatt_stop();
+		rt_stop();
+		usb_event_stop();
+		snapshot_stop();
+		bus_stats_stop();
+		isotp_stop(NULL);
+		flush_queue();
+		free(cmdq->msg);
+		cmdq->msg = NULL;
+		sub_clear();
+		uds_clear();
+
+		uint8_t data[MAX_LEN];
+		strcpy(data, "atz\r\n");
+		int r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
+		r = libusb_release_interface(con->dev_handle, endpoint->intf_num);
+		libusb_close(con->dev_handle);
+		libusb_exit(con->ctx);
+
+		if (write_log)
+		{
+			writelog("Closed\n");
+			fclose(logfile);
+		}
+	}
+#ifndef _MSC_VER
+	trace_end(&span);	// last span of the trace
+	if ((uint8_t)DeviceID == con->device_id)
+		trace_stop();
+#endif
+	return r;
+}
+
+/*
+  Establish a connection using a protocol channel.
+ */
+int32_t PassThruConnect(const unsigned long DeviceID, const unsigned long protocolID,
+	const unsigned long flags, const unsigned long baud, unsigned long *pChannelID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"Connecting...\n\t|\n"
+			"\tDeviceID:\t%lu\n"
+			"\tprotocolID:\t%lu\n"
+			"\tflags:\t\t%08lX\n"
+			"\tbaud:\t\t%lu\n"
+			, DeviceID, protocolID, flags, baud);
+		writelog(log_msg);
+	}
+
+	if ((uint8_t)DeviceID != con->device_id)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid DeviceID");
+		return J2534_ERR_INVALID_DEVICE_ID;
+	}
+
+	switch ((int)protocolID) {
+	case 3:
+		con->channel = ISO9141;
+		con->decode = write_log ? decode_kline_log : decode_kline;
+		break;
+	case 4:
+		con->channel = ISO14230;
+		con->decode = write_log ? decode_kline_log : decode_kline;
+		break;
+	case 5:
+		con->channel = CAN;
+		con->decode = write_log ? decode_can_log : decode_can;
+		break;
+	case 6:
+		con->channel = ISO15765;
+		con->decode = write_log ? decode_iso15765_log : decode_iso15765;
+		break;
+	default:
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+
+	if (con->backend == DAEMON_BACKEND)
+		return daemon_connect(protocolID, flags, baud, pChannelID);
+	if (con->backend == SOCKETCAN_BACKEND)
+		return socketcan_connect(protocolID, flags, baud, pChannelID);
+
+	int r = J2534_NOERROR;
+	uint8_t data[MAX_LEN];
+	snprintf(data, MAX_LEN, "ato%lu %lu %lu 0\r\n", protocolID, flags, baud);
+	r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
+	*pChannelID = protocolID;
+	con->protocol_id = protocolID;
+	con->baud = baud;
+	if (r == LIBUSB_SUCCESS && rt_env_set && rt_set(rt_env) != J2534_NOERROR && write_log)
+	{
+		// the channel works, only without the real-time mode
+		snprintf(log_msg, LM_LEN, "\tJ2534_RT not applied: %s\n", LAST_ERROR);
+		writelog(log_msg);
+	}
+	if (write_log && r == LIBUSB_SUCCESS)
+		writelog("Connected\n");
+	return error_map(r);
+}
+
+/*
+  Terminate a connection with a protocol channel.
+ */
+int32_t PassThruDisconnect(const unsigned long ChannelID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "Disconnecting\n\t|\n\tChannelID: %lu\n", ChannelID);
+		writelog(log_msg);
+	}
+
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+
+	uds_clear();
+	memset(read_batch, 0, sizeof(read_batch));
+	if (con->backend == DAEMON_BACKEND)
+		return daemon_disconnect(ChannelID);
+	if (con->backend == SOCKETCAN_BACKEND)
+		return socketcan_disconnect();
+
+	// Hand the bulk IN endpoint back and delete any messages in the FIFO queue
+	if (capture->ring)
+		capture_stop(NULL);
+	replay_stop(NULL);
+	gateway_stop(NULL);
+	vbatt_stop();
+	rt_stop();
+	usb_event_stop();
+	snapshot_stop();
+	bus_stats_stop();
+	isotp_stop(NULL);
+	flush_queue();
+	free(cmdq->msg);
+	cmdq->msg = NULL;
+	memset(filters, 0, sizeof(filters));
+	filter_cnt = 0;
+	memset(fset, 0, sizeof(fset));
+	fset->exact = TRUE;
+	memset(rx_cb, 0, sizeof(rx_cb));
+	usb_ev->cb_cnt = 0;
+	sub_clear();
+
+	uint8_t data[MAX_LEN];
+	snprintf(data, MAX_LEN, "atc%lu\r\n", ChannelID);
+	int r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
+
+	if (write_log && r == LIBUSB_SUCCESS)
+		writelog("Disconnected\n");
+	return error_map(r);
+}
+
+/*
+  Read message(s) from a protocol channel.
+ */
+int32_t PassThruReadMsgs(const unsigned long ChannelID, PASSTHRU_MSG *pMsg,
+	unsigned long *pNumMsgs, const unsigned long Timeout)
+{
+	TRACE_SPAN(__func__);
+	TRACE_COUNT(pNumMsgs);
+	if (pMsg == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: *pMsg must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+
+	int8_t channel = con->channel;
+	uint32_t timeout = Timeout;
+	unsigned long msg_cnt = *pNumMsgs;	// number of msgs to read into pMsg array
+	rx_buf_idx = 0;
+
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"ReadMsgs\n\t|\n"
+			"\tChannelID:\t%lu\n"
+			"\tpNumMsgs:\t%lu\n"
+			"\tTimeout:\t%u msec\n"
+			"\trxBufIndex:\t%lu\n",
+			ChannelID, msg_cnt, timeout, rx_buf_idx);
+		writelog(log_msg);
+	}
+
+	if (con->backend == DAEMON_BACKEND)
+		return daemon_read_msgs(pMsg, pNumMsgs, timeout);
+	if (con->backend == SOCKETCAN_BACKEND)
+		return socketcan_read_msgs(pMsg, pNumMsgs, timeout);
+
+	*pNumMsgs = 0;
+	PASSTHRU_MSG *msgBuf = pMsg;	// local copy for pointer arithmetic
+	uint64_t deadline = host_usec() + (uint64_t)timeout * 1000;
+	uint64_t first = 0;		// host_usec() the first message was read
+
+	// Any messages in the FIFO queue to send?
+	*pNumMsgs = read_queue_msgs(msgBuf, msg_cnt);
+
+	if (ATOMIC_LOAD(&usb_ev->running))
+	{
+		// The USB event thread decodes incoming data into the FIFO queue
+		while (timeout > 0)
+		{
+			uint64_t now = host_usec();
+			if (*pNumMsgs > 0 && first == 0)
+				first = now;
+			if (read_complete(read_batch, *pNumMsgs, msg_cnt, first, now) || now >= deadline)
+				break;
+			// Wait for the first message, then for the batch to fill up
+			unsigned long need = *pNumMsgs > 0 && read_batch->min_msgs > *pNumMsgs
+				? read_batch->min_msgs - *pNumMsgs : 1;
+			if (need > msg_cnt - *pNumMsgs)
+				need = msg_cnt - *pNumMsgs;
+			rx_wait(need, read_wait_until(read_batch, *pNumMsgs, first, deadline) - now);
+			*pNumMsgs += read_queue_msgs(msgBuf + *pNumMsgs, msg_cnt - *pNumMsgs);
+		}
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tRX Buffers remaining:\t%lu\nEndReadMsg\n", msg_cnt - *pNumMsgs);
+			writelog(log_msg);
+		}
+		if (*pNumMsgs == 0)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "No messages received");
+			return timeout > 0 ? J2534_ERR_TIMEOUT : J2534_ERR_BUFFER_EMPTY;
+		}
+		return J2534_NOERROR;
+	}
+
+	msgBuf += *pNumMsgs;
+	msg_cnt -= *pNumMsgs;
+	if (!msg_cnt)
+	{
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tRX Buffers remaining:\t%lu\nEndReadMsg\n", msg_cnt);
+			writelog(log_msg);
+		}
+		return J2534_NOERROR;
+	}
+
+	int bytes_read = 0, r = LIBUSB_SUCCESS;
+	if (rx_buf_idx < msg_cnt)	// if pMsg array is not full, read from USB
+	{
+		uint8_t data[PM_DATA_LEN];
+		int partial = FALSE;	// a message is incomplete, its remaining packets follow
+		int polled = FALSE;		// at least one transfer was made
+		int stop = FALSE;		// out of memory for more messages
+		msgBuf->DataSize = 0;	// Initialize msg datasize
+
+		while (TRUE)
+		{
+			// Every transfer only waits for what is left of the call's timeout
+			uint64_t now = host_usec();
+			if (*pNumMsgs + rx_buf_idx > 0 && first == 0)
+				first = now;
+			uint64_t until = read_wait_until(read_batch, *pNumMsgs + rx_buf_idx, first, deadline);
+			unsigned int wait = until > now ? (unsigned int)((until - now + 999) / 1000) : 0;
+			if (stop || (!partial && (read_complete(read_batch, *pNumMsgs + rx_buf_idx, *pNumMsgs + msg_cnt, first, now)
+				|| (now >= until && polled))))
+				break;
+			if (partial && now >= deadline + RX_PARTIAL_WAIT * 1000)
+				break;	// the rest of the message did not come, drop it
+			if (wait == 0)
+				wait = partial ? RX_PARTIAL_WAIT : 1;	// 0 would wait forever
+			polled = TRUE;
+
+			// Try to read USB
+			r = usb_bulk(endpoint->addr_in, data, PM_DATA_LEN, &bytes_read, wait);
+
+			if (r == LIBUSB_ERROR_TIMEOUT)
+			{
+				r = LIBUSB_SUCCESS;
+				continue;
+			}
+			if (r != LIBUSB_SUCCESS)
+			{
+				if (write_log)
+				{
+					snprintf(log_msg, LM_LEN, "\tRead Error: %s\n", libusb_error_name(r));
+					writelog(log_msg);
+				}
+				snprintf(LAST_ERROR, LE_LEN, "USB data transfer error: %s", libusb_error_name(r));
+				*pNumMsgs += rx_buf_idx;
+				return error_map(r);
+			}
+
+			TRACE_SPAN("decode");	// rest of this transfer
+			TRACE_SIZE(bytes_read);
+			int bytes_processed = 0;	// the number of bytes processed in the "data" array
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN,
+					"\t\t*** USB READ: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, USB:%s\n\t\t",
+					5, 3, bytes_processed, bytes_read, libusb_error_name(r));
+				writelog(log_msg);
+				writelogmsg(data, 0, bytes_read);
+				writelog("\n");
+			}
+
+			if (bytes_read > 0 && bytes_read <= PM_DATA_LEN)
+			{
+				if (write_log)
+				{
+					snprintf(log_msg, LM_LEN,
+						"\t\t=== %02X | %02X | %02X <> %02X | %02X ===\n",
+						(uint8_t)data[0], (uint8_t)data[1],
+						(uint8_t)data[2], (uint8_t)data[3],
+						(uint8_t)data[4]);
+					writelog(log_msg);
+				}
+
+				// Process an expected data packet
+				while (bytes_processed < bytes_read
+					&& data[bytes_processed + 0] == 0x61		// A
+					&& data[bytes_processed + 1] == 0x72		// R
+					&& (data[bytes_processed + 2] == channel
+						|| data[bytes_processed + 2] == 0x6F))	// O
+				{
+					// If third byte equals the channel #, then this is Message data
+					if (data[bytes_processed + 2] == channel)
+					{
+						int decoded = con->decode(msgBuf, data, bytes_processed, bytes_read, rx_buf_idx);
+						bytes_processed = bytes_processed + data[bytes_processed + 3] + 4;
+						if (decoded == DECODE_DONE && !filter_accept(msgBuf))
+						{
+							// let through by a merged device filter, reuse the message
+							msgBuf->DataSize = 0;
+							partial = FALSE;
+						}
+						else if (decoded == DECODE_DONE)
+						{
+							rx_buf_idx++;
+							if (rx_buf_idx < msg_cnt)
+							{
+								msgBuf++;
+								msgBuf->DataSize = 0;	// Initialize new msg datasize
+							}
+							partial = FALSE;
+						}
+						else if (decoded == DECODE_PARTIAL)
+							partial = TRUE;	// Read next message to get End indication and timestamp
+					}	// End of the AR channel# packet
+
+					// If third byte equals 'O', then this is Acknowledgement data
+					if (data[bytes_processed + 2] == 0x6F)	// O
+					{
+						bytes_processed = bytes_processed + 5;
+						if (write_log)
+						{
+							snprintf(log_msg, LM_LEN,
+								"\t\t\t-- ARO Msg: pos:%u, len:%u, bytes_processed:%d, bytes_read:%d, msg_cnt:%lu\n",
+								bytes_processed + 5, bytes_processed + 3, bytes_processed, bytes_read, rx_buf_idx);
+							writelog(log_msg);
+						}
+					}
+
+					// Check if we have read msg_cnt messages,
+					// if so, pMsg array is full, try to queue the message
+					if (bytes_processed < bytes_read && rx_buf_idx >= msg_cnt)
+					{
+						if (write_log)
+						{
+							snprintf(log_msg, LM_LEN, "\tRead message array full, %d bytes remaining\n",
+								bytes_read - bytes_processed);
+							writelog(log_msg);
+						}
+
+						// Try to queue the remaining bytes into new PT messages
+						msgBuf = (PASSTHRU_MSG*)malloc(sizeof(PASSTHRU_MSG));
+						if (msgBuf)
+						{
+							msgBuf->DataSize = 0;	// Initialize new msg datasize
+							if (write_log)
+								writelog("\tMore data, let's queue it\n");
+							if (queue_msg(msgBuf))
+								rx_buf_idx--;	// message queued so don't count it
+							else
+							{
+								// couldn't allocate memory in queue, skip remaining bytes and free msgBuf
+								bytes_processed = bytes_read;
+								stop = TRUE;
+								free(msgBuf);
+							}
+						}
+						else
+						{
 							// couldn't allocate memory, skip remaining bytes
 							bytes_processed = bytes_read;
-							dontexit = FALSE;
+							stop = TRUE;
 						}
 					}	// End of data packet type processing
 				}	// End of bytes to process
 			}	// End of bytes read
-		}	// End of dontexit
+		}	// End of transfers
 	}	// End of read msg_cnt messages
 
-	// add dequeued msg count to USB read message count
-	*pNumMsgs += rx_buf_idx;
-	if (write_log)
+	// add dequeued msg count to USB read message count
+	*pNumMsgs += rx_buf_idx;
+	if (write_log)
+	{
+		uint32_t i = 0;
+		for (; i < *pNumMsgs; i++)
+		{
+			writelogpassthrumsg(pMsg + i);
+		}
+		snprintf(log_msg, LM_LEN, "\tRX Buffers remaining:\t%lu\nEndReadMsg\n",
+			msg_cnt - rx_buf_idx);
+		writelog(log_msg);
+	}
+	if (rx_buf_idx > msg_cnt)
+	{
+		return J2534_ERR_BUFFER_OVERFLOW;
+	}
+	if (*pNumMsgs == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "No messages received");
+		return timeout > 0 ? J2534_ERR_TIMEOUT : J2534_ERR_BUFFER_EMPTY;
+	}
+	return J2534_NOERROR;
+}
+
+/*
+  Write message(s) to a protocol channel.
+ */
+int32_t PassThruWriteMsgs(const unsigned long ChannelID, const PASSTHRU_MSG *pMsg,
+	unsigned long *pNumMsgs, const unsigned long timeInterval)
+{
+	TRACE_SPAN(__func__);
+	TRACE_COUNT(pNumMsgs);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"WriteMsgs\n\t|\n"
+			"\tChannelID:\t%lu\n"
+			"\tpNumMsgs:\t%lu\n"
+			"\tTimeout:\t%lu msec\n",
+			ChannelID, *pNumMsgs, timeInterval);
+		writelog(log_msg);
+		writelogpassthrumsg(pMsg);
+	}
+
+	if (con->backend == DAEMON_BACKEND)
+		return daemon_write_msgs(ChannelID, pMsg, pNumMsgs, timeInterval);
+	if (con->backend == SOCKETCAN_BACKEND)
+		return socketcan_write_msgs(pMsg, pNumMsgs, timeInterval);
+
+	unsigned long msg_cnt = *pNumMsgs, i = 0, msg_data_size = 0;
+	int r = LIBUSB_SUCCESS;
+	uint8_t data[PM_DATA_LEN];
+	size_t strln = 0;
+	*pNumMsgs = 0;
+
+	while (i < msg_cnt)
+	{
+		msg_data_size = pMsg[i].DataSize;
+
+		if (msg_data_size > 0 && msg_data_size <= PM_DATA_LEN)
+		{
+			snprintf(data, PM_DATA_LEN, "att%lu %lu %lu\r\n", ChannelID, pMsg[i].DataSize, pMsg[i].TxFlags);
+
+			strln = strlen(data);
+			uint32_t j = 0;
+			while (j < msg_data_size)
+				data[strln++] = pMsg[i].Data[j++];
+
+			r = usb_send_expect(data, strln, PM_DATA_LEN, 0, NULL);
+		}
+		else
+		{
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\tInvalid message size: %lu\n", msg_data_size);
+				writelog(log_msg);
+			}
+			snprintf(LAST_ERROR, LE_LEN, "Invalid message size: %lu", msg_data_size);
+			return J2534_ERR_INVALID_MSG;
+		}
+		*pNumMsgs = ++i;
+	}
+	if (write_log)
+		writelog("EndWriteMsgs\n");
+	return error_map(r);
+}
+
+/*
+  Start sending a message at a specified time interval on a protocol channel.
+ */
+int32_t PassThruStartPeriodicMsg(const unsigned long ChannelID, const PASSTHRU_MSG *pMsg,
+	const unsigned long *pMsgID, const unsigned long timeInterval)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+		writelog("StartPeriodic, not supported\n");
+	return J2534_ERR_NOT_SUPPORTED;
+}
+
+/*
+  Stop a periodic message.
+ */
+int32_t PassThruStopPeriodicMsg(const unsigned long ChannelID, const unsigned long msgID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+		writelog("StopPeriodic, not supported\n");
+	return J2534_ERR_NOT_SUPPORTED;
+}
+
+/*
+  Start filtering incoming messages on a protocol channel.
+ */
+int32_t PassThruStartMsgFilter(const unsigned long ChannelID, const unsigned long FilterType,
+	const PASSTHRU_MSG *pMaskMsg, const PASSTHRU_MSG *pPatternMsg,
+	const PASSTHRU_MSG *pFlowControlMsg, unsigned long *pMsgID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"StartMsgFilter\n\t|\n"
+			"\tChannelID:\t%lu\n"
+			"\tFilterType:\t%lu\n"
+			"\tpMaskMsg:\n",
+			ChannelID, FilterType);
+		writelog(log_msg);
+		writelogpassthrumsg(pMaskMsg);
+		writelog("\n\tpPatternMsg:\n");
+		writelogpassthrumsg(pPatternMsg);
+		writelog("\n\tpFlowControlMsg:\n");
+		if (pFlowControlMsg == NULL)
+			writelog("\tNULL");
+		else
+			writelogpassthrumsg(pFlowControlMsg);
+		writelog("\n");
+	}
+
+	if (pMaskMsg == NULL || pPatternMsg == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: PASSTHRU_MSG* must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	if (pMaskMsg->DataSize > 12 || pPatternMsg->DataSize > 12)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: PASSTHRU_MSG invalid data length");
+		return J2534_ERR_INVALID_MSG;
+	}
+	if (pMaskMsg->DataSize != pPatternMsg->DataSize)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Mask and Pattern have differnt data lenghts");
+		return J2534_ERR_INVALID_MSG;
+	}
+	if (pMaskMsg->TxFlags != pPatternMsg->TxFlags)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Mask and Pattern have differnt TX flags");
+		return J2534_ERR_INVALID_MSG;
+	}
+	if ((FilterType == J2534_PASS_FILTER || FilterType == J2534_BLOCK_FILTER)
+		&& pFlowControlMsg)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: FilterType, FlowControlMsg mismatch");
+		return J2534_ERR_INVALID_MSG;
+	}
+
+	if (con->backend == DAEMON_BACKEND)
+		return daemon_start_filter(ChannelID, FilterType, pMaskMsg, pPatternMsg,
+			pFlowControlMsg, pMsgID);
+	if (con->backend == SOCKETCAN_BACKEND)
+		return socketcan_start_filter(FilterType, pMaskMsg, pPatternMsg, pFlowControlMsg, pMsgID);
+
+	// the device holds DEVICE_FILTERS filters, filter_update maps the host filters onto them
+	unsigned long filter_id = ++fset->last_id;
+	if (!filter_add(filter_id, FilterType, pMaskMsg, pPatternMsg, pFlowControlMsg))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: too many filters");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	int32_t r = filter_update(ChannelID);
+	if (r == J2534_NOERROR)
+		*pMsgID = filter_id;
+	else
+	{
+		filter_remove(filter_id);
+		filter_update(ChannelID);
+	}
+
+	if (write_log)
+		writelog("EndStartMsgFilter\n");
+	return error_map(r);
+}
+
+/*
+  Stops filtering incoming messages on a protocol channel.
+ */
+int32_t PassThruStopMsgFilter(const unsigned long ChannelID, const unsigned long msgID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"StopMsgFilter\n\t|\n"
+			"\tChannelID:\t%lu\n"
+			"\tmsgID:\t\t%lu\n",
+			ChannelID, msgID);
+		writelog(log_msg);
+	}
+
+	int r = J2534_NOERROR;
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		r = J2534_ERR_INVALID_CHANNEL_ID;
+	}
+	else if (con->backend == DAEMON_BACKEND)
+		r = daemon_simple(con->sock, J2534D_STOP_FILTER, ChannelID, msgID);
+	else if (con->backend == SOCKETCAN_BACKEND)
+		r = socketcan_stop_filter(msgID);
+	else
+	{
+		CB_LOCK();
+		int found = filter_find(msgID) != NULL;
+		CB_UNLOCK();
+		if (found)
+		{
+			filter_remove(msgID);
+			r = filter_update(ChannelID);
+		}
+		else
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid FilterID");
+			r = J2534_ERR_INVALID_MSG_ID;
+		}
+	}
+	if (write_log)
+		writelog("EndStopMsgFilter\n");
+	return error_map(r);
+}
+
+/*
+  Register a callback that receives each decoded message of a protocol
+  channel on the USB event thread, optionally only messages matching the
+  mask and pattern of a started message filter.
+ */
+int32_t PassThruRegisterRxCallback(const unsigned long ChannelID, const unsigned long FilterID,
+	const unsigned long Flags, PASSTHRU_RX_CALLBACK Callback, void *pContext,
+	unsigned long *pCallbackID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"RegisterRxCallback\n\t|\n"
+			"\tChannelID:\t%lu\n"
+			"\tFilterID:\t%lu\n"
+			"\tFlags:\t\t%08lX\n",
+			ChannelID, FilterID, Flags);
+		writelog(log_msg);
+	}
+
+	if (Callback == NULL || pCallbackID == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Callback and pCallbackID must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+	if (con->backend != USB_BACKEND)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: RX callbacks need an Openport connected over USB");
+		return J2534_ERR_NOT_SUPPORTED;
+	}
+	if (Flags & ~J2534_RX_CB_QUEUE)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid Flags");
+		return J2534_ERR_INVALID_FLAGS;
+	}
+
+	int r = J2534_ERR_EXCEEDED_LIMIT;
+	int i = 0;
+	CB_LOCK();
+	if (FilterID != J2534_ALL_FILTERS && filter_find(FilterID) == NULL)
+		r = J2534_ERR_INVALID_FILTER_ID;
+	else
+	{
+		for (; i < MAX_RX_CALLBACKS; i++)
+		{
+			if (rx_cb[i].fn == NULL)
+			{
+				rx_cb[i].context = pContext;
+				rx_cb[i].filter_id = FilterID;
+				rx_cb[i].flags = Flags;
+				rx_cb[i].fn = Callback;
+				usb_ev->cb_cnt++;
+				*pCallbackID = i + 1;
+				r = J2534_NOERROR;
+				break;
+			}
+		}
+	}
+	CB_UNLOCK();
+
+	if (r == J2534_ERR_INVALID_FILTER_ID)
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid FilterID");
+	else if (r != J2534_NOERROR)
+		snprintf(LAST_ERROR, LE_LEN, "Error: Too many RX callbacks");
+	else
+	{
+		// callbacks are only called by the USB event thread
+		int u = usb_event_start();
+		if (u != LIBUSB_SUCCESS)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+				libusb_error_name(u));
+			PassThruUnregisterRxCallback(ChannelID, *pCallbackID);
+			r = error_map(u);
+		}
+	}
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tCallbackID:\t%lu\nEndRegisterRxCallback\n",
+			r == J2534_NOERROR ? *pCallbackID : 0);
+		writelog(log_msg);
+	}
+	return r;
+}
+
+/*
+  Remove an RX callback.  Once this returns the callback is no longer
+  running and will not be called again.
+ */
+int32_t PassThruUnregisterRxCallback(const unsigned long ChannelID, const unsigned long CallbackID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"UnregisterRxCallback\n\t|\n"
+			"\tChannelID:\t%lu\n"
+			"\tCallbackID:\t%lu\n",
+			ChannelID, CallbackID);
+		writelog(log_msg);
+	}
+
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+
+	int r = J2534_ERR_INVALID_MSG_ID;
+	CB_LOCK();
+	if (CallbackID > 0 && CallbackID <= MAX_RX_CALLBACKS && rx_cb[CallbackID - 1].fn)
+	{
+		rx_cb[CallbackID - 1].fn = NULL;
+		usb_ev->cb_cnt--;
+		r = J2534_NOERROR;
+	}
+	CB_UNLOCK();
+	if (r != J2534_NOERROR)
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid CallbackID");
+	if (write_log)
+		writelog("EndUnregisterRxCallback\n");
+	return r;
+}
+
+/*
+  Route the messages with the given CAN IDs of a CAN or ISO15765 channel to
+  a queue of their own.
+ */
+int32_t PassThruSubscribe(const unsigned long ChannelID, const unsigned long *pIDs,
+	const unsigned long NumIDs, const unsigned long Flags, unsigned long *pSubscriptionID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"Subscribe\n\t|\n"
+			"\tChannelID:\t%lu\n"
+			"\tNumIDs:\t\t%lu\n"
+			"\tFlags:\t\t%08lX\n",
+			ChannelID, NumIDs, Flags);
+		writelog(log_msg);
+	}
+
+	if (pIDs == NULL || pSubscriptionID == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pIDs and pSubscriptionID must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+	if (con->backend != USB_BACKEND)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: subscriptions need an Openport connected over USB");
+		return J2534_ERR_NOT_SUPPORTED;
+	}
+	if (con->channel != CAN && con->channel != ISO15765)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: subscriptions need a CAN channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+	if (Flags & ~J2534_SUB_QUEUE)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid Flags");
+		return J2534_ERR_INVALID_FLAGS;
+	}
+	if (NumIDs == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: NumIDs must not be 0");
+		return J2534_ERR_INVALID_MSG;
+	}
+#ifndef _MSC_VER
+	subscription_t sub;
+	unsigned long n = 0;
+	memset(&sub, 0, sizeof(sub));
+	sub.flags = Flags;
+	sub.num_ids = NumIDs;
+	sub.ids = (uint32_t*)malloc(NumIDs * sizeof(uint32_t));
+	if (sub.ids == NULL || posix_memalign((void**)&sub.ring, 64, sizeof(j2534d_ring_t) + SUB_RING) != 0)
+	{
+		free(sub.ids);
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	memset(sub.ring, 0, sizeof(j2534d_ring_t));
+	sub.ring->size = SUB_RING;
+	for (; n < NumIDs; n++)
+		sub.ids[n] = pIDs[n] & 0x1FFFFFFF;
+
+	int r = J2534_ERR_EXCEEDED_LIMIT;
+	int i = 0;
+	CB_LOCK();
+	for (; i < MAX_SUBSCRIPTIONS; i++)
+	{
+		if (subs[i].ring == NULL)
+		{
+			subs[i] = sub;
+			if (sub_rebuild())
+			{
+				*pSubscriptionID = i + 1;
+				r = J2534_NOERROR;
+			}
+			else
+			{
+				// too many large CAN IDs, back out
+				memset(&subs[i], 0, sizeof(subscription_t));
+				sub_rebuild();
+			}
+			break;
+		}
+	}
+	CB_UNLOCK();
+
+	if (r != J2534_NOERROR)
+	{
+		snprintf(LAST_ERROR, LE_LEN, i < MAX_SUBSCRIPTIONS
+			? "Error: Too many CAN IDs above 0x7FF subscribed"
+			: "Error: Too many subscriptions");
+		free(sub.ring);
+		free(sub.ids);
+	}
+	else
+	{
+		// subscriptions are filled by the USB event thread
+		int u = usb_event_start();
+		if (u != LIBUSB_SUCCESS)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+				libusb_error_name(u));
+			PassThruUnsubscribe(ChannelID, *pSubscriptionID);
+			r = error_map(u);
+		}
+	}
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tSubscriptionID:\t%lu\nEndSubscribe\n",
+			r == J2534_NOERROR ? *pSubscriptionID : 0);
+		writelog(log_msg);
+	}
+	return r;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: subscriptions not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Read messages routed to a subscription, waiting up to Timeout msec for the
+  first one.
+ */
+int32_t PassThruReadSubscription(const unsigned long ChannelID, const unsigned long SubscriptionID,
+	PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs, const unsigned long Timeout)
+{
+	TRACE_SPAN(__func__);
+	if (pMsg == NULL || pNumMsgs == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pMsg and pNumMsgs must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		*pNumMsgs = 0;
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+#ifndef _MSC_VER
+	j2534d_ring_t *ring = NULL;
+	uint32_t *readers = NULL;
+	if (SubscriptionID > 0 && SubscriptionID <= MAX_SUBSCRIPTIONS)
+	{
+		// PassThruUnsubscribe frees the ring once no read holds it
+		readers = &sub_readers[SubscriptionID - 1];
+		ATOMIC_ADD(readers, 1);
+		ring = ATOMIC_LOAD(&subs[SubscriptionID - 1].ring);
+		if (ring == NULL)
+			ATOMIC_ADD(readers, -1);
+	}
+	if (ring == NULL)
+	{
+		*pNumMsgs = 0;
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid SubscriptionID");
+		return J2534_ERR_INVALID_MSG_ID;
+	}
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "ReadSubscription\n\t|\n\tSubscriptionID:\t%lu\n", SubscriptionID);
+		writelog(log_msg);
+	}
+	int32_t r = ring_read_msgs(ring, pMsg, pNumMsgs, Timeout, NULL);
+	ATOMIC_ADD(readers, -1);
+	return r;
+#else
+	*pNumMsgs = 0;
+	snprintf(LAST_ERROR, LE_LEN, "Error: Invalid SubscriptionID");
+	return J2534_ERR_INVALID_MSG_ID;
+#endif
+}
+
+/*
+  Remove a subscription.  Messages still in its queue are discarded.
+ */
+int32_t PassThruUnsubscribe(const unsigned long ChannelID, const unsigned long SubscriptionID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN,
+			"Unsubscribe\n\t|\n"
+			"\tChannelID:\t%lu\n"
+			"\tSubscriptionID:\t%lu\n",
+			ChannelID, SubscriptionID);
+		writelog(log_msg);
+	}
+
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+
+	int r = J2534_ERR_INVALID_MSG_ID;
+	subscription_t old;
+	memset(&old, 0, sizeof(old));
+	CB_LOCK();
+	if (SubscriptionID > 0 && SubscriptionID <= MAX_SUBSCRIPTIONS && subs[SubscriptionID - 1].ring)
+	{
+		old = subs[SubscriptionID - 1];
+		memset(&subs[SubscriptionID - 1], 0, sizeof(subscription_t));
+		sub_rebuild();
+		r = J2534_NOERROR;
+	}
+	CB_UNLOCK();
+	if (r == J2534_NOERROR)
+	{
+		readers_wait(&sub_readers[SubscriptionID - 1]);
+		sub_free(&old);
+	}
+	else
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid SubscriptionID");
+	if (write_log)
+		writelog("EndUnsubscribe\n");
+	return r;
+}
+
+/*
+  Copy the latest message of each CAN ID in pIDs to pMsg, DataSize is 0 for
+  an ID that has not been received.  Never waits for the USB event thread.
+ */
+int32_t PassThruReadSnapshot(const unsigned long ChannelID, const unsigned long *pIDs,
+	PASSTHRU_MSG *pMsg, const unsigned long NumIDs)
+{
+	TRACE_SPAN(__func__);
+	if (pIDs == NULL || pMsg == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pIDs and pMsg must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+#ifndef _MSC_VER
+	// snapshot_stop frees the table once no read holds it
+	ATOMIC_ADD(&snapshot_readers, 1);
+	snapshot_t *snap = ATOMIC_LOAD(&snapshot);
+	if (snap == NULL)
+	{
+		ATOMIC_ADD(&snapshot_readers, -1);
+		snprintf(LAST_ERROR, LE_LEN, "Error: snapshot not started");
+		return J2534_ERR_FAILED;
+	}
+	unsigned long i = 0;
+	for (; i < NumIDs; i++)
+	{
+		uint32_t id = pIDs[i] & 0x1FFFFFFF;
+		const snap_entry_t *e = id < SUB_STD_IDS ? &snap->std[id] : snapshot_slot(snap, id);
+		if (!snapshot_get(e, &pMsg[i]))
+		{
+			pMsg[i].ProtocolID = con->protocol_id;
+			pMsg[i].RxStatus = 0;
+			pMsg[i].TxFlags = 0;
+			pMsg[i].Timestamp = 0;
+			pMsg[i].DataSize = 0;
+			pMsg[i].ExtraDataIndex = 0;
+		}
+	}
+	ATOMIC_ADD(&snapshot_readers, -1);
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: snapshot not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Read up to *pNumPdus PDUs reassembled by the ISO-TP sniffer, waiting up
+  to Timeout msec for the first one.
+ */
+int32_t PassThruReadIsotp(const unsigned long ChannelID, ISOTP_PDU *pPdu, unsigned long *pNumPdus,
+	const unsigned long Timeout)
+{
+	TRACE_SPAN(__func__);
+	if (pPdu == NULL || pNumPdus == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pPdu and pNumPdus must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	unsigned long pdu_cnt = *pNumPdus;
+	*pNumPdus = 0;
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+#ifndef _MSC_VER
+	// isotp_stop frees the sniffer once no read holds it
+	ATOMIC_ADD(&isotp_readers, 1);
+	isotp_t *it = ATOMIC_LOAD(&isotp);
+	if (it == NULL)
+	{
+		ATOMIC_ADD(&isotp_readers, -1);
+		snprintf(LAST_ERROR, LE_LEN, "Error: ISO-TP sniffer not started");
+		return J2534_ERR_FAILED;
+	}
+	if (write_log)
+		writelog("ReadIsotp\n\t|\n");
+
+	j2534d_ring_t *ring = it->ring;
+	uint64_t deadline = host_usec() + (uint64_t)Timeout * 1000;
+	while (*pNumPdus < pdu_cnt)
+	{
+		uint32_t head = ATOMIC_LOAD(&ring->head);
+		uint32_t tail = ring->tail;
+		if (head == tail)
+		{
+			uint64_t t = host_usec();
+			if (*pNumPdus > 0 || t >= deadline)
+				break;
+			ring_wait(ring, head, deadline - t);
+			continue;
+		}
+		const isotp_rec_t *rec = (const isotp_rec_t*)(ring->data + (tail & (ring->size - 1)));
+		if (!(rec->size & J2534D_MSG_PAD))
+		{
+			ISOTP_PDU *pdu = &pPdu[(*pNumPdus)++];
+			pdu->SourceID = rec->source;
+			pdu->TargetID = rec->target;
+			pdu->RxStatus = rec->rx_status;
+			pdu->Address = rec->address;
+			pdu->StartTime = rec->start;
+			pdu->EndTime = rec->end;
+			pdu->DataSize = rec->data_size;
+			memcpy(pdu->Data, rec->data, rec->data_size);
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\tPDU %lX to %lX, %lu bytes, %lu to %lu usec\n",
+					pdu->SourceID, pdu->TargetID, pdu->DataSize, pdu->StartTime, pdu->EndTime);
+				writelog(log_msg);
+			}
+		}
+		ATOMIC_STORE(&ring->tail, tail + (rec->size & ~J2534D_MSG_PAD));
+	}
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tRing overflows:\t%u\nEndReadIsotp\n", ring->overflows);
+		writelog(log_msg);
+	}
+	ATOMIC_ADD(&isotp_readers, -1);
+	if (*pNumPdus == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "No PDUs received");
+		return Timeout > 0 ? J2534_ERR_TIMEOUT : J2534_ERR_BUFFER_EMPTY;
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: ISO-TP sniffer not supported");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Free a compiled DBC file.
+*/
+static void dbc_free(dbc_t *d)
+{
+	uint32_t i = 0;
+	if (d == NULL)
+		return;
+	for (; i < d->sig_cnt; i++)
+	{
+		free(d->sig[i].name);
+		free(d->sig[i].unit);
+	}
+	free(d->sig);
+	free(d->msg);
+	free(d->ext);
+	free(d);
+}
+
+static char *dbc_strdup(const char *str, const size_t len)
+{
+	char *dup = (char*)malloc(len + 1);
+	if (dup)
+	{
+		memcpy(dup, str, len);
+		dup[len] = 0;
+	}
+	return dup;
+}
+
+/*
+  Key of a CAN ID in a DBC file, bit 31 is set for an extended ID as in the
+  BO_ lines so a standard and an extended frame with the same ID differ.
+*/
+static uint32_t dbc_key(const unsigned long id, const int ext)
+{
+	uint32_t can_id = (uint32_t)id & 0x1FFFFFFF;
+	return can_id | (ext || (id & 0x80000000) || can_id > 0x7FF ? 0x80000000 : 0);
+}
+
+/*
+  Key of the CAN ID of a received message.
+*/
+static uint32_t dbc_msg_key(const PASSTHRU_MSG *msg)
+{
+	uint32_t id = (uint32_t)msg->Data[0] << 24 | (uint32_t)msg->Data[1] << 16
+		| (uint32_t)msg->Data[2] << 8 | msg->Data[3];
+	return dbc_key(id, msg->RxStatus & 0x100);	// CAN_29BIT_ID
+}
+
+/*
+  Find the message of a key, NULL if the DBC file does not describe it.
+*/
+static const dbc_msg_t *dbc_find(const dbc_t *d, const uint32_t id)
+{
+	uint32_t i = 0;
+	if (id < SUB_STD_IDS)
+		i = d->std[id];
+	else if (d->ext)
+	{
+		uint32_t mask = (1u << d->ext_bits) - 1;
+		uint32_t h = (id * 2654435761u) >> (32 - d->ext_bits);
+		while ((i = d->ext[h]) != 0 && d->msg[i - 1].id != id)
+			h = (h + 1) & mask;
+	}
+	return i ? &d->msg[i - 1] : NULL;
+}
+
+/*
+  Load the up to 8 payload bytes of a CAN message as a little and a big
+  endian word, missing bytes are 0.
+*/
+static void dbc_words(const PASSTHRU_MSG *msg, uint64_t *le, uint64_t *be)
+{
+	uint8_t b[8] = { 0 };
+	int i = 0;
+	memcpy(b, msg->Data + 4, msg->DataSize >= 12 ? 8 : msg->DataSize - 4);
+	*le = 0;
+	*be = 0;
+	for (; i < 8; i++)
+	{
+		*le |= (uint64_t)b[i] << (8 * i);
+		*be |= (uint64_t)b[i] << (56 - 8 * i);
+	}
+}
+
+static uint64_t dbc_raw(const dbc_signal_t *s, const uint64_t le, const uint64_t be)
+{
+	return ((s->big_endian ? be : le) >> s->shift) & s->mask;
+}
+
+static double dbc_value(const dbc_signal_t *s, const uint64_t raw)
+{
+	if (s->is_float == 1)
+	{
+		uint32_t bits = (uint32_t)raw;
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		return f * s->factor + s->offset;
+	}
+	if (s->is_float == 2)
+	{
+		double f;
+		memcpy(&f, &raw, sizeof(f));
+		return f * s->factor + s->offset;
+	}
+	if (s->sign)
+		return (double)(int64_t)((raw ^ s->sign) - s->sign) * s->factor + s->offset;
+	return (double)raw * s->factor + s->offset;
+}
+
+/*
+  Compile the SG_ line of a DBC file into a decode plan.  Return FALSE on a
+  syntax error, a signal outside the first 8 payload bytes gets mask 0.
+*/
+static int dbc_parse_signal(const char *line, dbc_signal_t *sig, int *is_switch)
+{
+	char name[DBC_NAME_LEN], mux[16] = "";
+	unsigned int start, len;
+	char order, sign;
+	double min, max;
+	int n = 0;
+
+	memset(sig, 0, sizeof(dbc_signal_t));
+	sig->mux = -1;
+	*is_switch = FALSE;
+	if (sscanf(line, " %127s %n", name, &n) != 1 || n == 0)
+		return FALSE;
+	line += n;
+	if (*line != ':')
+	{
+		n = 0;
+		if (sscanf(line, "%15[^: ] %n", mux, &n) != 1 || n == 0 || line[n] != ':')
+			return FALSE;
+		line += n;
+	}
+	n = 0;
+	if (sscanf(line + 1, " %u|%u@%c%c (%lf,%lf) [%lf|%lf] %n",
+		&start, &len, &order, &sign, &sig->factor, &sig->offset, &min, &max, &n) != 8 || n == 0
+		|| len == 0 || len > 64 || (order != '0' && order != '1') || (sign != '+' && sign != '-'))
+		return FALSE;
+	line += 1 + n;
+
+	sig->name = dbc_strdup(name, strlen(name));
+	if (*line == '"' && strchr(line + 1, '"'))
+		sig->unit = dbc_strdup(line + 1, strchr(line + 1, '"') - line - 1);
+	else
+		sig->unit = dbc_strdup("", 0);
+	if (mux[0] == 'M')
+		*is_switch = TRUE;
+	else if (mux[0] == 'm')
+		sig->mux = strtol(mux + 1, NULL, 10);	// extended multiplexing "mNM" is treated as "mN"
+
+	if (order == '1')
+	{
+		// Intel, start is the least significant bit
+		if (start + len > 64)
+			return TRUE;
+		sig->shift = start;
+	}
+	else
+	{
+		// Motorola, start is the most significant bit in sawtooth numbering
+		unsigned int msb = start / 8 * 8 + 7 - start % 8;
+		if (msb + len > 64)
+			return TRUE;
+		sig->shift = 64 - msb - len;
+		sig->big_endian = 1;
+	}
+	sig->mask = len == 64 ? ~(uint64_t)0 : ((uint64_t)1 << len) - 1;
+	if (sign == '-')
+		sig->sign = (uint64_t)1 << (len - 1);
+	return TRUE;
+}
+
+/*
+  Parse a DBC file.  Return NULL with LAST_ERROR set on failure.
+*/
+static dbc_t *dbc_parse(const char *path, char *text)
+{
+	dbc_t *d = (dbc_t*)calloc(1, sizeof(dbc_t));
+	uint32_t sig_max = 0, msg_max = 0, line_no = 0, skipped = 0;
+	int32_t cur = -1;
+	char *line = text;
+	if (d == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+		return NULL;
+	}
+
+	while (line && *line)
+	{
+		char *next = strchr(line, '\n');
+		if (next)
+			*next++ = 0;
+		line_no++;
+		while (*line == ' ' || *line == '\t')
+			line++;
+
+		if (strncmp(line, "BO_ ", 4) == 0)
+		{
+			unsigned long id;
+			char name[DBC_NAME_LEN];
+			if (sscanf(line + 4, "%lu %127[^: ]", &id, name) != 2)
+				goto SYNTAX;
+			cur = -1;
+			if (strcmp(name, "VECTOR__INDEPENDENT_SIG_MSG") == 0)
+				goto NEXT;
+			if (d->msg_cnt == 0xFFFF)
+			{
+				snprintf(LAST_ERROR, LE_LEN, "Error: %s: too many messages", path);
+				goto FAIL;
+			}
+			if (d->msg_cnt == msg_max)
+			{
+				msg_max = msg_max ? msg_max * 2 : 64;
+				dbc_msg_t *msg = (dbc_msg_t*)realloc(d->msg, msg_max * sizeof(dbc_msg_t));
+				if (msg == NULL)
+					goto NOMEM;
+				d->msg = msg;
+			}
+			cur = d->msg_cnt++;
+			d->msg[cur].id = dbc_key(id, FALSE);
+			d->msg[cur].first = d->sig_cnt;
+			d->msg[cur].count = 0;
+			d->msg[cur].mux = -1;
+		}
+		else if (strncmp(line, "SG_ ", 4) == 0 && cur >= 0)
+		{
+			if (d->sig_cnt == sig_max)
+			{
+				sig_max = sig_max ? sig_max * 2 : 256;
+				dbc_signal_t *sig = (dbc_signal_t*)realloc(d->sig, sig_max * sizeof(dbc_signal_t));
+				if (sig == NULL)
+					goto NOMEM;
+				d->sig = sig;
+			}
+			dbc_signal_t *sig = &d->sig[d->sig_cnt];
+			int is_switch;
+			if (!dbc_parse_signal(line + 4, sig, &is_switch))
+			{
+				free(sig->name);
+				free(sig->unit);
+				goto SYNTAX;
+			}
+			d->sig_cnt++;
+			if (sig->name == NULL || sig->unit == NULL)
+				goto NOMEM;
+			if (sig->mask == 0)
+				skipped++;
+			sig->msg = cur;
+			sig->msg_index = d->msg[cur].count++;
+			if (is_switch)
+				d->msg[cur].mux = d->sig_cnt - 1;
+		}
+		else if (strncmp(line, "SIG_VALTYPE_ ", 13) == 0)
+		{
+			unsigned long id;
+			char name[DBC_NAME_LEN];
+			int type;
+			uint32_t i = 0;
+			if (sscanf(line + 13, "%lu %127[^: ] : %d", &id, name, &type) != 3)
+				goto SYNTAX;
+			for (; i < d->sig_cnt; i++)
+			{
+				dbc_signal_t *sig = &d->sig[i];
+				if (d->msg[sig->msg].id == dbc_key(id, FALSE) && strcmp(sig->name, name) == 0
+					&& sig->mask != 0)
+				{
+					sig->is_float = type;
+					sig->sign = 0;
+				}
+			}
+		}
+		NEXT:
+		line = next;
+		continue;
+
+		SYNTAX:
+		snprintf(LAST_ERROR, LE_LEN, "Error: %s:%u: syntax error", path, line_no);
+		goto FAIL;
+	}
+
+	// index the messages by CAN ID
+	uint32_t ext_cnt = 0;
+	uint32_t i = 0;
+	for (; i < d->msg_cnt; i++)
+	{
+		if (dbc_find(d, d->msg[i].id) != NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: %s: CAN ID 0x%X%s defined twice", path,
+				d->msg[i].id & 0x1FFFFFFF, d->msg[i].id & 0x80000000 ? " extended" : "");
+			goto FAIL;
+		}
+		if (d->msg[i].id < SUB_STD_IDS)
+			d->std[d->msg[i].id] = i + 1;
+		else
+		{
+			if (d->ext == NULL)
+			{
+				uint32_t n = 0;
+				uint32_t j = i;
+				for (; j < d->msg_cnt; j++)
+					n += d->msg[j].id >= SUB_STD_IDS;
+				// at most half full
+				for (d->ext_bits = 4; (1u << d->ext_bits) < 2 * n; d->ext_bits++)
+					;
+				d->ext = (uint32_t*)calloc(1u << d->ext_bits, sizeof(uint32_t));
+				if (d->ext == NULL)
+					goto NOMEM;
+			}
+			uint32_t mask = (1u << d->ext_bits) - 1;
+			uint32_t h = (d->msg[i].id * 2654435761u) >> (32 - d->ext_bits);
+			while (d->ext[h])
+				h = (h + 1) & mask;
+			d->ext[h] = i + 1;
+			ext_cnt++;
+		}
+	}
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tMessages: %u (%u above 0x7FF), signals: %u, beyond 8 bytes: %u\n",
+			d->msg_cnt, ext_cnt, d->sig_cnt, skipped);
+		writelog(log_msg);
+	}
+	return d;
+
+	NOMEM:
+	snprintf(LAST_ERROR, LE_LEN, "Error: out of memory");
+	FAIL:
+	dbc_free(d);
+	return NULL;
+}
+
+/*
+  Compile a DBC file into decode plans for PassThruDecodeDbc.  Messages,
+  signals, multiplexing and float signals are used, everything else in the
+  file is ignored.  Signals beyond the first 8 payload bytes decode as 0.
+  Bit 31 of a BO_ ID marks an extended frame, so a standard and an
+  extended message may share an ID.
+ */
+int32_t PassThruLoadDbc(const char *pPath, unsigned long *pDbcID, unsigned long *pNumSignals)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "LoadDbc\n\t|\n\tPath:\t%s\n", pPath ? pPath : "NULL");
+		writelog(log_msg);
+	}
+
+	if (pPath == NULL || pDbcID == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pPath and pDbcID must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	int slot = 0;
+	while (slot < MAX_DBC && dbc[slot])
+		slot++;
+	if (slot == MAX_DBC)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Too many DBC files loaded");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+
+	FILE *fp = fopen(pPath, "rb");
+	if (fp == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: cannot open %s: %s", pPath, strerror(errno));
+		return J2534_ERR_FAILED;
+	}
+	char *text = NULL;
+	long len = -1;
+	if (fseek(fp, 0, SEEK_END) == 0)
+		len = ftell(fp);
+	if (len >= 0 && fseek(fp, 0, SEEK_SET) == 0)
+		text = (char*)malloc(len + 1);
+	if (text == NULL || fread(text, 1, len, fp) != (size_t)len)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: cannot read %s", pPath);
+		fclose(fp);
+		free(text);
+		return J2534_ERR_FAILED;
+	}
+	fclose(fp);
+	text[len] = 0;
+
+	dbc_t *d = dbc_parse(pPath, text);
+	free(text);
+	if (d == NULL)
+		return J2534_ERR_FAILED;
+	dbc[slot] = d;
+	*pDbcID = slot + 1;
+	if (pNumSignals)
+		*pNumSignals = d->sig_cnt;
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tDbcID:\t%lu\nEndLoadDbc\n", *pDbcID);
+		writelog(log_msg);
+	}
+	return J2534_NOERROR;
+}
+
+static dbc_t *dbc_get(const unsigned long DbcID)
+{
+	if (DbcID == 0 || DbcID > MAX_DBC || dbc[DbcID - 1] == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid DbcID");
+		return NULL;
+	}
+	return dbc[DbcID - 1];
+}
+
+/*
+  Free a DBC file loaded by PassThruLoadDbc.
+ */
+int32_t PassThruUnloadDbc(const unsigned long DbcID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "UnloadDbc\n\t|\n\tDbcID:\t%lu\n", DbcID);
+		writelog(log_msg);
+	}
+	if (dbc_get(DbcID) == NULL)
+		return J2534_ERR_INVALID_MSG_ID;
+	dbc_free(dbc[DbcID - 1]);
+	dbc[DbcID - 1] = NULL;
+	return J2534_NOERROR;
+}
+
+/*
+  Describe signal Index of a DBC file, Index is the position of the value
+  written by PassThruDecodeDbc.
+ */
+int32_t PassThruGetDbcSignal(const unsigned long DbcID, const unsigned long Index, DBC_SIGNAL *pSignal)
+{
+	TRACE_SPAN(__func__);
+	const dbc_t *d = dbc_get(DbcID);
+	if (d == NULL)
+		return J2534_ERR_INVALID_MSG_ID;
+	if (pSignal == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pSignal must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	if (Index >= d->sig_cnt)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid signal index");
+		return J2534_ERR_INVALID_MSG;
+	}
+	const dbc_signal_t *sig = &d->sig[Index];
+	pSignal->pName = sig->name;
+	pSignal->pUnit = sig->unit;
+	pSignal->MsgID = d->msg[sig->msg].id;
+	pSignal->MsgIndex = sig->msg_index;
+	pSignal->Factor = sig->factor;
+	pSignal->Offset = sig->offset;
+	return J2534_NOERROR;
+}
+
+/*
+  Decode the signals of each message in pMsg into pValues, indexed like
+  PassThruGetDbcSignal.  Values of signals not carried by the messages are
+  left alone, a later message overwrites the values of an earlier one.
+ */
+int32_t PassThruDecodeDbc(const unsigned long DbcID, const PASSTHRU_MSG *pMsg,
+	const unsigned long NumMsgs, double *pValues, unsigned long *pNumDecoded)
+{
+	TRACE_SPAN(__func__);
+	const dbc_t *d = dbc_get(DbcID);
+	if (d == NULL)
+		return J2534_ERR_INVALID_MSG_ID;
+	if (pMsg == NULL || pValues == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pMsg and pValues must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+
+	unsigned long decoded = 0;
+	unsigned long i = 0;
+	for (; i < NumMsgs; i++)
+	{
+		const PASSTHRU_MSG *msg = &pMsg[i];
+		if (msg->DataSize < 4 || (msg->RxStatus & (2 | 8)))	// START_OF_MESSAGE, TX_DONE
+			continue;
+		const dbc_msg_t *m = dbc_find(d, dbc_msg_key(msg));
+		if (m == NULL)
+			continue;
+
+		uint64_t le, be, mux = 0;
+		dbc_words(msg, &le, &be);
+		if (m->mux >= 0)
+			mux = dbc_raw(&d->sig[m->mux], le, be);
+		const dbc_signal_t *sig = &d->sig[m->first];
+		double *value = &pValues[m->first];
+		uint32_t n = 0;
+		for (; n < m->count; n++)
+			if (sig[n].mux < 0 || (uint64_t)sig[n].mux == mux)
+				value[n] = sig[n].mask ? dbc_value(&sig[n], dbc_raw(&sig[n], le, be)) : 0;
+		decoded++;
+	}
+	if (pNumDecoded)
+		*pNumDecoded = decoded;
+	return J2534_NOERROR;
+}
+
+/*
+  Decode NumMsgs messages of the CAN ID MsgID, bit 31 set for an extended
+  ID as in DBC_SIGNAL, into a matrix, one row per signal of the message and
+  one column per message, so pValues needs room for NumMsgs times the
+  signals of the message.  Columns of messages with
+  another CAN ID are NaN.  The frames are unpacked in blocks and each signal
+  is then a branch free loop over the block the compiler can vectorize.
+ */
+int32_t PassThruDecodeDbcSeries(const unsigned long DbcID, const unsigned long MsgID,
+	const PASSTHRU_MSG *pMsg, const unsigned long NumMsgs, double *pValues)
+{
+	TRACE_SPAN(__func__);
+	const dbc_t *d = dbc_get(DbcID);
+	if (d == NULL)
+		return J2534_ERR_INVALID_MSG_ID;
+	if (pMsg == NULL || pValues == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pMsg and pValues must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	uint32_t id = dbc_key(MsgID, FALSE);
+	const dbc_msg_t *m = dbc_find(d, id);
+	if (m == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: CAN ID 0x%lX not in DBC file", MsgID);
+		return J2534_ERR_INVALID_MSG;
+	}
+
+	uint64_t le[DBC_BLOCK], be[DBC_BLOCK], mux[DBC_BLOCK];
+	unsigned long base = 0;
+	for (; base < NumMsgs; base += DBC_BLOCK)
+	{
+		unsigned long cnt = NumMsgs - base < DBC_BLOCK ? NumMsgs - base : DBC_BLOCK;
+		int other = FALSE;	// a message of another CAN ID is in the block
+		unsigned long f = 0;
+		for (; f < cnt; f++)
+		{
+			const PASSTHRU_MSG *msg = &pMsg[base + f];
+			if (msg->DataSize < 4 || (msg->RxStatus & (2 | 8)) || dbc_msg_key(msg) != id)
+			{
+				le[f] = be[f] = 0;
+				mux[f] = ~(uint64_t)0;
+				other = TRUE;
+				continue;
+			}
+			dbc_words(msg, &le[f], &be[f]);
+			mux[f] = m->mux >= 0 ? dbc_raw(&d->sig[m->mux], le[f], be[f]) : 0;
+		}
+
+		uint32_t n = 0;
+		for (; n < m->count; n++)
+		{
+			const dbc_signal_t *sig = &d->sig[m->first + n];
+			const uint64_t *w = sig->big_endian ? be : le;
+			const uint64_t mask = sig->mask, sign = sig->sign;
+			const unsigned int shift = sig->shift;
+			const double factor = sig->factor, offset = sig->offset;
+			double *row = pValues + (size_t)n * NumMsgs + base;
+			if (mask == 0)
+			{
+				// beyond the first 8 payload bytes
+				for (f = 0; f < cnt; f++)
+					row[f] = 0;
+			}
+			else if (sig->is_float || (mask >> 63 && !sign))
+			{
+				for (f = 0; f < cnt; f++)
+					row[f] = dbc_value(sig, (w[f] >> shift) & mask);
+			}
+			else if (sign)
+			{
+				for (f = 0; f < cnt; f++)
+					row[f] = (double)(int64_t)((((w[f] >> shift) & mask) ^ sign) - sign) * factor + offset;
+			}
+			else
+			{
+				for (f = 0; f < cnt; f++)
+					row[f] = (double)(int64_t)((w[f] >> shift) & mask) * factor + offset;
+			}
+			if (other || sig->mux >= 0)
+			{
+				uint64_t want = sig->mux >= 0 ? (uint64_t)sig->mux : 0;
+				for (f = 0; f < cnt; f++)
+					if (mux[f] == ~(uint64_t)0 || (sig->mux >= 0 && mux[f] != want))
+						row[f] = NAN;
+			}
+		}
+	}
+	return J2534_NOERROR;
+}
+
+/*
+  Fit a line through the lower envelope points of a device clock.
+*/
+static void clock_fit(clock_model_t *c)
+{
+	double mean_dev = 0, mean_diff = 0, var = 0, cov = 0;
+	int i = 0;
+	for (; i < c->pt_cnt; i++)
+	{
+		mean_dev += c->pt_dev[i];
+		mean_diff += c->pt_diff[i];
+	}
+	mean_dev /= c->pt_cnt;
+	mean_diff /= c->pt_cnt;
+	for (i = 0; i < c->pt_cnt; i++)
+	{
+		var += (c->pt_dev[i] - mean_dev) * (c->pt_dev[i] - mean_dev);
+		cov += (c->pt_dev[i] - mean_dev) * (c->pt_diff[i] - mean_diff);
+	}
+	c->ref = mean_dev;
+	c->offset = mean_diff;
+	c->drift = var > 0 ? cov / var : 0;
+	if (c->drift > CLOCK_MAX_DRIFT)
+		c->drift = CLOCK_MAX_DRIFT;
+	if (c->drift < -CLOCK_MAX_DRIFT)
+		c->drift = -CLOCK_MAX_DRIFT;
+}
+
+/*
+  Feed the device timestamp of a message and the host time it arrived to a
+  clock model, return the device timestamp converted to host time.
+*/
+static uint64_t clock_update(clock_model_t *c, const uint32_t ts, const uint64_t host)
+{
+	if (!c->started)
+	{
+		c->started = TRUE;
+		c->dev = ts;
+	}
+	else
+		c->dev += (uint32_t)(ts - c->last);	// the 32-bit device clock wraps every 71 minutes
+	c->last = ts;
+
+	int64_t diff = (int64_t)host - c->dev;
+	int64_t span = c->dev / CLOCK_SPAN;
+	if (c->pt_cnt == 0 || span != c->pt_dev[c->pt_last] / CLOCK_SPAN)
+	{
+		c->pt_last = c->pt_cnt == 0 ? 0 : (c->pt_last + 1) % CLOCK_POINTS;
+		if (c->pt_cnt < CLOCK_POINTS)
+			c->pt_cnt++;
+		c->pt_dev[c->pt_last] = c->dev;
+		c->pt_diff[c->pt_last] = diff;
+		clock_fit(c);
+	}
+	else if (diff < c->pt_diff[c->pt_last])
+	{
+		c->pt_dev[c->pt_last] = c->dev;
+		c->pt_diff[c->pt_last] = diff;
+		clock_fit(c);
+	}
+	return (uint64_t)(c->dev + c->offset + c->drift * (c->dev - c->ref) + 0.5);
+}
+
+/*
+  Connect a CAN channel through the j2534d daemon at path for a merged
+  reader and let every message through to its ring.
+*/
+static int32_t merge_connect(merge_source_t *src, const char *path, const MERGE_CONFIG *cfg)
+{
+	uint32_t device_id;
+	int32_t r = daemon_dial(path, &src->sock, &device_id);
+	if (r != J2534_NOERROR)
+		return r;
+
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	int fd = -1;
+	memset(&req, 0, sizeof(req));
+	req.op = J2534D_CONNECT;
+	req.arg[0] = 5;	// CAN
+	req.arg[1] = cfg->Flags;
+	req.arg[2] = cfg->Baudrate;
+	r = daemon_io(src->sock, &req, NULL, &rsp, NULL, 0, &fd);
+	if (r != J2534_NOERROR)
+		return r;
+	src->channel_id = rsp.arg[0];
+	src->ring_len = sizeof(j2534d_ring_t) + rsp.arg[1];
+	src->ring = daemon_map(fd, src->ring_len);
+	if (src->ring == NULL)
+		return J2534_ERR_FAILED;
+
+	// a zero mask passes everything
+	PASSTHRU_MSG pass;
+	uint8_t payload[2 * J2534D_MSG_SIZE(4)];
+	memset(&pass, 0, sizeof(pass));
+	pass.ProtocolID = 5;
+	pass.DataSize = 4;
+	uint32_t off = daemon_msg_put((j2534d_msg_t*)payload, &pass);
+	off += daemon_msg_put((j2534d_msg_t*)(payload + off), &pass);
+	memset(&req, 0, sizeof(req));
+	req.op = J2534D_START_FILTER;
+	req.arg[0] = src->channel_id;
+	req.arg[1] = J2534_PASS_FILTER;
+	req.len = off;
+	return daemon_io(src->sock, &req, payload, &rsp, NULL, 0, NULL);
+}
+
+/*
+  Disconnect every source of a merged reader and free it.
+*/
+static void merge_free(merge_t *m)
+{
+	unsigned long i = 0;
+	for (; i < MERGE_SOURCES; i++)
+	{
+		merge_source_t *src = &m->src[i];
+		if (src->sock < 0)
+			continue;
+		if (src->ring)
+		{
+			daemon_simple(src->sock, J2534D_DISCONNECT, src->channel_id, 0);
+#ifndef _MSC_VER
+			munmap(src->ring, src->ring_len);
+#endif
+		}
+		daemon_simple(src->sock, J2534D_CLOSE, 0, 0);
+#ifndef _MSC_VER
+		close(src->sock);
+#endif
+	}
+	free(m);
+}
+
+/*
+  Take the next message of a source off its ring unless one is waiting to
+  be merged, and convert its timestamp to host time.
+*/
+static void merge_fill(merge_source_t *src, const uint64_t now)
+{
+	uint64_t host_time;
+	while (!src->has_head && ATOMIC_LOAD(&src->ring->head) != src->ring->tail)
+	{
+		if (!ring_get(src->ring, &src->head, &host_time))
+			continue;
+		uint64_t t = clock_update(&src->clock, (uint32_t)src->head.Timestamp, host_time ? host_time : now);
+		if (t < src->last_time)
+			t = src->last_time;	// a new fit must not reorder the messages of a source
+		src->head_time = src->last_time = t;
+		src->has_head = TRUE;
+	}
+}
+
+/*
+  Open a merged reader over the CAN channels of several devices, each
+  shared by a j2534d daemon.
+ */
+int32_t PassThruOpenMerged(const MERGE_CONFIG *pConfig, unsigned long *pMergeID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+		writelog("OpenMerged\n\t|\n");
+	if (pConfig == NULL || pConfig->pSockets == NULL || pMergeID == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pConfig, pSockets and pMergeID must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	if (pConfig->NumSockets == 0 || pConfig->NumSockets > MERGE_SOURCES)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: NumSockets must be 1 to %d", MERGE_SOURCES);
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+#ifndef _MSC_VER
+	int slot = 0;
+	while (slot < MAX_MERGED && merged[slot])
+		slot++;
+	merge_t *m = slot < MAX_MERGED ? (merge_t*)calloc(1, sizeof(merge_t)) : NULL;
+	if (m == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Too many merged readers");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	m->num = pConfig->NumSockets;
+	m->window = (uint64_t)pConfig->WindowMs * 1000;
+	unsigned long i = 0;
+	for (; i < MERGE_SOURCES; i++)
+		m->src[i].sock = -1;
+	for (i = 0; i < m->num; i++)
+	{
+		const char *path = pConfig->pSockets[i] ? pConfig->pSockets[i] : "";
+		int32_t r = merge_connect(&m->src[i], path, pConfig);
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\tSource %lu: %s, %s\n", i, path[0] ? path : J2534D_SOCKET,
+				r == J2534_NOERROR ? "connected" : (char*)LAST_ERROR);
+			writelog(log_msg);
+		}
+		if (r != J2534_NOERROR)
+		{
+			merge_free(m);
+			return r;
+		}
+	}
+	merged[slot] = m;
+	*pMergeID = slot + 1;
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tMergeID:\t%lu\nEndOpenMerged\n", *pMergeID);
+		writelog(log_msg);
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: j2534d is not supported on this platform");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Read up to *pNumMsgs messages of a merged reader in timestamp order,
+  waiting up to Timeout msec for the first one.
+ */
+int32_t PassThruReadMerged(const unsigned long MergeID, PASSTHRU_MSG *pMsg,
+	unsigned long *pNumMsgs, const unsigned long Timeout)
+{
+	TRACE_SPAN(__func__);
+	if (pMsg == NULL || pNumMsgs == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pMsg and pNumMsgs must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	unsigned long msg_cnt = *pNumMsgs;
+	*pNumMsgs = 0;
+	if (MergeID == 0 || MergeID > MAX_MERGED || merged[MergeID - 1] == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid MergeID");
+		return J2534_ERR_INVALID_MSG_ID;
+	}
+
+	merge_t *m = merged[MergeID - 1];
+	uint64_t deadline = host_usec() + (uint64_t)Timeout * 1000;
+	while (*pNumMsgs < msg_cnt)
+	{
+		uint64_t now = host_usec();
+		merge_source_t *first = NULL;	// source with the oldest message
+		merge_source_t *empty = NULL;	// a source without a message
+		unsigned long i = 0;
+		for (; i < m->num; i++)
+		{
+			merge_source_t *src = &m->src[i];
+			merge_fill(src, now);
+			if (!src->has_head)
+			{
+				if (empty == NULL)
+					empty = src;
+			}
+			else if (first == NULL || src->head_time < first->head_time)
+				first = src;
+		}
+
+		// the oldest message is final once every source has a later one or the window passed
+		if (first && (empty == NULL || first->head_time + m->window <= now))
+		{
+			PASSTHRU_MSG *msg = &pMsg[(*pNumMsgs)++];
+			memcpy(msg, &first->head, offsetof(PASSTHRU_MSG, Data) + first->head.DataSize);
+			msg->Timestamp = (unsigned long)first->head_time;
+			msg->RxStatus = (msg->RxStatus & 0x00FFFFFF) | (unsigned long)(first - m->src) << 24;
+			first->has_head = FALSE;
+			continue;
+		}
+		if (*pNumMsgs > 0 || now >= deadline)
+			break;
+
+		// sleep until the empty source publishes, polling the others every msec
+		uint64_t wait = deadline - now;
+		if (first && first->head_time + m->window - now < wait)
+			wait = first->head_time + m->window - now;
+		if (wait > 1000)
+			wait = 1000;
+		ring_wait(empty->ring, empty->ring->tail, wait);
+	}
+
+	if (*pNumMsgs == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "No messages received");
+		return Timeout > 0 ? J2534_ERR_TIMEOUT : J2534_ERR_BUFFER_EMPTY;
+	}
+	return J2534_NOERROR;
+}
+
+/*
+  Close a merged reader.
+ */
+int32_t PassThruCloseMerged(const unsigned long MergeID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "CloseMerged\n\t|\n\tMergeID:\t%lu\n", MergeID);
+		writelog(log_msg);
+	}
+	if (MergeID == 0 || MergeID > MAX_MERGED || merged[MergeID - 1] == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid MergeID");
+		return J2534_ERR_INVALID_MSG_ID;
+	}
+	merge_free(merged[MergeID - 1]);
+	merged[MergeID - 1] = NULL;
+	return J2534_NOERROR;
+}
+
+/*
+  Open an indexed capture file for queries.
+ */
+int32_t PassThruOpenCapture(const char *pPath, unsigned long *pCaptureID, CAPTURE_INFO *pInfo)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+		writelog("OpenCapture\n\t|\n");
+	if (pPath == NULL || pCaptureID == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pPath and pCaptureID must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+#ifndef _MSC_VER
+	int slot = 0;
+	while (slot < MAX_CAPSTORES && capstores[slot])
+		slot++;
+	if (slot == MAX_CAPSTORES)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Too many capture files open");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	capstore_t *cs = capstore_open(pPath);
+	if (cs == NULL)
+		return J2534_ERR_FAILED;
+	capstores[slot] = cs;
+	*pCaptureID = slot + 1;
+	if (pInfo)
+	{
+		memset(pInfo, 0, sizeof(CAPTURE_INFO));
+		pInfo->NumBlocks = cs->blocks;
+		unsigned long i = 0;
+		for (; i < cs->blocks; i++)
+			pInfo->NumFrames += cs->index[i].count;
+		if (cs->blocks)
+		{
+			pInfo->First = cs->index[0].first;
+			pInfo->Last = cs->index[cs->blocks - 1].last;
+		}
+		pInfo->Indexed = cs->rebuilt == NULL;
+	}
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tPath:\t\t%s\n\tBlocks:\t\t%lu%s\n\tCaptureID:\t%lu\nEndOpenCapture\n",
+			pPath, cs->blocks, cs->rebuilt ? " (index rebuilt)" : "", *pCaptureID);
+		writelog(log_msg);
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: indexed captures are not supported on this platform");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Return pointers to up to *pNumFrames frames of an indexed capture file
+  that fall in the time range of the query and carry one of its IDs.  The
+  frames stay valid until the file is closed.  pQuery->Cursor remembers
+  where the query stopped, call again with the same query for the next
+  frames until J2534_ERR_BUFFER_EMPTY.
+ */
+int32_t PassThruQueryCapture(const unsigned long CaptureID, CAPTURE_QUERY *pQuery,
+	const CAPTURE_FRAME **ppFrames, unsigned long *pNumFrames)
+{
+	TRACE_SPAN(__func__);
+	if (pQuery == NULL || ppFrames == NULL || pNumFrames == NULL || (pQuery->NumIDs && pQuery->pIDs == NULL))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pQuery, pIDs, ppFrames and pNumFrames must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	unsigned long frame_cnt = *pNumFrames;
+	*pNumFrames = 0;
+	if (CaptureID == 0 || CaptureID > MAX_CAPSTORES || capstores[CaptureID - 1] == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid CaptureID");
+		return J2534_ERR_INVALID_MSG_ID;
+	}
+#ifndef _MSC_VER
+	const capstore_t *cs = capstores[CaptureID - 1];
+	uint64_t end = pQuery->End ? pQuery->End : UINT64_MAX;
+	unsigned long b = 0;
+	uint32_t r = 0;
+	if (pQuery->Cursor == UINT64_MAX)
+		b = cs->blocks;
+	else if (pQuery->Cursor)
+	{
+		b = (unsigned long)((pQuery->Cursor - 1) >> 32);
+		r = (uint32_t)(pQuery->Cursor - 1);
+	}
+	else
+	{
+		// first block that reaches the start of the range
+		unsigned long hi = cs->blocks;
+		while (b < hi)
+		{
+			unsigned long mid = b + (hi - b) / 2;
+			if (cs->index[mid].last < pQuery->Start)
+				b = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+
+	// the file does not record whether a wanted ID is 11 or 29 bit, look for both
+	uint8_t want[CAPSTORE_ID_BITS / 8] = { 0 };
+	unsigned long i = 0;
+	for (; i < pQuery->NumIDs; i++)
+	{
+		uint32_t id = pQuery->pIDs[i] & 0x1FFFFFFF;
+		uint32_t bit = capstore_id_bit(id, TRUE);
+		want[bit >> 3] |= 1 << (bit & 7);
+		if (id <= 0x7FF)
+			want[id >> 3] |= 1 << (id & 7);
+	}
+
+	for (; b < cs->blocks && *pNumFrames < frame_cnt; b++, r = 0)
+	{
+		const capstore_block_t *blk = &cs->index[b];
+		if (blk->first > end)
+		{
+			b = cs->blocks;
+			break;
+		}
+		if (pQuery->NumIDs)
+		{
+			for (i = 0; i < sizeof(want) && !(want[i] & blk->ids[i]); i++)
+				;
+			if (i == sizeof(want))
+				continue;
+		}
+		const CAPTURE_FRAME *f = capstore_frames(cs, blk);
+		if (r == 0 && blk->first < pQuery->Start)
+			r = capstore_seek(f, blk->count, pQuery->Start);
+		for (; r < blk->count && *pNumFrames < frame_cnt; r++)
+		{
+			if (f[r].Timestamp > end)
+				break;
+			if (pQuery->NumIDs)
+			{
+				uint32_t id = f[r].CanID & 0x1FFFFFFF;
+				uint32_t bit = capstore_id_bit(id, (f[r].CanID & 0x80000000u) != 0);
+				if (!(want[bit >> 3] & 1 << (bit & 7)))
+					continue;
+				for (i = 0; i < pQuery->NumIDs && (pQuery->pIDs[i] & 0x1FFFFFFF) != id; i++)
+					;
+				if (i == pQuery->NumIDs)
+					continue;
+			}
+			ppFrames[(*pNumFrames)++] = &f[r];
+		}
+		if (r < blk->count)
+		{
+			if (f[r].Timestamp > end)
+				b = cs->blocks;
+			break;
+		}
+	}
+	pQuery->Cursor = b < cs->blocks ? ((uint64_t)b << 32 | r) + 1 : UINT64_MAX;
+
+	if (*pNumFrames == 0)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "No frames found");
+		return J2534_ERR_BUFFER_EMPTY;
+	}
+	return J2534_NOERROR;
+#else
+	snprintf(LAST_ERROR, LE_LEN, "Error: indexed captures are not supported on this platform");
+	return J2534_ERR_NOT_SUPPORTED;
+#endif
+}
+
+/*
+  Close an indexed capture file, the frames returned by its queries go
+  away with it.
+ */
+int32_t PassThruCloseCapture(const unsigned long CaptureID)
+{
+	TRACE_SPAN(__func__);
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "CloseCapture\n\t|\n\tCaptureID:\t%lu\n", CaptureID);
+		writelog(log_msg);
+	}
+	if (CaptureID == 0 || CaptureID > MAX_CAPSTORES || capstores[CaptureID - 1] == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid CaptureID");
+		return J2534_ERR_INVALID_MSG_ID;
+	}
+#ifndef _MSC_VER
+	capstore_free(capstores[CaptureID - 1]);
+#endif
+	capstores[CaptureID - 1] = NULL;
+	return J2534_NOERROR;
+}
+
+/*
+  Return TRUE if a ReadMemoryByAddress request of this size is in flight.
+  Responses carry no address, they are told apart by their length.
+*/
+static int mem_size_used(const mem_req_t *out, const int out_cnt, const uint32_t size)
+{
+	int i = 0;
+	for (; i < out_cnt; i++)
+		if (out[i].size == size)
+			return TRUE;
+	return FALSE;
+}
+
+/*
+  Queue a request to be sent again, the queue is kept in address order.
+*/
+static int mem_retry_add(mem_req_t *retry, int *retry_cnt, const mem_req_t *req)
+{
+	if (*retry_cnt == 2 * MEM_OUTSTANDING)
+		return FALSE;
+	int i = *retry_cnt;
+	while (i > 0 && retry[i - 1].off > req->off)
 	{
-		uint32_t i = 0;
-		for (; i < *pNumMsgs; i++)
-		{
-			writelogpassthrumsg(pMsg + i);
-		}
-		snprintf(log_msg, LM_LEN, "\tRX Buffers remaining:\t%lu\nEndReadMsg\n",
-			msg_cnt - rx_buf_idx);
-		writelog(log_msg);
+		retry[i] = retry[i - 1];
+		i--;
 	}
-	if (rx_buf_idx > msg_cnt)
+	retry[i] = *req;
+	(*retry_cnt)++;
+	return TRUE;
+}
+
+/*
+  Queue the oldest k requests in flight to be sent again after they went
+  unanswered.  Return FALSE when one of them ran out of retries.
+*/
+static int mem_lost(mem_req_t *out, int *out_cnt, const int k, mem_req_t *retry, int *retry_cnt,
+	const uint32_t retries, unsigned long *retried, uint32_t *failed)
+{
+	int i = 0;
+	for (; i < k; i++)
 	{
-		return J2534_ERR_BUFFER_OVERFLOW;
+		out[i].tries++;
+		if (out[i].tries > retries || !mem_retry_add(retry, retry_cnt, &out[i]))
+		{
+			*failed = out[i].off;
+			return FALSE;
+		}
+		(*retried)++;
 	}
-	return J2534_NOERROR;
+	memmove(out, out + k, (*out_cnt - k) * sizeof(mem_req_t));
+	*out_cnt -= k;
+	return TRUE;
 }
 
 /*
-  Write message(s) to a protocol channel.
+  Discard the responses of requests still in flight after a failed read so
+  a resumed read does not take them for its own.
+*/
+static void mem_drain(const unsigned long ChannelID, PASSTHRU_MSG *rx, const uint32_t timeout)
+{
+	unsigned long n = MEM_RX_MSGS;
+	while (PassThruReadMsgs(ChannelID, rx, &n, timeout) == J2534_NOERROR && n > 0)
+		n = MEM_RX_MSGS;
+}
+
+/*
+  Read a memory range of an ECU with pipelined ISO 14229 ReadMemoryByAddress
+  requests on an ISO15765 channel.
  */
-int32_t PassThruWriteMsgs(const unsigned long ChannelID, const PASSTHRU_MSG *pMsg,
-	unsigned long *pNumMsgs, const unsigned long timeInterval)
+int32_t PassThruReadMemory(const unsigned long ChannelID, const MEMORY_READ *pRead,
+	unsigned char *pBuffer, MEMORY_READ_STATUS *pStatus)
 {
+	TRACE_SPAN(__func__);
+	if (pRead == NULL || pBuffer == NULL || pStatus == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pRead, pBuffer and pStatus must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
 	if (write_log)
 	{
 		snprintf(log_msg, LM_LEN,
-			"WriteMsgs\n\t|\n"
+			"ReadMemory\n\t|\n"
 			"\tChannelID:\t%lu\n"
-			"\tpNumMsgs:\t%lu\n"
-			"\tTimeout:\t%lu msec\n",
-			ChannelID, *pNumMsgs, timeInterval);
+			"\tAddress:\t%08lX\n"
+			"\tLength:\t\t%lu\n"
+			"\tBytesRead:\t%lu\n",
+			ChannelID, pRead->Address, pRead->Length, pStatus->BytesRead);
 		writelog(log_msg);
-		writelogpassthrumsg(pMsg);
+	}
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
+	if (con->channel != ISO15765)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: memory reads need an ISO15765 channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
+	}
+	if (pRead->AddressBytes < 1 || pRead->AddressBytes > 4 || pRead->SizeBytes < 1 || pRead->SizeBytes > 4)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: AddressBytes and SizeBytes must be 1 to 4");
+		return J2534_ERR_INVALID_MSG;
+	}
+	if (pStatus->BytesRead > pRead->Length)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: BytesRead is beyond Length");
+		return J2534_ERR_INVALID_MSG;
 	}
 
-	unsigned long msg_cnt = *pNumMsgs, i = 0, msg_data_size = 0;
-	int r = LIBUSB_SUCCESS;
-	uint8_t data[PM_DATA_LEN];
-	size_t strln = 0;
-	*pNumMsgs = 0;
-
-	while (i < msg_cnt)
+	uint32_t timeout = pRead->Timeout ? pRead->Timeout : 1000;
+	uint32_t retries = pRead->Retries ? pRead->Retries : 3;
+	uint32_t max_blk = MEM_BLOCK_MAX;
+	if (pRead->MaxBlockSize && pRead->MaxBlockSize < max_blk)
+		max_blk = pRead->MaxBlockSize;
+	if (pRead->SizeBytes == 1 && max_blk > 0xFF)
+		max_blk = 0xFF;
+	uint32_t blk = pStatus->BlockSize ? pStatus->BlockSize : pRead->BlockSize ? pRead->BlockSize : 256;
+	if (blk > max_blk)
+		blk = max_blk;
+	uint32_t max_win = pRead->MaxOutstanding ? pRead->MaxOutstanding : 4;
+	if (max_win > MEM_OUTSTANDING)
+		max_win = MEM_OUTSTANDING;
+	uint32_t win = pStatus->Outstanding ? pStatus->Outstanding : 1;
+	if (win > max_win)
+		win = max_win;
+
+	PASSTHRU_MSG *rx = (PASSTHRU_MSG*)calloc(MEM_RX_MSGS + 1, sizeof(PASSTHRU_MSG));
+	if (rx == NULL)
 	{
-		msg_data_size = pMsg[i].DataSize;
+		snprintf(LAST_ERROR, LE_LEN, "Error: Out of memory");
+		return J2534_ERR_FAILED;
+	}
+	PASSTHRU_MSG *tx = &rx[MEM_RX_MSGS];
+	tx->ProtocolID = 6;		// ISO15765
+	tx->TxFlags = pRead->TxFlags;
+	tx->Data[0] = (uint8_t)(pRead->TxID >> 24);
+	tx->Data[1] = (uint8_t)(pRead->TxID >> 16);
+	tx->Data[2] = (uint8_t)(pRead->TxID >> 8);
+	tx->Data[3] = (uint8_t)pRead->TxID;
+	tx->Data[4] = 0x23;		// ReadMemoryByAddress
+	tx->Data[5] = (uint8_t)(pRead->SizeBytes << 4 | pRead->AddressBytes);
+	tx->DataSize = 6 + pRead->AddressBytes + pRead->SizeBytes;
+
+	/*
+	  out holds the requests in flight in the order they were sent.  The ECU
+	  answers in that order, so a response matched by its length also tells
+	  that the requests sent before it went unanswered.  Every request in
+	  flight has a different size to keep that match unambiguous.
+	*/
+	mem_req_t out[MEM_OUTSTANDING], retry[2 * MEM_OUTSTANDING];
+	int out_cnt = 0, retry_cnt = 0;
+	int drain = FALSE;		// send nothing until the requests in flight are resolved
+	int silent = 0;			// rejections not yet tied to a request
+	int blk_final = pStatus->BlockSize != 0 || blk == max_blk;	// block size probing is over
+	uint32_t ok = 0;		// responses since the window last grew
+	uint32_t win_limit = max_win;	// largest window the ECU kept up with
+	uint32_t next = pStatus->BytesRead;
+	uint32_t len = pRead->Length;
+	uint32_t failed = len;	// request the read failed on
+	uint64_t start = host_usec(), deadline = 0, bytes = 0;
+	int32_t ret = J2534_NOERROR;
+	pStatus->Requests = pStatus->Retries = pStatus->Nrc = 0;
+
+	while (ret == J2534_NOERROR && (out_cnt > 0 || retry_cnt > 0 || next < len))
+	{
+		// keep up to win requests in flight, resending lost ones first
+		while (!drain && out_cnt < (int)win)
+		{
+			mem_req_t req;
+			if (retry_cnt > 0)
+			{
+				req = retry[0];
+				if (mem_size_used(out, out_cnt, req.size))
+					break;
+			}
+			else if (next < len)
+			{
+				req.off = next;
+				req.size = len - next < blk ? len - next : blk;
+				req.tries = 0;
+				while (req.size > 1 && mem_size_used(out, out_cnt, req.size))
+					req.size--;
+				if (mem_size_used(out, out_cnt, req.size))
+					break;
+			}
+			else
+				break;
 
-		if (msg_data_size > 0 && msg_data_size <= PM_DATA_LEN)
+			uint32_t addr = (uint32_t)pRead->Address + req.off;
+			uint8_t *p = &tx->Data[6];
+			int i = pRead->AddressBytes;
+			while (i-- > 0)
+				*p++ = (uint8_t)(addr >> (8 * i));
+			i = pRead->SizeBytes;
+			while (i-- > 0)
+				*p++ = (uint8_t)(req.size >> (8 * i));
+			unsigned long n = 1;
+			ret = PassThruWriteMsgs(ChannelID, tx, &n, timeout);
+			if (ret != J2534_NOERROR)
+			{
+				failed = req.off;
+				break;
+			}
+
+			if (out_cnt == 0)
+				deadline = host_usec() + (uint64_t)timeout * 1000;
+			out[out_cnt++] = req;
+			if (retry_cnt > 0 && req.off == retry[0].off)
+				memmove(retry, retry + 1, --retry_cnt * sizeof(mem_req_t));
+			else
+				next += req.size;
+			pStatus->Requests++;
+		}
+		if (ret != J2534_NOERROR)
+			break;
+		if (out_cnt == 0)
 		{
-			snprintf(data, PM_DATA_LEN, "att%lu %lu %lu\r\n", ChannelID, pMsg[i].DataSize, pMsg[i].TxFlags);
+			drain = FALSE;
+			continue;
+		}
 
-			strln = strlen(data);
-			uint32_t j = 0;
-			while (j < msg_data_size)
-				data[strln++] = pMsg[i].Data[j++];
+		uint64_t now = host_usec();
+		unsigned long n = MEM_RX_MSGS;
+		// at least 1 msec, a timeout of 0 waits forever without the USB event thread
+		ret = PassThruReadMsgs(ChannelID, rx, &n,
+			deadline > now + 1000 ? (unsigned long)((deadline - now + 999) / 1000) : 1);
+		if (ret == J2534_ERR_TIMEOUT || ret == J2534_ERR_BUFFER_EMPTY)
+			ret = J2534_NOERROR;
+		now = host_usec();
+
+		unsigned long m = 0;
+		for (; ret == J2534_NOERROR && m < n; m++)
+		{
+			const PASSTHRU_MSG *msg = &rx[m];
+			if (msg->RxStatus & 0x0B || msg->DataSize < 5)
+				continue;	// loopback, first frame and TX done indications
+			uint32_t id = (uint32_t)msg->Data[0] << 24 | (uint32_t)msg->Data[1] << 16 |
+				(uint32_t)msg->Data[2] << 8 | msg->Data[3];
+			if (pRead->RxID && id != pRead->RxID)
+				continue;
+			const uint8_t *rsp = &msg->Data[4];
+			uint32_t rsp_len = msg->DataSize - 4;
+
+			if (rsp[0] == 0x63)		// positive response
+			{
+				int k = 0;
+				while (k < out_cnt && out[k].size != rsp_len - 1)
+					k++;
+				if (k == out_cnt)
+					continue;	// late answer to a request already given up on
+				memcpy(pBuffer + out[k].off, rsp + 1, out[k].size);
+				bytes += out[k].size;
+
+				// the requests sent before it were rejected or lost
+				if (k > 0)
+				{
+					if (!mem_lost(out, &out_cnt, k, retry, &retry_cnt, retries, &pStatus->Retries, &failed))
+					{
+						ret = J2534_ERR_TIMEOUT;
+						break;
+					}
+					silent = silent > k ? silent - k : 0;
+					win_limit = win > 1 ? win - 1 : 1;
+					win = win > 1 ? win / 2 : 1;
+					drain = TRUE;
+				}
+				memmove(out, out + 1, --out_cnt * sizeof(mem_req_t));
+				deadline = now + (uint64_t)timeout * 1000;
 
-			r = usb_send_expect(data, strln, PM_DATA_LEN, 0, NULL);
+				// find the block size at one request in flight, then grow the window
+				if (!blk_final)
+				{
+					blk = blk * 2 < max_blk ? blk * 2 : max_blk;
+					blk_final = blk == max_blk;
+				}
+				else if (!drain && ++ok >= win && win < win_limit)
+				{
+					win++;
+					ok = 0;
+				}
+			}
+			else if (rsp[0] == 0x7F && rsp_len >= 3 && rsp[1] == 0x23)
+			{
+				uint8_t nrc = rsp[2];
+				pStatus->Nrc = nrc;
+				if (nrc == 0x78)	// response pending
+				{
+					deadline = now + (uint64_t)UDS_PENDING * 1000;
+					continue;
+				}
+				if (out_cnt > 1)
+				{
+					// not known which request was rejected, find out at a window of 1
+					silent++;
+					if (nrc == 0x21)
+						win_limit = win > 1 ? win - 1 : 1;
+					win = 1;
+					drain = TRUE;
+					continue;
+				}
+				mem_req_t req = out[0];
+				silent = 0;
+				deadline = now + (uint64_t)timeout * 1000;
+				if (nrc == 0x21)	// busy, repeat request
+				{
+					if (!mem_lost(out, &out_cnt, 1, retry, &retry_cnt, retries, &pStatus->Retries, &failed))
+					{
+						snprintf(LAST_ERROR, LE_LEN, "Error: ECU busy reading %08lX", pRead->Address + req.off);
+						ret = J2534_ERR_FAILED;
+					}
+				}
+				else if ((nrc == 0x13 || nrc == 0x14 || nrc == 0x31) && req.size > 1)
+				{
+					// wrong length, response too long or out of range, try half the size
+					out_cnt = 0;
+					blk = max_blk = req.size / 2;
+					blk_final = TRUE;
+					mem_req_t tail = req;
+					req.size = blk;
+					tail.off += blk;
+					tail.size -= blk;
+					if (!mem_retry_add(retry, &retry_cnt, &req) || !mem_retry_add(retry, &retry_cnt, &tail))
+					{
+						snprintf(LAST_ERROR, LE_LEN, "Error: Too many reads to retry");
+						failed = req.off;
+						ret = J2534_ERR_FAILED;
+					}
+					pStatus->Retries++;
+				}
+				else
+				{
+					snprintf(LAST_ERROR, LE_LEN, "Error: Read at %08lX rejected, NRC %02X",
+						pRead->Address + req.off, nrc);
+					out_cnt = 0;
+					failed = req.off;
+					ret = J2534_ERR_FAILED;
+				}
+			}
 		}
-		else
+		if (ret == J2534_ERR_TIMEOUT)
+			snprintf(LAST_ERROR, LE_LEN, "Error: No response to read at %08lX", pRead->Address + failed);
+		if (ret != J2534_NOERROR)
+			break;
+
+		// the rest of the requests in flight were rejected, or the oldest timed out
+		if (out_cnt > 0 && (silent >= out_cnt || now >= deadline))
 		{
-			if (write_log)
+			if (!mem_lost(out, &out_cnt, silent >= out_cnt ? out_cnt : 1, retry, &retry_cnt, retries,
+				&pStatus->Retries, &failed))
 			{
-				snprintf(log_msg, LM_LEN, "\tInvalid message size: %lu\n", msg_data_size);
-				writelog(log_msg);
+				snprintf(LAST_ERROR, LE_LEN, "Error: No response to read at %08lX", pRead->Address + failed);
+				ret = J2534_ERR_TIMEOUT;
 			}
-			snprintf(LAST_ERROR, LE_LEN, "Invalid message size: %lu", msg_data_size);
-			return J2534_ERR_INVALID_MSG;
+			silent = 0;
+			win_limit = win > 1 ? win - 1 : 1;
+			win = 1;
+			drain = TRUE;
+			deadline = now + (uint64_t)timeout * 1000;
 		}
-		*pNumMsgs = ++i;
 	}
+
+	// everything before the first unread byte is in pBuffer
+	uint32_t done = next < failed ? next : failed;
+	int i = 0;
+	for (; i < out_cnt; i++)
+		if (out[i].off < done)
+			done = out[i].off;
+	if (retry_cnt > 0 && retry[0].off < done)
+		done = retry[0].off;
+	if (out_cnt > 0 && ret != J2534_ERR_DEVICE_NOT_CONNECTED)
+		mem_drain(ChannelID, rx, timeout);
+	free(rx);
+
+	uint64_t elapsed = host_usec() - start;
+	pStatus->BytesRead = done;
+	pStatus->BlockSize = blk;
+	pStatus->Outstanding = win;
+	pStatus->BytesPerSecond = elapsed > 0 ? (unsigned long)(bytes * 1000000 / elapsed) : 0;
 	if (write_log)
-		writelog("EndWriteMsgs\n");
-	return error_map(r);
+	{
+		snprintf(log_msg, LM_LEN,
+			"\tBytesRead:\t%lu\n\tBytesPerSecond:\t%lu\n\tBlockSize:\t%lu\n\tOutstanding:\t%lu\n"
+			"\tRequests:\t%lu\n\tRetries:\t%lu\nEndReadMemory\n",
+			pStatus->BytesRead, pStatus->BytesPerSecond, pStatus->BlockSize, pStatus->Outstanding,
+			pStatus->Requests, pStatus->Retries);
+		writelog(log_msg);
+	}
+	return ret;
 }
 
 /*
-  Start sending a message at a specified time interval on a protocol channel.
- */
-int32_t PassThruStartPeriodicMsg(const unsigned long ChannelID, const PASSTHRU_MSG *pMsg,
-	const unsigned long *pMsgID, const unsigned long timeInterval)
+  Send a UDS request and start waiting for its response.
+*/
+static int32_t uds_send(uds_req_t *req)
 {
-	if (write_log)
-		writelog("StartPeriodic, not supported\n");
-	return J2534_ERR_NOT_SUPPORTED;
+	PASSTHRU_MSG msg;
+	msg.ProtocolID = 6;		// ISO15765
+	msg.RxStatus = 0;
+	msg.TxFlags = req->tx_flags;
+	msg.Timestamp = 0;
+	msg.ExtraDataIndex = 0;
+	msg.DataSize = 4 + req->size;
+	msg.Data[0] = (uint8_t)(req->tx_id >> 24);
+	msg.Data[1] = (uint8_t)(req->tx_id >> 16);
+	msg.Data[2] = (uint8_t)(req->tx_id >> 8);
+	msg.Data[3] = (uint8_t)req->tx_id;
+	memcpy(&msg.Data[4], req->data, req->size);
+	unsigned long n = 1;
+	int32_t r = PassThruWriteMsgs(strtoul(&con->channel, NULL, 10), &msg, &n, req->p2);
+	req->state = UDS_SENT;
+	req->deadline = host_usec() + (uint64_t)req->p2 * 1000;
+	req->pending_cnt = 0;
+	return r;
 }
 
 /*
-  Stop a periodic message.
- */
-int32_t PassThruStopPeriodicMsg(const unsigned long ChannelID, const unsigned long msgID)
+  Free a finished request and send the oldest request queued behind it for
+  the same target.
+*/
+static void uds_finish(uds_req_t *req)
 {
-	if (write_log)
-		writelog("StopPeriodic, not supported\n");
-	return J2534_ERR_NOT_SUPPORTED;
+	uint32_t tx_id = req->tx_id;
+	free(req->data);
+	memset(req, 0, sizeof(uds_req_t));
+
+	uds_req_t *queued = NULL;
+	int i = 0;
+	for (; i < MAX_UDS; i++)
+		if (uds[i].id && uds[i].state == UDS_QUEUED && uds[i].tx_id == tx_id
+			&& (queued == NULL || uds[i].id < queued->id))
+			queued = &uds[i];
+	if (queued && uds_send(queued) != J2534_NOERROR)
+		queued->state = UDS_FAILED;		// reported by the next PassThruReadUds
 }
 
 /*
-  Start filtering incoming messages on a protocol channel.
+  Time a request times out at, later while an ECU has replied response
+  pending and not answered yet.
+*/
+static uint64_t uds_deadline(const uds_req_t *req)
+{
+	return req->pending_cnt > 0 && req->pending > req->deadline ? req->pending : req->deadline;
+}
+
+/*
+  Fill in the record that completes a request without a response.
+*/
+static void uds_complete(UDS_RESPONSE *rsp, const uds_req_t *req, const unsigned long status)
+{
+	rsp->RequestID = req->id;
+	rsp->SourceID = 0;
+	rsp->Status = status;
+	rsp->Flags = J2534_UDS_COMPLETE;
+	rsp->Timestamp = 0;
+	rsp->DataSize = 0;
+}
+
+/*
+  Send a UDS request on a connected ISO15765 channel.  The request is sent
+  at once unless another request to the same target is outstanding, its
+  responses are returned by PassThruReadUds.
  */
-int32_t PassThruStartMsgFilter(const unsigned long ChannelID, const unsigned long FilterType,
-	const PASSTHRU_MSG *pMaskMsg, const PASSTHRU_MSG *pPatternMsg,
-	const PASSTHRU_MSG *pFlowControlMsg, unsigned long *pMsgID)
+int32_t PassThruSendUds(const unsigned long ChannelID, const UDS_REQUEST *pRequest,
+	unsigned long *pRequestID)
 {
+	TRACE_SPAN(__func__);
+	if (pRequest == NULL || pRequest->pData == NULL || pRequestID == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pRequest, pData and pRequestID must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
 	if (write_log)
 	{
 		snprintf(log_msg, LM_LEN,
-			"StartMsgFilter\n\t|\n"
+			"SendUds\n\t|\n"
 			"\tChannelID:\t%lu\n"
-			"\tFilterType:\t%lu\n"
-			"\tpMaskMsg:\n",
-			ChannelID, FilterType);
+			"\tTxID:\t\t%08lX\n"
+			"\tRxID:\t\t%08lX/%08lX\n"
+			"\tService:\t%02X\n"
+			"\tFlags:\t\t%08lX\n",
+			ChannelID, pRequest->TxID, pRequest->RxID, pRequest->RxMask,
+			pRequest->DataSize ? pRequest->pData[0] : 0, pRequest->Flags);
 		writelog(log_msg);
-		writelogpassthrumsg(pMaskMsg);
-		writelog("\n\tpPatternMsg:\n");
-		writelogpassthrumsg(pPatternMsg);
-		writelog("\n\tpFlowControlMsg:\n");
-		if (pFlowControlMsg == NULL)
-			writelog("\tNULL");
-		else
-			writelogpassthrumsg(pFlowControlMsg);
-		writelog("\n");
 	}
-
-	if (pMaskMsg == NULL || pPatternMsg == NULL)
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: PASSTHRU_MSG* must not be NULL");
-		return J2534_ERR_NULL_PARAMETER;
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
 	}
-	if (pMaskMsg->DataSize > 12 || pPatternMsg->DataSize > 12)
+	if (con->channel != ISO15765)
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: PASSTHRU_MSG invalid data length");
-		return J2534_ERR_INVALID_MSG;
+		snprintf(LAST_ERROR, LE_LEN, "Error: UDS requests need an ISO15765 channel");
+		return J2534_ERR_INVALID_PROTOCOL_ID;
 	}
-	if (pMaskMsg->DataSize != pPatternMsg->DataSize)
+	if (pRequest->Flags & ~J2534_UDS_FUNCTIONAL)
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: Mask and Pattern have differnt data lenghts");
-		return J2534_ERR_INVALID_MSG;
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid Flags");
+		return J2534_ERR_INVALID_FLAGS;
 	}
-	if (pMaskMsg->TxFlags != pPatternMsg->TxFlags)
+	if (pRequest->DataSize == 0 || pRequest->DataSize > PM_DATA_LEN - 4)
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: Mask and Pattern have differnt TX flags");
+		snprintf(LAST_ERROR, LE_LEN, "Invalid message size: %lu", pRequest->DataSize);
 		return J2534_ERR_INVALID_MSG;
 	}
-	if ((FilterType == J2534_PASS_FILTER || FilterType == J2534_BLOCK_FILTER)
-		&& pFlowControlMsg)
+
+	uds_req_t *req = NULL;
+	int busy = FALSE;
+	int i = 0;
+	for (; i < MAX_UDS; i++)
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: FilterType, FlowControlMsg mismatch");
-		return J2534_ERR_INVALID_MSG;
+		if (uds[i].id == 0)
+		{
+			if (req == NULL)
+				req = &uds[i];
+		}
+		else if (uds[i].tx_id == pRequest->TxID)
+			busy = TRUE;
+	}
+	if (req == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Too many UDS requests outstanding");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	req->data = (uint8_t*)malloc(pRequest->DataSize);
+	if (req->data == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Out of memory");
+		return J2534_ERR_FAILED;
+	}
+	memcpy(req->data, pRequest->pData, pRequest->DataSize);
+	req->size = pRequest->DataSize;
+	req->sid = pRequest->pData[0];
+	req->flags = pRequest->Flags;
+	req->tx_id = pRequest->TxID;
+	req->tx_flags = pRequest->TxFlags;
+	req->rx_id = pRequest->RxID;
+	req->rx_mask = pRequest->RxMask ? pRequest->RxMask : 0xFFFFFFFF;
+	req->p2 = pRequest->Timeout ? pRequest->Timeout : 1000;
+	req->p2_star = pRequest->PendingTimeout ? pRequest->PendingTimeout : UDS_PENDING;
+	req->answered = 0;
+	req->id = uds_next_id++;
+	if (uds_next_id == 0)
+		uds_next_id = 1;
+
+	if (busy)
+		req->state = UDS_QUEUED;
+	else
+	{
+		int32_t r = uds_send(req);
+		if (r != J2534_NOERROR)
+		{
+			free(req->data);
+			memset(req, 0, sizeof(uds_req_t));
+			return r;
+		}
+	}
+	*pRequestID = req->id;
+	if (write_log)
+	{
+		snprintf(log_msg, LM_LEN, "\tRequestID:\t%lu%s\nEndSendUds\n", *pRequestID, busy ? " queued" : "");
+		writelog(log_msg);
 	}
+	return J2534_NOERROR;
+}
 
-	uint8_t data[MAX_LEN];
-	snprintf(data, MAX_LEN, "atf%lu %lu %lu %lu\r\n", ChannelID,
-		FilterType, pMaskMsg->TxFlags, pMaskMsg->DataSize);
-
-	// append the mask, pattern and flow control bytes keeping track of the final byte count
-	size_t j = 0;
-	size_t datalen = strlen(data);
-	size_t i = datalen;
-	datalen = datalen + pMaskMsg->DataSize;
-	while (i < datalen)
-		data[i++] = pMaskMsg->Data[j++];
-
-	datalen = i + pPatternMsg->DataSize;
-	j = 0;
-	while (i < datalen)
-		data[i++] = pPatternMsg->Data[j++];
+/*
+  Read up to *pNumResponses UDS responses and completions, waiting up to
+  Timeout msec for the first one.
+ */
+int32_t PassThruReadUds(const unsigned long ChannelID, UDS_RESPONSE *pResponse,
+	unsigned long *pNumResponses, const unsigned long Timeout)
+{
+	TRACE_SPAN(__func__);
+	if (pResponse == NULL || pNumResponses == NULL)
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: pResponse and pNumResponses must not be NULL");
+		return J2534_ERR_NULL_PARAMETER;
+	}
+	unsigned long room = *pNumResponses, cnt = 0;
+	*pNumResponses = 0;
+	if (ChannelID != strtoul(&con->channel, NULL, 10))
+	{
+		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+		return J2534_ERR_INVALID_CHANNEL_ID;
+	}
 
-	if (pFlowControlMsg)
+	PASSTHRU_MSG *rx = (PASSTHRU_MSG*)malloc(UDS_RX_MSGS * sizeof(PASSTHRU_MSG));
+	if (rx == NULL)
 	{
-		datalen = i + pFlowControlMsg->DataSize;
-		j = 0;
-		while (i < datalen)
-			data[i++] = pFlowControlMsg->Data[j++];
+		snprintf(LAST_ERROR, LE_LEN, "Error: Out of memory");
+		return J2534_ERR_FAILED;
 	}
+	uint64_t now = host_usec(), end = now + (uint64_t)Timeout * 1000;
+	int32_t ret = J2534_NOERROR;
+	int active = TRUE;
+	while (cnt < room)
+	{
+		// wait for the next response until the first request or the call times out
+		active = FALSE;
+		uint64_t wake = cnt > 0 ? now : end;
+		int i = 0;
+		for (; i < MAX_UDS; i++)
+		{
+			if (uds[i].id == 0)
+				continue;
+			active = TRUE;
+			if (uds[i].state == UDS_FAILED)
+				wake = now;
+			else if (uds[i].state == UDS_SENT && uds_deadline(&uds[i]) < wake)
+				wake = uds_deadline(&uds[i]);
+		}
+		if (!active)
+			break;
+
+		unsigned long n = room - cnt < UDS_RX_MSGS ? room - cnt : UDS_RX_MSGS;
+		ret = PassThruReadMsgs(ChannelID, rx, &n,
+			wake > now + 1000 ? (unsigned long)((wake - now + 999) / 1000) : 1);	// 0 would wait forever
+		if (ret == J2534_ERR_TIMEOUT || ret == J2534_ERR_BUFFER_EMPTY)
+			ret = J2534_NOERROR;
+		if (ret != J2534_NOERROR)
+			break;
+		now = host_usec();
 
-	int r = usb_send_expect(data, i, MAX_LEN, 2000, "arf");
+		unsigned long m = 0;
+		for (; m < n; m++)
+		{
+			const PASSTHRU_MSG *msg = &rx[m];
+			if (msg->RxStatus & 0x0B || msg->DataSize < 5)
+				continue;	// loopback, first frame and TX done indications
+			uint32_t src = (uint32_t)msg->Data[0] << 24 | (uint32_t)msg->Data[1] << 16 |
+				(uint32_t)msg->Data[2] << 8 | msg->Data[3];
+			uint8_t sid = msg->Data[4], nrc = 0;
+			if (sid == 0x7F && msg->DataSize >= 7)
+			{
+				sid = msg->Data[5];
+				nrc = msg->Data[6];
+			}
+			else if (sid >= 0x40)
+				sid -= 0x40;
+			else
+				continue;
+
+			// the oldest request this can answer
+			uds_req_t *req = NULL;
+			for (i = 0; i < MAX_UDS; i++)
+				if (uds[i].id && uds[i].state == UDS_SENT && uds[i].sid == sid
+					&& (src & uds[i].rx_mask) == (uds[i].rx_id & uds[i].rx_mask)
+					&& (req == NULL || uds[i].id < req->id))
+					req = &uds[i];
+			if (req == NULL)
+				continue;
+			uint32_t k = 0;
+			while (k < req->pending_cnt && req->pending_src[k] != src)
+				k++;
+			if (nrc == 0x78)	// response pending
+			{
+				if (k == req->pending_cnt && k < UDS_PENDING_SRCS)
+					req->pending_src[req->pending_cnt++] = src;
+				req->pending = now + (uint64_t)req->p2_star * 1000;
+				continue;
+			}
+			if (k < req->pending_cnt)
+				req->pending_src[k] = req->pending_src[--req->pending_cnt];
+
+			UDS_RESPONSE *rsp = &pResponse[cnt++];
+			rsp->RequestID = req->id;
+			rsp->SourceID = src;
+			rsp->Status = J2534_NOERROR;
+			rsp->Flags = 0;
+			rsp->Timestamp = msg->Timestamp;
+			rsp->DataSize = msg->DataSize - 4;
+			memcpy(rsp->Data, &msg->Data[4], rsp->DataSize);
+			if (req->flags & J2534_UDS_FUNCTIONAL)
+				req->answered++;
+			else
+			{
+				rsp->Flags = J2534_UDS_COMPLETE;
+				uds_finish(req);
+			}
+		}
 
-	int failed = FALSE;
-	int8_t *word = strtok(data, DELIMITERS);
-	if (word)
-	{
-		word = strtok(NULL, DELIMITERS);
-		if (word)
+		// requests whose time ran out or that could not be sent
+		for (i = 0; i < MAX_UDS && cnt < room; i++)
 		{
-			unsigned long lval = strtoul(word, NULL, 10);
-			if (is_valid(lval))
-				*pMsgID = lval;
-			else
-				failed = TRUE;
+			uds_req_t *req = &uds[i];
+			if (req->id == 0 || req->state == UDS_QUEUED || (req->state == UDS_SENT && uds_deadline(req) > now))
+				continue;
+			uds_complete(&pResponse[cnt++], req, req->state == UDS_FAILED ? J2534_ERR_FAILED
+				: req->answered ? J2534_NOERROR : J2534_ERR_TIMEOUT);
+			uds_finish(req);
 		}
-		else
-			failed = TRUE;
+		if (now >= end || (cnt > 0 && n == 0))
+			break;
 	}
-	else
-		failed = TRUE;
+	free(rx);
 
-	if (failed)
+	*pNumResponses = cnt;
+	if (ret != J2534_NOERROR)
+		return ret;
+	if (cnt == 0)
 	{
-		snprintf(LAST_ERROR, LE_LEN, "Error: failed to parse reply");
-		r = J2534_ERR_FAILED;
+		snprintf(LAST_ERROR, LE_LEN, active ? "No UDS responses received" : "No UDS requests outstanding");
+		return active && Timeout > 0 ? J2534_ERR_TIMEOUT : J2534_ERR_BUFFER_EMPTY;
 	}
-
-	if (write_log)
-		writelog("EndStartMsgFilter\n");
-	return error_map(r);
+	return J2534_NOERROR;
 }
 
 /*
-  Stops filtering incoming messages on a protocol channel.
+  Forget an outstanding UDS request, a response still arriving for it is
+  discarded.
  */
-int32_t PassThruStopMsgFilter(const unsigned long ChannelID, const unsigned long msgID)
+int32_t PassThruCancelUds(const unsigned long ChannelID, const unsigned long RequestID)
 {
-	if (write_log)
-	{
-		snprintf(log_msg, LM_LEN,
-			"StopMsgFilter\n\t|\n"
-			"\tChannelID:\t%lu\n"
-			"\tmsgID:\t\t%lu\n",
-			ChannelID, msgID);
-		writelog(log_msg);
-	}
-
-	int r = J2534_NOERROR;
+	TRACE_SPAN(__func__);
 	if (ChannelID != strtoul(&con->channel, NULL, 10))
 	{
 		snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
-		r = J2534_ERR_INVALID_CHANNEL_ID;
+		return J2534_ERR_INVALID_CHANNEL_ID;
 	}
-	else
+	int i = 0;
+	for (; i < MAX_UDS; i++)
 	{
-		uint8_t data[MAX_LEN];
-		snprintf(data, MAX_LEN, "atk%lu %lu\r\n", ChannelID, msgID);
-		r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
+		if (RequestID != 0 && uds[i].id == RequestID)
+		{
+			uds_finish(&uds[i]);
+			return J2534_NOERROR;
+		}
 	}
-	if (write_log)
-		writelog("EndStopMsgFilter\n");
-	return error_map(r);
+	snprintf(LAST_ERROR, LE_LEN, "Error: Invalid RequestID");
+	return J2534_ERR_INVALID_MSG_ID;
 }
 
 /*
@@ -1452,6 +10603,7 @@ int32_t PassThruStopMsgFilter(const unsigned long ChannelID, const unsigned long
 int32_t PassThruSetProgrammingVoltage(const unsigned long DeviceID,
 	const unsigned long pinNumber, const unsigned long voltage)
 {
+	TRACE_SPAN(__func__);
 	if (write_log)
 		writelog("SetProgrammingVoltage, not support\n");
 	return J2534_ERR_NOT_SUPPORTED;
@@ -1463,6 +10615,7 @@ int32_t PassThruSetProgrammingVoltage(const unsigned long DeviceID,
 int32_t PassThruReadVersion(const unsigned long DeviceID, char *pFirmwareVersion,
 	char *pDllVersion, char *pApiVersion)
 {
+	TRACE_SPAN(__func__);
 	if (pFirmwareVersion == NULL || pDllVersion == NULL
 		|| pApiVersion == NULL)
 	{
@@ -1470,6 +10623,9 @@ int32_t PassThruReadVersion(const unsigned long DeviceID, char *pFirmwareVersion
 		return J2534_ERR_NULL_PARAMETER;
 	}
 
+	if (con->backend == DAEMON_BACKEND)
+		return daemon_read_version(pFirmwareVersion, pDllVersion, pApiVersion);
+
 	char dll_ver[MAX_LEN];
 
 #ifdef GET_LIBUSB_VERSION
@@ -1520,6 +10676,7 @@ int32_t PassThruReadVersion(const unsigned long DeviceID, char *pFirmwareVersion
  */
 int32_t PassThruGetLastError(char *pErrorDescription)
 {
+	TRACE_SPAN(__func__);
 	if (write_log)
 		writelog("GetLastError\n\t|\n\tErrorDescription:\t");
 	if (pErrorDescription == NULL)
@@ -1528,7 +10685,8 @@ int32_t PassThruGetLastError(char *pErrorDescription)
 			writelog("NULL");
 		return J2534_ERR_NULL_PARAMETER;
 	}
-	pErrorDescription = LAST_ERROR;
+	memcpy(pErrorDescription, LAST_ERROR, LE_LEN);	// the caller's buffer holds 80 characters
+	pErrorDescription[LE_LEN - 1] = '\0';
 	if (write_log)
 	{
 		writelog(pErrorDescription);
@@ -1545,6 +10703,7 @@ int32_t PassThruGetLastError(char *pErrorDescription)
 int32_t PassThruIoctl(const unsigned long ChannelID, const unsigned long ioctlID,
 	const void *pInput, void *pOutput)
 {
+	TRACE_SPAN(__func__);
 	if (write_log)
 	{
 		snprintf(log_msg, LM_LEN,
@@ -1554,6 +10713,42 @@ int32_t PassThruIoctl(const unsigned long ChannelID, const unsigned long ioctlID
 			ChannelID, ioctlID);
 		writelog(log_msg);
 	}
+
+	if (ioctlID == J2534_SET_READ_BATCH)
+	{
+		// handled by the library for every backend
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		const READ_BATCH *batch = pInput;
+		read_batch->min_msgs = batch ? batch->MinMsgs : 0;
+		read_batch->max_latency = batch ? batch->MaxLatency : 0;
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "[SET_READ_BATCH]\n\t\tMinMsgs: %lu, MaxLatency: %lu usec\nEndIoctl\n",
+				read_batch->min_msgs, (unsigned long)read_batch->max_latency);
+			writelog(log_msg);
+		}
+		return J2534_NOERROR;
+	}
+
+	if (con->backend == DAEMON_BACKEND)
+	{
+		int32_t dr = daemon_ioctl(ChannelID, ioctlID, pInput, pOutput);
+		if (write_log)
+			writelog("\n\tthrough j2534d\nEndIoctl\n");
+		return dr;
+	}
+	if (con->backend == SOCKETCAN_BACKEND)
+	{
+		int32_t sr = socketcan_ioctl(ioctlID, pInput, pOutput);
+		if (write_log)
+			writelog("\n\ton SocketCAN\nEndIoctl\n");
+		return sr;
+	}
+
 	uint8_t data[MAX_LEN];
 	ssize_t bytes_written = 0;
 	size_t strln = 0;
@@ -1571,11 +10766,21 @@ int32_t PassThruIoctl(const unsigned long ChannelID, const unsigned long ioctlID
 		}
 		SCONFIG *cfgitem;
 		par_cnt = inputlist->NumOfParams;
+		uint32_t sent = 0;
 		for (i = 0; i < par_cnt; ++i)
 		{
+			// keep up to CMD_SLOTS requests in flight
+			for (; sent < par_cnt && sent - i < CMD_SLOTS; sent++)
+			{
+				snprintf(data, MAX_LEN, "atg%lu %lu\r\n", ChannelID, inputlist->ConfigPtr[sent].Parameter);
+				r = cmd_send(data, strlen(data), "arg");
+				if (r != LIBUSB_SUCCESS)
+					goto EXIT_IOCTL;
+			}
 			cfgitem = &inputlist->ConfigPtr[i];
-			snprintf(data, MAX_LEN, "atg%lu %lu\r\n", ChannelID, cfgitem->Parameter);
-			r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, "arg");
+			r = cmd_wait(data, MAX_LEN, 2000);
+			if (r != LIBUSB_SUCCESS)
+				goto EXIT_IOCTL;	// data still holds the previous reply
 
 			if (data[0] == 0x61		// a
 				&& data[1] == 0x72	// r
@@ -1624,7 +10829,8 @@ int32_t PassThruIoctl(const unsigned long ChannelID, const unsigned long ioctlID
 			else
 			{
 				snprintf(LAST_ERROR, LE_LEN, "Invalid parameter response");
-				return J2534_ERR_INVALID_MSG;
+				r = J2534_ERR_INVALID_MSG;
+				goto EXIT_IOCTL;
 			}
 		}
 	}
@@ -1640,21 +10846,54 @@ int32_t PassThruIoctl(const unsigned long ChannelID, const unsigned long ioctlID
 		}
 		SCONFIG *cfgitem;
 		par_cnt = inputlist->NumOfParams;
+		uint32_t sent = 0;
+		r = LIBUSB_SUCCESS;
 		for (i = 0; i < par_cnt; ++i)
 		{
-			cfgitem = &inputlist->ConfigPtr[i];
-			snprintf(data, MAX_LEN, "ats%lu %lu %lu\r\n", ChannelID, cfgitem->Parameter, cfgitem->Value);
-			if (write_log)
+			// keep up to CMD_SLOTS parameters in flight, report the first failure
+			for (; sent < par_cnt && sent - i < CMD_SLOTS; sent++)
 			{
-				snprintf(log_msg, LM_LEN,
-					"\t\tConfigItem(p,v): %02lX, %02lX\n",
-					cfgitem->Parameter, cfgitem->Value);
-				writelog(log_msg);
+				cfgitem = &inputlist->ConfigPtr[sent];
+				snprintf(data, MAX_LEN, "ats%lu %lu %lu\r\n", ChannelID, cfgitem->Parameter, cfgitem->Value);
+				if (cfgitem->Parameter == 0x01)	// DATA_RATE
+					con->baud = cfgitem->Value;
+				if (write_log)
+				{
+					snprintf(log_msg, LM_LEN,
+						"\t\tConfigItem(p,v): %02lX, %02lX\n",
+						cfgitem->Parameter, cfgitem->Value);
+					writelog(log_msg);
+				}
+				int rs = cmd_send(data, strlen(data), NULL);
+				if (rs != LIBUSB_SUCCESS)
+				{
+					r = rs;
+					goto EXIT_IOCTL;
+				}
 			}
-			r = usb_send_expect(data, strlen(data), MAX_LEN, 2000, NULL);
+			int rw = cmd_wait(data, MAX_LEN, 2000);
+			if (r == LIBUSB_SUCCESS)
+				r = rw;
 		}
 	}
-	if (ioctlID == J2534_READ_VBATT)
+	if (ioctlID == J2534_READ_VBATT && vbatt->active)
+	{
+		if (write_log)
+			writelog("[READ_VBATT] from the sampler\n");
+		if (pOutput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: pOutput must not be NULL");
+			r = J2534_ERR_NULL_PARAMETER;
+			goto EXIT_IOCTL;
+		}
+		r = vbatt_latest(pOutput);
+		if (write_log && r == J2534_NOERROR)
+		{
+			snprintf(log_msg, LM_LEN, "\t\tPin 16 Voltage:\t%umV\n", *(uint32_t*)pOutput);
+			writelog(log_msg);
+		}
+	}
+	else if (ioctlID == J2534_READ_VBATT)
 	{
 		if (write_log)
 			writelog("[READ_VBATT]\n");
@@ -1750,8 +10989,7 @@ int32_t PassThruIoctl(const unsigned long ChannelID, const unsigned long ioctlID
 				goto EXIT_IOCTL;
 			}
 
-			r = libusb_bulk_transfer(con->dev_handle, endpoint->addr_in,
-				data, MAX_LEN, &bytes_read, 500);
+			r = usb_recv(data, MAX_LEN, &bytes_read, 500);
 			if (r != LIBUSB_SUCCESS)
 			{
 				snprintf(LAST_ERROR, LE_LEN, "Error: failed to read timing: %s",
@@ -1797,8 +11035,332 @@ int32_t PassThruIoctl(const unsigned long ChannelID, const unsigned long ioctlID
 
 		r = LIBUSB_SUCCESS;
 	}
+	if (ioctlID == J2534_GET_RX_EVENT_FD)
+	{
+		if (write_log)
+			writelog("[GET_RX_EVENT_FD]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (pOutput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: pOutput must not be NULL");
+			r = J2534_ERR_NULL_PARAMETER;
+			goto EXIT_IOCTL;
+		}
+
+		r = usb_event_start();
+		if (r != LIBUSB_SUCCESS)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: failed to start USB event thread: %s",
+				libusb_error_name(r));
+			goto EXIT_IOCTL;
+		}
+
+		RX_LOCK();
+		usb_ev->watermark = 1;
+		if (pInput && *(const unsigned long*)pInput > 0)
+			usb_ev->watermark = *(const unsigned long*)pInput;
+		rx_event_update();
+		RX_UNLOCK();
+		*(int*)pOutput = usb_ev->event_fd[0];
+		if (write_log)
+		{
+			snprintf(log_msg, LM_LEN, "\t\tRX event fd: %d, watermark: %lu\n",
+				usb_ev->event_fd[0], usb_ev->watermark);
+			writelog(log_msg);
+		}
+	}
+
+	if (ioctlID == J2534_START_CAPTURE || ioctlID == J2534_STOP_CAPTURE)
+	{
+		if (write_log)
+			writelog(ioctlID == J2534_START_CAPTURE ? "[START_CAPTURE]\n" : "[STOP_CAPTURE]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (ioctlID == J2534_STOP_CAPTURE)
+			r = capture_stop(pOutput);
+		else if (pInput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: pInput must not be NULL");
+			r = J2534_ERR_NULL_PARAMETER;
+		}
+		else
+		{
+			const CAPTURE_CONFIG *cfg = pInput;
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\t\tFormat: %lu, Path: %s, Rotate: %lu bytes, %lu s\n",
+					cfg->Format, cfg->pPath ? cfg->pPath : "NULL", cfg->RotateBytes, cfg->RotateSeconds);
+				writelog(log_msg);
+			}
+			r = capture_start(cfg);
+		}
+	}
+
+	if (ioctlID == J2534_START_SNAPSHOT || ioctlID == J2534_STOP_SNAPSHOT)
+	{
+		if (write_log)
+			writelog(ioctlID == J2534_START_SNAPSHOT ? "[START_SNAPSHOT]\n" : "[STOP_SNAPSHOT]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (ioctlID == J2534_STOP_SNAPSHOT)
+		{
+			snapshot_stop();
+			r = J2534_NOERROR;
+		}
+		else
+			r = snapshot_start();
+	}
+
+	if (ioctlID == J2534_START_BUS_STATS || ioctlID == J2534_STOP_BUS_STATS
+		|| ioctlID == J2534_READ_BUS_STATS)
+	{
+		if (write_log)
+			writelog(ioctlID == J2534_START_BUS_STATS ? "[START_BUS_STATS]\n"
+				: ioctlID == J2534_STOP_BUS_STATS ? "[STOP_BUS_STATS]\n" : "[READ_BUS_STATS]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (ioctlID == J2534_STOP_BUS_STATS)
+		{
+			bus_stats_stop();
+			r = J2534_NOERROR;
+		}
+		else if (ioctlID == J2534_START_BUS_STATS)
+			r = bus_stats_start();
+		else if (pOutput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: pOutput must not be NULL");
+			r = J2534_ERR_NULL_PARAMETER;
+		}
+		else
+		{
+			r = bus_stats_read(pOutput);
+			if (write_log && r == J2534_NOERROR)
+			{
+				const BUS_STATS *b = pOutput;
+				snprintf(log_msg, LM_LEN, "\t\t%lu frames, %lu IDs, load %.1f%%, recent %.1f%%\n",
+					b->NumFrames, b->TotalIDs, b->BusLoad * 100, b->RecentLoad * 100);
+				writelog(log_msg);
+			}
+		}
+	}
+
+	if (ioctlID == J2534_START_REPLAY || ioctlID == J2534_STOP_REPLAY
+		|| ioctlID == J2534_READ_REPLAY_STATUS)
+	{
+		if (write_log)
+			writelog(ioctlID == J2534_START_REPLAY ? "[START_REPLAY]\n"
+				: ioctlID == J2534_STOP_REPLAY ? "[STOP_REPLAY]\n" : "[READ_REPLAY_STATUS]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (ioctlID == J2534_STOP_REPLAY)
+		{
+			replay_stop(pOutput);
+			r = J2534_NOERROR;
+		}
+		else if (ioctlID == J2534_START_REPLAY ? pInput == NULL : pOutput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: %s must not be NULL",
+				ioctlID == J2534_START_REPLAY ? "pInput" : "pOutput");
+			r = J2534_ERR_NULL_PARAMETER;
+		}
+		else if (ioctlID == J2534_START_REPLAY)
+		{
+			const REPLAY_CONFIG *cfg = pInput;
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\t\tFormat: %lu, Path: %s, Loops: %lu, Speed: %.3f\n",
+					cfg->Format, cfg->pPath ? cfg->pPath : "NULL", cfg->Loops, cfg->Speed);
+				writelog(log_msg);
+			}
+			r = replay_start(cfg);
+		}
+		else
+		{
+			r = replay_status(pOutput);
+			if (write_log && r == J2534_NOERROR)
+			{
+				const REPLAY_STATUS *st = pOutput;
+				snprintf(log_msg, LM_LEN, "\t\t%lu frames, error median %lu, p99 %lu, max %lu usec\n",
+					st->NumFrames, st->Median, st->P99, st->Max);
+				writelog(log_msg);
+			}
+		}
+	}
+
+	if (ioctlID == J2534_START_GATEWAY || ioctlID == J2534_STOP_GATEWAY
+		|| ioctlID == J2534_READ_GATEWAY_STATS)
+	{
+		if (write_log)
+			writelog(ioctlID == J2534_START_GATEWAY ? "[START_GATEWAY]\n"
+				: ioctlID == J2534_STOP_GATEWAY ? "[STOP_GATEWAY]\n" : "[READ_GATEWAY_STATS]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (ioctlID == J2534_STOP_GATEWAY)
+		{
+			gateway_stop(pOutput);
+			r = J2534_NOERROR;
+		}
+		else if (ioctlID == J2534_START_GATEWAY ? pInput == NULL : pOutput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: %s must not be NULL",
+				ioctlID == J2534_START_GATEWAY ? "pInput" : "pOutput");
+			r = J2534_ERR_NULL_PARAMETER;
+		}
+		else if (ioctlID == J2534_START_GATEWAY)
+		{
+			const GATEWAY_CONFIG *cfg = pInput;
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\t\tTarget: %s, Rewrite: %lu, Block: %lu\n",
+					cfg->pTarget ? cfg->pTarget : "this channel", cfg->NumRewrite, cfg->NumBlock);
+				writelog(log_msg);
+			}
+			r = gateway_start(cfg);
+		}
+		else
+		{
+			r = gateway_read(pOutput);
+			if (write_log && r == J2534_NOERROR)
+			{
+				const GATEWAY_STATS *st = pOutput;
+				snprintf(log_msg, LM_LEN, "\t\t%lu frames, latency median %lu, p99 %lu, max %lu usec\n",
+					st->NumFrames, st->Median, st->P99, st->Max);
+				writelog(log_msg);
+			}
+		}
+	}
+
+	if (ioctlID == J2534_START_ISOTP_SNIFFER || ioctlID == J2534_STOP_ISOTP_SNIFFER
+		|| ioctlID == J2534_READ_ISOTP_STATS)
+	{
+		if (write_log)
+			writelog(ioctlID == J2534_START_ISOTP_SNIFFER ? "[START_ISOTP_SNIFFER]\n"
+				: ioctlID == J2534_STOP_ISOTP_SNIFFER ? "[STOP_ISOTP_SNIFFER]\n" : "[READ_ISOTP_STATS]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (ioctlID == J2534_STOP_ISOTP_SNIFFER)
+		{
+			isotp_stop(pOutput);
+			r = J2534_NOERROR;
+		}
+		else if (ioctlID == J2534_START_ISOTP_SNIFFER ? pInput == NULL : pOutput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: %s must not be NULL",
+				ioctlID == J2534_START_ISOTP_SNIFFER ? "pInput" : "pOutput");
+			r = J2534_ERR_NULL_PARAMETER;
+		}
+		else if (ioctlID == J2534_START_ISOTP_SNIFFER)
+		{
+			const ISOTP_SNIFF_CONFIG *cfg = pInput;
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\t\tFilters: %lu, MaxStreams: %lu, Flags: %lX\n",
+					cfg->NumFilters, cfg->MaxStreams, cfg->Flags);
+				writelog(log_msg);
+			}
+			r = isotp_start(cfg);
+		}
+		else
+		{
+			r = isotp_read(pOutput);
+			if (write_log && r == J2534_NOERROR)
+			{
+				const ISOTP_STATS *st = pOutput;
+				snprintf(log_msg, LM_LEN, "\t\t%lu PDUs, %lu aborted, %lu evicted, %lu lost, %lu streams\n",
+					st->NumPdus, st->Aborted, st->Evicted, st->Overflows, st->NumStreams);
+				writelog(log_msg);
+			}
+		}
+	}
+
+	if (ioctlID == J2534_START_VBATT_SAMPLER || ioctlID == J2534_STOP_VBATT_SAMPLER
+		|| ioctlID == J2534_READ_VBATT_HISTORY)
+	{
+		if (write_log)
+			writelog(ioctlID == J2534_START_VBATT_SAMPLER ? "[START_VBATT_SAMPLER]\n"
+				: ioctlID == J2534_STOP_VBATT_SAMPLER ? "[STOP_VBATT_SAMPLER]\n" : "[READ_VBATT_HISTORY]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (ioctlID == J2534_STOP_VBATT_SAMPLER)
+		{
+			vbatt_stop();
+			r = J2534_NOERROR;
+		}
+		else if (ioctlID == J2534_START_VBATT_SAMPLER ? pInput == NULL : pOutput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: %s must not be NULL",
+				ioctlID == J2534_START_VBATT_SAMPLER ? "pInput" : "pOutput");
+			r = J2534_ERR_NULL_PARAMETER;
+		}
+		else if (ioctlID == J2534_START_VBATT_SAMPLER)
+		{
+			if (write_log)
+			{
+				snprintf(log_msg, LM_LEN, "\t\tPeriod: %lu msec\n", *(const unsigned long*)pInput);
+				writelog(log_msg);
+			}
+			r = vbatt_start(*(const unsigned long*)pInput);
+		}
+		else
+			r = vbatt_history(pOutput);
+	}
+
+	if (ioctlID == J2534_SET_RT_MODE || ioctlID == J2534_READ_RX_JITTER)
+	{
+		if (write_log)
+			writelog(ioctlID == J2534_SET_RT_MODE ? "[SET_RT_MODE]\n" : "[READ_RX_JITTER]\n");
+		if (ChannelID != strtoul(&con->channel, NULL, 10))
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: Invalid ChannelID");
+			return J2534_ERR_INVALID_CHANNEL_ID;
+		}
+		if (ioctlID == J2534_SET_RT_MODE)
+			r = rt_set(pInput);
+		else if (pOutput == NULL)
+		{
+			snprintf(LAST_ERROR, LE_LEN, "Error: pOutput must not be NULL");
+			r = J2534_ERR_NULL_PARAMETER;
+		}
+		else
+		{
+			r = rt_jitter(pOutput);
+			if (write_log && r == J2534_NOERROR)
+			{
+				const RX_JITTER *j = pOutput;
+				snprintf(log_msg, LM_LEN, "\t\t%lu messages, median %lu, p99 %lu, p99.9 %lu, max %lu usec\n",
+					j->NumMsgs, j->Median, j->P99, j->P999, j->Max);
+				writelog(log_msg);
+			}
+		}
+	}
 
 	EXIT_IOCTL:
+	cmd_cancel();
 	if (write_log)
 		writelog("EndIoctl\n");
 	return error_map(r);
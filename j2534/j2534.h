@@ -89,7 +89,32 @@ enum j2534_ioctl {
     J2534_CLEAR_FUNCT_MSG_LOOKUP_TABLE,
     J2534_ADD_TO_FUNCT_MSG_LOOKUP_TABLE,
     J2534_DELETE_FROM_FUNCT_MSG_LOOUP_TABLE,
-    J2534_READ_PROG_VOLTAGE
+    J2534_READ_PROG_VOLTAGE,
+
+    // Tool manufacturer specific
+    J2534_GET_RX_EVENT_FD = 0x10000, // pInput: unsigned long watermark or NULL, pOutput: int fd
+    J2534_START_CAPTURE,            // pInput: CAPTURE_CONFIG
+    J2534_STOP_CAPTURE,             // pOutput: unsigned long messages dropped or NULL
+    J2534_START_SNAPSHOT,           // keep the latest message of each CAN ID for PassThruReadSnapshot
+    J2534_STOP_SNAPSHOT,
+    J2534_SET_READ_BATCH,           // pInput: READ_BATCH, NULL to turn batching off
+    J2534_START_VBATT_SAMPLER,      // pInput: unsigned long sample period in msec
+    J2534_STOP_VBATT_SAMPLER,
+    J2534_READ_VBATT_HISTORY,       // pOutput: VBATT_HISTORY
+    J2534_SET_RT_MODE,              // pInput: RT_MODE, NULL for normal scheduling
+    J2534_READ_RX_JITTER,           // pOutput: RX_JITTER
+    J2534_START_BUS_STATS,          // keep bus load and per-ID timing statistics
+    J2534_STOP_BUS_STATS,
+    J2534_READ_BUS_STATS,           // pOutput: BUS_STATS
+    J2534_START_REPLAY,             // pInput: REPLAY_CONFIG
+    J2534_STOP_REPLAY,              // pOutput: REPLAY_STATUS or NULL
+    J2534_READ_REPLAY_STATUS,       // pOutput: REPLAY_STATUS
+    J2534_START_GATEWAY,            // pInput: GATEWAY_CONFIG
+    J2534_STOP_GATEWAY,             // pOutput: GATEWAY_STATS or NULL
+    J2534_READ_GATEWAY_STATS,       // pOutput: GATEWAY_STATS
+    J2534_START_ISOTP_SNIFFER,      // pInput: ISOTP_SNIFF_CONFIG
+    J2534_STOP_ISOTP_SNIFFER,       // pOutput: ISOTP_STATS or NULL
+    J2534_READ_ISOTP_STATS          // pOutput: ISOTP_STATS
 };
 
 enum j2534_filter {
@@ -121,6 +146,448 @@ typedef struct _PASSTHRU_MSG
     unsigned char Data[PM_DATA_LEN];
 } PASSTHRU_MSG;
 
+/*
+  RX callbacks are called on the USB event thread for each decoded message,
+  before the message would be queued for PassThruReadMsgs.  A callback:
+  - gets a read-only view of the message that is only valid until it returns,
+    copy whatever has to be kept
+  - must return quickly and must not block, no further USB data is decoded
+    while it runs
+  - must not call any PassThru function, these may wait for the USB event
+    thread and would deadlock
+  Messages given to a callback are not queued for PassThruReadMsgs unless it
+  was registered with J2534_RX_CB_QUEUE.  PassThruUnregisterRxCallback waits
+  for a running callback to return.
+ */
+enum j2534_rx_callback {
+    J2534_RX_CB_QUEUE = 0x01    // also queue messages for PassThruReadMsgs
+};
+
+#define J2534_ALL_FILTERS 0xFFFFFFFFUL  // FilterID to receive every message
+
+/*
+  A subscription receives the CAN and ISO15765 messages with the listed CAN
+  IDs into a queue of its own, read with PassThruReadSubscription.  The
+  USB event thread looks each message up once in a dispatch index, a direct
+  table for IDs up to 0x7FF and a hash for larger IDs, so the cost depends
+  on the matching traffic rather than the bus load.  Each subscription must
+  be read by a single thread, and must not be removed while it is read.
+  Messages routed to a subscription are not queued for PassThruReadMsgs
+  unless it was created with J2534_SUB_QUEUE.
+ */
+enum j2534_subscription {
+    J2534_SUB_QUEUE = 0x01      // also queue messages for PassThruReadMsgs
+};
+
+/*
+  PassThruReadMsgs returns after Timeout msec at the latest, or at once with
+  a Timeout of 0, and normally as soon as it has read one message.  With
+  J2534_SET_READ_BATCH it keeps reading until it has MinMsgs messages or
+  MaxLatency usec passed since it got the first one, so busy channels are
+  read in large batches while a single message still comes out promptly.
+ */
+typedef struct _READ_BATCH
+{
+    unsigned long MinMsgs;          // messages to wait for, up to *pNumMsgs
+    unsigned long MaxLatency;       // usec the first message may be held back
+} READ_BATCH;
+
+/*
+  J2534_START_VBATT_SAMPLER reads the pin 16 voltage every period msec in
+  the background and keeps the last samples in a ring.  J2534_READ_VBATT
+  then returns the latest sample instead of asking the device, and
+  J2534_READ_VBATT_HISTORY copies the samples from sequence number Next on,
+  oldest first, to find short dips such as engine cranking.  The sampler
+  runs until J2534_STOP_VBATT_SAMPLER or PassThruDisconnect.
+ */
+typedef struct _VBATT_SAMPLE
+{
+    unsigned long Timestamp;        // host CLOCK_MONOTONIC time in usec
+    unsigned long Voltage;          // mV
+} VBATT_SAMPLE;
+
+typedef struct _VBATT_HISTORY
+{
+    VBATT_SAMPLE *pSamples;
+    unsigned long NumSamples;       // in: size of pSamples, out: samples copied
+    unsigned long Next;             // in: first sample wanted, out: sequence number to ask for next time
+    unsigned long Lost;             // out: samples overwritten before they were copied
+} VBATT_HISTORY;
+
+/*
+  J2534_SET_RT_MODE runs the USB event thread, which decodes everything the
+  device sends, with a SCHED_FIFO priority on the given CPUs.  Give the
+  thread a CPU of its own and, with J2534_RT_BUSY_POLL, it never sleeps
+  between USB transfers.  J2534_RT_MEASURE records how much later than the
+  fastest ones messages are decoded, J2534_READ_RX_JITTER returns the
+  distribution since the last read.  The J2534_RT environment variable,
+  "Priority[,CpuMask[,Flags]]", applies a mode at every PassThruConnect.
+  Not in the Windows build and CpuMask needs Linux, a priority needs
+  CAP_SYS_NICE or an RLIMIT_RTPRIO.
+ */
+enum j2534_rt_flags {
+    J2534_RT_LOCK_MEMORY = 0x01,    // mlockall the process so the receive path never page faults
+    J2534_RT_BUSY_POLL = 0x02,      // poll libusb without sleeping
+    J2534_RT_MEASURE = 0x04         // record RX jitter
+};
+
+typedef struct _RT_MODE
+{
+    unsigned long Priority;         // SCHED_FIFO priority, 0 for normal scheduling
+    unsigned long CpuMask;          // bit n allows CPU n, 0 for any CPU
+    unsigned long Flags;            // j2534_rt_flags
+} RT_MODE;
+
+typedef struct _RX_JITTER
+{
+    unsigned long NumMsgs;          // messages measured
+    unsigned long Median;           // usec later than the fastest messages
+    unsigned long P99;
+    unsigned long P999;
+    unsigned long Max;
+} RX_JITTER;
+
+/*
+  After J2534_START_BUS_STATS the USB event thread keeps running statistics
+  of the frames received on a CAN channel, at the same small cost for every
+  frame.  The bus load counts each frame with its interframe space and the
+  worst case stuff bits for its ID format and length, so it is an upper
+  estimate.  Periods are taken from the device timestamps.
+  J2534_READ_BUS_STATS fills the totals and up to NumIDs per-ID records,
+  sorted by CAN ID.
+ */
+typedef struct _BUS_ID_STATS
+{
+    unsigned long CanID;
+    unsigned long NumFrames;
+    unsigned long FirstSeen;        // device timestamp of the first frame, usec
+    unsigned long LastSeen;         // device timestamp of the latest frame, usec
+    double FrameRate;               // frames per second from the first to the latest frame
+    double MeanPeriod;              // usec
+    double PeriodJitter;            // standard deviation of the period, usec
+    unsigned long MinPeriod;        // usec
+    unsigned long MaxPeriod;
+} BUS_ID_STATS;
+
+typedef struct _BUS_STATS
+{
+    unsigned long NumIDs;           // in: entries of pIDs, out: entries filled
+    BUS_ID_STATS *pIDs;             // NULL with a NumIDs of 0 for the totals only
+    unsigned long TotalIDs;         // IDs seen
+    unsigned long NumFrames;
+    unsigned long Untracked;        // frames of IDs above 0x7FF that found the table full
+    unsigned long Elapsed;          // usec since J2534_START_BUS_STATS
+    double BusLoad;                 // fraction of the bit rate used since the start
+    double RecentLoad;              // and since the previous J2534_READ_BUS_STATS
+} BUS_STATS;
+
+/*
+  Capture files written by J2534_START_CAPTURE.  Only complete CAN frames
+  are recorded, indications and ISO15765 payloads longer than a single
+  frame are skipped.
+ */
+enum j2534_capture_format {
+    J2534_CAPTURE_CANDUMP = 1,  // candump -l text log
+    J2534_CAPTURE_ASC,          // Vector ASCII log
+    J2534_CAPTURE_PCAPNG,       // pcapng, LINKTYPE_CAN_SOCKETCAN
+    J2534_CAPTURE_INDEXED       // indexed blocks for PassThruOpenCapture
+};
+
+typedef struct _CAPTURE_CONFIG
+{
+    unsigned long Format;
+    const char *pPath;          // rotated files get a -NNNN suffix before the extension
+    unsigned long RotateBytes;  // start a new file after this many bytes, 0 for no limit
+    unsigned long RotateSeconds;    // start a new file after this many seconds, 0 for no limit
+} CAPTURE_CONFIG;
+
+/*
+  An indexed capture file is written in 64 KiB blocks of CAPTURE_FRAME
+  records in time order, each block starting with its time range and a
+  bitmap of the CAN IDs in it, and ends with an index of all blocks.
+  PassThruOpenCapture maps the file into memory, so PassThruQueryCapture
+  only touches the blocks that can hold matching frames and returns
+  pointers into the mapping instead of copies.  A file without its index,
+  still being written or cut short, is opened from the blocks complete so
+  far.  Times are usec since the epoch and never go backwards in a file.
+ */
+typedef struct _CAPTURE_FRAME
+{
+    uint64_t Timestamp;
+    uint32_t CanID;             // bit 31 set for 29 bit IDs
+    uint8_t DataSize;
+    uint8_t Flags;              // 1 for frames sent by the device (TX_MSG_TYPE)
+    uint8_t Reserved[2];
+    uint8_t Data[8];
+} CAPTURE_FRAME;
+
+typedef struct _CAPTURE_INFO
+{
+    unsigned long NumBlocks;
+    unsigned long long NumFrames;
+    uint64_t First;             // time of the first frame
+    uint64_t Last;              // and of the last one
+    unsigned long Indexed;      // the file ends with its index, else it was rebuilt from the blocks
+} CAPTURE_INFO;
+
+typedef struct _CAPTURE_QUERY
+{
+    uint64_t Start;             // first frame time wanted
+    uint64_t End;               // last frame time wanted, 0 for no limit
+    const unsigned long *pIDs;  // CAN IDs wanted
+    unsigned long NumIDs;       // 0 for every ID
+    uint64_t Cursor;            // 0 for a new query, then kept by PassThruQueryCapture
+} CAPTURE_QUERY;
+
+/*
+  J2534_START_REPLAY loads a capture file of any of the formats above and
+  sends its frames on the connected CAN channel with their original
+  spacing.  Every frame is due at the start of the replay plus its offset
+  from the first frame of the file, divided by Speed, so scheduling errors
+  do not add up over a long replay.  The scheduling error of a frame is the
+  time the OUT transfer carrying it completed minus the time it was due.
+ */
+typedef struct _REPLAY_CONFIG
+{
+    unsigned long Format;           // j2534_capture_format
+    const char *pPath;
+    unsigned long Loops;            // times to play the file, 0 until J2534_STOP_REPLAY
+    double Speed;                   // 2.0 plays twice as fast, 0 for the original speed
+} REPLAY_CONFIG;
+
+typedef struct _REPLAY_STATUS
+{
+    unsigned long Running;          // frames are still being sent
+    unsigned long NumFrames;        // frames sent so far
+    unsigned long FileFrames;       // frames loaded from the file
+    unsigned long Loops;            // complete passes through the file
+    long MeanError;                 // usec, negative when frames went out early
+    unsigned long Median;           // of the absolute scheduling error, usec
+    unsigned long P99;
+    unsigned long Max;
+    long Status;                    // J2534 error that ended the replay, 0 if none
+} REPLAY_STATUS;
+
+/*
+  J2534_START_GATEWAY forwards the CAN frames received on the connected
+  channel from the USB event thread as they are decoded, without a trip
+  through PassThruReadMsgs and PassThruWriteMsgs.  Frames go out on the
+  same channel, or on a CAN channel the gateway connects on another device
+  served by j2534d.  Frames looped back or sent by the device itself are
+  never forwarded.  The frames decoded from one USB transfer are forwarded
+  together.  Forwarded frames are still delivered to the application.
+ */
+typedef struct _GATEWAY_RULE
+{
+    unsigned long CanID;            // frames with this ID
+    unsigned long NewID;            // are forwarded with this ID, 29 bit if either ID is
+    unsigned char Mask[8];          // data bits set in Mask are replaced
+    unsigned char Value[8];         // by these
+} GATEWAY_RULE;
+
+typedef struct _GATEWAY_CONFIG
+{
+    const char *pTarget;            // j2534d socket of the target device, "" for the default, NULL for this channel
+    unsigned long Flags;            // PassThruConnect flags of the target channel
+    unsigned long Baudrate;         // of the target channel
+    const GATEWAY_RULE *pRewrite;
+    unsigned long NumRewrite;
+    const unsigned long *pBlock;    // CAN IDs that are not forwarded
+    unsigned long NumBlock;
+} GATEWAY_CONFIG;
+
+/*
+  The forwarding latency runs from the decoding of a frame to the end of
+  the OUT transfer carrying it, or to the hand-over to the j2534d daemon
+  of the target device.  Percentiles are taken in 5 usec steps.
+ */
+typedef struct _GATEWAY_STATS
+{
+    unsigned long NumFrames;        // frames forwarded
+    unsigned long Rewritten;        // of these, frames changed by a rewrite rule
+    unsigned long Blocked;          // frames held back by the block list
+    unsigned long Dropped;          // frames that could not be sent
+    unsigned long Median;           // forwarding latency, usec
+    unsigned long P99;
+    unsigned long Max;
+} GATEWAY_STATS;
+
+/*
+  J2534_START_ISOTP_SNIFFER makes the USB event thread reassemble the
+  ISO 15765-2 transfers seen on a CAN channel, between any tester and ECU,
+  into PDUs read with PassThruReadIsotp.  Each sender, a CAN ID and with
+  J2534_ISOTP_EXT_ADDR an address byte, is followed by a stream with a
+  buffer of its own, MaxStreams of them allocated at the start.  A first
+  frame from a new sender while every stream is taken reuses the one idle
+  longest.  A flow control frame names the receiver of the transfer that
+  waits for it.  A transfer is dropped when a consecutive frame is out of
+  sequence or the receiver reports an overflow.  Received frames are still
+  delivered to the application.
+ */
+enum j2534_isotp_flags {
+    J2534_ISOTP_EXT_ADDR = 0x01     // the first data byte is an extended or mixed address
+};
+
+typedef struct _ISOTP_SNIFF_CONFIG
+{
+    const unsigned long *pMasks;    // frames with (CAN ID & mask) == pattern are taken as ISO-TP
+    const unsigned long *pPatterns;
+    unsigned long NumFilters;       // 0 for every CAN ID
+    unsigned long MaxStreams;       // transfers followed at the same time, 0 for 64
+    unsigned long Flags;            // j2534_isotp_flags
+} ISOTP_SNIFF_CONFIG;
+
+typedef struct _ISOTP_PDU
+{
+    unsigned long SourceID;         // CAN ID of the sender
+    unsigned long TargetID;         // CAN ID of the last flow control sent to it, 0 if none was seen
+    unsigned long RxStatus;         // CAN_29BIT_ID, TX_MSG_TYPE when the device sent the first frame
+    unsigned long Address;          // address byte with J2534_ISOTP_EXT_ADDR
+    unsigned long StartTime;        // device timestamp of the first frame, usec
+    unsigned long EndTime;          // and of the last one
+    unsigned long DataSize;
+    unsigned char Data[4095];
+} ISOTP_PDU;
+
+typedef struct _ISOTP_STATS
+{
+    unsigned long NumPdus;          // PDUs completed
+    unsigned long Aborted;          // transfers dropped by a sequence error, overflow or new first frame
+    unsigned long Evicted;          // transfers dropped for the stream of a new sender
+    unsigned long Oversize;         // transfers longer than an ISOTP_PDU, skipped
+    unsigned long Overflows;        // PDUs lost because PassThruReadIsotp did not keep up
+    unsigned long NumStreams;       // senders followed
+} ISOTP_STATS;
+
+/*
+  A signal of a DBC file compiled by PassThruLoadDbc.  PassThruDecodeDbc
+  writes the value of signal n to pValues[n].  PassThruDecodeDbcSeries
+  decodes many frames of one CAN ID and writes the values of a signal to
+  row MsgIndex, one column per frame; multiplexed signals are NaN in frames
+  of another multiplexer value.  Decoding does not use the device and may
+  be called from RX callbacks.
+ */
+typedef struct _DBC_SIGNAL
+{
+    const char *pName;
+    const char *pUnit;
+    unsigned long MsgID;        // CAN ID of the message carrying the signal, bit 31 set if extended
+    unsigned long MsgIndex;     // position among the signals of the message
+    double Factor;
+    double Offset;
+} DBC_SIGNAL;
+
+/*
+  A merged reader records CAN from several devices, each owned by its own
+  j2534d daemon (start them with -d openport:0, -d openport:1, ...).  Each
+  device clock is related to the host CLOCK_MONOTONIC clock by fitting the
+  lower envelope of host arrival minus device time, which gives its offset
+  and drift.  PassThruReadMerged returns the messages of all devices in the
+  order of their corrected timestamps: a message is held back until every
+  device has a later one queued or WindowMs has passed.  Timestamp is the
+  corrected host time in usec and RxStatus bits 24-31 hold the index of the
+  source in pSockets, see J2534_RX_SOURCE.
+ */
+typedef struct _MERGE_CONFIG
+{
+    const char *const *pSockets;    // j2534d control sockets, one per device
+    unsigned long NumSockets;
+    unsigned long Flags;            // PassThruConnect flags of the CAN channels
+    unsigned long Baudrate;
+    unsigned long WindowMs;         // reordering window
+} MERGE_CONFIG;
+
+#define J2534_RX_SOURCE(RxStatus) (((RxStatus) >> 24) & 0xFF)
+
+/*
+  PassThruReadMemory reads Length bytes from Address of an ECU with
+  ISO 14229 ReadMemoryByAddress requests on a connected ISO15765 channel,
+  which needs a flow control filter for TxID and RxID.  Up to
+  MaxOutstanding requests are kept in flight: the window starts at one
+  request and grows while every request is answered, it shrinks when the
+  ECU reports busy or a response goes missing.  The block size doubles from
+  BlockSize up to MaxBlockSize and is halved when the ECU rejects a length.
+  Responses carry no address, so the requests in flight all have different
+  sizes and are matched by response length.
+  pStatus is read too: BytesRead bytes of pBuffer are taken as already read
+  and BlockSize and Outstanding, if not 0, replace the starting values.
+  After an error call again with the same pStatus to resume, the bytes
+  before BytesRead are valid.
+ */
+typedef struct _MEMORY_READ
+{
+    unsigned long TxID;             // CAN ID of the requests
+    unsigned long RxID;             // CAN ID of the responses, 0 for any
+    unsigned long TxFlags;          // ISO15765 TxFlags of the requests
+    unsigned long Address;
+    unsigned long Length;           // bytes to read into pBuffer
+    unsigned long AddressBytes;     // length of memoryAddress, 1 to 4
+    unsigned long SizeBytes;        // length of memorySize, 1 to 4
+    unsigned long BlockSize;        // first request size, 0 for 256
+    unsigned long MaxBlockSize;     // 0 for 4094, the ISO15765 limit
+    unsigned long MaxOutstanding;   // requests in flight, 0 for 4, at most 16
+    unsigned long Timeout;          // msec to wait for a response, 0 for 1000
+    unsigned long Retries;          // times a request is sent again, 0 for 3
+} MEMORY_READ;
+
+typedef struct _MEMORY_READ_STATUS
+{
+    unsigned long BytesRead;        // bytes of pBuffer read without a gap
+    unsigned long BytesPerSecond;   // throughput of the last call
+    unsigned long BlockSize;        // block size reached
+    unsigned long Outstanding;      // requests in flight reached
+    unsigned long Requests;         // requests sent by the last call
+    unsigned long Retries;          // requests sent again by the last call
+    unsigned long Nrc;              // last negative response code, 0 if none
+} MEMORY_READ_STATUS;
+
+/*
+  UDS requests are sent with PassThruSendUds on a connected ISO15765
+  channel, which needs flow control filters for the ECUs addressed.  A
+  request waits while an earlier one to the same TxID is outstanding, so
+  requests to different ECUs run in parallel and those to one ECU in
+  order.  PassThruReadUds reads the channel and returns each response as it
+  arrives, matched to the oldest request of its service whose RxID and
+  RxMask accept the sender.  Response pending (0x78) replies only extend
+  the wait to PendingTimeout, other negative responses are returned like
+  positive ones.  A physical request completes with its response, the
+  response carries J2534_UDS_COMPLETE.  A J2534_UDS_FUNCTIONAL request
+  collects the responses of every ECU until Timeout and completes with a
+  record without data, Status is J2534_ERR_TIMEOUT if no ECU answered.
+  While requests are outstanding PassThruReadUds consumes the messages of
+  the channel, messages that answer no request are discarded.
+ */
+enum j2534_uds {
+    J2534_UDS_FUNCTIONAL = 0x01,    // UDS_REQUEST: collect responses from any number of ECUs
+    J2534_UDS_COMPLETE = 0x01       // UDS_RESPONSE: last record of the request
+};
+
+typedef struct _UDS_REQUEST
+{
+    unsigned long TxID;             // CAN ID of the request, physical or functional
+    unsigned long RxID;             // CAN ID of the responses
+    unsigned long RxMask;           // bits of RxID compared, 0 for all
+    unsigned long TxFlags;          // ISO15765 TxFlags
+    unsigned long Flags;
+    const unsigned char *pData;     // service ID and parameters
+    unsigned long DataSize;
+    unsigned long Timeout;          // msec to wait for a response, 0 for 1000
+    unsigned long PendingTimeout;   // msec to wait after response pending, 0 for 5000
+} UDS_REQUEST;
+
+typedef struct _UDS_RESPONSE
+{
+    unsigned long RequestID;
+    unsigned long SourceID;         // CAN ID of the ECU, 0 on a record without data
+    unsigned long Status;           // J2534 error code
+    unsigned long Flags;
+    unsigned long Timestamp;
+    unsigned long DataSize;
+    unsigned char Data[PM_DATA_LEN];    // response starting with the service ID or 0x7F
+} UDS_RESPONSE;
+
+typedef void (*PASSTHRU_RX_CALLBACK)(const PASSTHRU_MSG *pMsg, void *pContext);
+
 OP2J2534_API int32_t PassThruOpen(
     const void *pName, unsigned long *pDeviceID);
 OP2J2534_API int32_t PassThruClose(
@@ -155,6 +622,75 @@ OP2J2534_API int32_t PassThruGetLastError(
     char *pErrorDescription);
 OP2J2534_API int32_t PassThruIoctl(
     const unsigned long ChannelID, const unsigned long IoctlID, const void *pInput, void *pOutput);
+OP2J2534_API int32_t PassThruRegisterRxCallback(
+    const unsigned long ChannelID, const unsigned long FilterID, const unsigned long Flags,
+    PASSTHRU_RX_CALLBACK Callback, void *pContext, unsigned long *pCallbackID);
+OP2J2534_API int32_t PassThruUnregisterRxCallback(
+    const unsigned long ChannelID, const unsigned long CallbackID);
+OP2J2534_API int32_t PassThruSubscribe(
+    const unsigned long ChannelID, const unsigned long *pIDs, const unsigned long NumIDs,
+    const unsigned long Flags, unsigned long *pSubscriptionID);
+OP2J2534_API int32_t PassThruReadSubscription(
+    const unsigned long ChannelID, const unsigned long SubscriptionID, PASSTHRU_MSG *pMsg,
+    unsigned long *pNumMsgs, const unsigned long Timeout);
+OP2J2534_API int32_t PassThruUnsubscribe(
+    const unsigned long ChannelID, const unsigned long SubscriptionID);
+
+/*
+  After J2534_START_SNAPSHOT the USB event thread keeps the latest single
+  frame message of every CAN ID in a table that PassThruReadSnapshot reads
+  without locking, however slowly it samples.  Each message returned is
+  consistent on its own, messages of different IDs may have been received
+  between two reads.  Do not stop the snapshot while it is read.
+ */
+OP2J2534_API int32_t PassThruReadSnapshot(
+    const unsigned long ChannelID, const unsigned long *pIDs, PASSTHRU_MSG *pMsg,
+    const unsigned long NumIDs);
+
+/*
+  Read up to *pNumPdus PDUs of the ISO-TP sniffer, waiting up to Timeout
+  msec for the first one.  Only one thread may read them, and the sniffer
+  must not be stopped while it does.
+ */
+OP2J2534_API int32_t PassThruReadIsotp(
+    const unsigned long ChannelID, ISOTP_PDU *pPdu, unsigned long *pNumPdus,
+    const unsigned long Timeout);
+OP2J2534_API int32_t PassThruOpenMerged(
+    const MERGE_CONFIG *pConfig, unsigned long *pMergeID);
+OP2J2534_API int32_t PassThruReadMerged(
+    const unsigned long MergeID, PASSTHRU_MSG *pMsg, unsigned long *pNumMsgs,
+    const unsigned long Timeout);
+OP2J2534_API int32_t PassThruCloseMerged(
+    const unsigned long MergeID);
+OP2J2534_API int32_t PassThruOpenCapture(
+    const char *pPath, unsigned long *pCaptureID, CAPTURE_INFO *pInfo);
+OP2J2534_API int32_t PassThruQueryCapture(
+    const unsigned long CaptureID, CAPTURE_QUERY *pQuery, const CAPTURE_FRAME **ppFrames,
+    unsigned long *pNumFrames);
+OP2J2534_API int32_t PassThruCloseCapture(
+    const unsigned long CaptureID);
+OP2J2534_API int32_t PassThruReadMemory(
+    const unsigned long ChannelID, const MEMORY_READ *pRead, unsigned char *pBuffer,
+    MEMORY_READ_STATUS *pStatus);
+OP2J2534_API int32_t PassThruSendUds(
+    const unsigned long ChannelID, const UDS_REQUEST *pRequest, unsigned long *pRequestID);
+OP2J2534_API int32_t PassThruReadUds(
+    const unsigned long ChannelID, UDS_RESPONSE *pResponse, unsigned long *pNumResponses,
+    const unsigned long Timeout);
+OP2J2534_API int32_t PassThruCancelUds(
+    const unsigned long ChannelID, const unsigned long RequestID);
+OP2J2534_API int32_t PassThruLoadDbc(
+    const char *pPath, unsigned long *pDbcID, unsigned long *pNumSignals);
+OP2J2534_API int32_t PassThruUnloadDbc(
+    const unsigned long DbcID);
+OP2J2534_API int32_t PassThruGetDbcSignal(
+    const unsigned long DbcID, const unsigned long Index, DBC_SIGNAL *pSignal);
+OP2J2534_API int32_t PassThruDecodeDbc(
+    const unsigned long DbcID, const PASSTHRU_MSG *pMsg, const unsigned long NumMsgs,
+    double *pValues, unsigned long *pNumDecoded);
+OP2J2534_API int32_t PassThruDecodeDbcSeries(
+    const unsigned long DbcID, const unsigned long MsgID, const PASSTHRU_MSG *pMsg,
+    const unsigned long NumMsgs, double *pValues);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,702 @@
+/*
+  Copyright (C) 2022
+  Authors: NikolaKozina
+            Dale Schultz
+
+  You are free to use this software for any purpose, but please keep
+  acknowledge where it came from!
+
+  j2534d owns the Openport 2.0 and shares it with several processes.  Only one
+  process can claim the USB interface, so applications open the device with the
+  name "j2534d" (or set J2534_DAEMON) and the library forwards the PassThru calls
+  over a UNIX domain socket to this daemon.
+
+  The daemon connects the protocol channel once for all clients and publishes
+  every received message to a shared memory ring per client, applying the message
+  filters each client started.  Clients read the ring directly, so fanning out to
+  many readers costs no extra USB traffic and no system call per message.
+
+  Usage: j2534d [-d device name] [-s socket path] [-r ring size in KiB]
+ */
+
+#define _GNU_SOURCE
+#include "j2534.h"
+#include "j2534d.h"
+#include <errno.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CLIENTS	16	// Concurrent client connections
+#define MAX_CLIENT_FILTERS	10	// Message filters per client
+#define MAX_PAYLOAD	(1 << 20)	// Largest request payload accepted
+
+typedef struct _client_filter
+{
+	int used;
+	unsigned long id;		// filter ID on the device
+	unsigned long type;
+	unsigned long size;
+	uint8_t mask[12];
+	uint8_t pattern[12];
+} client_filter_t;
+
+typedef struct _client
+{
+	int sock;				// -1 when the slot is unused
+	int connected;			// client has the channel connected
+	j2534d_ring_t *ring;	// RX ring shared with the client
+	size_t ring_len;
+	uint32_t ring_size;		// size and head of the ring, the client can write their shared copies
+	uint32_t ring_head;
+	client_filter_t filters[MAX_CLIENT_FILTERS];
+} client_t;
+
+client_t clients[MAX_CLIENTS];
+pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;	// guards connected and ring against publish()
+unsigned long device_id;
+unsigned long channel_id;
+unsigned long channel_protocol;
+unsigned long channel_baud;
+unsigned long callback_id;
+int channel_refs = 0;
+uint32_t ring_size = J2534D_RING_SIZE;
+volatile sig_atomic_t quit = 0;
+
+static void on_signal(int sig)
+{
+	quit = 1;
+}
+
+/*
+  Check a message against the filters a client started.  As on the device,
+  a message must match a pass or flow control filter and no block filter.
+*/
+static int client_wants(const client_t *c, const PASSTHRU_MSG *msg)
+{
+	int pass = FALSE;
+	int i = 0;
+	for (; i < MAX_CLIENT_FILTERS; i++)
+	{
+		const client_filter_t *f = &c->filters[i];
+		unsigned long j = 0;
+		if (!f->used || msg->DataSize < f->size)
+			continue;
+		for (; j < f->size; j++)
+		{
+			if ((msg->Data[j] & f->mask[j]) != (f->pattern[j] & f->mask[j]))
+				break;
+		}
+		if (j < f->size)
+			continue;
+		if (f->type == J2534_BLOCK_FILTER)
+			return FALSE;
+		pass = TRUE;
+	}
+	return pass;
+}
+
+/*
+  Append a message to a client's RX ring, or count an overflow when the
+  client has fallen behind.  Only wakes the client when it sleeps.  The
+  offsets come from the daemon's own copy of size and head, a bad tail
+  only garbles what that client reads.
+*/
+static void ring_put(client_t *c, const PASSTHRU_MSG *msg, const uint64_t host_time)
+{
+	j2534d_ring_t *ring = c->ring;
+	uint32_t size = c->ring_size;
+	uint32_t need = J2534D_MSG_SIZE(msg->DataSize);
+	uint32_t head = c->ring_head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t off = head & (size - 1);
+	uint32_t pad = size - off < need ? size - off : 0;
+
+	if (size - (head - tail) < pad + need)
+	{
+		ring->overflows++;
+		return;
+	}
+	if (pad)
+	{
+		((j2534d_msg_t*)(ring->data + off))->size = pad | J2534D_MSG_PAD;
+		head += pad;
+		off = 0;
+	}
+
+	j2534d_msg_t *rec = (j2534d_msg_t*)(ring->data + off);
+	rec->size = need;
+	rec->protocol_id = msg->ProtocolID;
+	rec->rx_status = msg->RxStatus;
+	rec->tx_flags = msg->TxFlags;
+	rec->timestamp = msg->Timestamp;
+	rec->data_size = msg->DataSize;
+	rec->extra_data_index = msg->ExtraDataIndex;
+	rec->reserved = 0;
+	rec->host_time = host_time;
+	memcpy(rec->data, msg->Data, msg->DataSize);
+
+	c->ring_head = head + need;
+	__atomic_store_n(&ring->head, c->ring_head, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &ring->head, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/*
+  RX callback, runs on the library's USB event thread.  Messages are stamped
+  with the host time they arrived, clients use it to relate the device
+  clock to the host clock.
+*/
+static void publish(const PASSTHRU_MSG *msg, void *context)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t host_time = (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	int i = 0;
+	pthread_mutex_lock(&clients_lock);
+	for (; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i].connected && client_wants(&clients[i], msg))
+			ring_put(&clients[i], msg, host_time);
+	}
+	pthread_mutex_unlock(&clients_lock);
+}
+
+/*
+  Copy a request message record into a PASSTHRU_MSG.
+*/
+static void msg_get(PASSTHRU_MSG *msg, const j2534d_msg_t *rec)
+{
+	memset(msg, 0, sizeof(PASSTHRU_MSG) - PM_DATA_LEN);
+	msg->ProtocolID = rec->protocol_id;
+	msg->RxStatus = rec->rx_status;
+	msg->TxFlags = rec->tx_flags;
+	msg->Timestamp = rec->timestamp;
+	msg->DataSize = rec->data_size < PM_DATA_LEN ? rec->data_size : PM_DATA_LEN;
+	msg->ExtraDataIndex = rec->extra_data_index;
+	memcpy(msg->Data, rec->data, msg->DataSize);
+}
+
+/*
+  Validate that payload holds cnt message records and return the first one.
+*/
+static const j2534d_msg_t *msg_records(const uint8_t *payload, const uint32_t len, const uint32_t cnt)
+{
+	uint32_t off = 0, i = 0;
+	for (; i < cnt; i++)
+	{
+		const j2534d_msg_t *rec = (const j2534d_msg_t*)(payload + off);
+		// data_size is bounded first, J2534D_MSG_SIZE wraps for sizes near 4 GiB
+		if (off + sizeof(j2534d_msg_t) > len || rec->data_size > len - off - sizeof(j2534d_msg_t)
+			|| rec->size != J2534D_MSG_SIZE(rec->data_size) || off + rec->size > len)
+			return NULL;
+		off += rec->size;
+	}
+	return (const j2534d_msg_t*)payload;
+}
+
+/*
+  Send a response, its payload and optionally a file descriptor.
+*/
+static void respond(client_t *c, j2534d_rsp_t *rsp, const void *payload, const int fd)
+{
+	struct iovec iov[2];
+	struct msghdr mh;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	memset(&mh, 0, sizeof(mh));
+	iov[0].iov_base = rsp;
+	iov[0].iov_len = sizeof(j2534d_rsp_t);
+	iov[1].iov_base = (void*)payload;
+	iov[1].iov_len = rsp->len;
+	mh.msg_iov = iov;
+	mh.msg_iovlen = rsp->len ? 2 : 1;
+	if (fd >= 0)
+	{
+		memset(cbuf, 0, sizeof(cbuf));
+		mh.msg_control = cbuf;
+		mh.msg_controllen = sizeof(cbuf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	}
+	if (sendmsg(c->sock, &mh, MSG_NOSIGNAL) < 0)
+		fprintf(stderr, "j2534d: response to client %d failed: %s\n", c->sock, strerror(errno));
+}
+
+/*
+  Stop one filter a client started.
+*/
+static int32_t client_stop_filter(client_t *c, client_filter_t *f)
+{
+	int32_t r = PassThruStopMsgFilter(channel_id, f->id);
+	pthread_mutex_lock(&clients_lock);
+	f->used = FALSE;
+	pthread_mutex_unlock(&clients_lock);
+	return r;
+}
+
+/*
+  Drop a client's share of the channel, the channel is disconnected
+  when its last client leaves.
+*/
+static int32_t client_disconnect(client_t *c)
+{
+	int32_t r = J2534_NOERROR;
+	int i = 0;
+	if (!c->connected)
+		return J2534_ERR_INVALID_CHANNEL_ID;
+
+	for (; i < MAX_CLIENT_FILTERS; i++)
+	{
+		if (c->filters[i].used)
+			client_stop_filter(c, &c->filters[i]);
+	}
+	pthread_mutex_lock(&clients_lock);
+	c->connected = FALSE;
+	pthread_mutex_unlock(&clients_lock);
+	munmap(c->ring, c->ring_len);
+	c->ring = NULL;
+
+	if (--channel_refs == 0)
+	{
+		PassThruUnregisterRxCallback(channel_id, callback_id);
+		r = PassThruDisconnect(channel_id);
+		fprintf(stderr, "j2534d: channel %lu disconnected\n", channel_id);
+	}
+	return r;
+}
+
+/*
+  Connect the client to the shared channel and create its RX ring, the
+  ring's memory file descriptor is returned in fd.
+*/
+static int32_t client_connect(client_t *c, const j2534d_req_t *req, j2534d_rsp_t *rsp, int *fd)
+{
+	int32_t r = J2534_NOERROR;
+	if (c->connected)
+	{
+		snprintf(rsp->error, J2534D_ERR_LEN, "Error: channel already connected");
+		return J2534_ERR_CHANNEL_IN_USE;
+	}
+	if (channel_refs > 0 && (req->arg[0] != channel_protocol || req->arg[2] != channel_baud))
+	{
+		snprintf(rsp->error, J2534D_ERR_LEN, "Error: device in use with protocol %lu at %lu baud",
+			channel_protocol, channel_baud);
+		return J2534_ERR_CHANNEL_IN_USE;
+	}
+
+	*fd = memfd_create("j2534d-ring", MFD_CLOEXEC);
+	if (*fd < 0 || ftruncate(*fd, sizeof(j2534d_ring_t) + ring_size) != 0)
+	{
+		snprintf(rsp->error, J2534D_ERR_LEN, "Error: cannot create RX ring: %s", strerror(errno));
+		if (*fd >= 0)
+			close(*fd);
+		*fd = -1;
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	c->ring_len = sizeof(j2534d_ring_t) + ring_size;
+	c->ring = (j2534d_ring_t*)mmap(NULL, c->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+	if (c->ring == MAP_FAILED)
+	{
+		snprintf(rsp->error, J2534D_ERR_LEN, "Error: cannot map RX ring: %s", strerror(errno));
+		close(*fd);
+		*fd = -1;
+		c->ring = NULL;
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+	c->ring->size = ring_size;
+	c->ring_size = ring_size;
+	c->ring_head = 0;
+
+	if (channel_refs == 0)
+	{
+		r = PassThruConnect(device_id, req->arg[0], req->arg[1], req->arg[2], &channel_id);
+		if (r == J2534_NOERROR)
+			r = PassThruRegisterRxCallback(channel_id, J2534_ALL_FILTERS, 0, publish, NULL, &callback_id);
+		if (r != J2534_NOERROR)
+		{
+			snprintf(rsp->error, J2534D_ERR_LEN, "Error: connect protocol %u failed: %d", req->arg[0], r);
+			munmap(c->ring, c->ring_len);
+			c->ring = NULL;
+			close(*fd);
+			*fd = -1;
+			return r;
+		}
+		channel_protocol = req->arg[0];
+		channel_baud = req->arg[2];
+		fprintf(stderr, "j2534d: channel %lu connected, protocol %lu at %lu baud\n",
+			channel_id, channel_protocol, channel_baud);
+	}
+	channel_refs++;
+	memset(c->filters, 0, sizeof(c->filters));
+	pthread_mutex_lock(&clients_lock);
+	c->connected = TRUE;
+	pthread_mutex_unlock(&clients_lock);
+	rsp->arg[0] = channel_id;
+	rsp->arg[1] = ring_size;
+	return r;
+}
+
+/*
+  Start a message filter on the device and remember it for the client.
+*/
+static int32_t client_start_filter(client_t *c, const j2534d_req_t *req,
+	const uint8_t *payload, j2534d_rsp_t *rsp)
+{
+	const j2534d_msg_t *rec = msg_records(payload, req->len, req->arg[2] ? 3 : 2);
+	PASSTHRU_MSG msgs[3];
+	unsigned long filter_id = 0;
+	int i = 0;
+	if (rec == NULL || !c->connected)
+	{
+		snprintf(rsp->error, J2534D_ERR_LEN, "Error: invalid filter request");
+		return J2534_ERR_INVALID_MSG;
+	}
+	for (; i < (req->arg[2] ? 3 : 2); i++)
+	{
+		msg_get(&msgs[i], rec);
+		rec = (const j2534d_msg_t*)((const uint8_t*)rec + rec->size);
+	}
+	for (i = 0; i < MAX_CLIENT_FILTERS && c->filters[i].used; i++)
+		;
+	if (i == MAX_CLIENT_FILTERS)
+	{
+		snprintf(rsp->error, J2534D_ERR_LEN, "Error: too many filters");
+		return J2534_ERR_EXCEEDED_LIMIT;
+	}
+
+	int32_t r = PassThruStartMsgFilter(channel_id, req->arg[1], &msgs[0], &msgs[1],
+		req->arg[2] ? &msgs[2] : NULL, &filter_id);
+	if (r != J2534_NOERROR)
+	{
+		snprintf(rsp->error, J2534D_ERR_LEN, "Error: start filter failed: %d", r);
+		return r;
+	}
+	client_filter_t *f = &c->filters[i];
+	pthread_mutex_lock(&clients_lock);
+	f->id = filter_id;
+	f->type = req->arg[1];
+	f->size = msgs[0].DataSize;
+	memcpy(f->mask, msgs[0].Data, f->size);
+	memcpy(f->pattern, msgs[1].Data, f->size);
+	f->used = TRUE;
+	pthread_mutex_unlock(&clients_lock);
+	rsp->arg[0] = filter_id;
+	return r;
+}
+
+/*
+  Forward an Ioctl for a client.
+*/
+static int32_t client_ioctl(client_t *c, const j2534d_req_t *req, uint8_t *payload,
+	j2534d_rsp_t *rsp, uint8_t **rsp_payload)
+{
+	unsigned long ioctl_id = req->arg[1];
+	int32_t r;
+	int i = 0;
+	if (ioctl_id == J2534_GET_CONFIG || ioctl_id == J2534_SET_CONFIG)
+	{
+		uint32_t *pairs = (uint32_t*)payload;
+		SCONFIG cfg[64];
+		SCONFIG_LIST list;
+		list.NumOfParams = req->len / (2 * sizeof(uint32_t));
+		list.ConfigPtr = cfg;
+		if (list.NumOfParams > 64)
+			return J2534_ERR_EXCEEDED_LIMIT;
+		for (; i < (int)list.NumOfParams; i++)
+		{
+			cfg[i].Parameter = pairs[2 * i];
+			cfg[i].Value = pairs[2 * i + 1];
+		}
+		r = PassThruIoctl(channel_id, ioctl_id, &list, NULL);
+		for (i = 0; i < (int)list.NumOfParams; i++)
+			pairs[2 * i + 1] = (uint32_t)cfg[i].Value;
+		rsp->len = req->len;
+		*rsp_payload = payload;
+		return r;
+	}
+	if (ioctl_id == J2534_READ_VBATT)
+	{
+		uint32_t vbatt = 0;
+		r = PassThruIoctl(channel_id, ioctl_id, NULL, &vbatt);
+		rsp->arg[0] = vbatt;
+		return r;
+	}
+	if (ioctl_id == J2534_FAST_INIT)
+	{
+		static PASSTHRU_MSG in, out;
+		static uint8_t rec[J2534D_MSG_SIZE(PM_DATA_LEN)];
+		const j2534d_msg_t *m = msg_records(payload, req->len, 1);
+		if (m == NULL)
+			return J2534_ERR_INVALID_MSG;
+		msg_get(&in, m);
+		r = PassThruIoctl(channel_id, ioctl_id, &in, &out);
+		if (r == J2534_NOERROR)
+		{
+			j2534d_msg_t *o = (j2534d_msg_t*)rec;
+			o->size = J2534D_MSG_SIZE(out.DataSize);
+			o->protocol_id = out.ProtocolID;
+			o->rx_status = out.RxStatus;
+			o->tx_flags = out.TxFlags;
+			o->timestamp = out.Timestamp;
+			o->data_size = out.DataSize;
+			o->extra_data_index = out.ExtraDataIndex;
+			memcpy(o->data, out.Data, out.DataSize);
+			rsp->len = o->size;
+			*rsp_payload = rec;
+		}
+		return r;
+	}
+	if (ioctl_id == J2534_CLEAR_MSG_FILTERS)
+	{
+		// only the client's own filters
+		for (; i < MAX_CLIENT_FILTERS; i++)
+		{
+			if (c->filters[i].used)
+				client_stop_filter(c, &c->filters[i]);
+		}
+		return J2534_NOERROR;
+	}
+	return PassThruIoctl(channel_id, ioctl_id, NULL, NULL);
+}
+
+/*
+  Read and serve one request from a client, return FALSE when the
+  client went away.
+*/
+static int client_request(client_t *c)
+{
+	j2534d_req_t req;
+	j2534d_rsp_t rsp;
+	uint8_t *payload = NULL;
+	uint8_t *rsp_payload = NULL;
+	int fd = -1;
+
+	if (recv(c->sock, &req, sizeof(req), MSG_WAITALL) != sizeof(req) || req.len > MAX_PAYLOAD)
+		return FALSE;
+	if (req.len)
+	{
+		payload = (uint8_t*)malloc(req.len);
+		if (payload == NULL || recv(c->sock, payload, req.len, MSG_WAITALL) != (ssize_t)req.len)
+		{
+			free(payload);
+			return FALSE;
+		}
+	}
+
+	memset(&rsp, 0, sizeof(rsp));
+	switch (req.op) {
+	case J2534D_OPEN:
+		rsp.arg[0] = device_id;
+		break;
+	case J2534D_CLOSE:
+		if (c->connected)
+			client_disconnect(c);
+		break;
+	case J2534D_CONNECT:
+		rsp.status = client_connect(c, &req, &rsp, &fd);
+		break;
+	case J2534D_DISCONNECT:
+		rsp.status = client_disconnect(c);
+		break;
+	case J2534D_WRITE_MSGS:
+	{
+		const j2534d_msg_t *rec = msg_records(payload, req.len, req.arg[1]);
+		PASSTHRU_MSG *msgs = rec ? (PASSTHRU_MSG*)malloc(req.arg[1] * sizeof(PASSTHRU_MSG) + 1) : NULL;
+		unsigned long cnt = req.arg[1];
+		uint32_t i = 0;
+		if (msgs == NULL || !c->connected)
+		{
+			rsp.status = J2534_ERR_INVALID_MSG;
+			snprintf(rsp.error, J2534D_ERR_LEN, "Error: invalid write request");
+			free(msgs);
+			break;
+		}
+		for (; i < req.arg[1]; i++)
+		{
+			msg_get(&msgs[i], rec);
+			rec = (const j2534d_msg_t*)((const uint8_t*)rec + rec->size);
+		}
+		rsp.status = PassThruWriteMsgs(channel_id, msgs, &cnt, req.arg[2]);
+		rsp.arg[0] = cnt;
+		free(msgs);
+		break;
+	}
+	case J2534D_START_FILTER:
+		rsp.status = client_start_filter(c, &req, payload, &rsp);
+		break;
+	case J2534D_STOP_FILTER:
+	{
+		int i = 0;
+		rsp.status = J2534_ERR_INVALID_FILTER_ID;
+		for (; i < MAX_CLIENT_FILTERS; i++)
+		{
+			if (c->filters[i].used && c->filters[i].id == req.arg[1])
+				rsp.status = client_stop_filter(c, &c->filters[i]);
+		}
+		break;
+	}
+	case J2534D_READ_VERSION:
+	{
+		static char ver[3][80];
+		rsp.status = PassThruReadVersion(device_id, ver[0], ver[1], ver[2]);
+		rsp.len = sizeof(ver);
+		rsp_payload = (uint8_t*)ver;
+		break;
+	}
+	case J2534D_IOCTL:
+		rsp.status = client_ioctl(c, &req, payload, &rsp, &rsp_payload);
+		break;
+	default:
+		rsp.status = J2534_ERR_NOT_SUPPORTED;
+		break;
+	}
+	if (rsp.status != J2534_NOERROR && rsp.error[0] == '\0')
+		snprintf(rsp.error, J2534D_ERR_LEN, "Error: j2534d request %u failed: %d", req.op, rsp.status);
+	if (rsp_payload == NULL)
+		rsp.len = 0;
+
+	respond(c, &rsp, rsp_payload, fd);
+	if (fd >= 0)
+		close(fd);
+	free(payload);
+	return TRUE;
+}
+
+int main(int argc, char **argv)
+{
+	const char *path = J2534D_SOCKET;
+	const char *device = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:s:r:h")) != -1)
+	{
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'r':
+			ring_size = (uint32_t)strtoul(optarg, NULL, 10) * 1024;
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d device name] [-s socket path] [-r ring size in KiB]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (ring_size < 65536 || (ring_size & (ring_size - 1)))
+	{
+		fprintf(stderr, "j2534d: ring size must be a power of two of at least 64 KiB\n");
+		return 1;
+	}
+
+	// this process owns the device, never forward to ourselves
+	unsetenv("J2534_DAEMON");
+	if (PassThruOpen(device, &device_id) != J2534_NOERROR)
+	{
+		fprintf(stderr, "j2534d: cannot open the device\n");
+		return 1;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	unlink(path);
+	if (listener < 0 || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0
+		|| listen(listener, MAX_CLIENTS) != 0)
+	{
+		fprintf(stderr, "j2534d: cannot listen on %s: %s\n", path, strerror(errno));
+		PassThruClose(device_id);
+		return 1;
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	int i = 0;
+	for (; i < MAX_CLIENTS; i++)
+		clients[i].sock = -1;
+	fprintf(stderr, "j2534d: device %lu listening on %s\n", device_id, path);
+
+	while (!quit)
+	{
+		struct pollfd pfd[MAX_CLIENTS + 1];
+		int idx[MAX_CLIENTS + 1];
+		int n = 0;
+		pfd[n].fd = listener;
+		pfd[n].events = POLLIN;
+		idx[n++] = -1;
+		for (i = 0; i < MAX_CLIENTS; i++)
+		{
+			if (clients[i].sock >= 0)
+			{
+				pfd[n].fd = clients[i].sock;
+				pfd[n].events = POLLIN;
+				idx[n++] = i;
+			}
+		}
+		if (poll(pfd, n, 500) <= 0)
+			continue;
+
+		for (i = 1; i < n; i++)
+		{
+			client_t *c = &clients[idx[i]];
+			if (pfd[i].revents && !client_request(c))
+			{
+				if (c->connected)
+					client_disconnect(c);
+				close(c->sock);
+				c->sock = -1;
+			}
+		}
+		if (pfd[0].revents & POLLIN)
+		{
+			int sock = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+			for (i = 0; sock >= 0 && i < MAX_CLIENTS && clients[i].sock >= 0; i++)
+				;
+			if (sock >= 0 && i == MAX_CLIENTS)
+			{
+				fprintf(stderr, "j2534d: too many clients\n");
+				close(sock);
+			}
+			else if (sock >= 0)
+			{
+				memset(&clients[i], 0, sizeof(client_t));
+				clients[i].sock = sock;
+			}
+		}
+	}
+
+	for (i = 0; i < MAX_CLIENTS; i++)
+	{
+		if (clients[i].sock < 0)
+			continue;
+		if (clients[i].connected)
+			client_disconnect(&clients[i]);
+		close(clients[i].sock);
+	}
+	close(listener);
+	unlink(path);
+	PassThruClose(device_id);
+	fprintf(stderr, "j2534d: closed\n");
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+  Copyright (C) 2022
+  Authors: NikolaKozina
+            Dale Schultz
+
+  You are free to use this software for any purpose, but please keep
+  acknowledge where it came from!
+
+  Wire format shared by the j2534d multiplexing daemon and the client
+  transport in j2534.c.  Control requests travel over a UNIX domain socket,
+  received messages are published to each client through a shared memory
+  ring that the client maps when it connects a channel.
+
+ */
+
+#ifndef J2534D_H
+    #define J2534D_H
+
+#include <stdint.h>
+
+#define J2534D_SOCKET       "/tmp/j2534d.sock"  // Default control socket path
+#define J2534D_RING_SIZE    (1 << 20)           // Default RX ring size in bytes, power of two
+#define J2534D_ERR_LEN      80                  // Length of the error text in a response
+#define J2534D_MSG_PAD      0x80000000u         // Ring record is padding up to the end of the ring
+
+enum j2534d_op {
+    J2534D_OPEN = 1,
+    J2534D_CLOSE,
+    J2534D_CONNECT,         // response carries the ring file descriptor
+    J2534D_DISCONNECT,
+    J2534D_WRITE_MSGS,
+    J2534D_START_FILTER,
+    J2534D_STOP_FILTER,
+    J2534D_READ_VERSION,
+    J2534D_IOCTL
+};
+
+typedef struct _j2534d_req
+{
+    uint32_t op;
+    uint32_t arg[4];
+    uint32_t len;           // payload bytes following the request
+} j2534d_req_t;
+
+typedef struct _j2534d_rsp
+{
+    int32_t status;         // J2534 error code
+    uint32_t arg[2];
+    uint32_t len;           // payload bytes following the response
+    char error[J2534D_ERR_LEN];
+} j2534d_rsp_t;
+
+/*
+  A PASSTHRU_MSG as carried in request payloads and in the RX ring.  Records
+  are padded to a multiple of 8 bytes.
+ */
+typedef struct _j2534d_msg
+{
+    uint32_t size;          // record size including this header
+    uint32_t protocol_id;
+    uint32_t rx_status;
+    uint32_t tx_flags;
+    uint32_t timestamp;
+    uint32_t data_size;
+    uint32_t extra_data_index;
+    uint32_t reserved;
+    uint64_t host_time;     // CLOCK_MONOTONIC usec when the daemon received the message, 0 if unknown
+    uint8_t data[];
+} j2534d_msg_t;
+
+#define J2534D_MSG_SIZE(data_size) \
+    ((uint32_t)((sizeof(j2534d_msg_t) + (data_size) + 7) & ~(size_t)7))
+
+/*
+  Single producer (daemon), single consumer (client) ring.  head and tail
+  count bytes and only ever grow, the offset into data is taken modulo size.
+  The client sets waiting before sleeping on head with a futex so the
+  daemon only issues a wake-up system call when somebody sleeps.
+ */
+typedef struct _j2534d_ring
+{
+    uint32_t head;          // bytes published by the daemon
+    uint32_t waiting;       // client is sleeping on head
+    uint32_t overflows;     // messages dropped because the ring was full
+    uint32_t size;          // size of data
+    uint8_t pad0[48];
+    uint32_t tail;          // bytes consumed by the client
+    uint8_t pad1[60];
+    uint8_t data[];
+} j2534d_ring_t;
+
+#endif  // J2534D_H
@@ -0,0 +1,364 @@
+/*
+  Copyright (C) 2022
+  Authors: NikolaKozina
+            Dale Schultz
+
+  You are free to use this software for any purpose, but please keep
+  acknowledge where it came from!
+
+  j2534probe measures the round trip host -> USB -> Openport -> CAN bus ->
+  loopback indication -> host.  It turns on LOOPBACK on a CAN channel, sends
+  frames carrying a sequence number at a fixed rate and matches every frame
+  with its TX done indication and its loopback copy, which an RX callback
+  stamps with the host time as soon as the USB event thread decodes them.
+
+  Host stages are measured on CLOCK_MONOTONIC from the moment a frame is handed
+  to PassThruWriteMsgs.  Device stages use the timestamps of the indications,
+  mapped to the host clock with the offset of the fastest loopback seen, so
+  the uplink stage shows how much longer than the fastest one a loopback took.
+  Run it on an idle bus, or one where the probe ID is unused.
+
+  Usage: j2534probe [-d device name] [-b baud] [-i CAN ID] [-r frames per second]
+         [-n frames] [-p priority]
+ */
+
+#define _GNU_SOURCE
+#include "j2534.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RX_STATUS_TX_MSG	0x01	// loopback of a frame sent on this channel
+#define RX_STATUS_TX_DONE	0x08
+#define HIST_BUCKETS	24		// power of two usec buckets, the last one takes everything above
+#define DRAIN_MSEC	500		// wait for the indications of the last frames
+
+typedef struct _probe
+{
+	uint64_t send;			// host usec the frame was handed to PassThruWriteMsgs
+	uint64_t written;		// host usec PassThruWriteMsgs returned
+	uint64_t done_host;		// host usec the TX done indication was decoded, 0 if none
+	uint64_t lb_host;		// host usec the loopback was decoded, 0 if none
+	uint32_t done_dev;		// device timestamps of both
+	uint32_t lb_dev;
+} probe_t;
+
+typedef struct _stage
+{
+	const char *name;
+	int64_t *val;
+	unsigned long cnt;
+} stage_t;
+
+probe_t *probes;
+unsigned long num_probes = 1000;
+unsigned long probe_id = 0x7DF;
+unsigned long dones = 0;		// TX done indications seen, they come in send order
+unsigned long lost = 0;			// indications that matched no frame
+
+static uint64_t host_usec()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleep_until(const uint64_t usec)
+{
+	struct timespec t = { (time_t)(usec / 1000000), (long)(usec % 1000000) * 1000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) == EINTR)
+		;
+}
+
+static uint32_t msg_id(const PASSTHRU_MSG *msg)
+{
+	return ((uint32_t)msg->Data[0] << 24) | ((uint32_t)msg->Data[1] << 16)
+		| ((uint32_t)msg->Data[2] << 8) | msg->Data[3];
+}
+
+/*
+  RX callback on the USB event thread, only stamps the indications.  The
+  sending thread does not look at them before the callback is unregistered.
+*/
+static void on_rx(const PASSTHRU_MSG *msg, void *context)
+{
+	uint64_t now = host_usec();
+	if (msg->DataSize < 4 || msg_id(msg) != probe_id)
+		return;
+	if (msg->RxStatus & RX_STATUS_TX_DONE)
+	{
+		if (dones < num_probes)
+		{
+			probes[dones].done_host = now;
+			probes[dones].done_dev = (uint32_t)msg->Timestamp;
+		}
+		else
+			lost++;
+		dones++;
+	}
+	else if ((msg->RxStatus & RX_STATUS_TX_MSG) && msg->DataSize >= 8)
+	{
+		unsigned long seq = ((unsigned long)msg->Data[4] << 24) | ((unsigned long)msg->Data[5] << 16)
+			| ((unsigned long)msg->Data[6] << 8) | msg->Data[7];
+		if (seq < num_probes && probes[seq].lb_host == 0)
+		{
+			probes[seq].lb_host = now;
+			probes[seq].lb_dev = (uint32_t)msg->Timestamp;
+		}
+		else
+			lost++;
+	}
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t*)a;
+	int64_t y = *(const int64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void stage_add(stage_t *s, const int64_t v)
+{
+	s->val[s->cnt++] = v;
+}
+
+/*
+  Print the percentiles of a stage and a histogram with power of two buckets.
+*/
+static void stage_print(stage_t *s)
+{
+	printf("\n%s: ", s->name);
+	if (s->cnt == 0)
+	{
+		printf("no samples\n");
+		return;
+	}
+	qsort(s->val, s->cnt, sizeof(int64_t), cmp_i64);
+	printf("%lu samples, min %lld, median %lld, p99 %lld, p99.9 %lld, max %lld usec\n", s->cnt,
+		(long long)s->val[0], (long long)s->val[s->cnt / 2], (long long)s->val[s->cnt * 99 / 100],
+		(long long)s->val[s->cnt * 999 / 1000], (long long)s->val[s->cnt - 1]);
+
+	unsigned long hist[HIST_BUCKETS + 1] = {0};	// [0] counts negative values
+	unsigned long most = 0;
+	unsigned long i = 0;
+	for (; i < s->cnt; i++)
+	{
+		int b = 1;
+		if (s->val[i] < 0)
+			b = 0;
+		else
+		{
+			while (b < HIST_BUCKETS && s->val[i] >= (1LL << b))
+				b++;
+		}
+		if (++hist[b] > most)
+			most = hist[b];
+	}
+	int b = 0;
+	for (; b <= HIST_BUCKETS; b++)
+	{
+		if (hist[b] == 0)
+			continue;
+		char range[32];
+		if (b == 0)
+			snprintf(range, sizeof(range), "< 0");
+		else if (b == HIST_BUCKETS)
+			snprintf(range, sizeof(range), ">= %lld", 1LL << (b - 1));
+		else
+			snprintf(range, sizeof(range), "%lld - %lld", b == 1 ? 0LL : 1LL << (b - 1), (1LL << b) - 1);
+		int bar = (int)((hist[b] * 50 + most - 1) / most);
+		printf("  %17s %8lu %.*s\n", range, hist[b], bar, "##################################################");
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *device = NULL;
+	unsigned long baud = 500000;
+	unsigned long rate = 100;
+	unsigned long priority = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "d:b:i:r:n:p:h")) != -1)
+	{
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'b':
+			baud = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			probe_id = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			num_probes = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			priority = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-d device name] [-b baud] [-i CAN ID] [-r frames per second]"
+				" [-n frames] [-p priority]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (rate == 0 || num_probes == 0 || probe_id > 0x1FFFFFFF)
+	{
+		fprintf(stderr, "j2534probe: rate and frames must not be 0, the CAN ID must fit 29 bits\n");
+		return 1;
+	}
+	probes = calloc(num_probes, sizeof(probe_t));
+	stage_t stages[] = {
+		{"host: PassThruWriteMsgs"},
+		{"host: send to TX done indication"},
+		{"host: send to loopback (round trip)"},
+		{"device: send to TX done, on the mapped device clock"},
+		{"device: TX done to loopback"},
+		{"device: loopback uplink above the fastest"}
+	};
+	const int num_stages = sizeof(stages) / sizeof(stages[0]);
+	int s = 0;
+	for (; s < num_stages; s++)
+	{
+		stages[s].val = malloc(num_probes * sizeof(int64_t));
+		if (stages[s].val == NULL || probes == NULL)
+		{
+			fprintf(stderr, "j2534probe: out of memory\n");
+			return 1;
+		}
+	}
+
+	unsigned long device_id, channel_id, filter_id, callback_id;
+	char error[80];
+	char api[80], dll[80], firmware[80];
+	if (PassThruOpen(device, &device_id) != J2534_NOERROR
+		|| PassThruConnect(device_id, 5, 0, baud, &channel_id) != J2534_NOERROR)	// CAN
+	{
+		PassThruGetLastError(error);
+		fprintf(stderr, "j2534probe: cannot connect a CAN channel: %s\n", error);
+		return 1;
+	}
+
+	SCONFIG loopback = {0x03, 1};	// LOOPBACK
+	SCONFIG_LIST config = {1, &loopback};
+	PASSTHRU_MSG mask, pattern;
+	memset(&mask, 0, sizeof(mask));
+	memset(&pattern, 0, sizeof(pattern));
+	mask.ProtocolID = pattern.ProtocolID = 5;
+	mask.DataSize = pattern.DataSize = 4;
+	memset(mask.Data, 0xFF, 4);
+	pattern.Data[0] = (uint8_t)(probe_id >> 24);
+	pattern.Data[1] = (uint8_t)(probe_id >> 16);
+	pattern.Data[2] = (uint8_t)(probe_id >> 8);
+	pattern.Data[3] = (uint8_t)probe_id;
+	RT_MODE rt = {priority, 0, J2534_RT_LOCK_MEMORY};
+	if (PassThruIoctl(channel_id, J2534_SET_CONFIG, &config, NULL) != J2534_NOERROR
+		|| PassThruStartMsgFilter(channel_id, J2534_PASS_FILTER, &mask, &pattern, NULL, &filter_id)
+			!= J2534_NOERROR
+		|| PassThruRegisterRxCallback(channel_id, filter_id, 0, on_rx, NULL, &callback_id) != J2534_NOERROR
+		|| (priority && PassThruIoctl(channel_id, J2534_SET_RT_MODE, &rt, NULL) != J2534_NOERROR))
+	{
+		PassThruGetLastError(error);
+		fprintf(stderr, "j2534probe: cannot set up loopback: %s\n", error);
+		PassThruDisconnect(channel_id);
+		PassThruClose(device_id);
+		return 1;
+	}
+
+	struct utsname host;
+	uname(&host);
+	PassThruReadVersion(device_id, firmware, dll, api);
+	printf("firmware %s, library %s, kernel %s %s\n", firmware, dll, host.sysname, host.release);
+	printf("%lu frames with ID 0x%lX at %lu per second, %lu baud\n", num_probes, probe_id, rate, baud);
+
+	PASSTHRU_MSG msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.ProtocolID = 5;
+	msg.TxFlags = probe_id > 0x7FF ? 0x100 : 0;	// CAN_29BIT_ID
+	msg.DataSize = 12;
+	memcpy(msg.Data, pattern.Data, 4);
+	uint64_t period = 1000000 / rate;
+	uint64_t start = host_usec() + 10000;
+	unsigned long i = 0;
+	for (; i < num_probes; i++)
+	{
+		sleep_until(start + i * period);
+		msg.Data[4] = (uint8_t)(i >> 24);
+		msg.Data[5] = (uint8_t)(i >> 16);
+		msg.Data[6] = (uint8_t)(i >> 8);
+		msg.Data[7] = (uint8_t)i;
+		unsigned long n = 1;
+		probes[i].send = host_usec();
+		int r = PassThruWriteMsgs(channel_id, &msg, &n, 0);
+		probes[i].written = host_usec();
+		if (r != J2534_NOERROR)
+		{
+			PassThruGetLastError(error);
+			fprintf(stderr, "j2534probe: frame %lu not sent: %s\n", i, error);
+			num_probes = i;
+			break;
+		}
+	}
+	usleep(DRAIN_MSEC * 1000);
+	PassThruUnregisterRxCallback(channel_id, callback_id);	// waits for a running callback
+	PassThruDisconnect(channel_id);
+	PassThruClose(device_id);
+
+	// device time maps to host time with the offset of the fastest loopback,
+	// device timestamps are taken relative to the first loopback so they do
+	// not wrap within a run
+	int64_t offset = INT64_MAX;
+	uint32_t dev_base = 0;
+	int have_base = FALSE;
+	for (i = 0; i < num_probes; i++)
+	{
+		probe_t *p = &probes[i];
+		if (p->lb_host == 0)
+			continue;
+		if (!have_base)
+		{
+			dev_base = p->lb_dev;
+			have_base = TRUE;
+		}
+		int64_t d = (int64_t)p->lb_host - (int32_t)(p->lb_dev - dev_base);
+		if (d < offset)
+			offset = d;
+	}
+
+	unsigned long missing_done = 0, missing_lb = 0;
+	for (i = 0; i < num_probes; i++)
+	{
+		probe_t *p = &probes[i];
+		stage_add(&stages[0], (int64_t)(p->written - p->send));
+		if (p->done_host)
+			stage_add(&stages[1], (int64_t)(p->done_host - p->send));
+		else
+			missing_done++;
+		if (p->lb_host)
+		{
+			int64_t lb_mapped = offset + (int32_t)(p->lb_dev - dev_base);
+			stage_add(&stages[2], (int64_t)(p->lb_host - p->send));
+			stage_add(&stages[5], (int64_t)p->lb_host - lb_mapped);
+			if (p->done_host)
+			{
+				int64_t done_mapped = offset + (int32_t)(p->done_dev - dev_base);
+				stage_add(&stages[3], done_mapped - (int64_t)p->send);
+				stage_add(&stages[4], lb_mapped - done_mapped);
+			}
+		}
+		else
+			missing_lb++;
+	}
+	printf("%lu frames sent, %lu without TX done, %lu without loopback, %lu unmatched indications\n",
+		num_probes, missing_done, missing_lb, lost);
+	for (s = 0; s < num_stages; s++)
+		stage_print(&stages[s]);
+	return 0;
+}
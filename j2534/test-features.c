@@ -0,0 +1,428 @@
+/*
+  Copyright (C) 2022
+  Authors: NikolaKozina
+            Dale Schultz
+
+  You are free to use this software for any purpose, but please keep
+  acknowledge where it came from!
+
+  Checks of the parsers, the ISO-TP reassembly, the device clock fit, the
+  memory read window and the command queue, built against j2534.c itself
+  so the static functions can be called without a device.
+
+    make check
+
+ */
+
+#include "j2534.c"
+
+static int failures = 0;
+
+static void check(const char *what, const int ok)
+{
+	printf("%-48s %s\n", what, ok ? "ok" : "FAILED");
+	if (!ok)
+		failures++;
+}
+
+static void set_frame(PASSTHRU_MSG *msg, const uint32_t id, const uint8_t *data, const int len)
+{
+	memset(msg, 0, sizeof(PASSTHRU_MSG));
+	msg->ProtocolID = CAN;
+	msg->Data[0] = (uint8_t)(id >> 24);
+	msg->Data[1] = (uint8_t)(id >> 16);
+	msg->Data[2] = (uint8_t)(id >> 8);
+	msg->Data[3] = (uint8_t)id;
+	memcpy(msg->Data + 4, data, len);
+	msg->DataSize = 4 + len;
+	if (id > 0x7FF)
+		msg->RxStatus = 0x100;	// CAN_29BIT_ID
+}
+
+static void test_dbc()
+{
+	char text[] =
+		"VERSION \"\"\n"
+		"BO_ 256 Std: 8 ECU\n"
+		" SG_ Speed : 0|16@1+ (0.01,0) [0|655.35] \"km/h\" X\n"
+		" SG_ Temp : 16|8@1- (1,-40) [-40|87] \"C\" X\n"
+		" SG_ Rpm : 31|16@0+ (0.25,0) [0|16383] \"rpm\" X\n"
+		" SG_ Far : 64|8@1+ (1,0) [0|255] \"\" X\n"
+		"BO_ 2147483904 Ext: 8 ECU\n"
+		" SG_ Mode M : 0|8@1+ (1,0) [0|255] \"\" X\n"
+		" SG_ A m1 : 8|8@1+ (1,0) [0|255] \"\" X\n"
+		" SG_ B m2 : 8|8@1+ (2,0) [0|255] \"\" X\n";
+	dbc_t *d = dbc_parse("test.dbc", text);
+	check("dbc parse", d != NULL && d->msg_cnt == 2 && d->sig_cnt == 7);
+	if (d == NULL)
+		return;
+	dbc[0] = d;
+
+	const uint8_t std[8] = { 0x10, 0x27, 0xF6, 0x12, 0x34, 0, 0, 0 };
+	const uint8_t ext[8] = { 0x01, 0x2A, 0, 0, 0, 0, 0, 0 };
+	PASSTHRU_MSG msg[2];
+	double v[7];
+	unsigned long n = 0, i = 0;
+	for (; i < 7; i++)
+		v[i] = -1;
+	set_frame(&msg[0], 0x100, std, 8);
+	set_frame(&msg[1], 0x100, ext, 8);
+	msg[1].RxStatus = 0x100;
+	PassThruDecodeDbc(1, msg, 2, v, &n);
+	check("dbc decode of two messages", n == 2);
+	check("dbc intel unsigned with factor", fabs(v[0] - 100.0) < 1e-9);
+	check("dbc intel signed with offset", v[1] == -50.0);
+	check("dbc motorola", v[2] == 1165.0);
+	check("dbc signal beyond 8 bytes decodes as 0", v[3] == 0.0);
+	check("dbc extended ID apart from standard ID", v[4] == 1.0 && v[5] == 42.0);
+	check("dbc multiplexed signal not present left alone", v[6] == -1.0);
+
+	dbc_free(d);
+	dbc[0] = NULL;
+}
+
+static void test_replay_lines()
+{
+	uint64_t t = 0;
+	uint32_t id = 0;
+	int ext = 0;
+	uint8_t data[8];
+	unsigned long len = 0;
+	char line[CAPTURE_LINE];
+
+	snprintf(line, sizeof(line), "(1700000000.123456) can0 123#DEADBEEF\n");
+	check("candump standard frame", replay_parse_line(J2534_CAPTURE_CANDUMP, line, &t, &id, &ext, data, &len)
+		&& t == 1700000000123456ull && id == 0x123 && !ext && len == 4 && data[3] == 0xEF);
+	snprintf(line, sizeof(line), "(1.000001) can0 18DAF110#0102\n");
+	check("candump extended frame", replay_parse_line(J2534_CAPTURE_CANDUMP, line, &t, &id, &ext, data, &len)
+		&& t == 1000001 && id == 0x18DAF110 && ext && len == 2);
+	snprintf(line, sizeof(line), "(1.000001) can0 123#R\n");
+	check("candump remote frame skipped", !replay_parse_line(J2534_CAPTURE_CANDUMP, line, &t, &id, &ext, data, &len));
+	snprintf(line, sizeof(line), "(1.000001) can0 123##1112233\n");
+	check("candump CAN FD frame skipped", !replay_parse_line(J2534_CAPTURE_CANDUMP, line, &t, &id, &ext, data, &len));
+	snprintf(line, sizeof(line), "(1.000001) can0 123#000102030405060708\n");
+	check("candump frame over 8 bytes skipped", !replay_parse_line(J2534_CAPTURE_CANDUMP, line, &t, &id, &ext, data, &len));
+
+	snprintf(line, sizeof(line), "   0.012345 1  18DAF110x       Rx   d 3 01 02 03\n");
+	check("asc extended frame", replay_parse_line(J2534_CAPTURE_ASC, line, &t, &id, &ext, data, &len)
+		&& t == 12345 && id == 0x18DAF110 && ext && len == 3 && data[2] == 3);
+	snprintf(line, sizeof(line), "   1.5 1  7E8  Tx d 2 AA BB\n");
+	check("asc standard frame", replay_parse_line(J2534_CAPTURE_ASC, line, &t, &id, &ext, data, &len)
+		&& t == 1500000 && id == 0x7E8 && !ext && len == 2 && data[1] == 0xBB);
+	snprintf(line, sizeof(line), "date Mon Jan 1 00:00:00.000 am 2024\n");
+	check("asc header skipped", !replay_parse_line(J2534_CAPTURE_ASC, line, &t, &id, &ext, data, &len));
+	snprintf(line, sizeof(line), "   1.5 1  7E8  Rx d 9 00 01 02 03 04 05 06 07 08\n");
+	check("asc frame over 8 bytes skipped", !replay_parse_line(J2534_CAPTURE_ASC, line, &t, &id, &ext, data, &len));
+}
+
+/*
+  Append a pcapng enhanced packet block with a SocketCAN frame.
+*/
+static size_t pcapng_frame(uint8_t *out, const uint32_t iface, const uint64_t ts, const uint32_t can_id,
+	const uint8_t *data, const uint8_t len)
+{
+	uint32_t epb[8] = { 6, 48, iface, (uint32_t)(ts >> 32), (uint32_t)ts, 16, 16, 0 };
+	uint8_t frame[16] = { (uint8_t)(can_id >> 24), (uint8_t)(can_id >> 16), (uint8_t)(can_id >> 8),
+		(uint8_t)can_id, len };
+	uint32_t trailer = 48;
+	memcpy(frame + 8, data, len);
+	memcpy(out, epb, 28);
+	memcpy(out + 28, frame, 16);
+	memcpy(out + 44, &trailer, 4);
+	return 48;
+}
+
+static void test_pcapng()
+{
+	uint8_t buf[512];
+	size_t n = 0;
+	uint32_t shb[7] = { 0x0A0D0D0A, 28, 0x1A2B3C4D, 1, 0xFFFFFFFF, 0xFFFFFFFF, 28 };
+	uint32_t idb_usec[5] = { 1, 20, 227, 16, 20 };
+	// if_tsresol 9, nsec
+	uint32_t idb_nsec[8] = { 1, 32, 227, 16, 9 | 1 << 16, 9, 0, 32 };
+	const uint8_t data[3] = { 1, 2, 3 };
+	memcpy(buf + n, shb, sizeof(shb));
+	n += sizeof(shb);
+	memcpy(buf + n, idb_usec, sizeof(idb_usec));
+	n += sizeof(idb_usec);
+	memcpy(buf + n, idb_nsec, sizeof(idb_nsec));
+	n += sizeof(idb_nsec);
+	n += pcapng_frame(buf + n, 0, 1000000, 0x98DAF110, data, 3);
+	n += pcapng_frame(buf + n, 0, 1500000, 0x40000123, data, 0);	// remote frame
+	n += pcapng_frame(buf + n, 1, 2500000000ull, 0x7E8, data, 2);
+
+	replay_t *rp = (replay_t*)calloc(1, sizeof(replay_t));
+	FILE *f = fmemopen(buf, n, "rb");
+	int32_t r = f && rp ? replay_load_pcapng(rp, f) : J2534_ERR_FAILED;
+	if (f)
+		fclose(f);
+	check("pcapng load", r == J2534_NOERROR && rp->cnt == 2);
+	if (r == J2534_NOERROR && rp->cnt == 2)
+	{
+		check("pcapng extended frame, usec interface", rp->frame[0].offset == 1000000
+			&& rp->frame[0].id == 0x18DAF110 && rp->frame[0].ext && rp->frame[0].len == 3);
+		check("pcapng standard frame, nsec interface", rp->frame[1].offset == 2500000
+			&& rp->frame[1].id == 0x7E8 && !rp->frame[1].ext && rp->frame[1].len == 2);
+	}
+	if (rp)
+		free(rp->frame);
+	free(rp);
+}
+
+/*
+  Fill an indexed capture block with frames at the given times and IDs.
+*/
+static void capstore_fill(uint8_t *block, const uint64_t offset, const uint64_t *ts, const uint32_t *ids,
+	const uint32_t count)
+{
+	capstore_block_t *b = (capstore_block_t*)block;
+	CAPTURE_FRAME *f = (CAPTURE_FRAME*)(block + sizeof(capstore_block_t));
+	uint32_t i = 0;
+	memset(block, 0, CAPSTORE_BLOCK);
+	memcpy(b->magic, "JCB1", 4);
+	b->count = count;
+	b->first = ts[0];
+	b->last = ts[count - 1];
+	b->offset = offset;
+	for (; i < count; i++)
+	{
+		uint32_t bit = capstore_id_bit(ids[i] & 0x1FFFFFFF, (ids[i] & 0x80000000u) != 0);
+		f[i].Timestamp = ts[i];
+		f[i].CanID = ids[i];
+		f[i].DataSize = 1;
+		f[i].Data[0] = (uint8_t)i;
+		b->ids[bit >> 3] |= 1 << (bit & 7);
+	}
+}
+
+static void test_capstore()
+{
+	char path[] = "/tmp/test-features-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd < 0)
+	{
+		check("capstore temporary file", FALSE);
+		return;
+	}
+	uint8_t *file = (uint8_t*)calloc(1, CAPSTORE_HEADER + 2 * CAPSTORE_BLOCK
+		+ 2 * sizeof(capstore_block_t) + sizeof(capstore_trailer_t));
+	capstore_head_t *head = (capstore_head_t*)file;
+	memcpy(head->magic, "J2534CS1", 8);
+	head->block_size = CAPSTORE_BLOCK;
+	head->frame_size = sizeof(CAPTURE_FRAME);
+	const uint64_t ts1[3] = { 100, 200, 300 }, ts2[2] = { 400, 500 };
+	const uint32_t ids1[3] = { 0x100, 0x200, 0x98DAF110 }, ids2[2] = { 0x100, 0x300 };
+	capstore_fill(file + CAPSTORE_HEADER, CAPSTORE_HEADER, ts1, ids1, 3);
+	capstore_fill(file + CAPSTORE_HEADER + CAPSTORE_BLOCK, CAPSTORE_HEADER + CAPSTORE_BLOCK, ts2, ids2, 2);
+	size_t len = CAPSTORE_HEADER + 2 * CAPSTORE_BLOCK;
+	memcpy(file + len, file + CAPSTORE_HEADER, sizeof(capstore_block_t));
+	memcpy(file + len + sizeof(capstore_block_t), file + CAPSTORE_HEADER + CAPSTORE_BLOCK, sizeof(capstore_block_t));
+	capstore_trailer_t *trailer = (capstore_trailer_t*)(file + len + 2 * sizeof(capstore_block_t));
+	trailer->index = len;
+	trailer->blocks = 2;
+	memcpy(trailer->magic, "JCSINDEX", 8);
+	size_t full = len + 2 * sizeof(capstore_block_t) + sizeof(capstore_trailer_t);
+	int written = write(fd, file, full) == (ssize_t)full;
+	close(fd);
+	free(file);
+	check("capstore temporary file", written);
+
+	unsigned long cap_id = 0, n = 0, total = 0;
+	CAPTURE_INFO info;
+	int32_t r = PassThruOpenCapture(path, &cap_id, &info);
+	check("capstore open", r == J2534_NOERROR && info.NumBlocks == 2 && info.NumFrames == 5
+		&& info.First == 100 && info.Last == 500 && info.Indexed);
+	if (r == J2534_NOERROR)
+	{
+		const CAPTURE_FRAME *frames[8];
+		const unsigned long want[1] = { 0x100 };
+		CAPTURE_QUERY q;
+		memset(&q, 0, sizeof(q));
+		q.Start = 150;
+		q.End = 450;
+		q.pIDs = want;
+		q.NumIDs = 1;
+		n = 8;
+		r = PassThruQueryCapture(cap_id, &q, frames, &n);
+		check("capstore query by time and ID", r == J2534_NOERROR && n == 1 && frames[0]->Timestamp == 400);
+
+		memset(&q, 0, sizeof(q));
+		do
+		{
+			n = 2;
+			r = PassThruQueryCapture(cap_id, &q, frames, &n);
+			total += n;
+		} while (r == J2534_NOERROR);
+		check("capstore query in pages", r == J2534_ERR_BUFFER_EMPTY && total == 5);
+		PassThruCloseCapture(cap_id);
+	}
+
+	// without the index it is rebuilt from the blocks
+	r = truncate(path, len) == 0 ? PassThruOpenCapture(path, &cap_id, &info) : J2534_ERR_FAILED;
+	check("capstore open without index", r == J2534_NOERROR && info.NumBlocks == 2 && info.NumFrames == 5
+		&& !info.Indexed);
+	if (r == J2534_NOERROR)
+		PassThruCloseCapture(cap_id);
+	unlink(path);
+}
+
+static void isotp_feed(const uint32_t id, const uint8_t *data, const int len)
+{
+	PASSTHRU_MSG msg;
+	set_frame(&msg, id, data, len);
+	CB_LOCK();
+	isotp_put(&msg);
+	CB_UNLOCK();
+}
+
+static void test_isotp()
+{
+	ISOTP_SNIFF_CONFIG cfg;
+	memset(&cfg, 0, sizeof(cfg));
+	con->channel = CAN;
+	// frames are fed here instead of by the USB event thread
+	usb_ev->running = TRUE;
+	int32_t r = isotp_start(&cfg);
+	check("isotp start", r == J2534_NOERROR);
+	if (r != J2534_NOERROR)
+	{
+		usb_ev->running = FALSE;
+		return;
+	}
+
+	const uint8_t sf[4] = { 0x03, 0x22, 0xF1, 0x90 };
+	const uint8_t ff[8] = { 0x10, 0x0A, 0x62, 0xF1, 0x90, 0x41, 0x42, 0x43 };
+	const uint8_t fc[3] = { 0x30, 0x00, 0x00 };
+	const uint8_t cf[8] = { 0x21, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A };
+	const uint8_t cf_bad[8] = { 0x22, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A };
+	isotp_feed(0x7E0, sf, 4);
+	isotp_feed(0x7E8, ff, 8);
+	isotp_feed(0x7E0, fc, 3);
+	isotp_feed(0x7E8, cf, 8);
+	// consecutive frame out of sequence
+	isotp_feed(0x7E9, ff, 8);
+	isotp_feed(0x7E9, cf_bad, 8);
+
+	static ISOTP_PDU pdu[4];
+	unsigned long n = 4;
+	r = PassThruReadIsotp(strtoul(&con->channel, NULL, 10), pdu, &n, 0);
+	check("isotp PDUs", r == J2534_NOERROR && n == 2);
+	if (r == J2534_NOERROR && n == 2)
+	{
+		check("isotp single frame", pdu[0].SourceID == 0x7E0 && pdu[0].DataSize == 3 && pdu[0].Data[0] == 0x22);
+		check("isotp multi frame", pdu[1].SourceID == 0x7E8 && pdu[1].TargetID == 0x7E0
+			&& pdu[1].DataSize == 10 && pdu[1].Data[0] == 0x62 && pdu[1].Data[9] == 0x47);
+	}
+	ISOTP_STATS st;
+	isotp_stop(&st);
+	check("isotp sequence error aborts", st.NumPdus == 2 && st.Aborted == 1);
+	usb_ev->running = FALSE;
+}
+
+static void test_clock()
+{
+	clock_model_t c;
+	const uint32_t ts0 = 0xFFF00000;	// wraps after about a second
+	const uint64_t host0 = 5000000000ull;
+	uint64_t out = 0, want = 0;
+	uint32_t k = 0;
+	memset(&c, 0, sizeof(c));
+	// device clock 100 ppm slow, every 100th message arrives without delay
+	for (; k < 30000; k++)
+	{
+		uint64_t dev = (uint64_t)k * 1000;
+		want = host0 + dev + dev / 10000;
+		uint64_t latency = k % 100 == 0 ? 0 : 50 + k * 7919 % 400;
+		out = clock_update(&c, ts0 + (uint32_t)dev, want + latency);
+	}
+	check("clock drift", fabs(c.drift - 0.0001) < 0.000005);
+	check("clock conversion across the wrap", out > want - 20 && out < want + 20);
+}
+
+static void test_mem_window()
+{
+	mem_req_t out[MEM_OUTSTANDING], retry[2 * MEM_OUTSTANDING];
+	int out_cnt = 0, retry_cnt = 0, i = 0;
+	unsigned long retried = 0;
+	uint32_t failed = 0;
+	for (; i < 3; i++)
+	{
+		out[i].off = 256 * i;
+		out[i].size = 256 - i;
+		out[i].tries = 0;
+	}
+	out_cnt = 3;
+	check("mem size in flight", mem_size_used(out, out_cnt, 255) && !mem_size_used(out, out_cnt, 253));
+
+	// a response to the third request tells the first two were lost
+	check("mem lost requests queued", mem_lost(out, &out_cnt, 2, retry, &retry_cnt, 3, &retried, &failed)
+		&& out_cnt == 1 && out[0].off == 512 && retry_cnt == 2 && retried == 2);
+	mem_req_t req = { 128, 128, 0 };
+	mem_retry_add(retry, &retry_cnt, &req);
+	check("mem retries in address order", retry_cnt == 3 && retry[0].off == 0 && retry[1].off == 128
+		&& retry[2].off == 256);
+
+	out[0] = retry[0];
+	out[0].tries = 3;
+	out_cnt = 1;
+	check("mem out of retries", !mem_lost(out, &out_cnt, 1, retry, &retry_cnt, 3, &retried, &failed)
+		&& failed == 0);
+}
+
+static void cmd_queue_add(const char *expect)
+{
+	cmd_slot_t *slot = &cmdq->slot[cmdq->tail % CMD_SLOTS];
+	snprintf(slot->expect, sizeof(slot->expect), "%s", expect);
+	slot->len = 0;
+	cmdq->tail++;
+}
+
+static void test_cmd_queue()
+{
+	uint8_t reply[REPLY_LEN];
+	// replies are taken from the buffer instead of the USB event thread
+	usb_ev->running = TRUE;
+	memset(cmdq, 0, sizeof(cmd_queue_t));
+	cmd_queue_add("arg");
+	cmd_queue_add("aro");
+	cmd_queue_add("arg");
+
+	check("cmd reply matched to its command", cmd_put((const uint8_t*)"aro\r\n", 5)
+		&& cmd_put((const uint8_t*)"arg5 2 20\r\n", 11) && cmd_put((const uint8_t*)"arg5 1 10\r\n", 11));
+	int r = cmd_wait(reply, sizeof(reply), 0);
+	check("cmd replies in send order", r == LIBUSB_SUCCESS && strncmp((char*)reply, "arg5 2", 6) == 0);
+	r = cmd_wait(reply, sizeof(reply), 0);
+	check("cmd acknowledged", r == LIBUSB_SUCCESS && strncmp((char*)reply, "aro", 3) == 0);
+	r = cmd_wait(reply, sizeof(reply), 0);
+	check("cmd second get", r == LIBUSB_SUCCESS && strncmp((char*)reply, "arg5 1", 6) == 0);
+
+	cmd_queue_add("arg");
+	cmd_queue_add("aro");
+	check("cmd error reply to the oldest command", cmd_put((const uint8_t*)"are 8\r\n", 7)
+		&& cmdq->slot[(cmdq->tail - 2) % CMD_SLOTS].len > 0);
+	r = cmd_wait(reply, sizeof(reply), 0);
+	check("cmd device error", r == 8);
+	r = cmd_wait(reply, sizeof(reply), 0);
+	check("cmd missing reply cancels the queue", r == LIBUSB_ERROR_TIMEOUT && cmdq->head == cmdq->tail);
+	check("cmd late reply dropped", !cmd_put((const uint8_t*)"aro\r\n", 5));
+	usb_ev->running = FALSE;
+}
+
+int main()
+{
+	pthread_mutex_init(&usb_ev->cb_lock, NULL);
+	pthread_mutex_init(&usb_ev->lock, NULL);
+	pthread_cond_init(&usb_ev->reply_cond, NULL);
+
+	test_dbc();
+	test_replay_lines();
+	test_pcapng();
+	test_capstore();
+	test_isotp();
+	test_clock();
+	test_mem_window();
+	test_cmd_queue();
+
+	printf("%s\n", failures ? "FAILED" : "passed");
+	return failures != 0;
+}
@@ -0,0 +1,119 @@
+/*
+  Copyright (C) 2022
+  Authors: NikolaKozina
+            Dale Schultz
+
+  You are free to use this software for any purpose, but please keep
+  acknowledge where it came from!
+
+  Checks of the host message filter rules, built against j2534.c itself so
+  the static filter functions can be called without a device.
+
+    make check
+
+ */
+
+#include "j2534.c"
+
+static int failures = 0;
+
+static void set_msg(PASSTHRU_MSG *msg, const uint32_t id, const int data)
+{
+	memset(msg, 0, sizeof(PASSTHRU_MSG));
+	msg->ProtocolID = CAN;
+	msg->Data[0] = (uint8_t)(id >> 24);
+	msg->Data[1] = (uint8_t)(id >> 16);
+	msg->Data[2] = (uint8_t)(id >> 8);
+	msg->Data[3] = (uint8_t)id;
+	msg->Data[4] = (uint8_t)data;
+	msg->DataSize = 5;
+}
+
+/*
+  Keep a host filter on the CAN ID and, with a data byte of 0 or more, on
+  the first data byte.
+*/
+static void add_filter(const unsigned long filter_id, const unsigned long type, const uint32_t id,
+	const int data)
+{
+	PASSTHRU_MSG mask, pattern;
+	set_msg(&mask, 0xFFFFFFFF, 0xFF);
+	set_msg(&pattern, id, data);
+	if (data < 0)
+		mask.DataSize = pattern.DataSize = 4;
+	filter_add(filter_id, type, &mask, &pattern, NULL);
+}
+
+static void expect(const char *what, const uint32_t id, const int data, const int accepted)
+{
+	PASSTHRU_MSG msg;
+	set_msg(&msg, id, data);
+	int r = filter_accept(&msg) != 0;
+	printf("%-48s %03X %02X %s\n", what, id, data, r == accepted ? "ok" : "FAILED");
+	if (r != accepted)
+		failures++;
+}
+
+int main()
+{
+	pthread_mutex_init(&usb_ev->cb_lock, NULL);
+
+	add_filter(1, J2534_PASS_FILTER, 0x7E8, -1);
+	filter_rules();
+	expect("pass 7E8", 0x7E8, 0x00, TRUE);
+	expect("pass 7E8", 0x7E0, 0x00, FALSE);
+	filter_remove(1);
+	filter_rules();
+	expect("pass 7E8 stopped, no filters left", 0x7E8, 0x00, FALSE);
+
+	add_filter(2, J2534_PASS_FILTER, 0x7E8, -1);
+	add_filter(3, J2534_BLOCK_FILTER, 0x7E8, 0x7F);
+	filter_rules();
+	expect("pass 7E8, block 7E8 7F", 0x7E8, 0x00, TRUE);
+	expect("pass 7E8, block 7E8 7F", 0x7E8, 0x7F, FALSE);
+	filter_remove(2);
+	filter_rules();
+	expect("pass 7E8 stopped, block 7E8 7F left", 0x7E8, 0x00, FALSE);
+	expect("pass 7E8 stopped, block 7E8 7F left", 0x7E8, 0x7F, FALSE);
+	filter_remove(3);
+
+#ifdef __linux__
+	// SocketCAN applies the host filters itself, stopped ones leave holes
+	unsigned long ids[MAX_FILTERS], id;
+	PASSTHRU_MSG mask, pattern;
+	set_msg(&mask, 0xFFFFFFFF, 0);
+	mask.DataSize = 4;
+	sc->sock = -1;
+	int i = 0, r = 0;
+	for (; i < MAX_FILTERS && r == J2534_NOERROR; i++)
+	{
+		set_msg(&pattern, 0x100 + i, 0);
+		pattern.DataSize = 4;
+		r = socketcan_start_filter(i == 7 ? J2534_BLOCK_FILTER : J2534_PASS_FILTER, &mask, &pattern, NULL, &ids[i]);
+	}
+	printf("%-48s %s\n", "socketcan fills the filter table", r == J2534_NOERROR ? "ok" : "FAILED");
+	failures += r != J2534_NOERROR;
+	r = socketcan_start_filter(J2534_PASS_FILTER, &mask, &pattern, NULL, &id);
+	printf("%-48s %s\n", "socketcan filter beyond the table rejected", r == J2534_ERR_EXCEEDED_LIMIT ? "ok" : "FAILED");
+	failures += r != J2534_ERR_EXCEEDED_LIMIT;
+	for (i = 0; i < MAX_FILTERS - 1; i++)
+		if (i != 7)
+			socketcan_stop_filter(ids[i]);
+	PASSTHRU_MSG msg;
+	set_msg(&msg, 0x100 + MAX_FILTERS - 1, 0);
+	r = socketcan_pass(&msg);
+	printf("%-48s %03X    %s\n", "socketcan pass in the last slot", 0x100 + MAX_FILTERS - 1, r ? "ok" : "FAILED");
+	failures += !r;
+	set_msg(&msg, 0x107, 0);
+	r = socketcan_pass(&msg);
+	printf("%-48s %03X    %s\n", "socketcan block", 0x107, !r ? "ok" : "FAILED");
+	failures += r;
+	set_msg(&msg, 0x101, 0);
+	r = socketcan_pass(&msg);
+	printf("%-48s %03X    %s\n", "socketcan stopped pass", 0x101, !r ? "ok" : "FAILED");
+	failures += r;
+#endif
+
+	printf("%s\n", failures ? "FAILED" : "passed");
+	return failures != 0;
+}